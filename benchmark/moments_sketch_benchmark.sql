@@ -0,0 +1,262 @@
+-- Moments Sketch Benchmark for Weighted Statistics Extension
+--
+-- This benchmark measures:
+-- 1. Build throughput of moments_sketch_agg vs the exact weighted_quantile
+-- 2. Merge throughput of moments_sketch_merge over stored per-minute sketches
+-- 3. Quantile accuracy of moments_sketch_quantile against weighted_quantile
+--
+-- Uses multiple iterations and averages to account for PostgreSQL caching effects
+
+\timing off
+
+\echo '========================================='
+\echo 'Moments Sketch Benchmark'
+\echo 'Multiple iterations with averaged results'
+\echo '========================================='
+
+-- Test data setup
+\echo 'Setting up test data...'
+
+-- 200K rows: 500 hosts x 40 minutes x 10 rows
+DROP TABLE IF EXISTS sketch_rows;
+CREATE TEMP TABLE sketch_rows AS
+SELECT
+    (i % 500) AS host,
+    (i / 500) % 40 AS minute,
+    -ln(random()) * 100 AS val,  -- Exponential latencies
+    random() AS weight
+FROM generate_series(0, 199999) AS i;
+
+-- One stored sketch per host and minute (20K sketches)
+DROP TABLE IF EXISTS sketch_rollup;
+CREATE TEMP TABLE sketch_rollup AS
+SELECT host, minute, moments_sketch_agg(val, weight) AS sketch
+FROM sketch_rows
+GROUP BY host, minute;
+
+-- Distributions for the accuracy test (100K rows each)
+DROP TABLE IF EXISTS sketch_accuracy_data;
+CREATE TEMP TABLE sketch_accuracy_data AS
+SELECT d, v, w FROM (
+    SELECT 'uniform' AS d, random() * 100 AS v, random() AS w FROM generate_series(1, 100000)
+    UNION ALL
+    SELECT 'normal', 50 + 10 * sqrt(-2 * ln(random())) * cos(2 * pi() * random()), random()
+    FROM generate_series(1, 100000)
+    UNION ALL
+    SELECT 'exponential', -ln(random()), random() FROM generate_series(1, 100000)
+    UNION ALL
+    SELECT 'lognormal', exp(2 * sqrt(-2 * ln(random())) * cos(2 * pi() * random())), random()
+    FROM generate_series(1, 100000)
+    UNION ALL
+    SELECT 'bimodal', CASE WHEN random() < 0.3 THEN 10 + random() ELSE 20 + 2 * random() END, random()
+    FROM generate_series(1, 100000)
+    UNION ALL
+    SELECT 'offset 1e6', 1e6 + random(), random() FROM generate_series(1, 100000)
+    UNION ALL
+    SELECT 'sparse', random() * 100, random() * 0.000005 FROM generate_series(1, 100000)  -- Sum ≈ 0.25
+) s;
+
+-- Create results table for timing
+DROP TABLE IF EXISTS benchmark_results;
+CREATE TEMP TABLE benchmark_results (
+    test_name TEXT,
+    implementation TEXT,
+    iteration INTEGER,
+    n_items INTEGER,
+    execution_time_ms NUMERIC
+);
+
+\echo ''
+\echo '========================================='
+\echo 'Test Group 1: Build Throughput (200K rows)'
+\echo 'Running 5 iterations each for reliable averages'
+\echo '========================================='
+
+-- Warm up runs (not counted)
+SELECT moments_sketch_agg(val, weight) IS NOT NULL FROM sketch_rows;
+SELECT weighted_quantile(array_agg(val), array_agg(weight), ARRAY[0.5, 0.99]) IS NOT NULL FROM sketch_rows;
+
+\echo 'Testing moments_sketch_agg (one sketch)...'
+DO $$
+DECLARE
+    start_time TIMESTAMP;
+    end_time TIMESTAMP;
+    result moments_sketch;
+BEGIN
+    FOR i IN 1..5 LOOP
+        start_time := clock_timestamp();
+        SELECT moments_sketch_agg(val, weight) INTO result FROM sketch_rows;
+        end_time := clock_timestamp();
+
+        INSERT INTO benchmark_results VALUES (
+            'build', 'moments_sketch_agg', i, 200000,
+            EXTRACT(epoch FROM (end_time - start_time)) * 1000
+        );
+    END LOOP;
+END $$;
+
+\echo 'Testing weighted_quantile over array_agg (exact)...'
+DO $$
+DECLARE
+    start_time TIMESTAMP;
+    end_time TIMESTAMP;
+    result DOUBLE PRECISION[];
+BEGIN
+    FOR i IN 1..5 LOOP
+        start_time := clock_timestamp();
+        SELECT weighted_quantile(array_agg(val), array_agg(weight), ARRAY[0.5, 0.99])
+        INTO result FROM sketch_rows;
+        end_time := clock_timestamp();
+
+        INSERT INTO benchmark_results VALUES (
+            'build', 'weighted_quantile (exact)', i, 200000,
+            EXTRACT(epoch FROM (end_time - start_time)) * 1000
+        );
+    END LOOP;
+END $$;
+
+\echo 'Testing moments_sketch_agg per host and minute (20K sketches)...'
+DO $$
+DECLARE
+    start_time TIMESTAMP;
+    end_time TIMESTAMP;
+    result BIGINT;
+BEGIN
+    FOR i IN 1..5 LOOP
+        start_time := clock_timestamp();
+        SELECT count(*) INTO result FROM (
+            SELECT moments_sketch_agg(val, weight) AS sketch FROM sketch_rows GROUP BY host, minute
+        ) s WHERE sketch IS NOT NULL;
+        end_time := clock_timestamp();
+
+        INSERT INTO benchmark_results VALUES (
+            'build', 'moments_sketch_agg (grouped)', i, 200000,
+            EXTRACT(epoch FROM (end_time - start_time)) * 1000
+        );
+    END LOOP;
+END $$;
+
+\echo ''
+\echo '========================================='
+\echo 'Test Group 2: Merge Throughput (20K stored sketches)'
+\echo '========================================='
+
+-- Warm up run (not counted)
+SELECT moments_sketch_merge(sketch) IS NOT NULL FROM sketch_rollup;
+
+\echo 'Testing moments_sketch_merge (all sketches into one)...'
+DO $$
+DECLARE
+    start_time TIMESTAMP;
+    end_time TIMESTAMP;
+    result moments_sketch;
+BEGIN
+    FOR i IN 1..5 LOOP
+        start_time := clock_timestamp();
+        SELECT moments_sketch_merge(sketch) INTO result FROM sketch_rollup;
+        end_time := clock_timestamp();
+
+        INSERT INTO benchmark_results VALUES (
+            'merge', 'moments_sketch_merge', i, 20000,
+            EXTRACT(epoch FROM (end_time - start_time)) * 1000
+        );
+    END LOOP;
+END $$;
+
+\echo 'Testing moments_sketch_merge per host plus quantiles (500 rollups)...'
+DO $$
+DECLARE
+    start_time TIMESTAMP;
+    end_time TIMESTAMP;
+    result DOUBLE PRECISION;
+BEGIN
+    FOR i IN 1..5 LOOP
+        start_time := clock_timestamp();
+        SELECT max(q[3]) INTO result FROM (
+            SELECT moments_sketch_quantile(moments_sketch_merge(sketch), ARRAY[0.5, 0.9, 0.99]) AS q
+            FROM sketch_rollup GROUP BY host
+        ) s;
+        end_time := clock_timestamp();
+
+        INSERT INTO benchmark_results VALUES (
+            'merge', 'moments_sketch_merge + quantile (per host)', i, 20000,
+            EXTRACT(epoch FROM (end_time - start_time)) * 1000
+        );
+    END LOOP;
+END $$;
+
+\echo ''
+\echo '========================================='
+\echo 'Timing Summary'
+\echo '========================================='
+
+SELECT
+    test_name,
+    implementation,
+    ROUND(AVG(execution_time_ms), 2) || 'ms' AS avg_time,
+    ROUND(STDDEV(execution_time_ms), 2) || 'ms' AS stddev,
+    ROUND(MAX(n_items) / (AVG(execution_time_ms) / 1000.0)) AS items_per_sec
+FROM benchmark_results
+GROUP BY test_name, implementation
+ORDER BY test_name, AVG(execution_time_ms);
+
+\echo ''
+\echo 'State size:'
+SELECT
+    pg_column_size(sketch) AS sketch_bytes,
+    (SELECT pg_column_size(array_agg(val)) + pg_column_size(array_agg(weight))
+     FROM sketch_rows WHERE host = 0 AND minute = 0) AS arrays_bytes_10_rows
+FROM sketch_rollup
+LIMIT 1;
+
+\echo ''
+\echo '========================================='
+\echo 'Test Group 3: Accuracy vs weighted_quantile (100K rows each)'
+\echo 'rank error = distance of q from the weighted rank of the estimate'
+\echo '========================================='
+
+WITH levels AS (
+    SELECT ARRAY[0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99]::float8[] AS qs
+),
+estimates AS (
+    SELECT
+        d,
+        moments_sketch_quantile(moments_sketch_agg(v, w), (SELECT qs FROM levels)) AS est,
+        weighted_quantile(array_agg(v), array_agg(w), (SELECT qs FROM levels)) AS exact,
+        sum(w) AS total_weight
+    FROM sketch_accuracy_data
+    GROUP BY d
+),
+ranks AS (
+    -- Weighted ranks [F(est-), F(est)], with the implicit zero of sparse data
+    SELECT
+        e.d,
+        (SELECT qs FROM levels)[i] AS q,
+        e.est[i] AS est,
+        e.exact[i] AS exact,
+        (SELECT (coalesce(sum(a.w) FILTER (WHERE a.v < e.est[i]), 0) +
+                 greatest(0, 1 - e.total_weight) * (e.est[i] > 0)::int) / greatest(e.total_weight, 1)
+         FROM sketch_accuracy_data a WHERE a.d = e.d) AS rank_below,
+        (SELECT (coalesce(sum(a.w) FILTER (WHERE a.v <= e.est[i]), 0) +
+                 greatest(0, 1 - e.total_weight) * (e.est[i] >= 0)::int) / greatest(e.total_weight, 1)
+         FROM sketch_accuracy_data a WHERE a.d = e.d) AS rank_upto
+    FROM estimates e, generate_subscripts(e.est, 1) AS i
+),
+errors AS (
+    SELECT
+        d,
+        greatest(0, rank_below - q, q - rank_upto) AS rank_error,
+        abs(est - exact) / nullif(abs(exact), 0) AS relative_error
+    FROM ranks
+)
+SELECT
+    d AS distribution,
+    ROUND(MAX(rank_error)::numeric, 4) AS max_rank_error,
+    ROUND(AVG(rank_error)::numeric, 4) AS avg_rank_error,
+    ROUND(MAX(relative_error)::numeric, 4) AS max_relative_error
+FROM errors
+GROUP BY d
+ORDER BY d;
+
+\echo ''
+\echo 'Benchmark completed!'
@@ -131,13 +131,17 @@ main() {
     echo ""
     
     # Run the benchmark
-    if $PSQL_CMD -f "$(dirname "$0")/performance_test.sql"; then
+    if $PSQL_CMD -f "$(dirname "$0")/performance_test.sql" &&
+       $PSQL_CMD -f "$(dirname "$0")/moments_sketch_benchmark.sql" &&
+       $PSQL_CMD -f "$(dirname "$0")/small_array_benchmark.sql"; then
         echo ""
         print_success "Performance benchmark completed"
         echo ""
         print_info "Benchmark Results Summary:"
         echo "• Group 1: C vs PL/pgSQL comparison (mean, variance, std, quantiles)"
         echo "• Group 2: Quantile methods comparison (empirical vs Type 7 vs Harrell-Davis)"
+        echo "• Group 3: Moments sketch build/merge throughput and accuracy"
+        echo "• Group 4: Per-call latency of the array functions for 1..64 elements"
         echo "• Review 'Time:' values in output above for performance differences"
         echo ""
         print_info "Next Steps:"
@@ -0,0 +1,141 @@
+-- Small Array Benchmark for Weighted Statistics Extension
+--
+-- This benchmark measures the per-call latency of the array functions on
+-- arrays of 1 to 64 elements, where the fixed cost of a call (argument
+-- handling, buffers, sorting set-up, building the result) dominates:
+-- 1. weighted_mean, weighted_variance
+-- 2. weighted_quantile, wquantile, whdquantile (3 quantile levels)
+-- 3. weighted_quantile over weighted_pair[]
+--
+-- Each size is timed over 2000 stored arrays; the cost of scanning them
+-- (without calling a function) is subtracted, so the figures are the
+-- nanoseconds spent per call.
+
+\timing off
+
+\echo '========================================='
+\echo 'Small Array Benchmark'
+\echo 'Per-call latency for n = 1..64'
+\echo '========================================='
+
+-- Test data setup
+\echo 'Setting up test data...'
+
+-- 2000 arrays per size, weights summing to about 0.5 (sparse). Stored
+-- uncompressed and inline, so the timings do not include detoasting.
+DROP TABLE IF EXISTS small_arrays;
+CREATE TEMP TABLE small_arrays (
+    n INTEGER,
+    r INTEGER,
+    vals DOUBLE PRECISION[] STORAGE PLAIN,
+    weights DOUBLE PRECISION[] STORAGE PLAIN,
+    pairs weighted_pair[] STORAGE PLAIN
+);
+INSERT INTO small_arrays
+SELECT
+    n,
+    r,
+    vals,
+    weights,
+    (SELECT array_agg(weighted_pair(v, w)) FROM unnest(vals, weights) AS u(v, w)) AS pairs
+FROM (
+    SELECT
+        n,
+        r,
+        (SELECT array_agg(random() * 100) FROM generate_series(1, n) WHERE r > 0) AS vals,
+        (SELECT array_agg(u / n) FROM (SELECT random() AS u FROM generate_series(1, n) WHERE r > 0) e) AS weights
+    FROM generate_series(1, 64) AS sizes(n), generate_series(1, 2000) AS reps(r)
+) s;
+CREATE INDEX ON small_arrays (n);
+ANALYZE small_arrays;
+
+-- Create results table for timing
+DROP TABLE IF EXISTS benchmark_results;
+CREATE TEMP TABLE benchmark_results (
+    implementation TEXT,
+    n INTEGER,
+    iteration INTEGER,
+    n_calls INTEGER,
+    execution_time_ms NUMERIC
+);
+
+-- Warm up run (not counted)
+SELECT count(weighted_quantile(vals, weights, ARRAY[0.25, 0.5, 0.75])) FROM small_arrays;
+
+\echo ''
+\echo 'Timing 3 iterations per size and function...'
+DO $$
+DECLARE
+    start_time TIMESTAMP;
+    end_time TIMESTAMP;
+    result BIGINT;
+    impl TEXT;
+    query TEXT;
+BEGIN
+    FOR size IN 1..64 LOOP
+        FOR i IN 1..3 LOOP
+            FOREACH impl IN ARRAY ARRAY['scan only', 'weighted_mean', 'weighted_variance',
+                                        'weighted_quantile', 'wquantile', 'whdquantile',
+                                        'weighted_quantile (pairs)'] LOOP
+                query := CASE impl
+                    WHEN 'scan only' THEN 'SELECT count(vals) FROM small_arrays WHERE n = $1'
+                    WHEN 'weighted_mean' THEN
+                        'SELECT count(weighted_mean(vals, weights)) FROM small_arrays WHERE n = $1'
+                    WHEN 'weighted_variance' THEN
+                        'SELECT count(weighted_variance(vals, weights)) FROM small_arrays WHERE n = $1'
+                    WHEN 'weighted_quantile' THEN
+                        'SELECT count(weighted_quantile(vals, weights, ARRAY[0.25, 0.5, 0.75])) FROM small_arrays WHERE n = $1'
+                    WHEN 'wquantile' THEN
+                        'SELECT count(wquantile(vals, weights, ARRAY[0.25, 0.5, 0.75])) FROM small_arrays WHERE n = $1'
+                    WHEN 'whdquantile' THEN
+                        'SELECT count(whdquantile(vals, weights, ARRAY[0.25, 0.5, 0.75])) FROM small_arrays WHERE n = $1'
+                    ELSE
+                        'SELECT count(weighted_quantile(pairs, ARRAY[0.25, 0.5, 0.75])) FROM small_arrays WHERE n = $1'
+                END;
+
+                start_time := clock_timestamp();
+                EXECUTE query INTO result USING size;
+                end_time := clock_timestamp();
+
+                INSERT INTO benchmark_results VALUES (
+                    impl, size, i, 2000,
+                    EXTRACT(epoch FROM (end_time - start_time)) * 1000
+                );
+            END LOOP;
+        END LOOP;
+    END LOOP;
+END $$;
+
+\echo ''
+\echo '========================================='
+\echo 'Per-call latency (ns, scan cost subtracted)'
+\echo '========================================='
+
+WITH averages AS (
+    SELECT implementation, n, AVG(execution_time_ms) AS avg_ms, MAX(n_calls) AS n_calls
+    FROM benchmark_results
+    GROUP BY implementation, n
+),
+per_call AS (
+    SELECT
+        a.implementation,
+        a.n,
+        GREATEST(a.avg_ms - s.avg_ms, 0) * 1e6 / a.n_calls AS ns_per_call
+    FROM averages a
+    JOIN averages s ON s.n = a.n AND s.implementation = 'scan only'
+    WHERE a.implementation <> 'scan only'
+)
+SELECT
+    n,
+    ROUND(MAX(ns_per_call) FILTER (WHERE implementation = 'weighted_mean')) AS mean,
+    ROUND(MAX(ns_per_call) FILTER (WHERE implementation = 'weighted_variance')) AS variance,
+    ROUND(MAX(ns_per_call) FILTER (WHERE implementation = 'weighted_quantile')) AS quantile,
+    ROUND(MAX(ns_per_call) FILTER (WHERE implementation = 'wquantile')) AS wquantile,
+    ROUND(MAX(ns_per_call) FILTER (WHERE implementation = 'whdquantile')) AS whdquantile,
+    ROUND(MAX(ns_per_call) FILTER (WHERE implementation = 'weighted_quantile (pairs)')) AS quantile_pairs
+FROM per_call
+GROUP BY n
+ORDER BY n;
+
+\echo ''
+\echo 'Benchmark completed!'
@@ -0,0 +1,414 @@
+#!/usr/bin/env python3
+"""
+Accuracy vs speed benchmark of approximate quantile engines.
+
+Measures the trade-offs available for weighted quantiles against the exact
+weighted_quantile, wquantile and whdquantile of the extension, on synthetic
+distributions:
+
+- beta_cdf: whdquantile with looser weighted_statistics.beta_cdf_tolerance
+  and weighted_statistics.beta_cdf_max_iterations settings
+- quantized: values rounded to a relative precision and their weights
+  summed per bucket before calling the exact functions
+- subsampled: a Bernoulli sample of the rows
+- moments_sketch: the extension's moments_sketch aggregate
+- tdigest, kll: reference sketch implementations in this script (Python;
+  their throughput is not comparable to the SQL engines)
+
+Writes one CSV row per engine, setting, distribution and estimator with the
+maximum rank error (difference of the weighted mid-ranks of the estimate and
+the exact result) and relative error over the quantile levels, the state
+size in bytes, the build throughput (input rows/s, including the quantile
+estimate) and, for mergeable sketches, the merge throughput (states/s).
+
+Usage: python benchmark_approximations.py --rows 50000 --output pareto.csv
+"""
+
+import argparse
+import csv
+import math
+import sys
+import time
+from typing import Dict, List, Optional
+
+import numpy as np
+from validate_against_reference import connect_to_postgres
+
+import psycopg2.extras
+
+QUANTILES = [0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99]
+
+ESTIMATORS = ['weighted_quantile', 'wquantile', 'whdquantile']
+
+# Bytes of one (value, weight) pair, as in weighted_pair
+PAIR_BYTES = 16
+
+# Groups the data is split into for the merge measurements
+MERGE_GROUPS = 100
+
+CSV_COLUMNS = ['engine', 'implementation', 'setting', 'distribution', 'estimator',
+               'rows', 'rank_error', 'relative_error', 'state_bytes',
+               'build_rows_per_sec', 'merge_states_per_sec']
+
+
+def generate_distributions(n: int, seed: int) -> Dict[str, np.ndarray]:
+    """Synthetic value distributions, all with uniform(0, 1) weights."""
+    rng = np.random.default_rng(seed)
+    bimodal = np.where(rng.uniform(size=n) < 0.3,
+                       rng.normal(10.0, 1.0, n), rng.normal(20.0, 2.0, n))
+    return {
+        'uniform': rng.uniform(0.0, 100.0, n),
+        'normal': rng.normal(50.0, 10.0, n),
+        'exponential': rng.exponential(1.0, n),
+        'lognormal': rng.lognormal(0.0, 2.0, n),
+        'bimodal': bimodal,
+    }
+
+
+class WeightedCDF:
+    """Mid-rank weighted CDF of the data, F(x) = (F(x-) + F(x)) / 2."""
+
+    def __init__(self, values: np.ndarray, weights: np.ndarray):
+        order = np.argsort(values, kind='stable')
+        self.values = values[order]
+        self.cumulative = np.concatenate(([0.0], np.cumsum(weights[order])))
+        self.total = self.cumulative[-1]
+
+    def rank(self, x: float) -> float:
+        below = self.cumulative[np.searchsorted(self.values, x, side='left')]
+        upto = self.cumulative[np.searchsorted(self.values, x, side='right')]
+        return (below + upto) / 2.0 / self.total
+
+
+def errors(cdf: WeightedCDF, estimates: List[float], exact: List[float]):
+    """Max rank error and relative error of estimates against exact results."""
+    if any(e is None or not math.isfinite(e) for e in estimates):
+        return float('nan'), float('nan')
+    rank_error = max(abs(cdf.rank(e) - cdf.rank(x)) for e, x in zip(estimates, exact))
+    relative_error = max(abs(e - x) / max(abs(x), 1e-300)
+                         for e, x in zip(estimates, exact))
+    return rank_error, relative_error
+
+
+def timed(cursor, query: str, params=None, repeats: int = 3):
+    """Best wall time of a query and its first column."""
+    best = float('inf')
+    result = None
+    for _ in range(repeats):
+        start = time.perf_counter()
+        cursor.execute(query, params)
+        result = cursor.fetchone()[0]
+        best = min(best, time.perf_counter() - start)
+    return best, result
+
+
+class TDigest:
+    """
+    Merging t-digest (Dunning) with the k1 (arcsine) scale function.
+
+    Rows are buffered and merged into the centroids in sorted batches; each
+    centroid spans at most one unit of k.
+    """
+
+    def __init__(self, compression: float):
+        self.compression = compression
+        self.means = np.empty(0)
+        self.weights = np.empty(0)
+        self.buffer_values: List[np.ndarray] = []
+        self.buffer_weights: List[np.ndarray] = []
+        self.buffered = 0
+        self.min = math.inf
+        self.max = -math.inf
+
+    def add(self, values: np.ndarray, weights: np.ndarray):
+        keep = weights > 0
+        self.buffer_values.append(values[keep])
+        self.buffer_weights.append(weights[keep])
+        self.buffered += int(np.count_nonzero(keep))
+        if self.buffered >= 10 * self.compression:
+            self._compress()
+
+    def merge(self, other: 'TDigest'):
+        other._compress()
+        self.add(other.means, other.weights)
+        self.min = min(self.min, other.min)
+        self.max = max(self.max, other.max)
+
+    def _compress(self):
+        if self.buffered == 0:
+            return
+        means = np.concatenate([self.means] + self.buffer_values)
+        weights = np.concatenate([self.weights] + self.buffer_weights)
+        self.buffer_values, self.buffer_weights, self.buffered = [], [], 0
+        if len(means) == 0:
+            return
+        self.min = min(self.min, float(means.min()))
+        self.max = max(self.max, float(means.max()))
+
+        order = np.argsort(means, kind='stable')
+        means, weights = means[order], weights[order]
+        cumulative = np.cumsum(weights)
+        q_mid = (cumulative - weights / 2.0) / cumulative[-1]
+        k = self.compression / (2.0 * math.pi) * np.arcsin(2.0 * q_mid - 1.0)
+        cluster = np.floor(k - k[0]).astype(np.int64)
+        starts = np.flatnonzero(np.diff(cluster, prepend=-1))
+        self.weights = np.add.reduceat(weights, starts)
+        self.means = np.add.reduceat(means * weights, starts) / self.weights
+
+    def quantiles(self, levels: List[float]) -> List[float]:
+        self._compress()
+        cumulative = np.cumsum(self.weights)
+        centers = cumulative - self.weights / 2.0
+        positions = np.concatenate(([0.0], centers, [cumulative[-1]]))
+        values = np.concatenate(([self.min], self.means, [self.max]))
+        return np.interp(np.array(levels) * cumulative[-1], positions, values).tolist()
+
+    def state_bytes(self) -> int:
+        self._compress()
+        return PAIR_BYTES * len(self.means)
+
+
+class KLL:
+    """
+    KLL sketch (Karnin, Lang, Liberty) with weighted items.
+
+    Compacting a level pairs up its sorted items and keeps one of each pair
+    with probability proportional to its weight, carrying the pair's total
+    weight: rank estimates stay unbiased for unequal weights.
+    """
+
+    def __init__(self, k: int, seed: int = 0):
+        self.k = k
+        self.rng = np.random.default_rng(seed)
+        self.values: List[np.ndarray] = [np.empty(0)]
+        self.weights: List[np.ndarray] = [np.empty(0)]
+
+    def _capacity(self, level: int) -> int:
+        depth = len(self.values) - 1 - level
+        return max(2, int(math.ceil(self.k * (2.0 / 3.0) ** depth)))
+
+    def add(self, values: np.ndarray, weights: np.ndarray):
+        keep = weights > 0
+        self.values[0] = np.concatenate((self.values[0], values[keep]))
+        self.weights[0] = np.concatenate((self.weights[0], weights[keep]))
+        self._compress()
+
+    def merge(self, other: 'KLL'):
+        for level in range(len(other.values)):
+            if level == len(self.values):
+                self.values.append(np.empty(0))
+                self.weights.append(np.empty(0))
+            self.values[level] = np.concatenate((self.values[level], other.values[level]))
+            self.weights[level] = np.concatenate((self.weights[level], other.weights[level]))
+        self._compress()
+
+    def _compress(self):
+        level = 0
+        while level < len(self.values):
+            if len(self.values[level]) <= self._capacity(level):
+                level += 1
+                continue
+            if level + 1 == len(self.values):
+                self.values.append(np.empty(0))
+                self.weights.append(np.empty(0))
+            order = np.argsort(self.values[level], kind='stable')
+            values, weights = self.values[level][order], self.weights[level][order]
+            n_pairs = len(values) // 2
+            first_v, second_v = values[0:2 * n_pairs:2], values[1:2 * n_pairs:2]
+            first_w, second_w = weights[0:2 * n_pairs:2], weights[1:2 * n_pairs:2]
+            pair_w = first_w + second_w
+            take_first = self.rng.uniform(size=n_pairs) * pair_w < first_w
+            self.values[level + 1] = np.concatenate(
+                (self.values[level + 1], np.where(take_first, first_v, second_v)))
+            self.weights[level + 1] = np.concatenate((self.weights[level + 1], pair_w))
+            # An odd item out stays on this level
+            self.values[level] = values[2 * n_pairs:]
+            self.weights[level] = weights[2 * n_pairs:]
+            level = 0
+
+    def quantiles(self, levels: List[float]) -> List[float]:
+        values = np.concatenate(self.values)
+        weights = np.concatenate(self.weights)
+        order = np.argsort(values, kind='stable')
+        values, cumulative = values[order], np.cumsum(weights[order])
+        index = np.searchsorted(cumulative, np.array(levels) * cumulative[-1], side='left')
+        return values[np.minimum(index, len(values) - 1)].tolist()
+
+    def state_bytes(self) -> int:
+        return PAIR_BYTES * sum(len(v) for v in self.values)
+
+
+def bench_python_sketch(make, values: np.ndarray, weights: np.ndarray,
+                        batch: int = 1000):
+    """Build one sketch in batches, and merge MERGE_GROUPS group sketches."""
+    start = time.perf_counter()
+    sketch = make()
+    for i in range(0, len(values), batch):
+        sketch.add(values[i:i + batch], weights[i:i + batch])
+    estimates = sketch.quantiles(QUANTILES)
+    build_seconds = time.perf_counter() - start
+
+    groups = []
+    for g in range(MERGE_GROUPS):
+        part = make()
+        part.add(values[g::MERGE_GROUPS], weights[g::MERGE_GROUPS])
+        groups.append(part)
+    start = time.perf_counter()
+    merged = make()
+    for part in groups:
+        merged.merge(part)
+    merged.state_bytes()
+    merge_seconds = time.perf_counter() - start
+
+    return estimates, sketch.state_bytes(), build_seconds, merge_seconds
+
+
+def quantized_value_sql(epsilon: float) -> str:
+    """SQL expression rounding v to relative precision epsilon."""
+    step = math.log1p(epsilon)
+    return (f"CASE WHEN v = 0 THEN 0 ELSE "
+            f"sign(v) * exp(round(ln(abs(v)) / {step!r}) * {step!r}) END")
+
+
+def run(cursor, n: int, seed: int, writer, log):
+    rng = np.random.default_rng(seed + 1)
+
+    for dist_name, values in generate_distributions(n, seed).items():
+        weights = rng.uniform(0.0, 1.0, n)
+        cdf = WeightedCDF(values, weights)
+        log(f"{dist_name}: loading {n} rows")
+
+        cursor.execute("DROP TABLE IF EXISTS bench_data")
+        cursor.execute("CREATE TEMP TABLE bench_data AS "
+                       "SELECT (u.i - 1) %% %s AS g, u.v, u.w "
+                       "FROM unnest(%s::float8[], %s::float8[]) WITH ORDINALITY AS u(v, w, i)",
+                       (MERGE_GROUPS, values.tolist(), weights.tolist()))
+        cursor.execute("ANALYZE bench_data")
+
+        def emit(engine, implementation, setting, estimator, estimates, exact,
+                 state_bytes, build_seconds, merge_seconds=None, rows=n):
+            rank_error, relative_error = errors(cdf, estimates, exact)
+            writer.writerow({
+                'engine': engine,
+                'implementation': implementation,
+                'setting': setting,
+                'distribution': dist_name,
+                'estimator': estimator,
+                'rows': rows,
+                'rank_error': f"{rank_error:.3g}",
+                'relative_error': f"{relative_error:.3g}",
+                'state_bytes': state_bytes,
+                'build_rows_per_sec': f"{rows / build_seconds:.0f}",
+                'merge_states_per_sec': ('' if merge_seconds is None
+                                         else f"{MERGE_GROUPS / merge_seconds:.0f}"),
+            })
+
+        # Exact engines: the baseline of every other row
+        exact: Dict[str, List[float]] = {}
+        for estimator in ESTIMATORS:
+            seconds, result = timed(cursor, f"SELECT {estimator}(array_agg(v), array_agg(w), "
+                                            f"%(q)s) FROM bench_data", {'q': QUANTILES})
+            exact[estimator] = result
+            emit('exact', 'sql', '', estimator, result, result, PAIR_BYTES * n, seconds)
+
+        # Harrell-Davis with looser incomplete beta settings
+        for tolerance, iterations in [(1e-8, 200), (1e-6, 200), (1e-4, 200),
+                                      (1e-8, 50), (1e-8, 1000)]:
+            cursor.execute(f"SET weighted_statistics.beta_cdf_tolerance = {tolerance!r}")
+            cursor.execute(f"SET weighted_statistics.beta_cdf_max_iterations = {iterations}")
+            seconds, result = timed(cursor, "SELECT whdquantile(array_agg(v), array_agg(w), "
+                                            "%(q)s) FROM bench_data", {'q': QUANTILES})
+            emit('beta_cdf', 'sql', f"tolerance={tolerance:g} max_iterations={iterations}",
+                 'whdquantile', result, exact['whdquantile'], PAIR_BYTES * n, seconds)
+        cursor.execute("RESET weighted_statistics.beta_cdf_tolerance")
+        cursor.execute("RESET weighted_statistics.beta_cdf_max_iterations")
+
+        # Values rounded to a relative precision, weights summed per bucket
+        for epsilon in [1e-2, 1e-3]:
+            buckets_sql = (f"SELECT {quantized_value_sql(epsilon)} AS qv, sum(w) AS sw "
+                           f"FROM bench_data GROUP BY 1")
+            cursor.execute(f"SELECT count(*) FROM ({buckets_sql}) s")
+            buckets = cursor.fetchone()[0]
+            for estimator in ESTIMATORS:
+                seconds, result = timed(cursor, f"SELECT {estimator}(array_agg(qv), array_agg(sw), "
+                                                f"%(q)s) FROM ({buckets_sql}) s", {'q': QUANTILES})
+                emit('quantized', 'sql', f"epsilon={epsilon:g}", estimator, result,
+                     exact[estimator], PAIR_BYTES * buckets, seconds)
+
+        # Bernoulli samples of the rows
+        for percent in [10, 1]:
+            cursor.execute(f"SELECT count(*) FROM bench_data TABLESAMPLE BERNOULLI ({percent}) "
+                           f"REPEATABLE ({seed})")
+            sampled = cursor.fetchone()[0]
+            for estimator in ESTIMATORS:
+                seconds, result = timed(cursor, f"SELECT {estimator}(array_agg(v), array_agg(w), "
+                                                f"%(q)s) FROM bench_data TABLESAMPLE BERNOULLI "
+                                                f"({percent}) REPEATABLE ({seed})", {'q': QUANTILES})
+                emit('subsampled', 'sql', f"percent={percent}", estimator, result,
+                     exact[estimator], PAIR_BYTES * sampled, seconds)
+
+        # Moments sketch: build over all rows, merge per-group sketches
+        seconds, result = timed(cursor, "SELECT moments_sketch_quantile(moments_sketch_agg(v, w), "
+                                        "%(q)s) FROM bench_data", {'q': QUANTILES})
+        cursor.execute("DROP TABLE IF EXISTS bench_sketches")
+        cursor.execute("CREATE TEMP TABLE bench_sketches AS SELECT g, moments_sketch_agg(v, w) "
+                       "AS sketch FROM bench_data GROUP BY g")
+        merge_seconds, _ = timed(cursor, "SELECT moments_sketch_merge(sketch) FROM bench_sketches")
+        cursor.execute("SELECT pg_column_size(sketch) FROM bench_sketches LIMIT 1")
+        emit('moments_sketch', 'sql', 'k=10', 'weighted_quantile', result,
+             exact['weighted_quantile'], cursor.fetchone()[0], seconds, merge_seconds)
+
+        # Reference sketches
+        for compression in [50, 100, 200]:
+            estimates, size, seconds, merge_seconds = bench_python_sketch(
+                lambda: TDigest(compression), values, weights)
+            emit('tdigest', 'python', f"compression={compression}", 'weighted_quantile',
+                 estimates, exact['weighted_quantile'], size, seconds, merge_seconds)
+        for k in [50, 200]:
+            estimates, size, seconds, merge_seconds = bench_python_sketch(
+                lambda: KLL(k, seed), values, weights)
+            emit('kll', 'python', f"k={k}", 'weighted_quantile',
+                 estimates, exact['weighted_quantile'], size, seconds, merge_seconds)
+
+    cursor.execute("DROP TABLE IF EXISTS bench_sketches")
+    cursor.execute("DROP TABLE IF EXISTS bench_data")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark approximate quantile engines against the exact functions')
+    parser.add_argument('--host', default='localhost', help='PostgreSQL host')
+    parser.add_argument('--port', type=int, default=5432,
+                        help='PostgreSQL port')
+    parser.add_argument('--database', default='postgres',
+                        help='PostgreSQL database')
+    parser.add_argument('--user', default='postgres', help='PostgreSQL user')
+    parser.add_argument('--password', default='postgres',
+                        help='PostgreSQL password')
+    parser.add_argument('--rows', type=int, default=50000,
+                        help='Rows per distribution')
+    parser.add_argument('--seed', type=int, default=110, help='Random seed')
+    parser.add_argument('--output', help='CSV file (default: stdout)')
+
+    args = parser.parse_args()
+
+    conn = connect_to_postgres(
+        args.host, args.port, args.database, args.user, args.password)
+    cursor = conn.cursor(cursor_factory=psycopg2.extras.DictCursor)
+    # The GUCs are defined once the library is loaded
+    cursor.execute("LOAD 'weighted_statistics'")
+
+    output: Optional[object] = open(args.output, 'w', newline='') if args.output else sys.stdout
+    writer = csv.DictWriter(output, fieldnames=CSV_COLUMNS)
+    writer.writeheader()
+
+    run(cursor, args.rows, args.seed, writer,
+        lambda message: print(message, file=sys.stderr))
+
+    if args.output:
+        output.close()
+    conn.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -14,7 +14,12 @@ import numpy as np
 import psycopg2
 import psycopg2.extras
 from weighted_quantile import weighted_quantile, wquantile, whdquantile
-from weighted_stats import weighted_mean, weighted_variance, weighted_std
+from scipy import stats
+from weighted_stats import (weighted_mean, weighted_variance, weighted_std,
+                            weighted_kendall_tau, weighted_spearman,
+                            weighted_auc, weighted_hodges_lehmann,
+                            weighted_qn, weighted_sn, weighted_lmoments,
+                            weighted_expectile, weighted_expected_shortfall)
 
 
 def connect_to_postgres(host='localhost', port=5432, database='postgres',
@@ -127,6 +132,70 @@ def test_weighted_quantile(cursor,
     return results
 
 
+def test_large_quantiles(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_quantile on arrays large enough for the radix select path,
+    and against the sort path by requesting more quantiles than it handles."""
+    results = []
+    rng = np.random.default_rng(106)
+    n = 100000
+    few_quantiles = [0.0, 0.001, 0.1, 0.25, 0.5, 0.75, 0.9, 0.999, 1.0]
+    many_quantiles = np.linspace(0.0, 1.0, 101).tolist()
+    cases = [
+        ('uniform', rng.uniform(0.0, 100.0, n), rng.uniform(0.1, 1.0, n)),
+        ('heavy duplicates', rng.integers(-3, 4, n).astype(float), rng.uniform(0.0, 1.0, n)),
+        ('mixed signs, zero weights', rng.normal(0.0, 1e6, n),
+         np.where(rng.uniform(size=n) < 0.2, 0.0, rng.exponential(1.0, n))),
+        ('sparse (sum < 1.0)', rng.normal(0.0, 50.0, n), np.full(n, 0.5 / n)),
+        ('clustered', 1000.0 + rng.uniform(0.0, 1e-6, n), rng.uniform(0.1, 1.0, n)),
+    ]
+
+    i = 0
+    for case_name, values, weights in cases:
+        # The reference interpolates on the raw cumulative weights: keep the
+        # total just above 1 so rounding does not add an implicit zero, unless
+        # the case is sparse on purpose
+        if np.sum(weights) > 1.0:
+            weights = weights / np.sum(weights) * (1.0 + 1e-12)
+        # The extension drops zero weights, the reference interpolates over them
+        positive = weights > 0.0
+        for label, quantiles in (('select', few_quantiles), ('sort', many_quantiles)):
+            i += 1
+            name = f"large array ({label}): {case_name}"
+            ref_result = weighted_quantile(values[positive], np.array(quantiles),
+                                           weights[positive])
+
+            cursor.execute(
+                "SELECT weighted_quantile(%s, %s, %s) AS result",
+                (values.tolist(), weights.tolist(), quantiles)
+            )
+            pg_result = np.array(cursor.fetchone()['result'])
+
+            # Cumulative weights over 1e5 elements differ in the last bits,
+            # which the sparse tails of the distributions amplify
+            tolerance = 1e-7 * max(1.0, float(np.max(np.abs(values))))
+            max_diff = float(np.max(np.abs(ref_result - pg_result)))
+            passed = max_diff < tolerance
+
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': ref_result.tolist(),
+                'postgres_result': pg_result.tolist(),
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+                print(f"  Reference: {ref_result}")
+                print(f"  PostgreSQL: {pg_result}")
+
+    return results
+
+
 def generate_test_cases() -> Tuple[List[Dict], List[Dict]]:
     """Generate test cases for validation."""
 
@@ -400,6 +469,68 @@ def test_whdquantile(cursor, test_cases: List[Dict[str, Any]]) -> List[Dict[str,
     return results
 
 
+def test_threaded_whdquantile(cursor) -> List[Dict[str, Any]]:
+    """Test whdquantile with worker threads against the reference, and check
+    that the result does not depend on the number of threads."""
+    results = []
+    rng = np.random.default_rng(107)
+    n = 40000
+    quantiles = [0.05, 0.25, 0.5, 0.75, 0.95]
+    # Skewed weights keep the effective sample size in the range where the
+    # Beta CDF continued fraction converges
+    cases = [
+        ('normal values', rng.normal(0.0, 10.0, n), np.exp(rng.uniform(0.0, 12.0, n))),
+        ('sparse (sum < 1.0)', rng.exponential(5.0, n), rng.uniform(0.5, 1.0, n) * 0.9 / (0.75 * n)),
+    ]
+
+    # The GUCs are defined once the library is loaded
+    cursor.execute("LOAD 'weighted_statistics'")
+    cursor.execute("SET weighted_statistics.parallel_min_elements = 1000")
+
+    i = 0
+    for case_name, values, weights in cases:
+        ref_result = np.array(whdquantile(values, np.array(quantiles), weights))
+
+        pg_results = {}
+        for n_threads in (1, 4):
+            cursor.execute(f"SET weighted_statistics.max_worker_threads = {n_threads}")
+            cursor.execute(
+                "SELECT whdquantile(%s, %s, %s) AS result",
+                (values.tolist(), weights.tolist(), quantiles)
+            )
+            pg_results[n_threads] = np.array(cursor.fetchone()['result'])
+
+        reference_diff = float(np.max(np.abs(ref_result - pg_results[4])))
+        thread_diff = float(np.max(np.abs(pg_results[1] - pg_results[4])))
+        checks = [
+            ('4 threads vs reference', reference_diff < 1e-6, reference_diff),
+            # Chunks are summed in a fixed order, so the results are identical
+            ('4 threads vs 1 thread', thread_diff == 0.0, thread_diff),
+        ]
+
+        for label, passed, max_diff in checks:
+            i += 1
+            name = f"threaded whdquantile ({label}): {case_name}"
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': ref_result.tolist(),
+                'postgres_result': pg_results[4].tolist(),
+                'max_difference': max_diff,
+                'tolerance': 1e-6,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+
+    cursor.execute("RESET weighted_statistics.max_worker_threads")
+    cursor.execute("RESET weighted_statistics.parallel_min_elements")
+    return results
+
+
 def test_weighted_variance(cursor, test_cases: List[Dict[str, Any]]) -> List[Dict[str, Any]]:
     """Test weighted_variance function against reference implementation."""
     results = []
@@ -514,6 +645,1407 @@ def test_weighted_std(cursor, test_cases: List[Dict[str, Any]]) -> List[Dict[str
     return results
 
 
+def test_threaded_moments(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_mean/variance/std with worker threads against the
+    reference, and check that the result does not depend on the number of
+    threads."""
+    results = []
+    rng = np.random.default_rng(108)
+    n = 200000
+    query = ("SELECT ARRAY[weighted_mean(%(v)s, %(w)s), weighted_variance(%(v)s, %(w)s, 1), "
+             "weighted_std(%(v)s, %(w)s, 0)] AS result")
+    cases = [
+        ('uniform', rng.uniform(-100.0, 100.0, n), rng.uniform(0.0, 2.0, n)),
+        ('sparse (sum < 1.0)', rng.normal(1e3, 1.0, n), rng.uniform(0.0, 1.0 / n, n)),
+        ('zero weights', rng.exponential(5.0, n),
+         np.where(rng.uniform(size=n) < 0.5, 0.0, rng.uniform(0.0, 1.0, n))),
+    ]
+
+    # The GUCs are defined once the library is loaded
+    cursor.execute("LOAD 'weighted_statistics'")
+    cursor.execute("SET weighted_statistics.parallel_min_elements = 1000")
+
+    i = 0
+    for case_name, values, weights in cases:
+        ref_result = np.array([weighted_mean(values, weights),
+                               weighted_variance(values, weights, ddof=1),
+                               weighted_std(values, weights, ddof=0)])
+
+        pg_results = {}
+        for n_threads in (2, 4):
+            cursor.execute(f"SET weighted_statistics.max_worker_threads = {n_threads}")
+            cursor.execute(query, {'v': values.tolist(), 'w': weights.tolist()})
+            pg_results[n_threads] = np.array(cursor.fetchone()['result'])
+
+        tolerance = 1e-10 * max(1.0, float(np.max(np.abs(ref_result))))
+        reference_diff = float(np.max(np.abs(ref_result - pg_results[4])))
+        thread_diff = float(np.max(np.abs(pg_results[2] - pg_results[4])))
+        checks = [
+            ('4 threads vs reference', reference_diff < tolerance, reference_diff),
+            # Chunks are merged in a fixed tree order, so the results are identical
+            ('4 threads vs 2 threads', thread_diff == 0.0, thread_diff),
+        ]
+
+        for label, passed, max_diff in checks:
+            i += 1
+            name = f"threaded moments ({label}): {case_name}"
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': ref_result.tolist(),
+                'postgres_result': pg_results[4].tolist(),
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+
+    cursor.execute("RESET weighted_statistics.max_worker_threads")
+    cursor.execute("RESET weighted_statistics.parallel_min_elements")
+    return results
+
+
+def test_weighted_pair_overloads(cursor, mean_cases: List[Dict[str, Any]],
+                                 quantile_cases: List[Dict[str, Any]]
+                                 ) -> List[Dict[str, Any]]:
+    """Test weighted_pair[] overloads against reference implementation."""
+    results = []
+    pairs_sql = ("ARRAY(SELECT weighted_pair(v, w) FROM "
+                 "unnest(%s::float8[], %s::float8[]) AS u(v, w))")
+
+    checks = []
+    for case in mean_cases:
+        values = np.array(case['values'])
+        weights = np.array(case['weights'])
+        checks.append((f"weighted_mean: {case['name']}",
+                       f"SELECT ARRAY[weighted_mean({pairs_sql})] AS result",
+                       (values.tolist(), weights.tolist()),
+                       np.array([weighted_mean(values, weights)]), 1e-10))
+        checks.append((f"weighted_variance: {case['name']}",
+                       f"SELECT ARRAY[weighted_variance({pairs_sql}, 1)] AS result",
+                       (values.tolist(), weights.tolist()),
+                       np.array([weighted_variance(values, weights, ddof=1)]), 1e-10))
+
+    for case in quantile_cases:
+        values = np.array(case['values'])
+        weights = np.array(case['weights'])
+        quantiles = np.array(case['quantiles'])
+        for func, ref in (('weighted_quantile', weighted_quantile),
+                          ('wquantile', wquantile),
+                          ('whdquantile', whdquantile)):
+            checks.append((f"{func}: {case['name']}",
+                           f"SELECT {func}({pairs_sql}, %s) AS result",
+                           (values.tolist(), weights.tolist(), quantiles.tolist()),
+                           np.array(ref(values, quantiles, weights), dtype=float),
+                           case.get('tolerance', 1e-6)))
+
+    for i, (name, query, params, ref_result, tolerance) in enumerate(checks):
+        cursor.execute(query, params)
+        pg_result = np.array([np.nan if x is None else x
+                              for x in cursor.fetchone()['result']], dtype=float)
+
+        # NULL and NaN both mean "undefined"; positions must match
+        ref_nans = np.isnan(ref_result)
+        if not np.array_equal(ref_nans, np.isnan(pg_result)):
+            max_diff = float('inf')
+        elif np.all(ref_nans):
+            max_diff = 0.0
+        else:
+            max_diff = float(np.max(np.abs(ref_result[~ref_nans] -
+                                           pg_result[~ref_nans])))
+        passed = max_diff < tolerance
+
+        results.append({
+            'test_id': i + 1,
+            'name': name,
+            'reference_result': ref_result.tolist(),
+            'postgres_result': pg_result.tolist(),
+            'max_difference': max_diff,
+            'tolerance': tolerance,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i+1}: {name} - {status}")
+        if not passed:
+            print(f"  Max difference: {max_diff}")
+            print(f"  Reference: {ref_result}")
+            print(f"  PostgreSQL: {pg_result}")
+
+    return results
+
+
+def test_expanded_arrays(cursor, quantile_cases: List[Dict[str, Any]]
+                         ) -> List[Dict[str, Any]]:
+    """Test that arrays built element by element in PL/pgSQL (expanded
+    arrays) give exactly the same results as the flat arrays."""
+    results = []
+    stats_sql = ("ARRAY[weighted_mean({v}, {w}), weighted_variance({v}, {w}, 1)] || "
+                 "weighted_quantile({v}, {w}, {q}) || wquantile({v}, {w}, {q}) || "
+                 "whdquantile({v}, {w}, {q})")
+    cursor.execute(f"""
+        CREATE FUNCTION pg_temp.expanded_stats(v float8[], w float8[], q float8[])
+        RETURNS float8[] AS $$
+        DECLARE
+            ev float8[] := '{{}}';
+            ew float8[] := '{{}}';
+        BEGIN
+            FOR i IN 1..cardinality(v) LOOP
+                ev[i] := v[i];
+                ew := ew || w[i];
+            END LOOP;
+            RETURN {stats_sql.format(v='ev', w='ew', q='q')};
+        END $$ LANGUAGE plpgsql""")
+
+    for i, case in enumerate(quantile_cases, 1):
+        name = f"expanded arrays: {case['name']}"
+        params = {'v': case['values'], 'w': case['weights'], 'q': case['quantiles']}
+        cursor.execute("SELECT " + stats_sql.format(v='%(v)s::float8[]', w='%(w)s::float8[]',
+                                                     q='%(q)s::float8[]') + " AS result", params)
+        flat_result = np.array(cursor.fetchone()['result'], dtype=float)
+        cursor.execute("SELECT pg_temp.expanded_stats(%(v)s, %(w)s, %(q)s) AS result", params)
+        expanded_result = np.array(cursor.fetchone()['result'], dtype=float)
+
+        passed = np.array_equal(flat_result, expanded_result, equal_nan=True)
+        max_diff = 0.0 if passed else float(np.nanmax(np.abs(flat_result - expanded_result)))
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': flat_result.tolist(),
+            'postgres_result': expanded_result.tolist(),
+            'max_difference': max_diff,
+            'tolerance': 0.0,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Flat: {flat_result}")
+            print(f"  Expanded: {expanded_result}")
+
+    cursor.execute("DROP FUNCTION pg_temp.expanded_stats(float8[], float8[], float8[])")
+    return results
+
+
+def test_table_functions(cursor, mean_cases: List[Dict[str, Any]],
+                         quantile_cases: List[Dict[str, Any]]
+                         ) -> List[Dict[str, Any]]:
+    """Test *_table heap-scan functions against reference implementation."""
+    results = []
+
+    checks = []
+    for case in mean_cases:
+        values = np.array(case['values'], dtype=float)
+        weights = np.array(case['weights'], dtype=float)
+        checks.append((f"weighted_mean_table: {case['name']}", values, weights,
+                       "SELECT ARRAY[weighted_mean_table('validation_table', 'v', 'w')] AS result",
+                       (), np.array([weighted_mean(values, weights)]), 1e-10))
+        # Streaming moments differ from the two-pass result in the last ulp
+        ref_variance = weighted_variance(values, weights, ddof=1)
+        checks.append((f"weighted_variance_table: {case['name']}", values, weights,
+                       "SELECT ARRAY[weighted_variance_table('validation_table', 'v', 'w', 1)] AS result",
+                       (), np.array([ref_variance]),
+                       1e-10 * max(1.0, abs(np.nan_to_num(ref_variance)))))
+
+    for case in quantile_cases:
+        values = np.array(case['values'], dtype=float)
+        weights = np.array(case['weights'], dtype=float)
+        quantiles = np.array(case['quantiles'])
+        checks.append((f"weighted_quantile_table: {case['name']}", values, weights,
+                       "SELECT weighted_quantile_table('validation_table', 'v', 'w', %s) AS result",
+                       (quantiles.tolist(),),
+                       weighted_quantile(values, quantiles, weights),
+                       case.get('tolerance', 1e-6)))
+
+    for i, (name, values, weights, query, params, ref_result, tolerance) in enumerate(checks):
+        cursor.execute("DROP TABLE IF EXISTS validation_table")
+        cursor.execute("CREATE TEMP TABLE validation_table (v float8, w float8)")
+        cursor.execute("INSERT INTO validation_table "
+                       "SELECT * FROM unnest(%s::float8[], %s::float8[])",
+                       (values.tolist(), weights.tolist()))
+        cursor.execute(query, params)
+        pg_result = np.array([np.nan if x is None else x
+                              for x in cursor.fetchone()['result']], dtype=float)
+
+        ref_nans = np.isnan(ref_result)
+        if not np.array_equal(ref_nans, np.isnan(pg_result)):
+            max_diff = float('inf')
+        elif np.all(ref_nans):
+            max_diff = 0.0
+        else:
+            max_diff = float(np.max(np.abs(ref_result[~ref_nans] -
+                                           pg_result[~ref_nans])))
+        passed = max_diff < tolerance
+
+        results.append({
+            'test_id': i + 1,
+            'name': name,
+            'reference_result': ref_result.tolist(),
+            'postgres_result': pg_result.tolist(),
+            'max_difference': max_diff,
+            'tolerance': tolerance,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i+1}: {name} - {status}")
+        if not passed:
+            print(f"  Max difference: {max_diff}")
+            print(f"  Reference: {ref_result}")
+            print(f"  PostgreSQL: {pg_result}")
+
+    cursor.execute("DROP TABLE IF EXISTS validation_table")
+    results.extend(test_table_access(cursor, len(results)))
+    return results
+
+
+def test_table_access(cursor, first_id: int) -> List[Dict[str, Any]]:
+    """Test the privilege and row-level security checks of the *_table
+    functions, which scan the heap directly instead of running a SELECT."""
+    results = []
+    values = [1.0, 2.0, 4.0]
+    weights = [1.0, 2.0, 1.0]
+    expected_mean = weighted_mean(np.array(values), np.array(weights))
+
+    roles = ('weighted_stats_column_reader', 'weighted_stats_no_access',
+             'weighted_stats_rls_reader')
+    for table in ('validation_access_table', 'validation_rls_table'):
+        cursor.execute(f"DROP TABLE IF EXISTS {table}")
+    for role in roles:
+        cursor.execute(f"DROP ROLE IF EXISTS {role}")
+        cursor.execute(f"CREATE ROLE {role}")
+    for table in ('validation_access_table', 'validation_rls_table'):
+        cursor.execute(f"CREATE TABLE {table} (v float8, w float8, secret float8)")
+        cursor.execute(f"INSERT INTO {table} "
+                       "SELECT v, w, 0 FROM unnest(%s::float8[], %s::float8[]) AS u(v, w)",
+                       (values, weights))
+    cursor.execute("GRANT SELECT (v, w) ON validation_access_table "
+                   "TO weighted_stats_column_reader")
+    cursor.execute("GRANT SELECT ON validation_rls_table TO weighted_stats_rls_reader")
+    cursor.execute("ALTER TABLE validation_rls_table ENABLE ROW LEVEL SECURITY")
+    cursor.execute("CREATE POLICY validation_rls_policy ON validation_rls_table "
+                   "USING (v > 1.0)")
+
+    # (name, role, query, expected mean or None, expected error or None)
+    checks = [
+        ('column privileges are enough', 'weighted_stats_column_reader',
+         "SELECT weighted_mean_table('validation_access_table', 'v', 'w') AS result",
+         expected_mean, None),
+        ('column privileges of both columns', 'weighted_stats_column_reader',
+         "SELECT weighted_mean_table('validation_access_table', 'v', 'secret') AS result",
+         None, 'permission denied for table validation_access_table'),
+        ('no privileges', 'weighted_stats_no_access',
+         "SELECT weighted_mean_table('validation_access_table', 'v', 'w') AS result",
+         None, 'permission denied for table validation_access_table'),
+        ('row-level security', 'weighted_stats_rls_reader',
+         "SELECT weighted_mean_table('validation_rls_table', 'v', 'w') AS result",
+         None, 'table functions do not support row-level security on "validation_rls_table"'),
+    ]
+
+    for i, (case_name, role, query, expected_result, expected_error) in enumerate(
+            checks, start=first_id + 1):
+        pg_result, error = None, None
+        cursor.execute(f"SET ROLE {role}")
+        try:
+            cursor.execute(query)
+            pg_result = cursor.fetchone()['result']
+        except psycopg2.Error as e:
+            error = e.pgerror.splitlines()[0] if e.pgerror else str(e)
+        finally:
+            cursor.execute("RESET ROLE")
+
+        if expected_error is not None:
+            passed = error is not None and error.endswith(expected_error)
+            max_diff = 0.0 if passed else float('inf')
+        else:
+            max_diff = (abs(pg_result - expected_result) if pg_result is not None
+                        else float('inf'))
+            passed = error is None and max_diff < 1e-12
+        name = f"table function access: {case_name}"
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': expected_error or expected_result,
+            'postgres_result': error or pg_result,
+            'max_difference': max_diff,
+            'tolerance': 1e-12,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Expected: {expected_error or expected_result}")
+            print(f"  PostgreSQL: {error or pg_result}")
+
+    for table in ('validation_access_table', 'validation_rls_table'):
+        cursor.execute(f"DROP TABLE {table}")
+    for role in roles:
+        cursor.execute(f"DROP ROLE {role}")
+    return results
+
+
+def test_multipass_table_quantiles(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_quantile_table past work_mem, where it narrows the
+    quantiles with radix histogram passes over the table, against
+    weighted_quantile over array_agg of the same rows."""
+    results = []
+    rng = np.random.default_rng(114)
+    n = 100000
+    few_quantiles = [0.999, 0.0, 0.5, 1.0, 0.1, 0.25, 0.75, 0.9, 0.001, 0.5]
+    many_quantiles = np.linspace(0.0, 1.0, 101).tolist()
+    cases = [
+        ('uniform', rng.uniform(0.0, 100.0, n), rng.uniform(0.1, 1.0, n)),
+        ('heavy duplicates', rng.integers(-3, 4, n).astype(float), rng.uniform(0.0, 1.0, n)),
+        ('mixed signs, zero weights', rng.normal(0.0, 1e6, n),
+         np.where(rng.uniform(size=n) < 0.2, 0.0, rng.exponential(1.0, n))),
+        ('sparse (sum < 1.0)', rng.normal(0.0, 50.0, n), np.full(n, 0.5 / n)),
+        # Keys agree in their top bits, so every digit is needed
+        ('clustered', 1000.0 + rng.uniform(0.0, 1e-6, n), rng.uniform(0.1, 1.0, n)),
+    ]
+
+    cursor.execute("SET work_mem = '64kB'")
+    i = 0
+    for case_name, values, weights in cases:
+        cursor.execute("DROP TABLE IF EXISTS validation_table")
+        cursor.execute("CREATE TEMP TABLE validation_table (v float8, w float8)")
+        cursor.execute("INSERT INTO validation_table "
+                       "SELECT * FROM unnest(%s::float8[], %s::float8[])",
+                       (values.tolist(), weights.tolist()))
+
+        for label, quantiles in (('few', few_quantiles), ('many', many_quantiles)):
+            i += 1
+            name = f"multi-pass table quantiles ({label}): {case_name}"
+            cursor.execute("SELECT weighted_quantile(array_agg(v), array_agg(w), %s) AS expected, "
+                           "weighted_quantile_table('validation_table', 'v', 'w', %s) AS result "
+                           "FROM validation_table", (quantiles, quantiles))
+            row = cursor.fetchone()
+            expected = np.array(row['expected'])
+            pg_result = np.array(row['result'])
+
+            # Bucket totals add the weights in another order than one sort
+            tolerance = 1e-9 * max(1.0, float(np.max(np.abs(values))))
+            max_diff = float(np.max(np.abs(expected - pg_result)))
+            passed = max_diff < tolerance
+
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': expected.tolist(),
+                'postgres_result': pg_result.tolist(),
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+                print(f"  Reference: {expected}")
+                print(f"  PostgreSQL: {pg_result}")
+
+    cursor.execute("RESET work_mem")
+    cursor.execute("DROP TABLE IF EXISTS validation_table")
+    return results
+
+
+def test_row_aggregates(cursor, mean_cases: List[Dict[str, Any]]
+                        ) -> List[Dict[str, Any]]:
+    """Test weighted_*_agg row aggregates, with and without the custom scan,
+    and the rewrite of array_agg-based calls into them."""
+    results = []
+    query = ("SELECT ARRAY[weighted_mean_agg(v, w), weighted_variance_agg(v, w, 1), "
+             "weighted_std_agg(v, w)] AS result FROM validation_table")
+    legacy_query = ("SELECT ARRAY[weighted_mean(array_agg(v), array_agg(w)), "
+                    "weighted_variance(array_agg(v), array_agg(w), 1), "
+                    "weighted_std(array_agg(v), array_agg(w))] AS result "
+                    "FROM validation_table")
+    variants = [
+        ('custom scan off', query, "SET weighted_statistics.enable_custom_scan = off"),
+        ('custom scan on', query, "SET weighted_statistics.enable_custom_scan = on"),
+        ('array_agg rewrite', legacy_query, "RESET weighted_statistics.enable_custom_scan"),
+    ]
+
+    # The planner hook is only active once the library is loaded
+    cursor.execute("LOAD 'weighted_statistics'")
+
+    i = 0
+    for case in mean_cases:
+        values = np.array(case['values'], dtype=float)
+        weights = np.array(case['weights'], dtype=float)
+        ref_result = np.array([weighted_mean(values, weights),
+                               weighted_variance(values, weights, ddof=1),
+                               weighted_std(values, weights, ddof=0)])
+        # Streaming moments differ from the two-pass result in the last ulp
+        tolerance = 1e-10 * max(1.0, float(np.max(np.abs(np.nan_to_num(ref_result)))))
+
+        cursor.execute("DROP TABLE IF EXISTS validation_table")
+        cursor.execute("CREATE TEMP TABLE validation_table (v float8, w float8)")
+        cursor.execute("INSERT INTO validation_table "
+                       "SELECT * FROM unnest(%s::float8[], %s::float8[])",
+                       (values.tolist(), weights.tolist()))
+
+        for label, variant_query, setting in variants:
+            i += 1
+            name = f"row aggregates ({label}): {case['name']}"
+            cursor.execute(setting)
+            cursor.execute(variant_query)
+            pg_result = np.array([np.nan if x is None else x
+                                  for x in cursor.fetchone()['result']], dtype=float)
+
+            ref_nans = np.isnan(ref_result)
+            if not np.array_equal(ref_nans, np.isnan(pg_result)):
+                max_diff = float('inf')
+            elif np.all(ref_nans):
+                max_diff = 0.0
+            else:
+                max_diff = float(np.max(np.abs(ref_result[~ref_nans] -
+                                               pg_result[~ref_nans])))
+            passed = max_diff < tolerance
+
+            if variant_query is legacy_query:
+                cursor.execute("EXPLAIN (VERBOSE) " + variant_query)
+                plan = "\n".join(row['QUERY PLAN'] for row in cursor.fetchall())
+                passed = passed and 'weighted_mean_agg' in plan
+            elif label == 'custom scan on':
+                cursor.execute("EXPLAIN " + variant_query)
+                plan = "\n".join(row['QUERY PLAN'] for row in cursor.fetchall())
+                passed = passed and 'Custom Scan (WeightedAggScan)' in plan
+
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': ref_result.tolist(),
+                'postgres_result': pg_result.tolist(),
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+                print(f"  Reference: {ref_result}")
+                print(f"  PostgreSQL: {pg_result}")
+
+    # Invalid rows raise the array functions' errors whether the array_agg
+    # call is rewritten or not, and through the custom scan too
+    error_cases = [
+        ('NaN value', "('NaN', 1.0)", 'input arrays must not contain NaN or infinite values'),
+        ('infinite weight', "(1.0, 'Infinity')",
+         'input arrays must not contain NaN or infinite values'),
+        ('negative weight', "(1.0, -1.0)", 'weights must be non-negative'),
+    ]
+    error_variants = [
+        ('rewrite off', legacy_query, "SET weighted_statistics.enable_array_agg_rewrite = off"),
+        ('rewrite on', legacy_query, "RESET weighted_statistics.enable_array_agg_rewrite"),
+        ('custom scan on', query, "SET weighted_statistics.enable_custom_scan = on"),
+    ]
+    for case_name, bad_row, expected_error in error_cases:
+        cursor.execute("DROP TABLE IF EXISTS validation_table")
+        cursor.execute("CREATE TEMP TABLE validation_table (v float8, w float8)")
+        cursor.execute("INSERT INTO validation_table VALUES (2.0, 1.0), " + bad_row)
+        for label, variant_query, setting in error_variants:
+            i += 1
+            name = f"row aggregate errors ({label}): {case_name}"
+            cursor.execute(setting)
+            try:
+                cursor.execute(variant_query)
+                error = None
+            except psycopg2.Error as e:
+                error = e.pgerror.splitlines()[0] if e.pgerror else str(e)
+            passed = error is not None and error.endswith(expected_error)
+
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': expected_error,
+                'postgres_result': error,
+                'max_difference': 0.0 if passed else float('inf'),
+                'tolerance': 0.0,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Expected: {expected_error}")
+                print(f"  PostgreSQL: {error}")
+
+    cursor.execute("RESET weighted_statistics.enable_custom_scan")
+    cursor.execute("DROP TABLE IF EXISTS validation_table")
+
+    # The custom scan on a regular table, serial and as the partial step of a
+    # parallel plan, with quals over constants, external and initplan Params
+    rng = np.random.default_rng(103)
+    values = rng.normal(10.0, 3.0, 20000)
+    weights = rng.uniform(0.0, 1.0, 20000)
+    cursor.execute("DROP TABLE IF EXISTS validation_scan_table")
+    cursor.execute("CREATE TABLE validation_scan_table (v float8, w float8)")
+    cursor.execute("INSERT INTO validation_scan_table "
+                   "SELECT * FROM unnest(%s::float8[], %s::float8[])",
+                   (values.tolist(), weights.tolist()))
+    cursor.execute("ANALYZE validation_scan_table")
+    cursor.execute("SET weighted_statistics.enable_custom_scan = on")
+    cursor.execute("SET plan_cache_mode = force_generic_plan")
+
+    scan_query = query.replace("validation_table", "validation_scan_table")
+    qual_variants = [
+        ('no qual', None, scan_query),
+        ('plain qual', 9.0, scan_query + " WHERE v > 9.0"),
+        ('external param qual', 10.0, "EXECUTE scan_query(10.0)"),
+        ('initplan qual', 11.0, scan_query + " WHERE v > (SELECT 11.0)"),
+    ]
+    plan_variants = [
+        ('serial', 'Custom Scan (WeightedAggScan)',
+         ["SET max_parallel_workers_per_gather = 0"]),
+        ('parallel', 'Parallel Custom Scan (WeightedAggScan)',
+         ["RESET max_parallel_workers_per_gather", "SET parallel_setup_cost = 0",
+          "SET parallel_tuple_cost = 0", "SET min_parallel_table_scan_size = 0"]),
+    ]
+
+    for plan_label, plan_node, settings in plan_variants:
+        for setting in settings:
+            cursor.execute(setting)
+        # Prepared under these settings, as the generic plan is cached
+        cursor.execute("PREPARE scan_query(float8) AS " + query.replace(
+            "validation_table", "validation_scan_table WHERE v > $1"))
+        for qual_label, threshold, variant_query in qual_variants:
+            i += 1
+            name = f"custom scan ({plan_label}, {qual_label})"
+            mask = values > threshold if threshold is not None else np.ones(len(values), bool)
+            ref_result = np.array([weighted_mean(values[mask], weights[mask]),
+                                   weighted_variance(values[mask], weights[mask], ddof=1),
+                                   weighted_std(values[mask], weights[mask], ddof=0)])
+            tolerance = 1e-10 * max(1.0, float(np.max(np.abs(ref_result))))
+
+            cursor.execute("EXPLAIN " + variant_query)
+            plan = "\n".join(row['QUERY PLAN'] for row in cursor.fetchall())
+            planned = plan_node in plan and (plan_label == 'parallel' or 'Parallel' not in plan)
+            cursor.execute(variant_query)
+            pg_result = np.array(cursor.fetchone()['result'], dtype=float)
+            max_diff = float(np.max(np.abs(ref_result - pg_result)))
+            passed = planned and max_diff < tolerance
+
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': ref_result.tolist(),
+                'postgres_result': pg_result.tolist(),
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+                print(f"  Plan:\n{plan}")
+        cursor.execute("DEALLOCATE scan_query")
+
+    for setting in ("RESET plan_cache_mode",
+                    "RESET max_parallel_workers_per_gather", "RESET parallel_setup_cost",
+                    "RESET parallel_tuple_cost", "RESET min_parallel_table_scan_size",
+                    "RESET weighted_statistics.enable_custom_scan",
+                    "DROP TABLE validation_scan_table"):
+        cursor.execute(setting)
+    return results
+
+
+def test_quantile_aggregate(cursor, quantile_cases: List[Dict[str, Any]]
+                            ) -> List[Dict[str, Any]]:
+    """Test weighted_quantile_agg against weighted_quantile over array_agg, in
+    memory and with a work_mem small enough to spill sorted runs to disk."""
+    results = []
+    rng = np.random.default_rng(113)
+    n = 100000
+    # Unsorted and repeated levels, including the extremes
+    quantiles = [0.999, 0.0, 0.5, 1.0, 0.1, 0.25, 0.75, 0.9, 0.001, 0.5]
+    large_cases = [
+        ('uniform', rng.uniform(0.0, 100.0, n), rng.uniform(0.1, 1.0, n)),
+        ('heavy duplicates', rng.integers(-3, 4, n).astype(float), rng.uniform(0.0, 1.0, n)),
+        ('mixed signs, zero weights', rng.normal(0.0, 1e6, n),
+         np.where(rng.uniform(size=n) < 0.2, 0.0, rng.exponential(1.0, n))),
+        ('sparse (sum < 1.0)', rng.normal(0.0, 50.0, n), np.full(n, 0.5 / n)),
+    ]
+    cases = [('in memory: ' + case['name'], np.array(case['values'], dtype=float),
+              np.array(case['weights'], dtype=float), case['quantiles'], None)
+             for case in quantile_cases]
+    cases += [('spilled: ' + name, values, weights, quantiles, '64kB')
+              for name, values, weights in large_cases]
+
+    i = 0
+    for case_name, values, weights, levels, work_mem in cases:
+        cursor.execute("DROP TABLE IF EXISTS validation_table")
+        cursor.execute("CREATE TEMP TABLE validation_table (g int, v float8, w float8)")
+        cursor.execute("INSERT INTO validation_table "
+                       "SELECT i %% 3, v, w FROM unnest(%s::float8[], %s::float8[]) "
+                       "WITH ORDINALITY AS u(v, w, i)",
+                       (values.tolist(), weights.tolist()))
+        cursor.execute("SET work_mem = %s", (work_mem or '4MB',))
+
+        # One group of all rows, then three groups aggregated side by side
+        cursor.execute("SELECT weighted_quantile(array_agg(v), array_agg(w), %s) AS expected, "
+                       "weighted_quantile_agg(v, w, %s) AS result FROM validation_table",
+                       (levels, levels))
+        row = cursor.fetchone()
+        expected = [np.array(row['expected'])]
+        actual = [np.array(row['result'])]
+        cursor.execute("SELECT weighted_quantile(array_agg(v), array_agg(w), "
+                       "%s) AS expected, weighted_quantile_agg(v, w, %s) AS result "
+                       "FROM validation_table GROUP BY g ORDER BY g", (levels, levels))
+        for row in cursor.fetchall():
+            expected.append(np.array(row['expected']))
+            actual.append(np.array(row['result']))
+
+        # Merged runs add equal values' weights in another order than one sort
+        tolerance = 1e-9 * max(1.0, float(np.max(np.abs(values))))
+        max_diff = max(float(np.max(np.abs(e - a))) for e, a in zip(expected, actual))
+        passed = max_diff < tolerance
+
+        i += 1
+        name = f"quantile aggregate ({case_name})"
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': expected[0].tolist(),
+            'postgres_result': actual[0].tolist(),
+            'max_difference': max_diff,
+            'tolerance': tolerance,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Max difference: {max_diff}")
+            print(f"  Reference: {expected[0]}")
+            print(f"  PostgreSQL: {actual[0]}")
+
+    cursor.execute("RESET work_mem")
+    cursor.execute("DROP TABLE IF EXISTS validation_table")
+    return results
+
+
+def test_moments_sketch(cursor) -> List[Dict[str, Any]]:
+    """Test moments_sketch quantiles by their weighted rank error, and check
+    that merging per-group sketches matches one sketch of all rows."""
+    results = []
+    rng = np.random.default_rng(109)
+    n = 50000
+    quantiles = [0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99]
+    cases = [
+        ('uniform', rng.uniform(0.0, 100.0, n), rng.uniform(0.0, 1.0, n)),
+        ('normal', rng.normal(50.0, 10.0, n), rng.uniform(0.0, 1.0, n)),
+        ('lognormal', rng.lognormal(0.0, 2.0, n), rng.uniform(0.0, 1.0, n)),
+        ('offset 1e6', 1e6 + rng.uniform(0.0, 1.0, n), rng.uniform(0.0, 1.0, n)),
+        ('sparse (sum < 1.0)', rng.uniform(0.0, 100.0, n), rng.uniform(0.0, 0.5 / n, n)),
+    ]
+
+    # The planner hook is only active once the library is loaded
+    cursor.execute("LOAD 'weighted_statistics'")
+
+    i = 0
+    for case_name, values, weights in cases:
+        cursor.execute("DROP TABLE IF EXISTS validation_table")
+        cursor.execute("CREATE TEMP TABLE validation_table (g int, v float8, w float8)")
+        cursor.execute("INSERT INTO validation_table "
+                       "SELECT i %% 10, v, w FROM unnest(%s::float8[], %s::float8[]) "
+                       "WITH ORDINALITY AS u(v, w, i)",
+                       (values.tolist(), weights.tolist()))
+
+        cursor.execute("SELECT moments_sketch_quantile(moments_sketch_agg(v, w), %s) "
+                       "AS result FROM validation_table", (quantiles,))
+        estimates = np.array(cursor.fetchone()['result'])
+        cursor.execute("SELECT moments_sketch_quantile(moments_sketch_merge(s), %s) AS result "
+                       "FROM (SELECT moments_sketch_agg(v, w) AS s FROM validation_table "
+                       "GROUP BY g) groups", (quantiles,))
+        merged = np.array(cursor.fetchone()['result'])
+
+        # The custom scan folds the same rows in batches, in the same order
+        cursor.execute("SET weighted_statistics.enable_custom_scan = on")
+        scan_query = ("SELECT moments_sketch_quantile(moments_sketch_agg(v, w), %s) "
+                      "AS result, weighted_mean_agg(v, w) AS mean FROM validation_table")
+        cursor.execute("EXPLAIN " + scan_query, (quantiles,))
+        scan_planned = any('WeightedAggScan' in row['QUERY PLAN'] for row in cursor.fetchall())
+        cursor.execute(scan_query, (quantiles,))
+        scanned = np.array(cursor.fetchone()['result'])
+        cursor.execute("RESET weighted_statistics.enable_custom_scan")
+
+        # Distance of q from the weighted ranks [F(e-), F(e)] of each estimate,
+        # counting the implicit zero of sparse data
+        total = float(np.sum(weights))
+        zero_mass = max(0.0, 1.0 - total)
+        scale = max(total, 1.0)
+        rank_error = 0.0
+        for q, e in zip(quantiles, estimates):
+            below = (np.sum(weights[values < e]) + zero_mass * (e > 0.0)) / scale
+            upto = (np.sum(weights[values <= e]) + zero_mass * (e >= 0.0)) / scale
+            rank_error = max(rank_error, below - q, q - upto)
+        merge_diff = float(np.max(np.abs(estimates - merged) /
+                                  np.maximum(np.abs(estimates), 1.0)))
+        scan_diff = float(np.max(np.abs(estimates - scanned) /
+                                 np.maximum(np.abs(estimates), 1.0)))
+        checks = [
+            ('rank error', rank_error < 0.01, rank_error, 0.01),
+            # Merged sums differ from the single sketch in the last bits only
+            ('merged groups', merge_diff < 1e-6, merge_diff, 1e-6),
+            ('custom scan', scan_planned and scan_diff < 1e-6, scan_diff, 1e-6),
+        ]
+
+        for label, passed, max_diff, tolerance in checks:
+            i += 1
+            name = f"moments sketch ({label}): {case_name}"
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': quantiles,
+                'postgres_result': estimates.tolist(),
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+
+    cursor.execute("DROP TABLE IF EXISTS validation_table")
+    return results
+
+
+def test_rank_correlations(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_kendall_tau and weighted_spearman against the pairwise
+    references, and with equal weights against scipy on a large sample."""
+    results = []
+    rng = np.random.default_rng(118)
+    n = 400
+    base = rng.normal(0.0, 1.0, n)
+    cases = [
+        ('continuous', base, base + rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n)),
+        ('heavy ties', rng.integers(0, 4, n).astype(float),
+         rng.integers(0, 3, n).astype(float), rng.uniform(0.1, 1.0, n)),
+        ('zero weights', base, base ** 2,
+         np.where(rng.uniform(size=n) < 0.3, 0.0, rng.exponential(1.0, n))),
+        ('sparse (sum < 1.0)', base, -base + rng.normal(0.0, 0.5, n),
+         rng.uniform(0.0, 0.5 / n, n)),
+        ('small', np.array([1.0, 2.0, 3.0, 4.0, 5.0]), np.array([3.0, 1.0, 4.0, 1.0, 5.0]),
+         np.array([0.1, 0.2, 0.3, 0.2, 0.2])),
+        ('perfectly discordant', base, -3.0 * base, rng.uniform(0.1, 1.0, n)),
+        ('constant y', base, np.full(n, 2.0), rng.uniform(0.1, 1.0, n)),
+    ]
+
+    # Equal weights give the usual statistics; too large for the references
+    m = 200000
+    large_x = rng.integers(0, 1000, m).astype(float)
+    large_y = np.round(large_x / 10.0 + rng.normal(0.0, 20.0, m))
+
+    functions = [
+        ('weighted_kendall_tau', weighted_kendall_tau, stats.kendalltau),
+        ('weighted_spearman', weighted_spearman, stats.spearmanr),
+    ]
+    i = 0
+    for func, reference, scipy_func in functions:
+        checks = []
+        for case_name, x, y, weights in cases:
+            cursor.execute(f"SELECT {func}(%s, %s, %s) AS result",
+                           (x.tolist(), y.tolist(), weights.tolist()))
+            checks.append((case_name, reference(x, y, weights),
+                           cursor.fetchone()['result'], 1e-10))
+        cursor.execute(f"SELECT {func}(%s, %s, array_fill(1.0::float8, ARRAY[%s])) AS result",
+                       (large_x.tolist(), large_y.tolist(), m))
+        checks.append((f"{m} tied values vs scipy", scipy_func(large_x, large_y).statistic,
+                       cursor.fetchone()['result'], 1e-9))
+
+        for case_name, ref_result, pg_result, tolerance in checks:
+            i += 1
+            name = f"{func}: {case_name}"
+            # Undefined (constant x or y) is NULL, nan in the reference
+            if np.isnan(ref_result):
+                passed = pg_result is None
+                max_diff = 0.0 if passed else float('inf')
+            else:
+                max_diff = abs(ref_result - pg_result) if pg_result is not None else float('inf')
+                passed = max_diff < tolerance
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': ref_result,
+                'postgres_result': pg_result,
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Expected: {ref_result}, Got: {pg_result}")
+
+    return results
+
+
+def test_classification(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_auc against the pairwise reference and scipy's
+    Mann-Whitney U, weighted_roc against its area, and weighted_auc_agg
+    against weighted_auc, serially and in parallel."""
+    results = []
+    rng = np.random.default_rng(120)
+    n = 400
+    labels = rng.uniform(size=n) < 0.4
+    scores = rng.normal(0.0, 1.0, n) + labels
+    cases = [
+        ('continuous', scores, labels, rng.uniform(0.1, 1.0, n)),
+        ('heavy ties', rng.integers(0, 5, n).astype(float) + labels * rng.integers(0, 2, n),
+         labels, rng.uniform(0.1, 1.0, n)),
+        ('zero weights', scores, labels,
+         np.where(rng.uniform(size=n) < 0.3, 0.0, rng.exponential(1.0, n))),
+        ('sparse (sum < 1.0)', scores, labels, rng.uniform(0.0, 0.5 / n, n)),
+        ('small', np.array([0.1, 0.4, 0.35, 0.8]), np.array([False, False, True, True]),
+         np.array([1.0, 2.0, 1.0, 0.5])),
+        ('all tied', np.full(n, 3.0), labels, rng.uniform(0.1, 1.0, n)),
+        ('single label', scores, np.ones(n, dtype=bool), rng.uniform(0.1, 1.0, n)),
+    ]
+
+    checks = []
+    for case_name, case_scores, case_labels, weights in cases:
+        ref_result = weighted_auc(case_scores, case_labels, weights)
+        cursor.execute("SELECT weighted_auc(%s, %s, %s) AS result",
+                       (case_scores.tolist(), case_labels.tolist(), weights.tolist()))
+        checks.append((f"weighted_auc: {case_name}", ref_result,
+                       cursor.fetchone()['result'], 1e-12))
+
+        # Trapezoidal area under the full curve
+        cursor.execute("SELECT fpr, tpr FROM weighted_roc(%s, %s, %s, %s)",
+                       (case_scores.tolist(), case_labels.tolist(), weights.tolist(), n + 1))
+        curve = np.array([(row['fpr'], row['tpr']) for row in cursor.fetchall()])
+        area = (float(np.sum(np.diff(curve[:, 0]) * (curve[1:, 1] + curve[:-1, 1]) / 2.0))
+                if len(curve) else None)
+        checks.append((f"weighted_roc area: {case_name}", ref_result, area, 1e-12))
+
+    # Equal weights give the Mann-Whitney U statistic; too large for the reference
+    m = 200000
+    large_labels = rng.uniform(size=m) < 0.3
+    large_scores = np.round(rng.normal(0.0, 10.0, m) + 5.0 * large_labels)
+    u = stats.mannwhitneyu(large_scores[large_labels], large_scores[~large_labels]).statistic
+    cursor.execute("SELECT weighted_auc(%s, %s, array_fill(1.0::float8, ARRAY[%s])) AS result",
+                   (large_scores.tolist(), large_labels.tolist(), m))
+    checks.append((f"weighted_auc: {m} tied values vs Mann-Whitney U",
+                   u / np.sum(large_labels) / np.sum(~large_labels),
+                   cursor.fetchone()['result'], 1e-12))
+
+    # A reduced curve keeps its ends and stays monotone
+    cursor.execute("SELECT array_agg(fpr) AS fpr, array_agg(tpr) AS tpr, count(*) AS n "
+                   "FROM weighted_roc(%s, %s, array_fill(1.0::float8, ARRAY[%s]), 11)",
+                   (large_scores.tolist(), large_labels.tolist(), m))
+    row = cursor.fetchone()
+    reduced_ok = (row['n'] == 11 and row['fpr'][0] == 0.0 and row['tpr'][0] == 0.0 and
+                  row['fpr'][-1] == 1.0 and row['tpr'][-1] == 1.0 and
+                  bool(np.all(np.diff(row['fpr']) >= 0) and np.all(np.diff(row['tpr']) >= 0)))
+    checks.append(("weighted_roc: 11 points of a long curve", 1.0,
+                   1.0 if reduced_ok else None, 0.5))
+
+    # Integer scores below 65536 have bins of their own, so the aggregate is exact
+    cursor.execute("DROP TABLE IF EXISTS classification_table")
+    # Not a temp table: those are never scanned in parallel
+    cursor.execute("CREATE TABLE classification_table (g int, s float8, l bool, w float8)")
+    group_ids = rng.integers(0, 4, m)
+    group_weights = rng.uniform(0.0, 2.0, m)
+    cursor.execute("INSERT INTO classification_table "
+                   "SELECT * FROM unnest(%s::int[], %s::float8[], %s::bool[], %s::float8[])",
+                   (group_ids.tolist(), (large_scores + 100.0).tolist(),
+                    large_labels.tolist(), group_weights.tolist()))
+    cursor.execute("ANALYZE classification_table")
+    group_query = ("SELECT g, weighted_auc_agg(s, l, w) AS agg, "
+                   "weighted_auc(array_agg(s), array_agg(l), array_agg(w)) AS array_result "
+                   "FROM classification_table GROUP BY g ORDER BY g")
+    parallel_settings = ["SET parallel_setup_cost = 0", "SET parallel_tuple_cost = 0",
+                         "SET min_parallel_table_scan_size = 0",
+                         "SET max_parallel_workers_per_gather = 4"]
+    serial_settings = ["SET max_parallel_workers_per_gather = 0"]
+    for label, settings in [('serial', serial_settings), ('parallel', parallel_settings)]:
+        for setting in settings:
+            cursor.execute(setting)
+        cursor.execute("EXPLAIN " + group_query)
+        plan = "\n".join(row['QUERY PLAN'] for row in cursor.fetchall())
+        plan_ok = ('Partial' in plan) == (label == 'parallel')
+        cursor.execute(group_query)
+        for row in cursor.fetchall():
+            checks.append((f"weighted_auc_agg ({label}): group {row['g']}",
+                           row['array_result'], row['agg'] if plan_ok else None, 1e-12))
+    for setting in ["RESET parallel_setup_cost", "RESET parallel_tuple_cost",
+                    "RESET min_parallel_table_scan_size",
+                    "RESET max_parallel_workers_per_gather"]:
+        cursor.execute(setting)
+    cursor.execute("DROP TABLE IF EXISTS classification_table")
+
+    for i, (name, ref_result, pg_result, tolerance) in enumerate(checks, start=1):
+        # Undefined (a single label) is NULL or no rows, nan in the reference
+        if np.isnan(ref_result):
+            passed = pg_result is None
+            max_diff = 0.0 if passed else float('inf')
+        else:
+            max_diff = abs(ref_result - pg_result) if pg_result is not None else float('inf')
+            passed = max_diff < tolerance
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': ref_result,
+            'postgres_result': pg_result,
+            'max_difference': max_diff,
+            'tolerance': tolerance,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Expected: {ref_result}, Got: {pg_result}")
+
+    return results
+
+
+def test_hodges_lehmann(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_hodges_lehmann against the reference that materializes
+    all differences, and with equal weights against the median of all
+    differences on samples too large for the reference."""
+    results = []
+    rng = np.random.default_rng(121)
+    n, m = 300, 200
+    x = rng.normal(0.0, 1.0, n)
+    y = rng.normal(0.5, 2.0, m)
+    cases = [
+        ('continuous', x, rng.uniform(0.1, 1.0, n), y, rng.uniform(0.1, 1.0, m)),
+        ('heavy ties', rng.integers(0, 5, n).astype(float), rng.uniform(0.1, 1.0, n),
+         rng.integers(0, 7, m).astype(float), rng.uniform(0.1, 1.0, m)),
+        ('equal weights, even pairs', x, np.ones(n), y, np.ones(m)),
+        ('equal weights, odd pairs', x[:101], np.ones(101), y[:51], np.ones(51)),
+        ('zero weights', x, np.where(rng.uniform(size=n) < 0.3, 0.0, rng.exponential(1.0, n)),
+         y, np.where(rng.uniform(size=m) < 0.3, 0.0, rng.exponential(1.0, m))),
+        ('sparse (sum < 1.0)', x, rng.uniform(0.0, 0.5 / n, n), y, rng.uniform(0.0, 0.5 / m, m)),
+        ('skewed weights', rng.lognormal(0.0, 1.0, n), rng.pareto(1.5, n),
+         rng.lognormal(0.3, 1.0, m), rng.pareto(1.5, m)),
+        ('single observations', np.array([2.0]), np.array([0.3]), np.array([5.5]), np.array([2.0])),
+        ('no weight in y', x, np.ones(n), y, np.zeros(m)),
+    ]
+    checks = [(case_name, weighted_hodges_lehmann(cx, cwx, cy, cwy), cx, cwx, cy, cwy)
+              for case_name, cx, cwx, cy, cwy in cases]
+
+    # Equal weights: the median of all n * m differences, 2.4M of them here
+    for big_n, big_m in [(1200, 2000), (2001, 1201)]:
+        big_x = np.round(rng.normal(0.0, 10.0, big_n))
+        big_y = np.round(rng.normal(3.0, 10.0, big_m))
+        checks.append((f"{big_n} x {big_m} equal weights vs median of differences",
+                       float(np.median(big_y[None, :] - big_x[:, None])),
+                       big_x, np.ones(big_n), big_y, np.ones(big_m)))
+
+    for i, (case_name, ref_result, cx, cwx, cy, cwy) in enumerate(checks, start=1):
+        cursor.execute("SELECT weighted_hodges_lehmann(%s, %s, %s, %s) AS result",
+                       (cx.tolist(), cwx.tolist(), cy.tolist(), cwy.tolist()))
+        pg_result = cursor.fetchone()['result']
+        name = f"weighted_hodges_lehmann: {case_name}"
+        # Undefined (a sample without weight) is NULL, nan in the reference
+        if np.isnan(ref_result):
+            passed = pg_result is None
+            max_diff = 0.0 if passed else float('inf')
+        else:
+            max_diff = abs(ref_result - pg_result) if pg_result is not None else float('inf')
+            passed = max_diff < 1e-12
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': ref_result,
+            'postgres_result': pg_result,
+            'max_difference': max_diff,
+            'tolerance': 1e-12,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Expected: {ref_result}, Got: {pg_result}")
+
+    return results
+
+
+def test_robust_scale(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_qn and weighted_sn against the pairwise references,
+    and with equal weights against the unweighted order statistics of
+    Rousseeuw and Croux."""
+    results = []
+    rng = np.random.default_rng(122)
+    n = 300
+    base = rng.normal(0.0, 2.0, n)
+    cases = [
+        ('continuous', base, rng.uniform(0.1, 1.0, n)),
+        ('heavy ties', rng.integers(0, 6, n).astype(float), rng.uniform(0.1, 1.0, n)),
+        ('outliers', np.append(base[:270], rng.normal(50.0, 1.0, 30)), rng.uniform(0.1, 1.0, n)),
+        ('zero weights', base, np.where(rng.uniform(size=n) < 0.3, 0.0, rng.exponential(1.0, n))),
+        ('sparse (sum < 1.0)', base, rng.uniform(0.0, 0.5 / n, n)),
+        ('skewed weights', rng.lognormal(0.0, 1.0, n), rng.pareto(1.5, n)),
+        ('weights 1/n', base[:200], np.full(200, 1.0 / 200)),
+        ('single observation', np.array([4.0]), np.array([2.0])),
+    ]
+
+    # Equal weights: the unweighted estimators, as order statistics
+    def unweighted_qn(x):
+        m = len(x)
+        i, j = np.triu_indices(m, 1)
+        h = m // 2 + 1
+        return 2.21914 * np.sort(np.abs(x[i] - x[j]))[h * (h - 1) // 2 - 1]
+
+    def unweighted_sn(x):
+        m = len(x)
+        inner = np.sort(np.abs(x[:, None] - x[None, :]), axis=1)[:, m // 2]
+        return 1.1926 * np.sort(inner)[(m + 1) // 2 - 1]
+
+    checks = []
+    for func, reference, unweighted in [('weighted_qn', weighted_qn, unweighted_qn),
+                                        ('weighted_sn', weighted_sn, unweighted_sn)]:
+        for case_name, values, weights in cases:
+            checks.append((f"{func}: {case_name}", func, reference(values, weights),
+                           values, weights))
+        for m in [2, 3, 2000, 2001]:
+            values = np.round(rng.normal(0.0, 10.0, m), 1)
+            checks.append((f"{func}: {m} equal weights vs unweighted", func, unweighted(values),
+                           values, np.ones(m)))
+
+    for i, (name, func, ref_result, values, weights) in enumerate(checks, start=1):
+        cursor.execute(f"SELECT {func}(%s::float8[], %s::float8[]) AS result, "
+                       f"{func}((SELECT array_agg(weighted_pair(v, w)) "
+                       f"FROM unnest(%s::float8[], %s::float8[]) AS u(v, w))) AS pairs_result",
+                       (values.tolist(), weights.tolist(), values.tolist(), weights.tolist()))
+        row = cursor.fetchone()
+        pg_result = row['result']
+        # Undefined (Qn of a single observation) is NULL, nan in the reference
+        if np.isnan(ref_result):
+            passed = pg_result is None and row['pairs_result'] is None
+            max_diff = 0.0 if passed else float('inf')
+        else:
+            max_diff = abs(ref_result - pg_result) if pg_result is not None else float('inf')
+            passed = max_diff < 1e-12 and row['pairs_result'] == pg_result
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': ref_result,
+            'postgres_result': pg_result,
+            'max_difference': max_diff,
+            'tolerance': 1e-12,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Expected: {ref_result}, Got: {pg_result} (pairs: {row['pairs_result']})")
+
+    return results
+
+
+def test_lmoments(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_lmoments against the reference that integrates every
+    step of the quantile function, and on large samples against the
+    population L-moments of known distributions."""
+    results = []
+    rng = np.random.default_rng(123)
+    n = 500
+    checks = []
+    cases = [
+        ('normal', rng.normal(10.0, 2.0, n), rng.uniform(0.1, 1.0, n), 4),
+        ('heavy ties', rng.integers(0, 5, n).astype(float), rng.uniform(0.1, 1.0, n), 6),
+        ('lognormal', rng.lognormal(0.0, 1.0, n), rng.exponential(1.0, n), 4),
+        ('zero weights', rng.normal(0.0, 1.0, n),
+         np.where(rng.uniform(size=n) < 0.3, 0.0, rng.uniform(0.1, 1.0, n)), 5),
+        ('sparse (sum < 1.0)', rng.gamma(2.0, 1.0, n), rng.uniform(0.0, 0.5 / n, n), 4),
+        ('offset 1e6', 1e6 + rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n), 4),
+        ('order 20', rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n), 20),
+        ('constant', np.full(10, 3.0), np.ones(10), 4),
+        ('single order', rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n), 1),
+    ]
+    for case_name, values, weights, nmom in cases:
+        ref_result = weighted_lmoments(values, weights, nmom)
+        scale = max(1.0, float(np.max(np.abs(np.nan_to_num(ref_result)))))
+        checks.append((case_name, values, weights, nmom, ref_result, 1e-10 * scale))
+
+    # Population L-moments: uniform (1/2, 1/6, 0, 0), exponential (1, 1/2, 1/3, 1/6),
+    # normal(0, 1) (0, 1/sqrt(pi), 0, 0.1226)
+    m = 1000000
+    sample_error = 5e-3
+    checks.append(('uniform, 1M', rng.uniform(0.0, 1.0, m), rng.uniform(0.5, 1.5, m), 4,
+                   np.array([0.5, 1.0 / 6.0, 0.0, 0.0]), sample_error))
+    checks.append(('exponential, 1M', rng.exponential(1.0, m), rng.uniform(0.5, 1.5, m), 4,
+                   np.array([1.0, 0.5, 1.0 / 3.0, 1.0 / 6.0]), sample_error))
+    checks.append(('normal, 1M', rng.normal(0.0, 1.0, m), rng.uniform(0.5, 1.5, m), 4,
+                   np.array([0.0, 1.0 / np.sqrt(np.pi), 0.0, 0.1226017]), sample_error))
+
+    for i, (case_name, values, weights, nmom, ref_result, tolerance) in enumerate(checks, start=1):
+        cursor.execute("SELECT weighted_lmoments(%s::float8[], %s::float8[], %s) AS result, "
+                       "weighted_lmoments((SELECT array_agg(weighted_pair(v, w)) "
+                       "FROM unnest(%s::float8[], %s::float8[]) AS u(v, w)), %s) AS pairs_result",
+                       (values.tolist(), weights.tolist(), nmom,
+                        values.tolist(), weights.tolist(), nmom))
+        row = cursor.fetchone()
+        pg_result = np.array([np.nan if v is None else v for v in row['result']], dtype=float)
+        pairs_result = np.array([np.nan if v is None else v for v in row['pairs_result']],
+                                dtype=float)
+        name = f"weighted_lmoments: {case_name}"
+        # Undefined ratios (constant data) are NULL, nan in the reference
+        if (pg_result.shape != ref_result.shape or
+                not np.array_equal(np.isnan(pg_result), np.isnan(ref_result))):
+            max_diff = float('inf')
+        else:
+            defined = ~np.isnan(ref_result)
+            max_diff = float(np.max(np.abs(pg_result[defined] - ref_result[defined])))
+        passed = max_diff < tolerance and np.array_equal(pg_result, pairs_result, equal_nan=True)
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': ref_result.tolist(),
+            'postgres_result': pg_result.tolist(),
+            'max_difference': max_diff,
+            'tolerance': tolerance,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Expected: {ref_result}, Got: {pg_result} (pairs: {pairs_result})")
+
+    return results
+
+
+def test_expectiles(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_expectile against the bisection reference, including
+    unsorted and many levels, and the mean at tau = 0.5."""
+    results = []
+    rng = np.random.default_rng(124)
+    n = 500
+    levels = np.array([0.5, 0.01, 0.99, 0.25, 0.0, 1.0, 0.75])
+    cases = [
+        ('normal', rng.normal(10.0, 2.0, n), rng.uniform(0.1, 1.0, n), levels),
+        ('heavy ties', rng.integers(0, 5, n).astype(float), rng.uniform(0.1, 1.0, n), levels),
+        ('lognormal', rng.lognormal(0.0, 1.0, n), rng.exponential(1.0, n), levels),
+        ('zero weights', rng.normal(0.0, 1.0, n),
+         np.where(rng.uniform(size=n) < 0.3, 0.0, rng.uniform(0.1, 1.0, n)), levels),
+        ('sparse (sum < 1.0)', rng.gamma(2.0, 1.0, n), rng.uniform(0.0, 0.5 / n, n), levels),
+        ('offset 1e6', 1e6 + rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n), levels),
+        ('small', np.array([3.0, 1.0, 4.0, 1.0, 5.0]), np.array([1.0, 2.0, 0.5, 1.0, 1.5]),
+         levels),
+        ('single value', np.array([7.0]), np.array([2.0]), levels),
+        ('100 levels', rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n),
+         rng.uniform(0.0, 1.0, 100)),
+        ('200000 values', rng.standard_t(3.0, 200000), rng.uniform(0.5, 1.5, 200000),
+         np.array([0.001, 0.1, 0.5, 0.9, 0.999])),
+    ]
+
+    for i, (case_name, values, weights, taus) in enumerate(cases, start=1):
+        ref_result = weighted_expectile(values, weights, taus)
+        tolerance = 1e-9 * max(1.0, float(np.max(np.abs(ref_result))))
+        cursor.execute("SELECT weighted_expectile(%s::float8[], %s::float8[], %s::float8[]) "
+                       "AS result, weighted_expectile((SELECT array_agg(weighted_pair(v, w)) "
+                       "FROM unnest(%s::float8[], %s::float8[]) AS u(v, w)), %s::float8[]) "
+                       "AS pairs_result",
+                       (values.tolist(), weights.tolist(), taus.tolist(),
+                        values.tolist(), weights.tolist(), taus.tolist()))
+        row = cursor.fetchone()
+        pg_result = np.array(row['result'], dtype=float)
+        max_diff = (float(np.max(np.abs(pg_result - ref_result)))
+                    if pg_result.shape == ref_result.shape else float('inf'))
+        passed = max_diff < tolerance and row['result'] == row['pairs_result']
+        name = f"weighted_expectile: {case_name}"
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': ref_result.tolist(),
+            'postgres_result': pg_result.tolist(),
+            'max_difference': max_diff,
+            'tolerance': tolerance,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Expected: {ref_result}, Got: {pg_result} (pairs: {row['pairs_result']})")
+
+    # The 0.5-expectile is the weighted mean
+    values = rng.normal(5.0, 3.0, n)
+    weights = rng.uniform(0.1, 1.0, n)
+    cursor.execute("SELECT (weighted_expectile(%s::float8[], %s::float8[], '{0.5}'))[1] AS result, "
+                   "weighted_mean(%s::float8[], %s::float8[]) AS mean",
+                   (values.tolist(), weights.tolist(), values.tolist(), weights.tolist()))
+    row = cursor.fetchone()
+    max_diff = abs(row['result'] - row['mean'])
+    passed = max_diff < 1e-12 * max(1.0, abs(row['mean']))
+    name = "weighted_expectile: tau 0.5 is the weighted mean"
+    results.append({
+        'test_id': len(cases) + 1,
+        'name': name,
+        'reference_result': row['mean'],
+        'postgres_result': row['result'],
+        'max_difference': max_diff,
+        'tolerance': 1e-12,
+        'passed': passed
+    })
+    status = "PASS" if passed else "FAIL"
+    print(f"Test {len(cases) + 1}: {name} - {status}")
+    if not passed:
+        print(f"  Expected: {row['mean']}, Got: {row['result']}")
+
+    # Out-of-range levels are reported as expectile levels, not quantiles
+    expected_error = 'expectile levels must be between 0 and 1'
+    try:
+        cursor.execute("SELECT weighted_expectile('{1,2}'::float8[], '{1,1}'::float8[], "
+                       "'{0.5,1.5}'::float8[])")
+        error = None
+    except psycopg2.Error as e:
+        error = e.pgerror.splitlines()[0] if e.pgerror else str(e)
+    passed = error is not None and error.endswith(expected_error)
+    name = "weighted_expectile: out-of-range level error"
+    results.append({
+        'test_id': len(cases) + 2,
+        'name': name,
+        'reference_result': expected_error,
+        'postgres_result': error,
+        'max_difference': 0.0 if passed else float('inf'),
+        'tolerance': 0.0,
+        'passed': passed
+    })
+    status = "PASS" if passed else "FAIL"
+    print(f"Test {len(cases) + 2}: {name} - {status}")
+    if not passed:
+        print(f"  Expected: {expected_error}, Got: {error}")
+
+    return results
+
+
+def test_var_es(cursor) -> List[Dict[str, Any]]:
+    """Test weighted_var_es against weighted_quantile (the VaR) and an
+    expected shortfall that integrates the tail of the quantile function, and
+    weighted_var_es_agg against weighted_var_es, in memory and spilled."""
+    results = []
+    rng = np.random.default_rng(125)
+    n = 500
+    # 20 confidence levels, unsorted, with the extremes
+    levels = np.array([0.95, 0.99, 0.5, 0.0, 1.0, 0.9, 0.975, 0.995, 0.999, 0.1,
+                       0.25, 0.75, 0.8, 0.85, 0.6, 0.7, 0.65, 0.55, 0.01, 0.3])
+    cases = [
+        ('normal', rng.normal(10.0, 2.0, n), rng.uniform(0.1, 1.0, n), levels),
+        ('heavy ties', rng.integers(0, 5, n).astype(float), rng.uniform(0.1, 1.0, n), levels),
+        ('integer weights', rng.normal(0.0, 1.0, 40), np.ones(40), levels),
+        ('lognormal', rng.lognormal(0.0, 1.0, n), rng.exponential(1.0, n), levels),
+        ('zero weights', rng.normal(0.0, 1.0, n),
+         np.where(rng.uniform(size=n) < 0.3, 0.0, rng.uniform(0.1, 1.0, n)), levels),
+        ('sparse (sum < 1.0)', rng.gamma(2.0, 1.0, n), rng.uniform(0.0, 0.5 / n, n), levels),
+        ('offset 1e6', 1e6 + rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n), levels),
+        ('single value', np.array([7.0]), np.array([2.0]), levels),
+        ('100 levels', rng.normal(0.0, 1.0, n), rng.uniform(0.1, 1.0, n),
+         rng.uniform(0.0, 1.0, 100)),
+        ('200000 values', rng.standard_t(3.0, 200000), rng.uniform(0.5, 1.5, 200000), levels),
+    ]
+
+    i = 0
+    for case_name, values, weights, case_levels in cases:
+        ref_es = weighted_expected_shortfall(values, weights, case_levels)
+        scale = max(1.0, float(np.max(np.abs(values))))
+        tolerance = 1e-9 * scale
+        cursor.execute("SELECT weighted_var_es(%s::float8[], %s::float8[], %s::float8[]) "
+                       "AS result, weighted_var_es((SELECT array_agg(weighted_pair(v, w)) "
+                       "FROM unnest(%s::float8[], %s::float8[]) AS u(v, w)), %s::float8[]) "
+                       "AS pairs_result, weighted_quantile(%s::float8[], %s::float8[], "
+                       "%s::float8[]) AS var",
+                       (values.tolist(), weights.tolist(), case_levels.tolist(),
+                        values.tolist(), weights.tolist(), case_levels.tolist(),
+                        values.tolist(), weights.tolist(), case_levels.tolist()))
+        row = cursor.fetchone()
+        ref_var = np.array(row['var'], dtype=float)
+        pg_result = np.array(row['result'], dtype=float)
+        if pg_result.shape == (2, len(case_levels)):
+            max_diff = max(float(np.max(np.abs(pg_result[0] - ref_var))),
+                           float(np.max(np.abs(pg_result[1] - ref_es))))
+        else:
+            max_diff = float('inf')
+        # The shortfall never falls below the VaR
+        passed = (max_diff < tolerance and row['result'] == row['pairs_result'] and
+                  bool(np.all(pg_result[1] >= pg_result[0] - tolerance)))
+        i += 1
+        name = f"weighted_var_es: {case_name}"
+        results.append({
+            'test_id': i,
+            'name': name,
+            'reference_result': [ref_var.tolist(), ref_es.tolist()],
+            'postgres_result': pg_result.tolist(),
+            'max_difference': max_diff,
+            'tolerance': tolerance,
+            'passed': passed
+        })
+
+        status = "PASS" if passed else "FAIL"
+        print(f"Test {i}: {name} - {status}")
+        if not passed:
+            print(f"  Expected VaR: {ref_var}, ES: {ref_es}")
+            print(f"  Got: {pg_result} (pairs: {row['pairs_result']})")
+
+    m = 100000
+    agg_cases = [
+        ('normal', rng.normal(0.0, 1e3, m), rng.uniform(0.1, 1.0, m)),
+        ('heavy duplicates, zero weights', rng.integers(-3, 4, m).astype(float),
+         np.where(rng.uniform(size=m) < 0.2, 0.0, rng.exponential(1.0, m))),
+        ('sparse (sum < 1.0)', rng.exponential(50.0, m), np.full(m, 0.5 / m)),
+    ]
+    for work_mem in ('4MB', '64kB'):
+        for case_name, values, weights in agg_cases:
+            cursor.execute("DROP TABLE IF EXISTS validation_table")
+            cursor.execute("CREATE TEMP TABLE validation_table (g int, v float8, w float8)")
+            cursor.execute("INSERT INTO validation_table "
+                           "SELECT i %% 3, v, w FROM unnest(%s::float8[], %s::float8[]) "
+                           "WITH ORDINALITY AS u(v, w, i)",
+                           (values.tolist(), weights.tolist()))
+            cursor.execute("SET work_mem = %s", (work_mem,))
+            cursor.execute("SELECT weighted_var_es(array_agg(v), array_agg(w), %s::float8[]) "
+                           "AS expected, weighted_var_es_agg(v, w, %s::float8[]) AS result "
+                           "FROM validation_table GROUP BY ROLLUP (g)",
+                           (levels.tolist(), levels.tolist()))
+            rows = cursor.fetchall()
+            tolerance = 1e-9 * max(1.0, float(np.max(np.abs(values))))
+            max_diff = max(float(np.max(np.abs(np.array(row['expected']) -
+                                               np.array(row['result']))))
+                           for row in rows)
+            passed = len(rows) == 4 and max_diff < tolerance
+            i += 1
+            mode = 'in memory' if work_mem == '4MB' else 'spilled'
+            name = f"weighted_var_es_agg ({mode}): {case_name}"
+            results.append({
+                'test_id': i,
+                'name': name,
+                'reference_result': rows[-1]['expected'],
+                'postgres_result': rows[-1]['result'],
+                'max_difference': max_diff,
+                'tolerance': tolerance,
+                'passed': passed
+            })
+
+            status = "PASS" if passed else "FAIL"
+            print(f"Test {i}: {name} - {status}")
+            if not passed:
+                print(f"  Max difference: {max_diff}")
+
+    cursor.execute("RESET work_mem")
+    cursor.execute("DROP TABLE IF EXISTS validation_table")
+    return results
+
+
 def validate_mathematical_properties(cursor) -> List[Dict[str, Any]]:
     """
     Validate mathematical properties of the weighted statistics functions.
@@ -633,6 +2165,100 @@ def validate_mathematical_properties(cursor) -> List[Dict[str, Any]]:
                         f"Consistent: {is_consistent}"
         })
 
+    # Property 4: Tie order
+    # Interpolation starts from the preceding pair, so equal values must keep
+    # their input order: the result equals that of the stably sorted input.
+    # Small arrays go through the sorting network, larger ones the radix sort.
+    rng = np.random.default_rng(116)
+    for n in (13, 64, 500):
+        values = [float(v) for v in rng.integers(-3, 5, n)]
+        weights = [float(w) for w in rng.uniform(0.0, 1.0 / n, n)]
+        order = sorted(range(n), key=lambda i: values[i])
+        quantiles = [0.1, 0.25, 0.5, 0.75, 0.9]
+
+        cursor.execute(
+            "SELECT weighted_quantile(%s, %s, %s) AS shuffled, "
+            "weighted_quantile(%s, %s, %s) AS sorted",
+            (values, weights, quantiles,
+             [values[i] for i in order], [weights[i] for i in order], quantiles)
+        )
+        row = cursor.fetchone()
+
+        property_results.append({
+            'property': 'Tie Order',
+            'test_name': f"Tie order test ({n} values)",
+            'passed': row['shuffled'] == row['sorted'],
+            'details':  f"Unsorted: {row['shuffled']}, "
+                        f"Stably sorted: {row['sorted']}"
+        })
+
+    # Property 5: Constant levels
+    # A constant levels argument is parsed once per call site (and the
+    # Harrell-Davis parameters reused while the effective sample size repeats);
+    # the results must equal those of levels read afresh from each row.
+    cursor.execute("SELECT setseed(0.117)")
+    cursor.execute("""
+        CREATE TEMP TABLE level_rows AS
+        SELECT g,
+               (SELECT array_agg(x) FROM (SELECT round(random() * 10) AS x
+                                          FROM generate_series(1, 3 + g % 40)) s) AS v,
+               (SELECT array_agg(CASE WHEN g % 3 = 0 THEN 1.0 / n ELSE u END)
+                FROM (SELECT 3 + g % 40 AS n, random() AS u
+                      FROM generate_series(1, 3 + g % 40)) s) AS w,
+               ARRAY[0.9, 0.1, 0.5, 0.5, 0, 1, 0.25]::float8[] AS q
+        FROM generate_series(1, 600) AS g""")
+    for func in ('weighted_quantile', 'wquantile', 'whdquantile'):
+        cursor.execute(f"""
+            SELECT count(*) FILTER (WHERE {func}(v, w, ARRAY[0.9, 0.1, 0.5, 0.5, 0, 1, 0.25])
+                                    IS DISTINCT FROM {func}(v, w, q)) AS mismatches
+            FROM level_rows""")
+        mismatches = cursor.fetchone()['mismatches']
+
+        property_results.append({
+            'property': 'Constant Levels',
+            'test_name': f"Constant vs per-row levels ({func})",
+            'passed': mismatches == 0,
+            'details': f"Rows with different results: {mismatches}"
+        })
+    cursor.execute("DROP TABLE level_rows")
+
+    # Property 6: Levels from a variable
+    # A PL/pgSQL variable is a parameter of the same call site on every loop
+    # iteration, so its levels may be cached but must follow the variable.
+    for func in ('weighted_quantile', 'wquantile', 'whdquantile', 'weighted_expectile',
+                 'weighted_var_es'):
+        cursor.execute(f"""
+            CREATE FUNCTION pg_temp.levels_loop(v float8[], w float8[]) RETURNS text AS $$
+            DECLARE
+                qs float8[];
+                r text := '';
+            BEGIN
+                FOR i IN 1..6 LOOP
+                    qs := CASE WHEN i % 3 = 0 THEN ARRAY[i * 0.125]
+                               ELSE ARRAY[i * 0.125, 1 - i * 0.125] END;
+                    r := r || {func}(v, w, qs)::text || ';';
+                END LOOP;
+                RETURN r;
+            END $$ LANGUAGE plpgsql""")
+        cursor.execute(f"""
+            SELECT pg_temp.levels_loop(v, w) AS loop,
+                   (SELECT string_agg({func}(v, w,
+                               (CASE WHEN i % 3 = 0 THEN ARRAY[i * 0.125]
+                                     ELSE ARRAY[i * 0.125, 1 - i * 0.125] END)::float8[])::text
+                               || ';', '' ORDER BY i)
+                    FROM generate_series(1, 6) AS i) AS expected
+            FROM (VALUES ('{{1, 2, 3, 4, 5, 6, 7, 8}}'::float8[],
+                          '{{0.3, 1, 0.5, 2, 1, 0.2, 1, 0.8}}'::float8[])) AS t(v, w)""")
+        row = cursor.fetchone()
+        cursor.execute("DROP FUNCTION pg_temp.levels_loop(float8[], float8[])")
+
+        property_results.append({
+            'property': 'Variable Levels',
+            'test_name': f"Levels changed through a PL/pgSQL variable ({func})",
+            'passed': row['loop'] == row['expected'],
+            'details': f"Loop: {row['loop']}, Expected: {row['expected']}"
+        })
+
     return property_results
 
 
@@ -683,6 +2309,11 @@ def main():
     print("-" * 35)
     quantile_results = test_weighted_quantile(cursor, quantile_cases)
     
+    # Run large-array weighted_quantile tests
+    print("\nTesting weighted_quantile on large arrays:")
+    print("-" * 35)
+    large_quantile_results = test_large_quantiles(cursor)
+    
     # Run wquantile tests
     print(
         f"\nTesting wquantile function ({len(quantile_cases)} tests):")
@@ -695,6 +2326,11 @@ def main():
     print("-" * 35)
     whdquantile_results = test_whdquantile(cursor, quantile_cases)
     
+    # Run threaded whdquantile tests
+    print("\nTesting whdquantile with worker threads:")
+    print("-" * 35)
+    threaded_hd_results = test_threaded_whdquantile(cursor)
+    
     # Run weighted_variance tests
     print(
         f"\nTesting weighted_variance function ({len(variance_cases)} tests):")
@@ -706,6 +2342,82 @@ def main():
         f"\nTesting weighted_std function ({len(variance_cases)} tests):")
     print("-" * 35)
     std_results = test_weighted_std(cursor, variance_cases)
+    
+    # Run threaded mean/variance/std tests
+    print("\nTesting weighted_mean/variance/std with worker threads:")
+    print("-" * 35)
+    threaded_moments_results = test_threaded_moments(cursor)
+
+    # Run weighted_pair[] overload tests
+    print("\nTesting weighted_pair[] overloads:")
+    print("-" * 35)
+    pair_results = test_weighted_pair_overloads(cursor, mean_cases,
+                                                quantile_cases)
+
+    # Run expanded array tests
+    print("\nTesting expanded arrays:")
+    print("-" * 35)
+    expanded_results = test_expanded_arrays(cursor, quantile_cases)
+
+    # Run table scan function tests
+    print("\nTesting table scan functions:")
+    print("-" * 35)
+    table_results = test_table_functions(cursor, mean_cases, quantile_cases)
+
+    # Run multi-pass table quantile tests
+    print("\nTesting weighted_quantile_table past work_mem:")
+    print("-" * 35)
+    multipass_results = test_multipass_table_quantiles(cursor)
+
+    # Run row aggregate tests
+    print("\nTesting row aggregates:")
+    print("-" * 35)
+    aggregate_results = test_row_aggregates(cursor, mean_cases)
+
+    # Run exact quantile aggregate tests
+    print("\nTesting weighted_quantile_agg:")
+    print("-" * 35)
+    quantile_agg_results = test_quantile_aggregate(cursor, quantile_cases)
+
+    # Run moments sketch tests
+    print("\nTesting moments sketch:")
+    print("-" * 35)
+    sketch_results = test_moments_sketch(cursor)
+
+    # Run rank correlation tests
+    print("\nTesting rank correlations:")
+    print("-" * 35)
+    correlation_results = test_rank_correlations(cursor)
+
+    # Run ROC analysis tests
+    print("\nTesting ROC analysis:")
+    print("-" * 35)
+    classification_results = test_classification(cursor)
+
+    # Run Hodges-Lehmann tests
+    print("\nTesting Hodges-Lehmann estimator:")
+    print("-" * 35)
+    hodges_lehmann_results = test_hodges_lehmann(cursor)
+
+    # Run robust scale tests
+    print("\nTesting robust scale estimators:")
+    print("-" * 35)
+    robust_scale_results = test_robust_scale(cursor)
+
+    # Run L-moment tests
+    print("\nTesting L-moments:")
+    print("-" * 35)
+    lmoment_results = test_lmoments(cursor)
+
+    # Run expectile tests
+    print("\nTesting expectiles:")
+    print("-" * 35)
+    expectile_results = test_expectiles(cursor)
+
+    # Run VaR and expected shortfall tests
+    print("\nTesting VaR and expected shortfall:")
+    print("-" * 35)
+    var_es_results = test_var_es(cursor)
 
     # Run mathematical property validation tests
     print("\nTesting mathematical properties:")
@@ -719,12 +2431,31 @@ def main():
             print(f"  Details: {result['details']}")
 
     # Summary
-    total_tests = (len(mean_results) + len(quantile_results) + len(wquantile_results) + 
-                   len(whdquantile_results) + len(variance_results) + 
-                   len(std_results) + len(property_results))
-    passed_tests = (sum(r['passed'] for r in mean_results + quantile_results + 
-                        wquantile_results + whdquantile_results + 
-                        variance_results + std_results) +
+    total_tests = (len(mean_results) + len(quantile_results) +
+                   len(large_quantile_results) + len(wquantile_results) + 
+                   len(whdquantile_results) + len(threaded_hd_results) +
+                   len(variance_results) + 
+                   len(std_results) + len(threaded_moments_results) +
+                   len(pair_results) + len(expanded_results) +
+                   len(table_results) + len(multipass_results) +
+                   len(aggregate_results) + len(quantile_agg_results) +
+                   len(sketch_results) + len(correlation_results) +
+                   len(classification_results) + len(hodges_lehmann_results) +
+                   len(robust_scale_results) + len(lmoment_results) +
+                   len(expectile_results) + len(var_es_results) +
+                   len(property_results))
+    passed_tests = (sum(r['passed'] for r in mean_results + quantile_results +
+                        large_quantile_results +
+                        wquantile_results + whdquantile_results +
+                        threaded_hd_results + 
+                        variance_results + std_results +
+                        threaded_moments_results + pair_results +
+                        expanded_results + table_results + multipass_results +
+                        aggregate_results + quantile_agg_results +
+                        sketch_results + correlation_results +
+                        classification_results + hodges_lehmann_results +
+                        robust_scale_results + lmoment_results +
+                        expectile_results + var_es_results) +
                     sum(r['passed'] for r in property_results))
     failed_tests = total_tests - passed_tests
 
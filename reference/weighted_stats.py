@@ -156,3 +156,442 @@ def weighted_std(values: np.ndarray, weights: np.ndarray,
     """
     variance = weighted_variance(values, weights, ddof=ddof)
     return np.sqrt(variance)
+
+
+def weighted_kendall_tau(x: np.ndarray, y: np.ndarray,
+                         weights: np.ndarray) -> float:
+    """
+    Calculate the weighted Kendall rank correlation (tau-b) by comparing
+    every pair of observations directly (O(n^2) reference).
+
+    Parameters
+    ----------
+    x : np.ndarray
+        First variable
+    y : np.ndarray
+        Second variable
+    weights : np.ndarray
+        Observation weights (relative, no implicit zero is added)
+
+    Returns
+    -------
+    float
+        Weighted tau-b, or nan when x or y is constant
+
+    Notes
+    -----
+    Each pair (i, j) counts with weight w_i * w_j:
+    tau_b = sum(w_i w_j sign(dx) sign(dy)) /
+            sqrt(sum(w_i w_j sign(dx)^2) * sum(w_i w_j sign(dy)^2))
+    With equal weights this is scipy.stats.kendalltau (tau-b).
+    """
+    x = np.asarray(x, dtype=float)
+    y = np.asarray(y, dtype=float)
+    weights = np.asarray(weights, dtype=float)
+
+    if len(x) != len(y) or len(x) != len(weights):
+        raise ValueError("x, y and weights must have the same length")
+
+    if np.any(weights < 0):
+        raise ValueError("Weights must be non-negative")
+
+    keep = weights > 0
+    x, y, weights = x[keep], y[keep], weights[keep]
+
+    dx = np.sign(x[:, None] - x[None, :])
+    dy = np.sign(y[:, None] - y[None, :])
+    pair_weights = weights[:, None] * weights[None, :]
+
+    # Both sums run over i != j, which counts every pair twice
+    numerator = np.sum(pair_weights * dx * dy)
+    denominator = np.sqrt(np.sum(pair_weights * dx * dx) *
+                          np.sum(pair_weights * dy * dy))
+    if denominator == 0:
+        return np.nan
+    return numerator / denominator
+
+
+def weighted_spearman(x: np.ndarray, y: np.ndarray,
+                      weights: np.ndarray) -> float:
+    """
+    Calculate the weighted Spearman rank correlation.
+
+    Parameters
+    ----------
+    x : np.ndarray
+        First variable
+    y : np.ndarray
+        Second variable
+    weights : np.ndarray
+        Observation weights (relative, no implicit zero is added)
+
+    Returns
+    -------
+    float
+        Weighted Pearson correlation of the weighted mid-ranks, or nan when
+        x or y is constant
+
+    Notes
+    -----
+    The weighted mid-rank of x_i is sum(w_j for x_j < x_i) plus half of
+    sum(w_j for x_j == x_i). With equal weights the result is
+    scipy.stats.spearmanr.
+    """
+    x = np.asarray(x, dtype=float)
+    y = np.asarray(y, dtype=float)
+    weights = np.asarray(weights, dtype=float)
+
+    if len(x) != len(y) or len(x) != len(weights):
+        raise ValueError("x, y and weights must have the same length")
+
+    if np.any(weights < 0):
+        raise ValueError("Weights must be non-negative")
+
+    keep = weights > 0
+    x, y, weights = x[keep], y[keep], weights[keep]
+
+    def mid_ranks(v):
+        below = np.sum(weights[None, :] * (v[None, :] < v[:, None]), axis=1)
+        tied = np.sum(weights[None, :] * (v[None, :] == v[:, None]), axis=1)
+        return below + 0.5 * tied
+
+    rank_x = mid_ranks(x)
+    rank_y = mid_ranks(y)
+    dx = rank_x - np.average(rank_x, weights=weights)
+    dy = rank_y - np.average(rank_y, weights=weights)
+    denominator = np.sqrt(np.sum(weights * dx * dx) * np.sum(weights * dy * dy))
+    if denominator == 0:
+        return np.nan
+    return np.sum(weights * dx * dy) / denominator
+
+
+def weighted_auc(scores: np.ndarray, labels: np.ndarray,
+                 weights: np.ndarray) -> float:
+    """
+    Calculate the weighted area under the ROC curve by comparing every
+    (positive, negative) pair directly (O(n^2) reference).
+
+    Parameters
+    ----------
+    scores : np.ndarray
+        Scores, higher meaning more likely positive
+    labels : np.ndarray
+        Boolean labels
+    weights : np.ndarray
+        Observation weights (relative, no implicit zero is added)
+
+    Returns
+    -------
+    float
+        Weighted AUC, or nan unless both labels have positive weight
+
+    Notes
+    -----
+    Each pair (i positive, j negative) counts with weight w_i * w_j, scoring
+    1 when s_i > s_j and 1/2 when s_i == s_j. With equal weights this is the
+    Mann-Whitney U statistic divided by n_pos * n_neg.
+    """
+    scores = np.asarray(scores, dtype=float)
+    labels = np.asarray(labels, dtype=bool)
+    weights = np.asarray(weights, dtype=float)
+
+    if len(scores) != len(labels) or len(scores) != len(weights):
+        raise ValueError("scores, labels and weights must have the same length")
+
+    if np.any(weights < 0):
+        raise ValueError("Weights must be non-negative")
+
+    pos_scores, pos_weights = scores[labels], weights[labels]
+    neg_scores, neg_weights = scores[~labels], weights[~labels]
+    pos_total = np.sum(pos_weights)
+    neg_total = np.sum(neg_weights)
+    if pos_total == 0 or neg_total == 0:
+        return np.nan
+
+    diff = pos_scores[:, None] - neg_scores[None, :]
+    wins = (diff > 0) + 0.5 * (diff == 0)
+    return np.sum(pos_weights[:, None] * neg_weights[None, :] * wins) / (pos_total * neg_total)
+
+
+def weighted_hodges_lehmann(x: np.ndarray, wx: np.ndarray,
+                            y: np.ndarray, wy: np.ndarray) -> float:
+    """
+    Calculate the weighted Hodges-Lehmann shift estimate by materializing
+    every pairwise difference (O(nm) reference).
+
+    Parameters
+    ----------
+    x : np.ndarray
+        First sample
+    wx : np.ndarray
+        Weights of the first sample (relative, no implicit zero is added)
+    y : np.ndarray
+        Second sample
+    wy : np.ndarray
+        Weights of the second sample
+
+    Returns
+    -------
+    float
+        Weighted median of y_j - x_i, or nan unless both samples have
+        positive weight
+
+    Notes
+    -----
+    Difference y_j - x_i weighs wx_i * wy_j. The result is the midpoint of
+    the lower weighted median (smallest d with weight at or below d reaching
+    half the total) and the upper one (smallest d with more than half), so
+    equal weights give the median of all n * m differences.
+    """
+    x = np.asarray(x, dtype=float)
+    wx = np.asarray(wx, dtype=float)
+    y = np.asarray(y, dtype=float)
+    wy = np.asarray(wy, dtype=float)
+
+    if len(x) != len(wx) or len(y) != len(wy):
+        raise ValueError("Values and weights must have the same length")
+
+    if np.any(wx < 0) or np.any(wy < 0):
+        raise ValueError("Weights must be non-negative")
+
+    x, wx = x[wx > 0], wx[wx > 0]
+    y, wy = y[wy > 0], wy[wy > 0]
+    if len(x) == 0 or len(y) == 0:
+        return np.nan
+
+    diffs = (y[None, :] - x[:, None]).ravel()
+    weights = (wx[:, None] * wy[None, :]).ravel()
+    order = np.argsort(diffs, kind='stable')
+    diffs, cum_weights = diffs[order], np.cumsum(weights[order])
+    half = cum_weights[-1] / 2.0
+    lower = diffs[np.searchsorted(cum_weights, half, side='left')]
+    upper = diffs[np.searchsorted(cum_weights, half, side='right')]
+    return (lower + upper) / 2.0
+
+
+# Relative slack of the weight comparisons, as in the C implementation
+WEIGHT_RELATIVE_SLACK = 1e-12
+
+
+def _sparse_positive(values: np.ndarray, weights: np.ndarray):
+    """Drop zero weights and add the implicit zero of sparse data."""
+    values = np.asarray(values, dtype=float)
+    weights = np.asarray(weights, dtype=float)
+
+    if len(values) != len(weights):
+        raise ValueError("Values and weights must have the same length")
+
+    if np.any(weights < 0):
+        raise ValueError("Weights must be non-negative")
+
+    values, weights = values[weights > 0], weights[weights > 0]
+    # Summed in input order, as the C code does: it decides the implicit zero
+    sum_weights = np.cumsum(weights)[-1] if len(weights) else 0.0
+    if sum_weights < 1.0:
+        values = np.append(values, 0.0)
+        weights = np.append(weights, 1.0 - sum_weights)
+    return values, weights
+
+
+def weighted_qn(values: np.ndarray, weights: np.ndarray) -> float:
+    """
+    Calculate the weighted Rousseeuw-Croux Qn scale estimator from all
+    pairwise distances (O(n^2) reference).
+
+    Parameters
+    ----------
+    values : np.ndarray
+        Array of values
+    weights : np.ndarray
+        Array of weights (may sum to less than 1.0)
+
+    Returns
+    -------
+    float
+        2.21914 times the weighted order statistic of |x_i - x_j| (i < j,
+        weight w_i * w_j) at k of the n(n-1)/2 pairs, k = h(h-1)/2 with
+        h = n/2 + 1; nan for a single observation
+    """
+    values, weights = _sparse_positive(values, weights)
+    n = len(values)
+    if n < 2:
+        return np.nan
+
+    i, j = np.triu_indices(n, 1)
+    distances = np.abs(values[i] - values[j])
+    pair_weights = weights[i] * weights[j]
+    order = np.argsort(distances, kind='stable')
+    distances, cum_weights = distances[order], np.cumsum(pair_weights[order])
+
+    h = n // 2 + 1
+    target = cum_weights[-1] * (h * (h - 1) / 2.0) / (n * (n - 1) / 2.0)
+    k = np.searchsorted(cum_weights, target * (1.0 - WEIGHT_RELATIVE_SLACK), side='left')
+    return 2.21914 * distances[min(k, len(distances) - 1)]
+
+
+def weighted_sn(values: np.ndarray, weights: np.ndarray) -> float:
+    """
+    Calculate the weighted Rousseeuw-Croux Sn scale estimator from all
+    pairwise distances (O(n^2) reference).
+
+    Parameters
+    ----------
+    values : np.ndarray
+        Array of values
+    weights : np.ndarray
+        Array of weights (may sum to less than 1.0)
+
+    Returns
+    -------
+    float
+        1.1926 times the weighted low median over i of m_i, the weighted
+        high median over j (i included) of |x_i - x_j|
+
+    Notes
+    -----
+    The high median is the smallest d with more than half of the weight at
+    or below it, the low median the smallest with at least half.
+    """
+    values, weights = _sparse_positive(values, weights)
+    half = np.sum(weights) / 2.0
+
+    medians = np.empty(len(values))
+    for i, x in enumerate(values):
+        distances = np.abs(values - x)
+        order = np.argsort(distances, kind='stable')
+        cum_weights = np.cumsum(weights[order])
+        k = np.searchsorted(cum_weights, half * (1.0 + WEIGHT_RELATIVE_SLACK), side='right')
+        medians[i] = distances[order][min(k, len(values) - 1)]
+
+    order = np.argsort(medians, kind='stable')
+    cum_weights = np.cumsum(weights[order])
+    k = np.searchsorted(cum_weights, cum_weights[-1] / 2.0 * (1.0 - WEIGHT_RELATIVE_SLACK),
+                        side='left')
+    return 1.1926 * medians[order][min(k, len(values) - 1)]
+
+
+def weighted_lmoments(values: np.ndarray, weights: np.ndarray,
+                      nmom: int = 4) -> np.ndarray:
+    """
+    Calculate the L-moments of the weighted empirical distribution by
+    integrating each step of its quantile function exactly.
+
+    Parameters
+    ----------
+    values : np.ndarray
+        Array of values
+    weights : np.ndarray
+        Array of weights (may sum to less than 1.0)
+    nmom : int, optional
+        Number of L-moments. Default is 4.
+
+    Returns
+    -------
+    np.ndarray
+        [lambda_1, lambda_2, tau_3, ..., tau_nmom], tau_r = lambda_r / lambda_2
+        (nan when lambda_2 is 0)
+
+    Notes
+    -----
+    lambda_{r+1} is the integral of Q(u) P*_r(u) over [0, 1], P*_r the
+    shifted Legendre polynomial; value x_i occupies the probability interval
+    of its cumulative weight.
+    """
+    values, weights = _sparse_positive(values, weights)
+    order = np.argsort(values, kind='stable')
+    values, weights = values[order], weights[order]
+    cum = np.concatenate([[0.0], np.cumsum(weights)]) / np.sum(weights)
+
+    lambdas = np.empty(nmom)
+    lambdas[0] = np.sum(weights * values) / np.sum(weights)
+    # Higher orders do not change with a shift: centering avoids cancellation
+    centered = values - values[0]
+    for r in range(1, nmom):
+        antiderivative = np.polynomial.Legendre.basis(r, domain=[0, 1]).integ()
+        lambdas[r] = np.sum(centered * (antiderivative(cum[1:]) - antiderivative(cum[:-1])))
+
+    result = lambdas.copy()
+    if nmom > 2:
+        result[2:] = lambdas[2:] / lambdas[1] if lambdas[1] != 0 else np.nan
+    return result
+
+
+def weighted_expectile(values: np.ndarray, weights: np.ndarray,
+                       taus: np.ndarray) -> np.ndarray:
+    """
+    Calculate weighted expectiles by bisection on the first-order condition.
+
+    Parameters
+    ----------
+    values : np.ndarray
+        Array of values
+    weights : np.ndarray
+        Array of weights (may sum to less than 1.0)
+    taus : np.ndarray
+        Expectile levels between 0 and 1
+
+    Returns
+    -------
+    np.ndarray
+        The tau-expectiles e, solving
+        (1 - tau) sum_{x < e} w (e - x) = tau sum_{x > e} w (x - e)
+    """
+    values, weights = _sparse_positive(values, weights)
+    results = []
+    for tau in np.asarray(taus, dtype=float):
+        lo, hi = float(np.min(values)), float(np.max(values))
+        if tau <= 0.0:
+            results.append(lo)
+            continue
+        if tau >= 1.0:
+            results.append(hi)
+            continue
+        for _ in range(200):
+            mid = 0.5 * (lo + hi)
+            if mid <= lo or mid >= hi:
+                break
+            below = np.sum(weights * np.maximum(mid - values, 0.0))
+            above = np.sum(weights * np.maximum(values - mid, 0.0))
+            if (1.0 - tau) * below - tau * above >= 0.0:
+                hi = mid
+            else:
+                lo = mid
+        results.append(0.5 * (lo + hi))
+    return np.array(results)
+
+
+def weighted_expected_shortfall(values: np.ndarray, weights: np.ndarray,
+                                levels: np.ndarray) -> np.ndarray:
+    """
+    Calculate the weighted expected shortfall of losses by integrating the
+    step quantile function over the upper tail.
+
+    Parameters
+    ----------
+    values : np.ndarray
+        Array of losses
+    weights : np.ndarray
+        Array of weights (may sum to less than 1.0)
+    levels : np.ndarray
+        Confidence levels between 0 and 1
+
+    Returns
+    -------
+    np.ndarray
+        The mean of the upper (1 - level) fraction of the distribution; the
+        maximum at level 1
+    """
+    values, weights = _sparse_positive(values, weights)
+    order = np.argsort(values, kind='stable')
+    values, weights = values[order], weights[order]
+    cum = np.concatenate([[0.0], np.cumsum(weights)]) / np.sum(weights)
+
+    results = []
+    for level in np.asarray(levels, dtype=float):
+        if level >= 1.0:
+            results.append(values[-1])
+            continue
+        # Probability of each value's interval that lies above the level
+        above = np.clip(cum[1:], level, 1.0) - np.clip(cum[:-1], level, 1.0)
+        results.append(np.sum(above * values) / (1.0 - level))
+    return np.array(results)
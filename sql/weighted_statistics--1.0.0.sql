@@ -4,6 +4,15 @@
 -- functions optimized for sparse data. All functions handle sparse data where 
 -- sum(weights) < 1.0 implies implicit zeros in the dataset.
 
+-- Planner support for weighted_mean/weighted_variance/weighted_std over
+-- array_agg: rewrites e.g. weighted_mean(array_agg(v), array_agg(w)) into the
+-- weighted_mean_agg(v, w) row aggregate defined below. Disable with
+-- SET weighted_statistics.enable_array_agg_rewrite = off.
+CREATE OR REPLACE FUNCTION weighted_array_agg_support(internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_array_agg_support'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 -- Function: weighted_mean
 -- 
 -- Calculates weighted mean for sparse data. When sum(weights) < 1.0, implicit
@@ -21,7 +30,8 @@ CREATE OR REPLACE FUNCTION weighted_mean(
 )
 RETURNS double precision
 AS 'MODULE_PATHNAME', 'weighted_mean_sparse_c'
-LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+SUPPORT weighted_array_agg_support;
 
 -- Function: weighted_quantile
 -- 
@@ -70,6 +80,8 @@ LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 -- 
 -- Calculates weighted Harrell-Davis quantiles.
 -- Uses Beta distribution weights for smoothing over all data points.
+-- STABLE rather than IMMUTABLE: the result depends on the settings
+-- weighted_statistics.beta_cdf_tolerance and beta_cdf_max_iterations.
 --
 -- Parameters:
 --   vals: Array of values (double precision[])
@@ -85,7 +97,7 @@ CREATE OR REPLACE FUNCTION whdquantile(
 )
 RETURNS double precision[]
 AS 'MODULE_PATHNAME', 'whdquantile_sparse_c'
-LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
 
 -- Function: weighted_variance
 -- 
@@ -107,7 +119,8 @@ CREATE OR REPLACE FUNCTION weighted_variance(
 )
 RETURNS double precision
 AS 'MODULE_PATHNAME', 'weighted_variance_sparse_c'
-LANGUAGE C IMMUTABLE PARALLEL SAFE;
+LANGUAGE C IMMUTABLE PARALLEL SAFE
+SUPPORT weighted_array_agg_support;
 
 -- Function: weighted_std
 -- 
@@ -129,7 +142,8 @@ CREATE OR REPLACE FUNCTION weighted_std(
 )
 RETURNS double precision
 AS 'MODULE_PATHNAME', 'weighted_std_sparse_c'
-LANGUAGE C IMMUTABLE PARALLEL SAFE;
+LANGUAGE C IMMUTABLE PARALLEL SAFE
+SUPPORT weighted_array_agg_support;
 
 -- Convenience function: weighted_median
 --
@@ -148,4 +162,860 @@ CREATE OR REPLACE FUNCTION weighted_median(
 RETURNS double precision
 AS $$
     SELECT (weighted_quantile(vals, weights, ARRAY[0.5]))[1];
-$$ LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
\ No newline at end of file
+$$ LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Type: weighted_pair
+--
+-- Fixed-length (16 byte) value/weight pair. Its storage layout matches the
+-- C ValueWeight struct, so weighted_pair[] inputs are read with a single copy
+-- instead of two array deconstructions. Text form: '(value,weight)'.
+--
+CREATE TYPE weighted_pair;
+
+CREATE OR REPLACE FUNCTION weighted_pair_in(cstring)
+RETURNS weighted_pair
+AS 'MODULE_PATHNAME', 'weighted_pair_in'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_pair_out(weighted_pair)
+RETURNS cstring
+AS 'MODULE_PATHNAME', 'weighted_pair_out'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_pair_recv(internal)
+RETURNS weighted_pair
+AS 'MODULE_PATHNAME', 'weighted_pair_recv'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_pair_send(weighted_pair)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'weighted_pair_send'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE weighted_pair (
+    INTERNALLENGTH = 16,
+    INPUT = weighted_pair_in,
+    OUTPUT = weighted_pair_out,
+    RECEIVE = weighted_pair_recv,
+    SEND = weighted_pair_send,
+    ALIGNMENT = double,
+    STORAGE = plain
+);
+
+-- Function: weighted_pair
+--
+-- Constructs a weighted_pair from a value and its weight.
+--
+-- Parameters:
+--   value: Value (double precision)
+--   weight: Weight of the value (double precision)
+--
+-- Returns: weighted_pair
+--
+CREATE OR REPLACE FUNCTION weighted_pair(
+    value double precision,
+    weight double precision
+)
+RETURNS weighted_pair
+AS 'MODULE_PATHNAME', 'weighted_pair_make'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Aggregate: weighted_pair_agg
+--
+-- Collects (value, weight) rows into a weighted_pair[] in one buffer, the
+-- single-array replacement for array_agg(value), array_agg(weight).
+-- NULL values and weights are stored as 0.0.
+--
+-- Parameters:
+--   value: Value column (double precision)
+--   weight: Weight column (double precision)
+--
+-- Returns: Array of pairs (weighted_pair[]), NULL for no input rows
+--
+CREATE OR REPLACE FUNCTION weighted_pair_agg_transfn(internal, double precision, double precision)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_pair_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_pair_agg_combinefn(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_pair_agg_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_pair_agg_serialfn(internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'weighted_pair_agg_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_pair_agg_deserialfn(bytea, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_pair_agg_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_pair_agg_finalfn(internal)
+RETURNS weighted_pair[]
+AS 'MODULE_PATHNAME', 'weighted_pair_agg_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE weighted_pair_agg(value double precision, weight double precision) (
+    SFUNC = weighted_pair_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_pair_agg_finalfn,
+    COMBINEFUNC = weighted_pair_agg_combinefn,
+    SERIALFUNC = weighted_pair_agg_serialfn,
+    DESERIALFUNC = weighted_pair_agg_deserialfn,
+    PARALLEL = SAFE
+);
+
+-- weighted_pair[] overloads
+--
+-- Same semantics as the (values[], weights[]) versions above, including the
+-- sparse-data handling, but reading one interleaved array.
+--
+CREATE OR REPLACE FUNCTION weighted_mean(
+    pairs weighted_pair[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_mean_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_quantile(
+    pairs weighted_pair[],
+    quantiles double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_quantile_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION wquantile(
+    pairs weighted_pair[],
+    quantiles double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'wquantile_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION whdquantile(
+    pairs weighted_pair[],
+    quantiles double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'whdquantile_pairs_c'
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_variance(
+    pairs weighted_pair[],
+    ddof integer DEFAULT 0
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_variance_pairs_c'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_std(
+    pairs weighted_pair[],
+    ddof integer DEFAULT 0
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_std_pairs_c'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_median(
+    pairs weighted_pair[]
+)
+RETURNS double precision
+AS $$
+    SELECT (weighted_quantile(pairs, ARRAY[0.5]))[1];
+$$ LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_quantile_table
+--
+-- Calculates empirical CDF weighted quantiles over a whole table by scanning
+-- its heap directly, without building arrays through the executor. Equivalent
+-- to weighted_quantile(array_agg(value_col), array_agg(weight_col), quantiles).
+-- Includes inheritance children and partitions; NULLs are read as 0.0.
+-- Tables with more rows than fit in work_mem are not loaded into memory: the
+-- quantiles are narrowed down with radix histogram passes over the table.
+--
+-- Parameters:
+--   rel: Table to scan (regclass)
+--   value_col: Name of the value column (any integer, float or numeric type)
+--   weight_col: Name of the weight column (any integer, float or numeric type)
+--   quantiles: Array of desired quantiles between 0.0 and 1.0 (double precision[])
+--
+-- Returns: Array of calculated quantiles (double precision[])
+--
+CREATE OR REPLACE FUNCTION weighted_quantile_table(
+    rel regclass,
+    value_col name,
+    weight_col name,
+    quantiles double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_quantile_table_c'
+LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+-- Function: weighted_mean_table
+--
+-- Calculates the weighted mean of two table columns with a direct heap scan.
+-- Equivalent to weighted_mean(array_agg(value_col), array_agg(weight_col)).
+--
+-- Parameters:
+--   rel: Table to scan (regclass)
+--   value_col: Name of the value column
+--   weight_col: Name of the weight column
+--
+-- Returns: Weighted mean (double precision), NULL for an empty table
+--
+CREATE OR REPLACE FUNCTION weighted_mean_table(
+    rel regclass,
+    value_col name,
+    weight_col name
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_mean_table_c'
+LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+-- Function: weighted_variance_table
+--
+-- Calculates the weighted variance of two table columns with a direct heap
+-- scan. Equivalent to weighted_variance(array_agg(value_col), array_agg(weight_col), ddof).
+--
+-- Parameters:
+--   rel: Table to scan (regclass)
+--   value_col: Name of the value column
+--   weight_col: Name of the weight column
+--   ddof: Delta degrees of freedom (integer, default 0)
+--
+-- Returns: Weighted variance (double precision)
+--
+CREATE OR REPLACE FUNCTION weighted_variance_table(
+    rel regclass,
+    value_col name,
+    weight_col name,
+    ddof integer DEFAULT 0
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_variance_table_c'
+LANGUAGE C STABLE PARALLEL RESTRICTED;
+
+-- Aggregates: weighted_mean_agg, weighted_variance_agg, weighted_std_agg
+--
+-- Row aggregates over (value, weight) columns. Each is equivalent to the
+-- array function applied to array_agg(value), array_agg(weight) of the group,
+-- including the sparse-data handling, but keeps only mergeable weighted
+-- moments in its state instead of materializing arrays, and supports
+-- parallel aggregation. NULL values and weights are read as 0.0.
+--
+-- Parameters:
+--   value: Value column (double precision)
+--   weight: Weight column (double precision)
+--   ddof: Delta degrees of freedom (integer, variance/std only, default 0)
+--
+-- Returns: Weighted mean, variance or standard deviation (double precision),
+--          NULL for no input rows
+--
+CREATE OR REPLACE FUNCTION weighted_moments_transfn(internal, double precision, double precision)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_moments_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_moments_transfn(internal, double precision, double precision, integer)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_moments_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_moments_combinefn(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_moments_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_moments_serialfn(internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'weighted_moments_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_moments_deserialfn(bytea, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_moments_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_moments_mean_final(internal)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_moments_mean_final'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_moments_variance_final(internal)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_moments_variance_final'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_moments_std_final(internal)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_moments_std_final'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE weighted_mean_agg(value double precision, weight double precision) (
+    SFUNC = weighted_moments_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_moments_mean_final,
+    COMBINEFUNC = weighted_moments_combinefn,
+    SERIALFUNC = weighted_moments_serialfn,
+    DESERIALFUNC = weighted_moments_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE weighted_variance_agg(value double precision, weight double precision) (
+    SFUNC = weighted_moments_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_moments_variance_final,
+    COMBINEFUNC = weighted_moments_combinefn,
+    SERIALFUNC = weighted_moments_serialfn,
+    DESERIALFUNC = weighted_moments_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE weighted_variance_agg(value double precision, weight double precision, ddof integer) (
+    SFUNC = weighted_moments_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_moments_variance_final,
+    COMBINEFUNC = weighted_moments_combinefn,
+    SERIALFUNC = weighted_moments_serialfn,
+    DESERIALFUNC = weighted_moments_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE weighted_std_agg(value double precision, weight double precision) (
+    SFUNC = weighted_moments_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_moments_std_final,
+    COMBINEFUNC = weighted_moments_combinefn,
+    SERIALFUNC = weighted_moments_serialfn,
+    DESERIALFUNC = weighted_moments_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE weighted_std_agg(value double precision, weight double precision, ddof integer) (
+    SFUNC = weighted_moments_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_moments_std_final,
+    COMBINEFUNC = weighted_moments_combinefn,
+    SERIALFUNC = weighted_moments_serialfn,
+    DESERIALFUNC = weighted_moments_deserialfn,
+    PARALLEL = SAFE
+);
+
+-- Aggregate: weighted_quantile_agg
+--
+-- Exact empirical CDF quantiles of (value, weight) rows, equivalent to
+-- weighted_quantile(array_agg(value), array_agg(weight), quantiles) including
+-- the sparse-data handling. Rows are buffered up to work_mem; beyond that
+-- they are sorted into runs in a temporary file and merged when finalizing,
+-- so a large group does not have to fit in memory. Rows with NULL or
+-- non-positive weights are ignored and NULL values are read as 0.0. The
+-- quantile levels are taken from the first row of each group.
+--
+-- Parameters:
+--   value: Value column (double precision)
+--   weight: Weight column (double precision)
+--   quantiles: Array of quantile levels in [0, 1] (double precision[])
+--
+-- Returns: Array of quantiles (double precision[]), NULL for no input rows
+--
+CREATE OR REPLACE FUNCTION weighted_quantile_agg_transfn(internal, double precision, double precision, double precision[])
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_quantile_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_quantile_agg_finalfn(internal)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_quantile_agg_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE weighted_quantile_agg(value double precision, weight double precision, quantiles double precision[]) (
+    SFUNC = weighted_quantile_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_quantile_agg_finalfn,
+    FINALFUNC_MODIFY = READ_WRITE,
+    PARALLEL = SAFE
+);
+
+-- Type: moments_sketch
+--
+-- Fixed-length (192 byte) mergeable quantile summary: min, max, and the
+-- weighted power sums sum(w * x^i) and log-power sums sum(w * log(x)^i),
+-- i = 0..10. Sketches of disjoint row sets merge by adding the sums, so they
+-- can be stored in rollup tables and combined later. Text form:
+-- '(min,max,p0,...,p10,l0,...,l10)'.
+--
+CREATE TYPE moments_sketch;
+
+CREATE OR REPLACE FUNCTION moments_sketch_in(cstring)
+RETURNS moments_sketch
+AS 'MODULE_PATHNAME', 'moments_sketch_in'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION moments_sketch_out(moments_sketch)
+RETURNS cstring
+AS 'MODULE_PATHNAME', 'moments_sketch_out'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION moments_sketch_recv(internal)
+RETURNS moments_sketch
+AS 'MODULE_PATHNAME', 'moments_sketch_recv'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION moments_sketch_send(moments_sketch)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'moments_sketch_send'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE moments_sketch (
+    INTERNALLENGTH = 192,
+    INPUT = moments_sketch_in,
+    OUTPUT = moments_sketch_out,
+    RECEIVE = moments_sketch_recv,
+    SEND = moments_sketch_send,
+    ALIGNMENT = double,
+    STORAGE = plain
+);
+
+-- Aggregate: moments_sketch_agg
+--
+-- Builds a moments_sketch from (value, weight) rows. Rows with non-positive
+-- weights are ignored; NULL values and weights are read as 0.0.
+--
+-- Parameters:
+--   value: Value column (double precision)
+--   weight: Weight column (double precision)
+--
+-- Returns: moments_sketch, NULL for no input rows
+--
+CREATE OR REPLACE FUNCTION moments_sketch_transfn(moments_sketch, double precision, double precision)
+RETURNS moments_sketch
+AS 'MODULE_PATHNAME', 'moments_sketch_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION moments_sketch_combinefn(moments_sketch, moments_sketch)
+RETURNS moments_sketch
+AS 'MODULE_PATHNAME', 'moments_sketch_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE moments_sketch_agg(value double precision, weight double precision) (
+    SFUNC = moments_sketch_transfn,
+    STYPE = moments_sketch,
+    COMBINEFUNC = moments_sketch_combinefn,
+    PARALLEL = SAFE
+);
+
+-- Aggregate: moments_sketch_merge
+--
+-- Merges stored sketches, e.g. per-minute sketches into an hourly one. The
+-- result is the sketch of all their rows.
+--
+-- Parameters:
+--   sketch: Sketch column (moments_sketch)
+--
+-- Returns: moments_sketch, NULL for no input rows
+--
+CREATE AGGREGATE moments_sketch_merge(sketch moments_sketch) (
+    SFUNC = moments_sketch_combinefn,
+    STYPE = moments_sketch,
+    COMBINEFUNC = moments_sketch_combinefn,
+    PARALLEL = SAFE
+);
+
+-- Function: moments_sketch_quantile
+--
+-- Estimates quantiles from a sketch with the maximum-entropy density that
+-- matches its moments. Same sparse-data handling as weighted_quantile: when
+-- the total weight is below 1 the missing mass is an implicit zero.
+--
+-- Parameters:
+--   sketch: Sketch (moments_sketch)
+--   quantiles: Array of quantile levels in [0, 1] (double precision[])
+--
+-- Returns: Array of estimated quantiles (double precision[])
+--
+CREATE OR REPLACE FUNCTION moments_sketch_quantile(
+    sketch moments_sketch,
+    quantiles double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'moments_sketch_quantile_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_kendall_tau
+--
+-- Weighted Kendall rank correlation (tau-b) of paired observations. Every
+-- pair of observations counts with the product of their weights, and ties
+-- in x or y are corrected for as in tau-b, so equal weights give the usual
+-- tau-b. Weights are relative: no implicit zero is added when they sum to
+-- less than 1, and zero weights are ignored. Runs in O(n log n) (Knight's
+-- algorithm), so it suits samples of millions of observations.
+--
+-- Parameters:
+--   x: First variable (double precision[])
+--   y: Second variable (double precision[])
+--   weights: Array of observation weights (double precision[])
+--
+-- Returns: Weighted tau-b in [-1, 1] (double precision), NULL when x or y is
+--          constant over the observations with positive weight
+--
+CREATE OR REPLACE FUNCTION weighted_kendall_tau(
+    x double precision[],
+    y double precision[],
+    weights double precision[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_kendall_tau_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_spearman
+--
+-- Weighted Spearman rank correlation: the weighted Pearson correlation of
+-- the weighted mid-ranks of x and y. An observation's rank is the weight of
+-- the smaller values plus half the weight of its ties, so equal weights give
+-- the usual Spearman correlation with mid-ranks for ties. Weights are
+-- relative: no implicit zero is added, and zero weights are ignored.
+--
+-- Parameters:
+--   x: First variable (double precision[])
+--   y: Second variable (double precision[])
+--   weights: Array of observation weights (double precision[])
+--
+-- Returns: Weighted Spearman correlation in [-1, 1] (double precision), NULL
+--          when x or y is constant over the observations with positive weight
+--
+CREATE OR REPLACE FUNCTION weighted_spearman(
+    x double precision[],
+    y double precision[],
+    weights double precision[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_spearman_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_auc
+--
+-- Weighted area under the ROC curve of scores for boolean labels: the
+-- probability that a positive observation scores above a negative one, ties
+-- counting one half, with every (positive, negative) pair counting with the
+-- product of their weights. Times the positive and negative weight totals it
+-- is the weighted Mann-Whitney U statistic. Weights are relative: no
+-- implicit zero is added. Zero weights and NULL labels are ignored.
+--
+-- Parameters:
+--   scores: Array of scores, higher meaning more likely positive (double precision[])
+--   labels: Array of labels (boolean[])
+--   weights: Array of observation weights (double precision[])
+--
+-- Returns: Weighted AUC in [0, 1] (double precision), NULL unless both labels
+--          have positive weight
+--
+CREATE OR REPLACE FUNCTION weighted_auc(
+    scores double precision[],
+    labels boolean[],
+    weights double precision[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_auc_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_roc
+--
+-- Weighted ROC curve of scores for boolean labels, by decreasing threshold.
+-- The row for threshold t gives the weighted false and true positive rates
+-- of classifying score >= t as positive; the first row is (Infinity, 0, 0)
+-- and there is one row per distinct score, so tied scores move the curve
+-- diagonally. Curves longer than points are reduced to points rows evenly
+-- spaced along the curve, keeping both ends. The trapezoidal area under the
+-- full curve is weighted_auc.
+--
+-- Parameters:
+--   scores: Array of scores (double precision[])
+--   labels: Array of labels (boolean[])
+--   weights: Array of observation weights (double precision[])
+--   points: Maximum number of rows (integer, at least 2, default 101)
+--
+-- Returns: Rows (threshold, fpr, tpr), none unless both labels have positive
+--          weight
+--
+CREATE OR REPLACE FUNCTION weighted_roc(
+    scores double precision[],
+    labels boolean[],
+    weights double precision[],
+    points integer DEFAULT 101
+)
+RETURNS TABLE(threshold double precision, fpr double precision, tpr double precision)
+AS 'MODULE_PATHNAME', 'weighted_roc_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+ROWS 101;
+
+-- Aggregate: weighted_auc_agg
+--
+-- Row aggregate form of weighted_auc over (score, label, weight) columns,
+-- with mergeable states and parallel aggregation. Scores are binned to their
+-- top 16 mantissa bits (relative width 2^-16, exact for integer scores below
+-- 65536) and scores sharing a bin count as ties, so the state holds at most
+-- two entries per occupied bin however many rows it has seen. Rows with a
+-- NULL label or zero weight are skipped; NULL scores and weights read as 0.0.
+--
+-- Parameters:
+--   score: Score column (double precision)
+--   label: Label column (boolean)
+--   weight: Weight column (double precision)
+--
+-- Returns: Weighted AUC (double precision), NULL unless both labels have
+--          positive weight
+--
+CREATE OR REPLACE FUNCTION weighted_auc_transfn(internal, double precision, boolean, double precision)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_auc_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_auc_combinefn(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_auc_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_auc_serialfn(internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'weighted_auc_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_auc_deserialfn(bytea, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'weighted_auc_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_auc_final(internal)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_auc_final'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE weighted_auc_agg(score double precision, label boolean, weight double precision) (
+    SFUNC = weighted_auc_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_auc_final,
+    COMBINEFUNC = weighted_auc_combinefn,
+    SERIALFUNC = weighted_auc_serialfn,
+    DESERIALFUNC = weighted_auc_deserialfn,
+    PARALLEL = SAFE
+);
+
+-- Function: weighted_hodges_lehmann
+--
+-- Weighted Hodges-Lehmann estimate of the shift from sample x to sample y:
+-- the weighted median of the differences y_j - x_i over all pairs, each
+-- pair weighing wx_i * wy_j (the midpoint of the lower and upper weighted
+-- medians, so equal weights give the usual estimate). The n * m differences
+-- are never materialized: both samples are sorted once and the median is
+-- selected in the implicitly sorted difference matrix, in
+-- O((n + m) log(n + m)) expected time and linear memory. Weights are
+-- relative: no implicit zero is added, and zero weights are ignored.
+--
+-- Parameters:
+--   x: First sample (double precision[])
+--   wx: Weights of the first sample (double precision[])
+--   y: Second sample (double precision[])
+--   wy: Weights of the second sample (double precision[])
+--
+-- Returns: Shift estimate (double precision), NULL unless both samples have
+--          positive weight
+--
+CREATE OR REPLACE FUNCTION weighted_hodges_lehmann(
+    x double precision[],
+    wx double precision[],
+    y double precision[],
+    wy double precision[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_hodges_lehmann_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Functions: weighted_qn, weighted_sn
+--
+-- Weighted Rousseeuw-Croux robust scale estimators, scaled to estimate the
+-- standard deviation of normal data (asymptotic constants, no small-sample
+-- correction). Qn is 2.21914 times the order statistic of the distances
+-- |x_i - x_j| (i < j, weight w_i * w_j) at k of the n(n-1)/2 pairs, with
+-- k = h(h-1)/2 and h = n/2 + 1; Sn is 1.1926 times the weighted low median
+-- over i of the weighted high median over j of |x_i - x_j|. Equal weights
+-- give the unweighted estimators. Both sort once and select in
+-- O(n log n) (Qn in expected time), so arrays of millions of elements are
+-- fine. Like weighted_variance, sparse data (sum(weights) < 1.0) gets an
+-- implicit zero with weight 1.0 - sum(weights), which counts in n.
+--
+-- Parameters:
+--   vals: Array of values (double precision[])
+--   weights: Array of corresponding weights (double precision[])
+--   pairs: Array of (value, weight) pairs (weighted_pair[])
+--
+-- Returns: Scale estimate (double precision); weighted_qn is NULL for a
+--          single observation
+--
+CREATE OR REPLACE FUNCTION weighted_qn(
+    vals double precision[],
+    weights double precision[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_qn_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_qn(
+    pairs weighted_pair[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_qn_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_sn(
+    vals double precision[],
+    weights double precision[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_sn_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_sn(
+    pairs weighted_pair[]
+)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'weighted_sn_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_lmoments
+--
+-- Weighted L-moments: the L-moments of the weighted empirical distribution,
+-- lambda_r = integral of Q(u) P*_{r-1}(u) du with Q its quantile function
+-- and P* the shifted Legendre polynomials. The result holds the L-location
+-- lambda_1 (the weighted mean), the L-scale lambda_2 and the L-moment ratios
+-- tau_r = lambda_r / lambda_2 for r = 3..nmom (tau_3 is the L-skewness,
+-- tau_4 the L-kurtosis). The ratios are NULL when lambda_2 is 0 (constant
+-- data). All orders come from one sort and one sweep. Sparse data
+-- (sum(weights) < 1.0) gets an implicit zero as in weighted_quantile.
+--
+-- Parameters:
+--   vals: Array of values (double precision[])
+--   weights: Array of corresponding weights (double precision[])
+--   pairs: Array of (value, weight) pairs (weighted_pair[])
+--   nmom: Number of L-moments, 1 to 20 (integer, default 4)
+--
+-- Returns: Array {lambda_1, lambda_2, tau_3, ..., tau_nmom} (double precision[])
+--
+CREATE OR REPLACE FUNCTION weighted_lmoments(
+    vals double precision[],
+    weights double precision[],
+    nmom integer DEFAULT 4
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_lmoments_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_lmoments(
+    pairs weighted_pair[],
+    nmom integer DEFAULT 4
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_lmoments_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_expectile
+--
+-- Weighted expectiles: the tau-expectile e minimizes the asymmetrically
+-- weighted squared deviations sum w |tau - 1{x < e}| (x - e)^2, so that
+-- tau = 0.5 gives the weighted mean and tau = 0 and 1 the minimum and
+-- maximum. One sort and one prefix sweep of w and w*x serve all levels, each
+-- found by binary search over the sorted values and solved in closed form
+-- within its segment. Sparse data (sum(weights) < 1.0) gets an implicit zero
+-- as in weighted_quantile.
+--
+-- Parameters:
+--   vals: Array of values (double precision[])
+--   weights: Array of corresponding weights (double precision[])
+--   pairs: Array of (value, weight) pairs (weighted_pair[])
+--   taus: Array of expectile levels between 0.0 and 1.0 (double precision[])
+--
+-- Returns: Array of expectiles, one per level (double precision[])
+--
+CREATE OR REPLACE FUNCTION weighted_expectile(
+    vals double precision[],
+    weights double precision[],
+    taus double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_expectile_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_expectile(
+    pairs weighted_pair[],
+    taus double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_expectile_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Function: weighted_var_es
+--
+-- Weighted Value-at-Risk and expected shortfall (CVaR) of losses at many
+-- confidence levels. Row 1 of the result holds the VaR of each level, the
+-- same value as weighted_quantile(vals, weights, levels); row 2 holds the
+-- expected shortfall, the weighted mean of the upper (1 - level) fraction of
+-- the distribution, in which the value at the boundary counts with the exact
+-- fraction of its weight that lies above it. One sort and one sweep of the
+-- cumulative weight and weight * value serve all levels. Losses are positive
+-- values; pass negated returns. Sparse data (sum(weights) < 1.0) gets an
+-- implicit zero as in weighted_quantile.
+--
+-- Parameters:
+--   vals: Array of losses (double precision[])
+--   weights: Array of corresponding weights (double precision[])
+--   pairs: Array of (value, weight) pairs (weighted_pair[])
+--   levels: Array of confidence levels between 0.0 and 1.0 (double precision[])
+--
+-- Returns: Array {{VaR_1, ..., VaR_k}, {ES_1, ..., ES_k}} (double precision[][])
+--
+CREATE OR REPLACE FUNCTION weighted_var_es(
+    vals double precision[],
+    weights double precision[],
+    levels double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_var_es_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION weighted_var_es(
+    pairs weighted_pair[],
+    levels double precision[]
+)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_var_es_pairs_c'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Aggregate: weighted_var_es_agg
+--
+-- weighted_var_es of (value, weight) rows, collected like
+-- weighted_quantile_agg: exact, spilling to a temporary file beyond work_mem.
+-- Rows with NULL or non-positive weights are ignored and NULL values are read
+-- as 0.0. The levels are taken from the first row of each group.
+--
+-- Parameters:
+--   value: Loss column (double precision)
+--   weight: Weight column (double precision)
+--   levels: Array of confidence levels in [0, 1] (double precision[])
+--
+-- Returns: Array {{VaR_1, ..., VaR_k}, {ES_1, ..., ES_k}} (double precision[][]),
+--          NULL for no input rows
+--
+CREATE OR REPLACE FUNCTION weighted_var_es_agg_finalfn(internal)
+RETURNS double precision[]
+AS 'MODULE_PATHNAME', 'weighted_var_es_agg_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE weighted_var_es_agg(value double precision, weight double precision, levels double precision[]) (
+    SFUNC = weighted_quantile_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = weighted_var_es_agg_finalfn,
+    FINALFUNC_MODIFY = READ_WRITE,
+    PARALLEL = SAFE
+);
@@ -9,6 +9,7 @@
 #include "utils/array.h"
 #include "utils/lsyscache.h"
 #include "utils/builtins.h"
+#include "utils/memutils.h"
 #include "catalog/pg_type.h"
 #include <math.h>
 #include <string.h>
@@ -27,10 +28,126 @@ compare_value_weight(const void *a, const void *b) {
     return 0;
 }
 
+/* Pair and input position, for the small buckets of the in-place sort */
+typedef struct {
+    ValueWeight pair;
+    uint64_t key;
+    int32 position;
+} PositionedPair;
+
+static int
+compare_positioned_pairs(const void *a, const void *b) {
+    const PositionedPair *pa = (const PositionedPair *)a;
+    const PositionedPair *pb = (const PositionedPair *)b;
+    
+    if (pa->key != pb->key) {
+        return pa->key < pb->key ? -1 : 1;
+    }
+    return (pa->position > pb->position) - (pa->position < pb->position);
+}
+
+/* Digit of the (value key, input position) sort key, 11 most significant */
+static inline int
+positioned_digit(const ValueWeight *pair, int32 position, int digit) {
+    if (digit >= 4) {
+        return (int) ((sortable_double_key(pair->value) >> ((digit - 4) * 8)) & 0xFF);
+    }
+    return (int) (((uint32) position >> (digit * 8)) & 0xFF);
+}
+
+/*
+ * In-place MSD radix sort (American flag sort) on the sortable keys
+ *
+ * Permutes each digit's buckets into place by swapping, then recurses into
+ * the buckets on the next digit down, so it needs no second pair buffer.
+ * Used past MaxAllocSize, where the LSD sort's copy would be another 1GB+
+ * allocation. The input position of every pair moves along with it and
+ * serves as the four least significant digits, so equal values keep their
+ * input order as in the stable LSD sort: the interpolating kernels depend
+ * on the order of tied weights.
+ */
+static void
+inplace_radix_sort_positioned(ValueWeight *pairs, int32 *positions, int n, int digit) {
+    int count[256] = {0};
+    int next[256], end[256];
+    int b, i;
+    
+    if (n < 256) {
+        PositionedPair small[256];
+        
+        for (i = 0; i < n; i++) {
+            small[i].pair = pairs[i];
+            small[i].key = sortable_double_key(pairs[i].value);
+            small[i].position = positions[i];
+        }
+        qsort(small, n, sizeof(PositionedPair), compare_positioned_pairs);
+        for (i = 0; i < n; i++) {
+            pairs[i] = small[i].pair;
+            positions[i] = small[i].position;
+        }
+        return;
+    }
+    
+    for (i = 0; i < n; i++) {
+        count[positioned_digit(&pairs[i], positions[i], digit)]++;
+    }
+    next[0] = 0;
+    for (b = 0; b < 256; b++) {
+        if (b > 0) {
+            next[b] = end[b - 1];
+        }
+        end[b] = next[b] + count[b];
+    }
+    
+    /* Cycle each misplaced pair into the next free slot of its bucket */
+    for (b = 0; b < 256; b++) {
+        while (next[b] < end[b]) {
+            ValueWeight item = pairs[next[b]];
+            int32 position = positions[next[b]];
+            int dest = positioned_digit(&item, position, digit);
+            
+            while (dest != b) {
+                ValueWeight displaced = pairs[next[dest]];
+                int32 displaced_position = positions[next[dest]];
+                
+                positions[next[dest]] = position;
+                pairs[next[dest]++] = item;
+                item = displaced;
+                position = displaced_position;
+                dest = positioned_digit(&item, position, digit);
+            }
+            positions[next[b]] = position;
+            pairs[next[b]++] = item;
+        }
+    }
+    
+    if (digit > 0) {
+        for (b = 0; b < 256; b++) {
+            if (count[b] > 1) {
+                inplace_radix_sort_positioned(pairs + end[b] - count[b],
+                                              positions + end[b] - count[b],
+                                              count[b], digit - 1);
+            }
+        }
+    }
+}
+
+/* Stable in-place sort of a pair buffer too large to copy */
+static void
+inplace_radix_sort_pairs(ValueWeight *pairs, int n) {
+    int32 *positions = (int32 *)palloc_huge((Size) n * sizeof(int32));
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        positions[i] = i;
+    }
+    inplace_radix_sort_positioned(pairs, positions, n, 11);
+    pfree(positions);
+}
+
 /* Radix sort for doubles - much faster than qsort for large arrays */
 static void radix_sort_value_weight_pairs(ValueWeight *pairs, int n) {
     ValueWeight *temp;
-    union { double d; uint64_t u; } conv;
     int byte, i;
     
     if (n <= 1) return;
@@ -41,11 +158,20 @@ static void radix_sort_value_weight_pairs(ValueWeight *pairs, int n) {
         return;
     }
     
+    /* A second copy would not fit in a regular allocation */
+    if ((Size) n * sizeof(ValueWeight) > MaxAllocSize) {
+        inplace_radix_sort_pairs(pairs, n);
+        return;
+    }
+    
     /* Radix sort implementation for IEEE 754 doubles */
     temp = (ValueWeight *)palloc(n * sizeof(ValueWeight));
     
-    /* Sort by each byte of the double, from most significant */
-    for (byte = 7; byte >= 0; byte--) {
+    /*
+     * Stable counting passes from the least significant byte, so the last
+     * pass (most significant byte) decides the final order
+     */
+    for (byte = 0; byte < 8; byte++) {
         int count[256] = {0};
         int shift = byte * 8;
         uint64_t key;
@@ -53,16 +179,7 @@ static void radix_sort_value_weight_pairs(ValueWeight *pairs, int n) {
         
         /* Count occurrences */
         for (i = 0; i < n; i++) {
-            conv.d = pairs[i].value;
-            key = conv.u;
-            /* Transform IEEE 754 bit pattern for correct radix sort ordering:
-             * - For negative numbers (sign bit set): flip all bits
-             * - For positive numbers (sign bit clear): flip only sign bit */
-            if (key & 0x8000000000000000ULL) {
-                key = ~key;
-            } else {
-                key ^= 0x8000000000000000ULL;
-            }
+            key = sortable_double_key(pairs[i].value);
             count[(key >> shift) & 0xFF]++;
         }
         
@@ -73,13 +190,7 @@ static void radix_sort_value_weight_pairs(ValueWeight *pairs, int n) {
         
         /* Place elements in sorted order */
         for (i = n - 1; i >= 0; i--) {
-            conv.d = pairs[i].value;
-            key = conv.u;
-            if (key & 0x8000000000000000ULL) {
-                key = ~key;
-            } else {
-                key ^= 0x8000000000000000ULL;
-            }
+            key = sortable_double_key(pairs[i].value);
             bucket = (key >> shift) & 0xFF;
             temp[--count[bucket]] = pairs[i];
         }
@@ -117,6 +228,12 @@ static void counting_sort_value_weight_pairs(ValueWeight *pairs, int n) {
         return;
     }
     
+    /* Too large for a regular temp copy: sort in place instead */
+    if ((Size) n * sizeof(ValueWeight) > MaxAllocSize) {
+        inplace_radix_sort_pairs(pairs, n);
+        return;
+    }
+    
     range_int = (int)range + 1;
     count = (int *)palloc0(range_int * sizeof(int));
     temp = (ValueWeight *)palloc(n * sizeof(ValueWeight));
@@ -153,6 +270,73 @@ static void counting_sort_value_weight_pairs(ValueWeight *pairs, int n) {
     pfree(temp);
 }
 
+/* A pair's sort key: the sortable value bits, ties broken by input position */
+typedef struct {
+    uint64_t key;
+    int position;
+} NetworkSlot;
+
+/* Compare-exchange of the sorting network, without a branch on the data */
+#define NETWORK_EXCHANGE(slots, i, j) \
+    do { \
+        NetworkSlot lo_ = (slots)[i], hi_ = (slots)[j]; \
+        bool swap_ = lo_.key > hi_.key || (lo_.key == hi_.key && lo_.position > hi_.position); \
+        (slots)[i] = swap_ ? hi_ : lo_; \
+        (slots)[j] = swap_ ? lo_ : hi_; \
+    } while (0)
+
+/*
+ * Sorting network for small arrays (Batcher's merge exchange, Knuth 5.2.2M)
+ *
+ * The sequence of compare-exchanges depends only on n, so there are no
+ * unpredictable branches, and everything lives on the stack. Ties on the
+ * value keep their input order, giving the same order as the stable radix
+ * sort used for larger arrays.
+ */
+static void
+network_sort_value_weight_pairs(ValueWeight *pairs, int n) {
+    NetworkSlot slots[SMALL_ARRAY_MAX_PAIRS];
+    ValueWeight copy[SMALL_ARRAY_MAX_PAIRS];
+    int t = 0;
+    int p, i;
+    
+    Assert(n <= SMALL_ARRAY_MAX_PAIRS);
+    
+    for (i = 0; i < n; i++) {
+        slots[i].key = sortable_double_key(pairs[i].value);
+        slots[i].position = i;
+    }
+    
+    while ((1 << t) < n) {
+        t++;
+    }
+    
+    for (p = 1 << (t - 1); p > 0; p >>= 1) {
+        int q = 1 << (t - 1);
+        int r = 0;
+        int d = p;
+        
+        for (;;) {
+            for (i = 0; i < n - d; i++) {
+                if ((i & p) == r) {
+                    NETWORK_EXCHANGE(slots, i, i + d);
+                }
+            }
+            if (q == p) {
+                break;
+            }
+            d = q - p;
+            q >>= 1;
+            r = p;
+        }
+    }
+    
+    memcpy(copy, pairs, n * sizeof(ValueWeight));
+    for (i = 0; i < n; i++) {
+        pairs[i] = copy[slots[i].position];
+    }
+}
+
 /* Intelligent sorting dispatch */
 void optimized_sort_value_weight_pairs(ValueWeight *pairs, int n) {
     double min_val, max_val, range;
@@ -161,9 +345,9 @@ void optimized_sort_value_weight_pairs(ValueWeight *pairs, int n) {
     
     if (n <= 1) return;
     
-    /* For small arrays, use standard qsort */
-    if (n < 32) {
-        qsort(pairs, n, sizeof(ValueWeight), compare_value_weight);
+    /* For small arrays, a sorting network on the stack */
+    if (n <= SMALL_ARRAY_MAX_PAIRS) {
+        network_sort_value_weight_pairs(pairs, n);
         return;
     }
     
@@ -189,23 +373,689 @@ void optimized_sort_value_weight_pairs(ValueWeight *pairs, int n) {
     }
 }
 
-/* Utility function to extract double arrays from PostgreSQL arrays */
-int
-extract_double_arrays(ArrayType *vals_array, ArrayType *weights_array,
-                      double **vals, double **weights, int *n_elements) {
-    Datum *vals_datums, *weights_datums;
-    bool *vals_nulls, *weights_nulls;
-    int vals_count, weights_count;
+/*
+ * Radix select for empirical CDF quantiles
+ *
+ * Instead of sorting all pairs, histogram the weight over the top bits of the
+ * sortable keys, locate the bucket holding each target cumulative weight and
+ * only look further into those buckets: recursively on the next bits while a
+ * bucket is large, otherwise by sorting it. All targets share each histogram
+ * pass, so a few quantiles of a large array touch the data two or three times.
+ */
+
+/* Key bits consumed per histogram pass */
+#define RADIX_SELECT_BITS 16
+#define RADIX_SELECT_BUCKETS (1 << RADIX_SELECT_BITS)
+
+/* Segments up to this size are sorted instead of histogrammed again */
+#define RADIX_SELECT_SORT_THRESHOLD 65536
+
+/* A target cumulative weight and where its quantile goes */
+typedef struct {
+    double target;
+    int index;
+} QuantileTarget;
+
+/* Buckets selected by one histogram pass */
+typedef struct {
+    int bucket;
+    int first_target;
+    int n_targets;
+    double base_cum;        /* cumulative weight before the bucket */
+    bool has_pred;          /* whether a smaller element exists */
+    double pred_value;      /* largest element before the bucket */
+    int offset;             /* start of the bucket's elements in the gather buffer */
+} SelectedBucket;
+
+static int
+compare_quantile_targets(const void *a, const void *b) {
+    const QuantileTarget *ta = (const QuantileTarget *)a;
+    const QuantileTarget *tb = (const QuantileTarget *)b;
+    
+    if (ta->target < tb->target) return -1;
+    if (ta->target > tb->target) return 1;
+    return ta->index - tb->index;
+}
+
+/*
+ * Resolve ascending targets inside a sorted segment
+ *
+ * Same rule as the empirical CDF kernel: take the first element whose
+ * cumulative weight reaches the target, interpolating from its predecessor
+ * unless it is the smallest element or the target is hit exactly.
+ */
+static void
+resolve_sorted_targets(const ValueWeight *pairs, int n, double base_cum,
+                       bool has_pred, double pred_value,
+                       const QuantileTarget *targets, int n_targets, double *results) {
+    double cum = base_cum + pairs[0].weight;
+    double prev_cum = base_cum;
+    double prev_value = pred_value;
+    bool prev_valid = has_pred;
+    int i = 0;
+    int t;
+    
+    for (t = 0; t < n_targets; t++) {
+        double target = targets[t].target;
+        
+        while (cum < target && i < n - 1) {
+            prev_cum = cum;
+            prev_value = pairs[i].value;
+            prev_valid = true;
+            i++;
+            cum += pairs[i].weight;
+        }
+        
+        if (!prev_valid || cum == target) {
+            results[targets[t].index] = pairs[i].value;
+        } else {
+            double interp_factor = (target - prev_cum) / (cum - prev_cum);
+            results[targets[t].index] = prev_value + interp_factor * (pairs[i].value - prev_value);
+        }
+    }
+}
+
+/* Select the targets within a segment whose keys agree above shift + RADIX_SELECT_BITS */
+static void
+radix_select_segment(ValueWeight *pairs, int n, int shift, double base_cum,
+                     bool has_pred, double pred_value,
+                     const QuantileTarget *targets, int n_targets, double *results) {
+    double *bucket_weight;
+    double *bucket_max;
+    int *bucket_count;
+    int *bucket_selection;
+    SelectedBucket *selected;
+    ValueWeight *gathered;
+    int n_selected = 0;
+    int n_gathered = 0;
+    double cum, prev_max;
+    bool prev_valid;
+    int last_bucket = -1;
+    SelectedBucket last_info;
+    int b, i, t;
+    
+    if (n <= RADIX_SELECT_SORT_THRESHOLD || shift < 0) {
+        optimized_sort_value_weight_pairs(pairs, n);
+        resolve_sorted_targets(pairs, n, base_cum, has_pred, pred_value,
+                               targets, n_targets, results);
+        return;
+    }
+    
+    bucket_weight = (double *)palloc0(RADIX_SELECT_BUCKETS * sizeof(double));
+    bucket_max = (double *)palloc(RADIX_SELECT_BUCKETS * sizeof(double));
+    bucket_count = (int *)palloc0(RADIX_SELECT_BUCKETS * sizeof(int));
+    
+    /* Histogram pass */
+    for (i = 0; i < n; i++) {
+        b = (int)((sortable_double_key(pairs[i].value) >> shift) & (RADIX_SELECT_BUCKETS - 1));
+        bucket_weight[b] += pairs[i].weight;
+        if (bucket_count[b]++ == 0 || pairs[i].value > bucket_max[b]) {
+            bucket_max[b] = pairs[i].value;
+        }
+    }
+    
+    /* Walk the buckets in key order and assign each target to its bucket */
+    selected = (SelectedBucket *)palloc((n_targets + 1) * sizeof(SelectedBucket));
+    cum = base_cum;
+    prev_valid = has_pred;
+    prev_max = pred_value;
+    t = 0;
+    memset(&last_info, 0, sizeof(SelectedBucket));
+    for (b = 0; b < RADIX_SELECT_BUCKETS && t < n_targets; b++) {
+        int first = t;
+        
+        if (bucket_count[b] == 0) {
+            continue;
+        }
+        
+        last_bucket = b;
+        last_info.bucket = b;
+        last_info.base_cum = cum;
+        last_info.has_pred = prev_valid;
+        last_info.pred_value = prev_max;
+        
+        while (t < n_targets && targets[t].target <= cum + bucket_weight[b]) {
+            t++;
+        }
+        if (t > first) {
+            selected[n_selected] = last_info;
+            selected[n_selected].first_target = first;
+            selected[n_selected].n_targets = t - first;
+            n_selected++;
+        }
+        
+        cum += bucket_weight[b];
+        prev_valid = true;
+        prev_max = bucket_max[b];
+    }
+    
+    /*
+     * Targets beyond the accumulated weight (rounding) go to the last bucket;
+     * the walk above only ends early once every target is assigned
+     */
+    if (t < n_targets) {
+        if (n_selected > 0 && selected[n_selected - 1].bucket == last_bucket) {
+            selected[n_selected - 1].n_targets += n_targets - t;
+        } else {
+            selected[n_selected] = last_info;
+            selected[n_selected].first_target = t;
+            selected[n_selected].n_targets = n_targets - t;
+            n_selected++;
+        }
+    }
+    
+    /* Gather the elements of the selected buckets */
+    bucket_selection = (int *)palloc(RADIX_SELECT_BUCKETS * sizeof(int));
+    memset(bucket_selection, -1, RADIX_SELECT_BUCKETS * sizeof(int));
+    for (i = 0; i < n_selected; i++) {
+        bucket_selection[selected[i].bucket] = i;
+        selected[i].offset = n_gathered;
+        n_gathered += bucket_count[selected[i].bucket];
+    }
+    
+    gathered = (ValueWeight *)palloc_huge((Size) n_gathered * sizeof(ValueWeight));
+    for (i = 0; i < n_selected; i++) {
+        bucket_count[selected[i].bucket] = selected[i].offset;
+    }
+    for (i = 0; i < n; i++) {
+        b = (int)((sortable_double_key(pairs[i].value) >> shift) & (RADIX_SELECT_BUCKETS - 1));
+        if (bucket_selection[b] >= 0) {
+            gathered[bucket_count[b]++] = pairs[i];
+        }
+    }
+    
+    pfree(bucket_weight);
+    pfree(bucket_max);
+    pfree(bucket_selection);
+    
+    /* Refine each selected bucket on the next bits */
+    for (i = 0; i < n_selected; i++) {
+        int start = selected[i].offset;
+        int count = bucket_count[selected[i].bucket] - start;
+        
+        radix_select_segment(gathered + start, count, shift - RADIX_SELECT_BITS,
+                             selected[i].base_cum, selected[i].has_pred, selected[i].pred_value,
+                             targets + selected[i].first_target, selected[i].n_targets,
+                             results);
+    }
+    
+    pfree(bucket_count);
+    pfree(selected);
+    pfree(gathered);
+}
+
+/*
+ * Empirical CDF quantiles of unsorted, compacted pairs without a full sort
+ *
+ * Gives the same results as sorting the pairs and running the empirical
+ * quantile kernel (up to the summation order of the cumulative weights).
+ * The pairs may be reordered.
+ */
+void
+radix_select_weighted_quantiles(ValueWeight *pairs, int n, double total_weight,
+                                const double *quantiles, int n_quantiles, double *results) {
+    QuantileTarget *targets;
+    int n_targets = 0;
+    bool need_max = false;
+    double max_value;
+    int i;
+    
+    targets = (QuantileTarget *)palloc(n_quantiles * sizeof(QuantileTarget));
+    for (i = 0; i < n_quantiles; i++) {
+        if (quantiles[i] >= 1.0) {
+            need_max = true;
+        } else {
+            /* q <= 0 gives target 0, resolved to the smallest element */
+            targets[n_targets].target = quantiles[i] > 0.0 ? quantiles[i] * total_weight : 0.0;
+            targets[n_targets].index = i;
+            n_targets++;
+        }
+    }
+    
+    if (need_max) {
+        max_value = pairs[0].value;
+        for (i = 1; i < n; i++) {
+            if (pairs[i].value > max_value) max_value = pairs[i].value;
+        }
+        for (i = 0; i < n_quantiles; i++) {
+            if (quantiles[i] >= 1.0) results[i] = max_value;
+        }
+    }
+    
+    if (n_targets > 0) {
+        qsort(targets, n_targets, sizeof(QuantileTarget), compare_quantile_targets);
+        radix_select_segment(pairs, n, 64 - RADIX_SELECT_BITS, 0.0, false, 0.0,
+                             targets, n_targets, results);
+    }
+    
+    pfree(targets);
+}
+
+/*
+ * Multi-pass radix select over input that does not fit in memory
+ *
+ * The same bucket walk as radix_select_segment, but the input is a scan
+ * callback that replays the rows instead of an array. Each pass scans all
+ * rows once and keeps, for every segment still being narrowed, only a
+ * histogram over the next 16 key bits (weight, count, minimum and maximum
+ * value per bucket), or the rows themselves once a segment is small enough
+ * to sort, so an exact answer takes a few sequential scans in O(65536)
+ * memory per segment.
+ */
+
+/* Segments narrowed together in one pass (each holds a 2.5MB histogram) */
+#define MULTIPASS_MAX_SEGMENTS 8
+
+/* A key range still holding targets, and what is known below it */
+typedef struct {
+    uint64_t prefix;        /* key >> (shift + RADIX_SELECT_BITS) of its rows */
+    int shift;              /* position of the next 16-bit digit */
+    int64 count;            /* rows in the range */
+    int first_target;
+    int n_targets;
+    double base_cum;        /* cumulative weight before the range */
+    bool has_pred;          /* whether a smaller element exists */
+    double pred_value;      /* largest element before the range */
+    /* Filled by the pass: either a histogram... */
+    double *bucket_weight;
+    double *bucket_min;
+    double *bucket_max;
+    double *bucket_first;   /* weight of the first row in scan order */
+    int64 *bucket_count;
+    /* ...or, for small ranges, the rows themselves */
+    ValueWeight *gathered;
+    int n_gathered;
+} ScanSegment;
+
+struct MultipassSelect {
+    double total_weight;    /* positive weights, summed in scan order */
+    bool first_pass;
+    ScanSegment *active;    /* segments filled by the current pass */
+    int n_active;
+    ScanSegment *pending;   /* segments waiting for a pass */
+    int n_pending;
+    int pending_capacity;
+};
+
+/* Whether a key falls in a segment's range (the root covers every key) */
+static inline bool
+scan_segment_matches(const ScanSegment *seg, uint64_t key) {
+    return seg->shift + RADIX_SELECT_BITS >= 64 ||
+        (key >> (seg->shift + RADIX_SELECT_BITS)) == seg->prefix;
+}
+
+/* Allocate what a segment collects during a pass */
+static void
+scan_segment_prepare(ScanSegment *seg) {
+    seg->gathered = NULL;
+    seg->n_gathered = 0;
+    if (seg->count <= RADIX_SELECT_SORT_THRESHOLD) {
+        seg->gathered = (ValueWeight *)palloc(seg->count * sizeof(ValueWeight));
+        return;
+    }
+    seg->bucket_weight = (double *)palloc0(RADIX_SELECT_BUCKETS * sizeof(double));
+    seg->bucket_min = (double *)palloc(RADIX_SELECT_BUCKETS * sizeof(double));
+    seg->bucket_max = (double *)palloc(RADIX_SELECT_BUCKETS * sizeof(double));
+    seg->bucket_first = (double *)palloc(RADIX_SELECT_BUCKETS * sizeof(double));
+    seg->bucket_count = (int64 *)palloc0(RADIX_SELECT_BUCKETS * sizeof(int64));
+}
+
+/* Add one positive-weight row to the active segment whose range holds it */
+static inline void
+multipass_add_row(MultipassSelect *select, double value, double weight) {
+    uint64_t key = sortable_double_key(value);
+    int s;
+    
+    for (s = 0; s < select->n_active; s++) {
+        ScanSegment *seg = &select->active[s];
+        int b;
+        
+        if (!scan_segment_matches(seg, key)) {
+            continue;
+        }
+        
+        if (seg->gathered != NULL) {
+            /* The rows were counted in an earlier pass over the same snapshot */
+            if (seg->n_gathered >= seg->count) {
+                elog(ERROR, "weighted quantile input changed between passes");
+            }
+            seg->gathered[seg->n_gathered].value = value;
+            seg->gathered[seg->n_gathered].weight = weight;
+            seg->n_gathered++;
+        } else {
+            b = (int)((key >> seg->shift) & (RADIX_SELECT_BUCKETS - 1));
+            seg->bucket_weight[b] += weight;
+            if (seg->bucket_count[b]++ == 0) {
+                seg->bucket_min[b] = value;
+                seg->bucket_max[b] = value;
+                seg->bucket_first[b] = weight;
+            } else if (value > seg->bucket_max[b]) {
+                seg->bucket_max[b] = value;
+            } else if (value < seg->bucket_min[b]) {
+                seg->bucket_min[b] = value;
+            }
+        }
+        /* Active ranges are disjoint */
+        return;
+    }
+}
+
+/*
+ * Chunk consumer of a pass: rows with non-positive weights are skipped, as
+ * compact_sparse_pairs drops them
+ */
+void
+multipass_select_consume(const double *vals, const double *weights, int n_rows, void *arg) {
+    MultipassSelect *select = (MultipassSelect *) arg;
+    int i;
+    
+    for (i = 0; i < n_rows; i++) {
+        if (weights[i] > 0.0) {
+            if (select->first_pass) {
+                select->total_weight += weights[i];
+            }
+            multipass_add_row(select, vals[i], weights[i]);
+        }
+    }
+}
+
+/*
+ * Start a multi-pass selection; the caller feeds the first pass through
+ * multipass_select_consume, e.g. during its own scan
+ */
+MultipassSelect *
+multipass_select_begin(void) {
+    MultipassSelect *select = (MultipassSelect *)palloc0(sizeof(MultipassSelect));
+    
+    /* The root covers all keys; its count is unknown but large */
+    select->active = (ScanSegment *)palloc0(MULTIPASS_MAX_SEGMENTS * sizeof(ScanSegment));
+    select->active[0].shift = 64 - RADIX_SELECT_BITS;
+    select->active[0].count = PG_INT64_MAX;
+    scan_segment_prepare(&select->active[0]);
+    select->n_active = 1;
+    select->first_pass = true;
+    
+    return select;
+}
+
+/* Queue a sub-range of a segment for the next passes */
+static void
+multipass_push_segment(MultipassSelect *select, const ScanSegment *parent, int bucket,
+                       const SelectedBucket *info) {
+    ScanSegment *child;
+    
+    if (select->n_pending >= select->pending_capacity) {
+        select->pending_capacity = Max(16, select->pending_capacity * 2);
+        select->pending = select->pending == NULL ?
+            (ScanSegment *)palloc(select->pending_capacity * sizeof(ScanSegment)) :
+            (ScanSegment *)repalloc(select->pending, select->pending_capacity * sizeof(ScanSegment));
+    }
+    
+    child = &select->pending[select->n_pending++];
+    memset(child, 0, sizeof(ScanSegment));
+    child->prefix = (parent->prefix << RADIX_SELECT_BITS) | (uint64_t) bucket;
+    child->shift = parent->shift - RADIX_SELECT_BITS;
+    child->count = parent->bucket_count[bucket];
+    child->first_target = info->first_target;
+    child->n_targets = info->n_targets;
+    child->base_cum = info->base_cum;
+    child->has_pred = info->has_pred;
+    child->pred_value = info->pred_value;
+}
+
+/*
+ * Resolve the targets that fall on a bucket of equal values (or a single row)
+ *
+ * Like resolve_sorted_targets over the bucket's rows in scan order: only the
+ * first row can interpolate from the predecessor; past it the neighbours are
+ * equal values.
+ */
+static void
+resolve_equal_values(double value, double first_weight, int64 count, const SelectedBucket *info,
+                   const QuantileTarget *targets, double *results) {
+    double cum = info->base_cum + first_weight;
+    int t;
+    
+    for (t = info->first_target; t < info->first_target + info->n_targets; t++) {
+        double target = targets[t].target;
+        
+        if ((target <= cum || count == 1) && info->has_pred && cum != target) {
+            double interp_factor = (target - info->base_cum) / (cum - info->base_cum);
+            results[targets[t].index] = info->pred_value +
+                interp_factor * (value - info->pred_value);
+        } else {
+            results[targets[t].index] = value;
+        }
+    }
+}
+
+/* Assign a histogrammed segment's targets to buckets: resolve or queue each */
+static void
+multipass_walk_segment(MultipassSelect *select, ScanSegment *seg,
+                       const QuantileTarget *targets, double *results) {
+    SelectedBucket info;
+    double cum = seg->base_cum;
+    bool prev_valid = seg->has_pred;
+    double prev_max = seg->pred_value;
+    int t = seg->first_target;
+    int end = seg->first_target + seg->n_targets;
+    int last_bucket;
+    int b;
+    
+    for (last_bucket = RADIX_SELECT_BUCKETS - 1; last_bucket > 0; last_bucket--) {
+        if (seg->bucket_count[last_bucket] > 0) break;
+    }
+    
+    memset(&info, 0, sizeof(SelectedBucket));
+    for (b = 0; b <= last_bucket && t < end; b++) {
+        int first = t;
+        
+        if (seg->bucket_count[b] == 0) {
+            continue;
+        }
+        
+        if (b == last_bucket) {
+            /* Targets beyond the accumulated weight (rounding) go to the last bucket */
+            t = end;
+        } else {
+            while (t < end && targets[t].target <= cum + seg->bucket_weight[b]) {
+                t++;
+            }
+        }
+        
+        if (t > first) {
+            info.bucket = b;
+            info.first_target = first;
+            info.n_targets = t - first;
+            info.base_cum = cum;
+            info.has_pred = prev_valid;
+            info.pred_value = prev_max;
+            
+            /* Heavy duplicates end here instead of descending to the last digit */
+            if (seg->shift == 0 || seg->bucket_min[b] == seg->bucket_max[b]) {
+                resolve_equal_values(seg->bucket_max[b], seg->bucket_first[b],
+                                   seg->bucket_count[b], &info, targets, results);
+            } else {
+                multipass_push_segment(select, seg, b, &info);
+            }
+        }
+        
+        cum += seg->bucket_weight[b];
+        prev_valid = true;
+        prev_max = seg->bucket_max[b];
+    }
+}
+
+/* Resolve or split every segment filled by the pass that just ended */
+static void
+multipass_finish_pass(MultipassSelect *select, const QuantileTarget *targets, double *results) {
+    int s;
+    
+    for (s = 0; s < select->n_active; s++) {
+        ScanSegment *seg = &select->active[s];
+        
+        if (seg->gathered != NULL) {
+            if (seg->n_gathered != seg->count) {
+                elog(ERROR, "weighted quantile input changed between passes");
+            }
+            optimized_sort_value_weight_pairs(seg->gathered, seg->n_gathered);
+            resolve_sorted_targets(seg->gathered, seg->n_gathered, seg->base_cum,
+                                   seg->has_pred, seg->pred_value,
+                                   targets + seg->first_target, seg->n_targets, results);
+            pfree(seg->gathered);
+        } else {
+            multipass_walk_segment(select, seg, targets, results);
+            pfree(seg->bucket_weight);
+            pfree(seg->bucket_min);
+            pfree(seg->bucket_max);
+            pfree(seg->bucket_first);
+            pfree(seg->bucket_count);
+        }
+    }
+    select->n_active = 0;
+}
+
+/*
+ * Finish a multi-pass selection of empirical CDF quantiles
+ *
+ * The first pass must have been fed through multipass_select_consume; the
+ * later passes call scan, which must replay the same rows. Gives the same
+ * results as collecting the rows and calling empirical_quantiles_from_pairs
+ * (up to the summation order of the cumulative weights), including the
+ * implicit zero of sparse data, which is treated as one more row after the
+ * scanned ones.
+ */
+void
+multipass_select_finish(MultipassSelect *select, WeightedScanFn scan, void *scan_arg,
+                        const double *quantiles, int n_quantiles, double *results) {
+    ScanSegment *root = &select->active[0];
+    QuantileTarget *targets;
+    double zero_weight = 0.0;
+    double total_weight;
+    int n_targets = 0;
+    int b, i;
+    
+    /* Handle sparse data: add implicit zero if total weight < 1.0 */
+    select->first_pass = false;
+    total_weight = select->total_weight;
+    if (total_weight < 1.0) {
+        zero_weight = 1.0 - total_weight;
+        multipass_add_row(select, 0.0, zero_weight);
+        total_weight = 1.0;
+    }
+    
+    /* Largest element, for q >= 1; there is at least the implicit zero */
+    for (b = RADIX_SELECT_BUCKETS - 1; b > 0; b--) {
+        if (root->bucket_count[b] > 0) break;
+    }
+    
+    targets = (QuantileTarget *)palloc(n_quantiles * sizeof(QuantileTarget));
+    for (i = 0; i < n_quantiles; i++) {
+        if (quantiles[i] >= 1.0) {
+            results[i] = root->bucket_max[b];
+        } else {
+            /* q <= 0 gives target 0, resolved to the smallest element */
+            targets[n_targets].target = quantiles[i] > 0.0 ? quantiles[i] * total_weight : 0.0;
+            targets[n_targets].index = i;
+            n_targets++;
+        }
+    }
+    qsort(targets, n_targets, sizeof(QuantileTarget), compare_quantile_targets);
+    
+    root->first_target = 0;
+    root->n_targets = n_targets;
+    multipass_finish_pass(select, targets, results);
+    
+    /* Each pass narrows up to MULTIPASS_MAX_SEGMENTS queued ranges */
+    while (select->n_pending > 0) {
+        int n = Min(select->n_pending, MULTIPASS_MAX_SEGMENTS);
+        
+        select->n_pending -= n;
+        memcpy(select->active, select->pending + select->n_pending, n * sizeof(ScanSegment));
+        for (i = 0; i < n; i++) {
+            scan_segment_prepare(&select->active[i]);
+        }
+        select->n_active = n;
+        
+        scan(scan_arg, multipass_select_consume, select);
+        if (zero_weight > 0.0) {
+            multipass_add_row(select, 0.0, zero_weight);
+        }
+        
+        multipass_finish_pass(select, targets, results);
+    }
+    
+    pfree(targets);
+    if (select->pending != NULL) {
+        pfree(select->pending);
+    }
+    pfree(select->active);
+    pfree(select);
+}
+
+/*
+ * Copy a float8[] into a palloc'd buffer, NULL elements becoming 0
+ *
+ * Expanded arrays (as built incrementally by PL/pgSQL) are read from their
+ * deconstructed element values instead of being flattened on every call;
+ * flat arrays without NULLs are copied with a single memcpy.
+ */
+double *
+any_array_to_doubles(AnyArrayType *array, int *n_elements) {
+    double *result;
+    int n;
     int i;
     
-    /* Deconstruct the arrays */
-    deconstruct_array(vals_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                      &vals_datums, &vals_nulls, &vals_count);
+    n = ArrayGetNItems(AARR_NDIM(array), AARR_DIMS(array));
+    result = (double *)palloc(n * sizeof(double));
+    *n_elements = n;
+    
+    if (VARATT_IS_EXPANDED_HEADER(array) && array->xpn.dvalues != NULL) {
+        ExpandedArrayHeader *eah = &array->xpn;
+        
+        for (i = 0; i < n; i++) {
+            result[i] = (eah->dnulls && eah->dnulls[i]) ? 0.0 : DatumGetFloat8(eah->dvalues[i]);
+        }
+        return result;
+    }
     
-    deconstruct_array(weights_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                      &weights_datums, &weights_nulls, &weights_count);
+    {
+        /* Not deconstructed yet: an expanded array still holds its flat copy */
+        ArrayType *flat = VARATT_IS_EXPANDED_HEADER(array) ? array->xpn.fvalue : &array->flt;
+        
+        if (!ARR_HASNULL(flat)) {
+            memcpy(result, ARR_DATA_PTR(flat), n * sizeof(double));
+        } else {
+            bits8 *bitmap = ARR_NULLBITMAP(flat);
+            const char *data = ARR_DATA_PTR(flat);
+            
+            for (i = 0; i < n; i++) {
+                if (bitmap[i / 8] & (1 << (i % 8))) {
+                    memcpy(&result[i], data, sizeof(double));
+                    data += sizeof(double);
+                } else {
+                    result[i] = 0.0;
+                }
+            }
+        }
+    }
+    
+    return result;
+}
+
+/*
+ * Utility function to extract double arrays from PostgreSQL arrays
+ *
+ * Accepts flat or expanded arrays (PG_GETARG_ANY_ARRAY_P).
+ */
+int
+extract_double_arrays(AnyArrayType *vals_array, AnyArrayType *weights_array,
+                      double **vals, double **weights, int *n_elements) {
+    int vals_count, weights_count;
     
     /* Check array lengths match */
+    vals_count = ArrayGetNItems(AARR_NDIM(vals_array), AARR_DIMS(vals_array));
+    weights_count = ArrayGetNItems(AARR_NDIM(weights_array), AARR_DIMS(weights_array));
     if (vals_count != weights_count) {
         ereport(ERROR,
                 (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
@@ -213,19 +1063,105 @@ extract_double_arrays(ArrayType *vals_array, ArrayType *weights_array,
         return -1;
     }
     
-    *n_elements = vals_count;
+    *vals = any_array_to_doubles(vals_array, n_elements);
+    *weights = any_array_to_doubles(weights_array, n_elements);
     
-    /* Allocate memory for the arrays */
-    *vals = (double *)palloc(vals_count * sizeof(double));
-    *weights = (double *)palloc(weights_count * sizeof(double));
+    return 0;
+}
+
+/*
+ * Extract value-weight pairs from a weighted_pair[] array
+ *
+ * Returns a palloc'd buffer with room for one extra pair, so callers can
+ * append the implicit zero of sparse data without reallocating. Flat arrays
+ * without NULLs are copied with a single memcpy, and expanded arrays are read
+ * from their element values without flattening. NULL elements get weight 0
+ * and are therefore ignored by the statistics.
+ */
+ValueWeight *
+extract_value_weight_pairs(AnyArrayType *pairs_array, int *n_elements) {
+    ValueWeight *pairs;
+    ArrayType *flat;
+    int n;
+    int i;
     
-    /* Copy data, handling NULLs */
-    for (i = 0; i < vals_count; i++) {
-        *(*vals + i) = vals_nulls[i] ? 0.0 : DatumGetFloat8(vals_datums[i]);
-        *(*weights + i) = weights_nulls[i] ? 0.0 : DatumGetFloat8(weights_datums[i]);
+    n = ArrayGetNItems(AARR_NDIM(pairs_array), AARR_DIMS(pairs_array));
+    pairs = (ValueWeight *)palloc_huge((Size) (n + 1) * sizeof(ValueWeight));
+    *n_elements = n;
+    
+    if (VARATT_IS_EXPANDED_HEADER(pairs_array) && pairs_array->xpn.dvalues != NULL) {
+        ExpandedArrayHeader *eah = &pairs_array->xpn;
+        
+        for (i = 0; i < n; i++) {
+            if (eah->dnulls && eah->dnulls[i]) {
+                pairs[i].value = 0.0;
+                pairs[i].weight = 0.0;
+            } else {
+                pairs[i] = *DatumGetValueWeightP(eah->dvalues[i]);
+            }
+        }
+        return pairs;
     }
     
-    return 0;
+    flat = VARATT_IS_EXPANDED_HEADER(pairs_array) ? pairs_array->xpn.fvalue : &pairs_array->flt;
+    if (!ARR_HASNULL(flat)) {
+        /* weighted_pair is fixed-length and double aligned: data is contiguous */
+        memcpy(pairs, ARR_DATA_PTR(flat), n * sizeof(ValueWeight));
+    } else {
+        Datum *pair_datums;
+        bool *pair_nulls;
+        int pair_count;
+        
+        deconstruct_array(flat, ARR_ELEMTYPE(flat),
+                          sizeof(ValueWeight), false, 'd',
+                          &pair_datums, &pair_nulls, &pair_count);
+        
+        for (i = 0; i < pair_count; i++) {
+            if (pair_nulls[i]) {
+                pairs[i].value = 0.0;
+                pairs[i].weight = 0.0;
+            } else {
+                pairs[i] = *DatumGetValueWeightP(pair_datums[i]);
+            }
+        }
+        
+        pfree(pair_datums);
+        pfree(pair_nulls);
+    }
+    
+    return pairs;
+}
+
+/*
+ * Drop non-positive weights in place and add the implicit zero of sparse data
+ *
+ * The buffer must have room for n_elements + 1 pairs. Returns the number of
+ * pairs kept and stores the total weight (1.0 for sparse data).
+ */
+int
+compact_sparse_pairs(ValueWeight *pairs, int n_elements, double *total_weight) {
+    double sum_weights = 0.0;
+    int n_pairs = 0;
+    int i;
+    
+    for (i = 0; i < n_elements; i++) {
+        if (pairs[i].weight > 0.0) {
+            pairs[n_pairs] = pairs[i];
+            sum_weights += pairs[i].weight;
+            n_pairs++;
+        }
+    }
+    
+    /* Handle sparse data: add implicit zero if total weight < 1.0 */
+    if (sum_weights < 1.0) {
+        pairs[n_pairs].value = 0.0;
+        pairs[n_pairs].weight = 1.0 - sum_weights;
+        n_pairs++;
+        sum_weights = 1.0;
+    }
+    
+    *total_weight = sum_weights;
+    return n_pairs;
 }
 
 /* 
@@ -234,6 +1170,19 @@ extract_double_arrays(ArrayType *vals_array, ArrayType *weights_array,
  */
 double
 calculate_weighted_variance(double *vals, double *weights, int n_elements, int ddof) {
+    return calculate_weighted_variance_strided(vals, weights, 1, n_elements, ddof);
+}
+
+/*
+ * Weighted variance over strided input
+ *
+ * vals[i * stride] and weights[i * stride] form the i-th observation, so the
+ * same code serves separate arrays (stride 1) and interleaved ValueWeight
+ * pairs (stride 2).
+ */
+double
+calculate_weighted_variance_strided(const double *vals, const double *weights,
+                                    int stride, int n_elements, int ddof) {
     double sum_weighted = 0.0;
     double sum_weights = 0.0;
     double mean = 0.0;
@@ -245,7 +1194,7 @@ calculate_weighted_variance(double *vals, double *weights, int n_elements, int d
     double n_eff;
     
     /* Validate inputs */
-    if (!vals || !weights || n_elements < 0 || ddof < 0) {
+    if (!vals || !weights || stride < 1 || n_elements < 0 || ddof < 0) {
         return NAN;
     }
     
@@ -256,11 +1205,11 @@ calculate_weighted_variance(double *vals, double *weights, int n_elements, int d
     
     /* Check for negative weights and calculate total weight */
     for (i = 0; i < n_elements; i++) {
-        if (weights[i] < 0.0) {
+        if (weights[i * stride] < 0.0) {
             return NAN;
         }
-        if (weights[i] > 0.0) {
-            sum_weights += weights[i];
+        if (weights[i * stride] > 0.0) {
+            sum_weights += weights[i * stride];
         }
     }
     
@@ -276,8 +1225,8 @@ calculate_weighted_variance(double *vals, double *weights, int n_elements, int d
     
     /* Calculate weighted mean first */
     for (i = 0; i < n_elements; i++) {
-        if (weights[i] > 0.0) {
-            sum_weighted += vals[i] * weights[i];
+        if (weights[i * stride] > 0.0) {
+            sum_weighted += vals[i * stride] * weights[i * stride];
         }
     }
     mean = sum_weighted / sum_weights;
@@ -287,9 +1236,9 @@ calculate_weighted_variance(double *vals, double *weights, int n_elements, int d
     
     /* Sum of weighted squared deviations for explicit values */
     for (i = 0; i < n_elements; i++) {
-        if (weights[i] > 0.0) {
-            double deviation = vals[i] - mean;
-            sum_weighted_sq_dev += weights[i] * deviation * deviation;
+        if (weights[i * stride] > 0.0) {
+            double deviation = vals[i * stride] - mean;
+            sum_weighted_sq_dev += weights[i * stride] * deviation * deviation;
         }
     }
     
@@ -310,8 +1259,8 @@ calculate_weighted_variance(double *vals, double *weights, int n_elements, int d
         sum_weights_sq = 0.0;
         
         for (i = 0; i < n_elements; i++) {
-            if (weights[i] > 0.0) {
-                sum_weights_sq += weights[i] * weights[i];
+            if (weights[i * stride] > 0.0) {
+                sum_weights_sq += weights[i * stride] * weights[i * stride];
             }
         }
         
@@ -332,4 +1281,261 @@ calculate_weighted_variance(double *vals, double *weights, int n_elements, int d
     }
     
     return variance;
-}
\ No newline at end of file
+}
+
+/* Reset accumulated moments */
+void
+weighted_moments_init(WeightedMoments *moments) {
+    moments->sum_weights = 0.0;
+    moments->mean = 0.0;
+    moments->m2 = 0.0;
+    moments->sum_weights_sq = 0.0;
+}
+
+/*
+ * Accumulate a batch of observations
+ *
+ * Computes the batch moments with two branch-free passes (non-positive weights
+ * contribute nothing) and merges them in, which keeps the inner loops
+ * vectorizable and numerically stable.
+ */
+void
+weighted_moments_add_batch(WeightedMoments *moments, const double *vals,
+                           const double *weights, int n_elements) {
+    WeightedMoments batch;
+    double sum_weighted = 0.0;
+    int i;
+    
+    weighted_moments_init(&batch);
+    
+    for (i = 0; i < n_elements; i++) {
+        double w = weights[i] > 0.0 ? weights[i] : 0.0;
+        batch.sum_weights += w;
+        batch.sum_weights_sq += w * w;
+        sum_weighted += w * vals[i];
+    }
+    
+    if (batch.sum_weights <= 0.0) {
+        return;
+    }
+    
+    batch.mean = sum_weighted / batch.sum_weights;
+    
+    for (i = 0; i < n_elements; i++) {
+        double w = weights[i] > 0.0 ? weights[i] : 0.0;
+        double deviation = vals[i] - batch.mean;
+        batch.m2 += w * deviation * deviation;
+    }
+    
+    weighted_moments_merge(moments, &batch);
+}
+
+/* Merge src into dst (Chan et al. pairwise update) */
+void
+weighted_moments_merge(WeightedMoments *dst, const WeightedMoments *src) {
+    double total_weight, delta;
+    
+    if (src->sum_weights <= 0.0) {
+        return;
+    }
+    if (dst->sum_weights <= 0.0) {
+        *dst = *src;
+        return;
+    }
+    
+    total_weight = dst->sum_weights + src->sum_weights;
+    delta = src->mean - dst->mean;
+    
+    dst->mean += delta * src->sum_weights / total_weight;
+    dst->m2 += src->m2 + delta * delta * dst->sum_weights * src->sum_weights / total_weight;
+    dst->sum_weights = total_weight;
+    dst->sum_weights_sq += src->sum_weights_sq;
+}
+
+/*
+ * Raise the error of an invalid (value, weight) row (see weighted_check_input)
+ *
+ * The messages are the ones the array functions have always raised; the row
+ * aggregates, table functions and the rest reuse them unchanged.
+ */
+void
+weighted_input_error(bool negative_weight) {
+    if (negative_weight) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("weights must be non-negative")));
+    }
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("input arrays must not contain NaN or infinite values")));
+}
+
+/* Elements per task of the chunked reduction: 2 x 128 kB of input, L2-sized */
+#define MOMENTS_CHUNK_SIZE 16384
+
+/* First invalid input of a chunk, reported by the backend after the join */
+typedef enum {
+    MOMENTS_INPUT_VALID,
+    MOMENTS_INPUT_NEGATIVE_WEIGHT,
+    MOMENTS_INPUT_NOT_FINITE
+} MomentsInputError;
+
+/* Shared state of the chunked moments reduction tasks */
+typedef struct {
+    const double *vals;
+    const double *weights;
+    int stride;                         /* doubles between consecutive elements */
+    int n_elements;
+    bool second_moment;                 /* also accumulate m2 */
+    WeightedMoments *chunk_moments;     /* one per chunk */
+    MomentsInputError *chunk_errors;    /* one per chunk */
+} MomentsChunkWork;
+
+/* Task body: validate and reduce one chunk, no PostgreSQL calls */
+static void
+moments_chunk_task(void *arg, int chunk) {
+    MomentsChunkWork *work = (MomentsChunkWork *)arg;
+    WeightedMoments *moments = &work->chunk_moments[chunk];
+    int start = chunk * MOMENTS_CHUNK_SIZE;
+    int n = Min(MOMENTS_CHUNK_SIZE, work->n_elements - start);
+    int stride = work->stride;
+    const double *vals = work->vals + (Size) start * stride;
+    const double *weights = work->weights + (Size) start * stride;
+    double sum_weighted = 0.0;
+    int i;
+    
+    weighted_moments_init(moments);
+    work->chunk_errors[chunk] = MOMENTS_INPUT_VALID;
+    
+    for (i = 0; i < n; i++) {
+        double v = vals[i * stride], w = weights[i * stride];
+        
+        if (w < 0.0) {
+            work->chunk_errors[chunk] = MOMENTS_INPUT_NEGATIVE_WEIGHT;
+            return;
+        }
+        if (isnan(v) || isinf(v) || isnan(w) || isinf(w)) {
+            work->chunk_errors[chunk] = MOMENTS_INPUT_NOT_FINITE;
+            return;
+        }
+    }
+    
+    /* The two passes of weighted_moments_add_batch, the second one if needed */
+    for (i = 0; i < n; i++) {
+        double w = weights[i * stride];
+        
+        moments->sum_weights += w;
+        moments->sum_weights_sq += w * w;
+        sum_weighted += w * vals[i * stride];
+    }
+    if (moments->sum_weights <= 0.0) {
+        return;
+    }
+    moments->mean = sum_weighted / moments->sum_weights;
+    
+    if (work->second_moment) {
+        for (i = 0; i < n; i++) {
+            double deviation = vals[i * stride] - moments->mean;
+            
+            moments->m2 += weights[i * stride] * deviation * deviation;
+        }
+    }
+}
+
+/*
+ * Validate and reduce a giant input in chunks, on worker threads if allowed
+ *
+ * Returns false, without doing anything, when the input has fewer than
+ * MOMENTS_CHUNKED_MIN_ELEMENTS elements; the caller then uses its serial
+ * code. Otherwise the input (element i at vals[i * stride] and
+ * weights[i * stride]) is split into cache-sized chunks whose moments are
+ * merged pairwise in a fixed tree order. The chunks run on worker threads
+ * as weighted_statistics.max_worker_threads and parallel_min_elements allow,
+ * or all in the backend, so the result depends on neither setting. m2 is
+ * only accumulated when second_moment is set. Invalid input raises the same
+ * errors as the array functions, for the first offending element.
+ */
+bool
+weighted_moments_threaded(const double *vals, const double *weights, int stride,
+                          int n_elements, bool second_moment, WeightedMoments *moments) {
+    MomentsChunkWork work;
+    int n_chunks = (n_elements + MOMENTS_CHUNK_SIZE - 1) / MOMENTS_CHUNK_SIZE;
+    int c, step;
+    
+    if (n_elements < MOMENTS_CHUNKED_MIN_ELEMENTS) {
+        return false;
+    }
+    
+    work.vals = vals;
+    work.weights = weights;
+    work.stride = stride;
+    work.n_elements = n_elements;
+    work.second_moment = second_moment;
+    work.chunk_moments = (WeightedMoments *)palloc(n_chunks * sizeof(WeightedMoments));
+    work.chunk_errors = (MomentsInputError *)palloc(n_chunks * sizeof(MomentsInputError));
+    
+    weighted_parallel_run(moments_chunk_task, &work, n_chunks,
+                          weighted_parallel_threads(n_elements, n_chunks));
+    
+    for (c = 0; c < n_chunks; c++) {
+        if (work.chunk_errors[c] != MOMENTS_INPUT_VALID) {
+            weighted_input_error(work.chunk_errors[c] == MOMENTS_INPUT_NEGATIVE_WEIGHT);
+        }
+    }
+    
+    /* Pairwise tree: 0+1, 2+3, ...; then 0+2, 4+6, ...; and so on */
+    for (step = 1; step < n_chunks; step *= 2) {
+        for (c = 0; c + step < n_chunks; c += 2 * step) {
+            weighted_moments_merge(&work.chunk_moments[c], &work.chunk_moments[c + step]);
+        }
+    }
+    *moments = work.chunk_moments[0];
+    
+    pfree(work.chunk_moments);
+    pfree(work.chunk_errors);
+    return true;
+}
+
+/* Weighted mean including the implicit zero of sparse data */
+double
+weighted_moments_mean(const WeightedMoments *moments) {
+    if (moments->sum_weights < 1.0) {
+        /* Implicit zero with weight (1.0 - sum_weights), total weight 1.0 */
+        return moments->mean * moments->sum_weights;
+    }
+    return moments->mean;
+}
+
+/*
+ * Weighted variance including the implicit zero of sparse data
+ * Returns NaN when the effective sample size does not exceed ddof
+ */
+double
+weighted_moments_variance(const WeightedMoments *moments, int ddof) {
+    WeightedMoments total = *moments;
+    double n_eff;
+    
+    /* Merge in the implicit zero if needed */
+    if (total.sum_weights < 1.0) {
+        WeightedMoments zero;
+        
+        zero.sum_weights = 1.0 - total.sum_weights;
+        zero.mean = 0.0;
+        zero.m2 = 0.0;
+        zero.sum_weights_sq = zero.sum_weights * zero.sum_weights;
+        weighted_moments_merge(&total, &zero);
+    }
+    
+    if (ddof == 0) {
+        /* Population variance */
+        return total.m2 / total.sum_weights;
+    }
+    
+    /* Sample variance with Bessel's correction on the effective sample size */
+    n_eff = total.sum_weights * total.sum_weights / total.sum_weights_sq;
+    if (n_eff <= ddof) {
+        return NAN;
+    }
+    
+    return total.m2 / total.sum_weights * n_eff / (n_eff - ddof);
+}
@@ -10,19 +10,274 @@
 #include "postgres.h"
 #include "fmgr.h"
 #include "utils/array.h"
+#include <math.h>
 
-/* Data structure for value-weight pairs */
+/*
+ * Data structure for value-weight pairs
+ *
+ * This is also the on-disk layout of the SQL type weighted_pair, so a
+ * weighted_pair[] without NULLs can be read as a ValueWeight array in place.
+ */
 typedef struct {
     double value;
     double weight;
 } ValueWeight;
 
+/*
+ * Allocate a per-element buffer that may exceed MaxAllocSize (1GB), i.e.
+ * more than ~67M pairs; huge chunks are freed with pfree as usual
+ */
+#define palloc_huge(size) palloc_extended((size), MCXT_ALLOC_HUGE)
+
+/*
+ * Validation of one (value, weight) row, shared by every function so that
+ * the messages and their order stay the same: a negative weight is reported
+ * first, then a NaN or infinite value or weight (see utils.c)
+ */
+void weighted_input_error(bool negative_weight) pg_attribute_noreturn();
+
+static inline void
+weighted_check_input(double value, double weight) {
+    if (weight < 0.0 || isnan(value) || isinf(value) || isnan(weight) || isinf(weight)) {
+        weighted_input_error(weight < 0.0);
+    }
+}
+
+/*
+ * Parse a float8 field of a text input like the core float8 input does
+ * (NaN, Infinity, denormals, whitespace), raising errors that name type_name
+ * and the whole input orig. *endptr is left after the trailing whitespace.
+ * Needs utils/float.h.
+ */
+#if PG_VERSION_NUM >= 160000
+#define weighted_float8in(num, endptr, type_name, orig) \
+    float8in_internal((num), (endptr), (type_name), (orig), NULL)
+#else
+#define weighted_float8in(num, endptr, type_name, orig) \
+    float8in_internal((num), (endptr), (type_name), (orig))
+#endif
+
+/*
+ * Transform an IEEE 754 bit pattern into an unsigned key with the same order:
+ * - For negative numbers (sign bit set): flip all bits
+ * - For positive numbers (sign bit clear): flip only sign bit
+ *
+ * The radix sorts order pairs by this key; code merging their output
+ * compares the same keys.
+ */
+static inline uint64_t
+sortable_double_key(double value) {
+    union { double d; uint64_t u; } conv;
+    
+    conv.d = value;
+    if (conv.u & 0x8000000000000000ULL) {
+        return ~conv.u;
+    }
+    return conv.u ^ 0x8000000000000000ULL;
+}
+
+/*
+ * Arrays of up to SMALL_ARRAY_MAX_ELEMENTS elements take the allocation-free
+ * path: stack buffers, input read in place and a sorting network. One more
+ * pair holds the implicit zero of sparse data.
+ */
+#define SMALL_ARRAY_MAX_ELEMENTS 64
+#define SMALL_ARRAY_MAX_PAIRS (SMALL_ARRAY_MAX_ELEMENTS + 1)
+
+#define DatumGetValueWeightP(X)  ((ValueWeight *) DatumGetPointer(X))
+#define ValueWeightPGetDatum(X)  PointerGetDatum(X)
+#define PG_GETARG_VALUEWEIGHT_P(n) DatumGetValueWeightP(PG_GETARG_DATUM(n))
+#define PG_RETURN_VALUEWEIGHT_P(x) return ValueWeightPGetDatum(x)
+
+/*
+ * Mergeable weighted moments of the explicit (positive-weight) values
+ *
+ * Streaming and chunked code paths accumulate these and apply the sparse
+ * implicit zero only when finalizing, so results match the array functions.
+ */
+typedef struct {
+    double sum_weights;     /* sum of positive weights */
+    double mean;            /* weighted mean of the explicit values */
+    double m2;              /* sum of w * (v - mean)^2 */
+    double sum_weights_sq;  /* sum of w^2, for the effective sample size */
+} WeightedMoments;
+
+/*
+ * Inputs of at least this many elements have their moments reduced in
+ * chunks merged in a fixed tree order (see weighted_moments_threaded). A
+ * constant, so that results do not depend on the thread settings.
+ */
+#define MOMENTS_CHUNKED_MIN_ELEMENTS 1000000
+
+/* Rows buffered by the row aggregates before running the batch kernel */
+#define MOMENTS_AGG_BUFFER_SIZE 64
+
+/*
+ * Transition state of the weighted_mean/variance/std row aggregates
+ *
+ * The transition function only appends rows to the buffer, which is folded
+ * into the moments a batch at a time. Only the fields before n_buffered are
+ * serialized, after flushing. Shared with the custom scan, which emits
+ * serialized partial states for the Finalize Aggregate above it in parallel
+ * plans.
+ */
+typedef struct {
+    WeightedMoments moments;
+    int64 n_rows;           /* rows seen, including zero weights and buffered rows */
+    int32 ddof;             /* delta degrees of freedom (variance/std) */
+    int32 n_buffered;       /* rows in the buffer, not yet in moments */
+    double buffer_vals[MOMENTS_AGG_BUFFER_SIZE];
+    double buffer_weights[MOMENTS_AGG_BUFFER_SIZE];
+} MomentsAggState;
+
+/* Result computed by a weighted moments aggregate */
+typedef enum {
+    MOMENTS_AGG_MEAN,
+    MOMENTS_AGG_VARIANCE,
+    MOMENTS_AGG_STD,
+    MOMENTS_AGG_SKETCH          /* moments_sketch_agg, state in a MomentsSketch */
+} MomentsAggKind;
+
+/* Highest power kept in the sums of a moments_sketch */
+#define SKETCH_K 10
+
+/*
+ * Storage layout of the moments_sketch SQL type (see weighted_sketch.c)
+ *
+ * power_sums[0] is the total positive weight; log_sums[0] is the weight of
+ * the positive values, which equals it when the log moments cover all rows.
+ */
+typedef struct {
+    double min;
+    double max;
+    double power_sums[SKETCH_K + 1];
+    double log_sums[SKETCH_K + 1];
+} MomentsSketch;
+
+/* Consumer of converted (value, weight) chunks */
+typedef void (*WeightedChunkFn) (const double *vals, const double *weights,
+                                 int n_rows, void *arg);
+
+/* Feeds all input rows to consumer in chunks, in the same order on every call */
+typedef void (*WeightedScanFn) (void *scan_arg, WeightedChunkFn consumer, void *consumer_arg);
+
+/* State of a multi-pass radix select over a WeightedScanFn (see utils.c) */
+typedef struct MultipassSelect MultipassSelect;
+
+/*
+ * (value, weight) input of an array function, read in place where possible
+ *
+ * Built by weighted_source_from_arrays or weighted_source_from_pairs and
+ * consumed by the kernels of weighted_kernels.c. NULL elements read as 0.
+ */
+typedef struct {
+    int n_elements;
+    bool pairs;                 /* vals holds interleaved weighted_pair data */
+    const char *vals;           /* float8 or weighted_pair element data */
+    const bits8 *vals_nulls;    /* NULL bitmap of vals, or NULL */
+    const char *weights;        /* float8 element data (separate arrays only) */
+    const bits8 *weights_nulls; /* NULL bitmap of weights, or NULL */
+    AnyArrayType *vals_array;   /* source arrays (vals_array alone for pairs) */
+    AnyArrayType *weights_array;
+    void *to_free[2];           /* copies of deconstructed expanded arrays */
+    int n_to_free;
+} WeightedSource;
+
+/* A unit of work run by weighted_parallel_run, possibly on a worker thread */
+typedef void (*ParallelTaskFunc) (void *arg, int task);
+
 /* Function declarations */
-int extract_double_arrays(ArrayType *vals_array, ArrayType *weights_array,
+double *any_array_to_doubles(AnyArrayType *array, int *n_elements);
+
+int extract_double_arrays(AnyArrayType *vals_array, AnyArrayType *weights_array,
                          double **vals, double **weights, int *n_elements);
 
+ValueWeight *extract_value_weight_pairs(AnyArrayType *pairs_array, int *n_elements);
+
+int compact_sparse_pairs(ValueWeight *pairs, int n_elements, double *total_weight);
+
 void optimized_sort_value_weight_pairs(ValueWeight *pairs, int n);
 
+void radix_select_weighted_quantiles(ValueWeight *pairs, int n, double total_weight,
+                                     const double *quantiles, int n_quantiles,
+                                     double *results);
+
+MultipassSelect *multipass_select_begin(void);
+
+void multipass_select_consume(const double *vals, const double *weights, int n_rows, void *arg);
+
+void multipass_select_finish(MultipassSelect *select, WeightedScanFn scan, void *scan_arg,
+                             const double *quantiles, int n_quantiles, double *results);
+
 double calculate_weighted_variance(double *vals, double *weights, int n_elements, int ddof);
 
+double calculate_weighted_variance_strided(const double *vals, const double *weights,
+                                           int stride, int n_elements, int ddof);
+
+double *extract_quantile_levels(ArrayType *quantiles_array, int *n_quantiles);
+
+ArrayType *build_quantile_result(const double *results, int n_quantiles);
+
+ArrayType *empirical_quantiles_from_pairs(ValueWeight *vw_pairs, int n_elements,
+                                          const double *quantiles, int n_quantiles);
+
+ArrayType *build_var_es_result(const double *results, int n_levels);
+
+ArrayType *var_es_from_pairs(ValueWeight *vw_pairs, int n_elements,
+                             const double *levels, int n_levels);
+
+void weighted_moments_init(WeightedMoments *moments);
+
+void weighted_moments_add_batch(WeightedMoments *moments, const double *vals,
+                                const double *weights, int n_elements);
+
+void weighted_moments_merge(WeightedMoments *dst, const WeightedMoments *src);
+
+bool weighted_moments_threaded(const double *vals, const double *weights, int stride,
+                               int n_elements, bool second_moment, WeightedMoments *moments);
+
+double weighted_moments_mean(const WeightedMoments *moments);
+
+double weighted_moments_variance(const WeightedMoments *moments, int ddof);
+
+void moments_agg_check_batch(const double *vals, const double *weights, int n_elements);
+
+bytea *moments_agg_serialize(MomentsAggState *state);
+
+bool moments_agg_final_value(MomentsAggState *state, MomentsAggKind kind,
+                             double *result);
+
+void moments_sketch_init(MomentsSketch *sketch);
+
+void moments_sketch_add_batch(MomentsSketch *sketch, const double *vals, const double *weights,
+                              int n_elements);
+
+void weighted_source_from_arrays(WeightedSource *src, AnyArrayType *vals_array,
+                                 AnyArrayType *weights_array);
+
+void weighted_source_from_pairs(WeightedSource *src, AnyArrayType *pairs_array);
+
+void weighted_source_free(WeightedSource *src);
+
+int weighted_source_gather(const WeightedSource *src, bool checked, bool sparse,
+                           ValueWeight *out, double *total_weight);
+
+void weighted_source_sums(const WeightedSource *src, bool checked,
+                          double *sum_weighted, double *sum_weights);
+
+bool weighted_source_moments_threaded(const WeightedSource *src, bool second_moment,
+                                      WeightedMoments *moments);
+
+void weighted_customscan_register(void);
+
+void weighted_support_register(void);
+
+void weighted_parallel_register(void);
+
+int weighted_parallel_threads(int64 n_elements, int n_tasks);
+
+void weighted_parallel_run(ParallelTaskFunc func, void *arg, int n_tasks, int n_threads);
+
+void weighted_quantiles_register(void);
+
 #endif /* WEIGHTED_STATS_UTILS_H */
\ No newline at end of file
@@ -0,0 +1,305 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Row Aggregates
+ *
+ * Native aggregates over (value, weight) rows:
+ * - weighted_mean_agg(value, weight)
+ * - weighted_variance_agg(value, weight [, ddof])
+ * - weighted_std_agg(value, weight [, ddof])
+ *
+ * They give the same results as the array functions applied to
+ * array_agg(value), array_agg(weight) of the group, including the implicit
+ * zero of sparse data, but stream the rows through mergeable weighted moments
+ * instead of materializing arrays, and support parallel aggregation.
+ *
+ * The transition function stores each row in a small buffer inside the state;
+ * the validation and the moments arithmetic run over whole buffers in the
+ * vectorizable batch kernel, when the buffer fills up and before the state is
+ * combined, serialized or finalized.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/builtins.h"
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* Size of the serialized state: everything before the row buffer */
+#define MOMENTS_AGG_SERIALIZED_SIZE offsetof(MomentsAggState, n_buffered)
+
+/*
+ * Validate a batch of rows with the array functions' errors, so that the
+ * array_agg rewrite does not change which error a statement raises
+ */
+void
+moments_agg_check_batch(const double *vals, const double *weights, int n_elements)
+{
+    int i;
+    
+    for (i = 0; i < n_elements; i++) {
+        weighted_check_input(vals[i], weights[i]);
+    }
+}
+
+/* Fold a batch of rows into the moments of a state */
+static void
+moments_agg_add_rows(MomentsAggState *state, const double *vals, const double *weights,
+                     int n_elements)
+{
+    moments_agg_check_batch(vals, weights, n_elements);
+    weighted_moments_add_batch(&state->moments, vals, weights, n_elements);
+}
+
+/* Fold the buffered rows into the moments */
+static void
+moments_agg_flush(MomentsAggState *state)
+{
+    if (state->n_buffered > 0) {
+        moments_agg_add_rows(state, state->buffer_vals, state->buffer_weights,
+                             state->n_buffered);
+        state->n_buffered = 0;
+    }
+}
+
+/*
+ * Serialize a state for parallel aggregation
+ */
+bytea *
+moments_agg_serialize(MomentsAggState *state)
+{
+    bytea *result;
+    
+    moments_agg_flush(state);
+    
+    result = (bytea *)palloc(VARHDRSZ + MOMENTS_AGG_SERIALIZED_SIZE);
+    SET_VARSIZE(result, VARHDRSZ + MOMENTS_AGG_SERIALIZED_SIZE);
+    memcpy(VARDATA(result), state, MOMENTS_AGG_SERIALIZED_SIZE);
+    
+    return result;
+}
+
+/*
+ * Compute the final value of a state
+ *
+ * Returns false when the result is NULL: no rows, or a variance that is
+ * undefined for the requested ddof.
+ */
+bool
+moments_agg_final_value(MomentsAggState *state, MomentsAggKind kind, double *result)
+{
+    double variance;
+    
+    /* Empty groups behave like weighted_mean(NULL, NULL) */
+    if (state == NULL || state->n_rows == 0) {
+        return false;
+    }
+    
+    /* Does not change the result, so shared states stay valid */
+    moments_agg_flush(state);
+    
+    if (kind == MOMENTS_AGG_MEAN) {
+        *result = weighted_moments_mean(&state->moments);
+        return true;
+    }
+    
+    variance = weighted_moments_variance(&state->moments, state->ddof);
+    if (isnan(variance)) {
+        return false;
+    }
+    
+    *result = (kind == MOMENTS_AGG_STD) ? sqrt(variance) : variance;
+    return true;
+}
+
+/* Allocate an empty state in the aggregate memory context */
+static MomentsAggState *
+moments_agg_create(MemoryContext agg_context, int32 ddof)
+{
+    MomentsAggState *state;
+    
+    state = (MomentsAggState *)MemoryContextAlloc(agg_context, sizeof(MomentsAggState));
+    weighted_moments_init(&state->moments);
+    state->n_rows = 0;
+    state->ddof = ddof;
+    state->n_buffered = 0;
+    
+    return state;
+}
+
+/*
+ * weighted_moments_transfn - Add one (value, weight [, ddof]) row
+ *
+ * NULL values and weights are read as 0.0, like NULL array elements. The row
+ * is only buffered; it is validated when the buffer is flushed.
+ */
+PG_FUNCTION_INFO_V1(weighted_moments_transfn);
+
+Datum
+weighted_moments_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    MomentsAggState *state;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_moments_transfn called in non-aggregate context");
+    }
+    
+    if (PG_ARGISNULL(0)) {
+        int32 ddof = 0;
+        
+        /* Get optional ddof parameter (default 0) */
+        if (PG_NARGS() > 3 && !PG_ARGISNULL(3)) {
+            ddof = PG_GETARG_INT32(3);
+            if (ddof < 0) {
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("ddof must be non-negative")));
+            }
+        }
+        state = moments_agg_create(agg_context, ddof);
+    } else {
+        state = (MomentsAggState *)PG_GETARG_POINTER(0);
+    }
+    
+    if (state->n_buffered == MOMENTS_AGG_BUFFER_SIZE) {
+        moments_agg_flush(state);
+    }
+    
+    state->buffer_vals[state->n_buffered] = PG_ARGISNULL(1) ? 0.0 : PG_GETARG_FLOAT8(1);
+    state->buffer_weights[state->n_buffered] = PG_ARGISNULL(2) ? 0.0 : PG_GETARG_FLOAT8(2);
+    state->n_buffered++;
+    state->n_rows++;
+    
+    PG_RETURN_POINTER(state);
+}
+
+/*
+ * weighted_moments_combinefn - Merge two partial states (parallel aggregation)
+ */
+PG_FUNCTION_INFO_V1(weighted_moments_combinefn);
+
+Datum
+weighted_moments_combinefn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    MomentsAggState *state1;
+    MomentsAggState *state2;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_moments_combinefn called in non-aggregate context");
+    }
+    
+    state1 = PG_ARGISNULL(0) ? NULL : (MomentsAggState *)PG_GETARG_POINTER(0);
+    state2 = PG_ARGISNULL(1) ? NULL : (MomentsAggState *)PG_GETARG_POINTER(1);
+    
+    if (state2 == NULL) {
+        if (state1 == NULL) {
+            PG_RETURN_NULL();
+        }
+        PG_RETURN_POINTER(state1);
+    }
+    
+    if (state1 == NULL) {
+        state1 = moments_agg_create(agg_context, state2->ddof);
+    }
+    
+    /* state2 is read-only: fold its buffered rows in directly */
+    weighted_moments_merge(&state1->moments, &state2->moments);
+    if (state2->n_buffered > 0) {
+        moments_agg_add_rows(state1, state2->buffer_vals, state2->buffer_weights,
+                             state2->n_buffered);
+    }
+    state1->n_rows += state2->n_rows;
+    
+    PG_RETURN_POINTER(state1);
+}
+
+/*
+ * weighted_moments_serialfn - Serialize a state
+ */
+PG_FUNCTION_INFO_V1(weighted_moments_serialfn);
+
+Datum
+weighted_moments_serialfn(PG_FUNCTION_ARGS)
+{
+    MomentsAggState *state = (MomentsAggState *)PG_GETARG_POINTER(0);
+    
+    PG_RETURN_BYTEA_P(moments_agg_serialize(state));
+}
+
+/*
+ * weighted_moments_deserialfn - Rebuild a state from its serialized form
+ */
+PG_FUNCTION_INFO_V1(weighted_moments_deserialfn);
+
+Datum
+weighted_moments_deserialfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    bytea *serialized = PG_GETARG_BYTEA_PP(0);
+    MomentsAggState *state;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_moments_deserialfn called in non-aggregate context");
+    }
+    
+    if (VARSIZE_ANY_EXHDR(serialized) != MOMENTS_AGG_SERIALIZED_SIZE) {
+        elog(ERROR, "invalid weighted moments aggregate state size");
+    }
+    
+    state = (MomentsAggState *)MemoryContextAlloc(agg_context, sizeof(MomentsAggState));
+    memcpy(state, VARDATA_ANY(serialized), MOMENTS_AGG_SERIALIZED_SIZE);
+    state->n_buffered = 0;
+    
+    PG_RETURN_POINTER(state);
+}
+
+/* Shared body of the final functions */
+static Datum
+moments_agg_final(FunctionCallInfo fcinfo, MomentsAggKind kind)
+{
+    MomentsAggState *state;
+    double result;
+    
+    state = PG_ARGISNULL(0) ? NULL : (MomentsAggState *)PG_GETARG_POINTER(0);
+    
+    if (!moments_agg_final_value(state, kind, &result)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(result);
+}
+
+/*
+ * weighted_moments_mean_final - Final function of weighted_mean_agg(value, weight)
+ */
+PG_FUNCTION_INFO_V1(weighted_moments_mean_final);
+
+Datum
+weighted_moments_mean_final(PG_FUNCTION_ARGS)
+{
+    return moments_agg_final(fcinfo, MOMENTS_AGG_MEAN);
+}
+
+/*
+ * weighted_moments_variance_final - Final function of weighted_variance_agg(value, weight [, ddof])
+ */
+PG_FUNCTION_INFO_V1(weighted_moments_variance_final);
+
+Datum
+weighted_moments_variance_final(PG_FUNCTION_ARGS)
+{
+    return moments_agg_final(fcinfo, MOMENTS_AGG_VARIANCE);
+}
+
+/*
+ * weighted_moments_std_final - Final function of weighted_std_agg(value, weight [, ddof])
+ */
+PG_FUNCTION_INFO_V1(weighted_moments_std_final);
+
+Datum
+weighted_moments_std_final(PG_FUNCTION_ARGS)
+{
+    return moments_agg_final(fcinfo, MOMENTS_AGG_STD);
+}
@@ -0,0 +1,556 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Weighted ROC Analysis
+ *
+ * How well scores rank binary labels, with observation weights:
+ * - weighted_auc: area under the ROC curve, P(score+ > score-) + P(tie) / 2
+ * - weighted_roc: the ROC curve, reduced to a given number of points
+ * - weighted_auc_agg: row aggregate of weighted_auc over binned scores
+ *
+ * Each observation becomes one pair whose value is the score and whose
+ * weight carries the label in its sign (+w positive, -w negative), so one
+ * optimized_sort_value_weight_pairs orders everything and a sweep over the
+ * groups of tied scores accumulates the positive and negative weights. A tie
+ * between a positive and a negative counts one half, so the AUC times the two
+ * weight totals is the weighted Mann-Whitney U statistic. Weights are
+ * relative: no implicit zero is added.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/float.h"
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* Initial capacity of the aggregate's pair buffer */
+#define AUC_AGG_INITIAL_SIZE 1024
+
+/*
+ * Mantissa bits kept by the aggregate's score bins: scores agreeing in their
+ * sign, exponent and top 16 mantissa bits (relative width 2^-16) share a bin
+ */
+#define AUC_AGG_MANTISSA_BITS 16
+
+/*
+ * Read scores, labels and weights into labeled pairs
+ *
+ * Zero weights and NULL labels are skipped; NULL scores and weights read as
+ * 0. Returns a palloc'd buffer and stores the number of pairs.
+ */
+static ValueWeight *
+read_labeled_scores(AnyArrayType *scores_array, ArrayType *labels_array,
+                    AnyArrayType *weights_array, int *n_pairs)
+{
+    double *scores, *weights;
+    Datum *label_datums;
+    bool *label_nulls;
+    int n_scores, n_labels, n_weights;
+    ValueWeight *pairs;
+    int i, k = 0;
+    
+    n_scores = ArrayGetNItems(AARR_NDIM(scores_array), AARR_DIMS(scores_array));
+    n_labels = ArrayGetNItems(ARR_NDIM(labels_array), ARR_DIMS(labels_array));
+    n_weights = ArrayGetNItems(AARR_NDIM(weights_array), AARR_DIMS(weights_array));
+    if (n_scores != n_labels || n_scores != n_weights) {
+        ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("scores, labels and weights arrays must have the same length")));
+    }
+    
+    scores = any_array_to_doubles(scores_array, &n_scores);
+    weights = any_array_to_doubles(weights_array, &n_weights);
+    deconstruct_array(labels_array, BOOLOID, 1, true, 'c',
+                      &label_datums, &label_nulls, &n_labels);
+    
+    pairs = (ValueWeight *)palloc_huge((Size) Max(n_scores, 1) * sizeof(ValueWeight));
+    for (i = 0; i < n_scores; i++) {
+        weighted_check_input(scores[i], weights[i]);
+        if (label_nulls[i] || weights[i] == 0.0) {
+            continue;
+        }
+        pairs[k].value = scores[i];
+        pairs[k].weight = DatumGetBool(label_datums[i]) ? weights[i] : -weights[i];
+        k++;
+    }
+    
+    pfree(scores);
+    pfree(weights);
+    pfree(label_datums);
+    pfree(label_nulls);
+    *n_pairs = k;
+    return pairs;
+}
+
+/*
+ * Weighted Mann-Whitney U of labeled pairs sorted by score
+ *
+ * The positive weight of each group of tied scores wins against all the
+ * negative weight below the group and ties with the group's own. Stores the
+ * positive and negative weight totals.
+ */
+static double
+labeled_pairs_u(const ValueWeight *pairs, int n, double *pos_total, double *neg_total)
+{
+    double u = 0.0, pos = 0.0, neg = 0.0;
+    int start, end;
+    
+    for (start = 0; start < n; start = end) {
+        double group_pos = 0.0, group_neg = 0.0;
+        
+        for (end = start; end < n && pairs[end].value == pairs[start].value; end++) {
+            if (pairs[end].weight > 0.0) {
+                group_pos += pairs[end].weight;
+            } else {
+                group_neg -= pairs[end].weight;
+            }
+        }
+        u += group_pos * (neg + 0.5 * group_neg);
+        pos += group_pos;
+        neg += group_neg;
+    }
+    
+    *pos_total = pos;
+    *neg_total = neg;
+    return u;
+}
+
+/* AUC of labeled pairs sorted by score, NaN without both labels */
+static double
+labeled_pairs_auc(const ValueWeight *pairs, int n)
+{
+    double pos_total, neg_total;
+    double u = labeled_pairs_u(pairs, n, &pos_total, &neg_total);
+    
+    if (!(pos_total > 0.0) || !(neg_total > 0.0)) {
+        return NAN;
+    }
+    return u / pos_total / neg_total;
+}
+
+/* ROC curve points, by decreasing threshold */
+typedef struct {
+    int n_points;
+    double *thresholds;
+    double *fpr;
+    double *tpr;
+} RocCurve;
+
+/*
+ * ROC curve of labeled pairs sorted by score, with at most max_points points
+ *
+ * The full curve has a point per distinct score s (classify as positive when
+ * score >= s), after a first point (0, 0) at threshold +Infinity; tied scores
+ * move the curve diagonally in one step. Longer curves keep max_points
+ * evenly spaced points, always including both ends. Without both labels the
+ * curve is empty.
+ */
+static void
+build_roc_curve(const ValueWeight *pairs, int n, int max_points, RocCurve *curve)
+{
+    double pos_total = 0.0, neg_total = 0.0;
+    double tp = 0.0, fp = 0.0;
+    int n_full = 1;
+    int start, end, i;
+    
+    /* Totals summed in the order of the sweep below, so the last point is (1, 1) */
+    for (i = n - 1; i >= 0; i--) {
+        if (pairs[i].weight > 0.0) {
+            pos_total += pairs[i].weight;
+        } else {
+            neg_total -= pairs[i].weight;
+        }
+        if (i == n - 1 || pairs[i].value != pairs[i + 1].value) {
+            n_full++;
+        }
+    }
+    
+    curve->n_points = 0;
+    if (!(pos_total > 0.0) || !(neg_total > 0.0)) {
+        return;
+    }
+    
+    curve->thresholds = (double *)palloc_huge((Size) n_full * sizeof(double));
+    curve->fpr = (double *)palloc_huge((Size) n_full * sizeof(double));
+    curve->tpr = (double *)palloc_huge((Size) n_full * sizeof(double));
+    curve->thresholds[0] = get_float8_infinity();
+    curve->fpr[0] = 0.0;
+    curve->tpr[0] = 0.0;
+    curve->n_points = 1;
+    
+    for (end = n; end > 0; end = start) {
+        for (start = end - 1; start > 0 && pairs[start - 1].value == pairs[end - 1].value; start--)
+            ;
+        for (i = end - 1; i >= start; i--) {
+            if (pairs[i].weight > 0.0) {
+                tp += pairs[i].weight;
+            } else {
+                fp -= pairs[i].weight;
+            }
+        }
+        curve->thresholds[curve->n_points] = pairs[start].value;
+        curve->fpr[curve->n_points] = fp / neg_total;
+        curve->tpr[curve->n_points] = tp / pos_total;
+        curve->n_points++;
+    }
+    
+    /* Evenly spaced points along the full curve, in place */
+    if (curve->n_points > max_points) {
+        int n_full_points = curve->n_points;
+        
+        for (i = 0; i < max_points; i++) {
+            int src = (int) (((int64) i * (n_full_points - 1) + (max_points - 1) / 2) /
+                             (max_points - 1));
+            
+            curve->thresholds[i] = curve->thresholds[src];
+            curve->fpr[i] = curve->fpr[src];
+            curve->tpr[i] = curve->tpr[src];
+        }
+        curve->n_points = max_points;
+    }
+}
+
+/*
+ * weighted_auc_c - Weighted area under the ROC curve
+ *
+ * Exposed as: weighted_auc(scores[], labels[], weights[])
+ */
+PG_FUNCTION_INFO_V1(weighted_auc_c);
+
+Datum
+weighted_auc_c(PG_FUNCTION_ARGS)
+{
+    ValueWeight *pairs;
+    int n_pairs;
+    double auc;
+    
+    pairs = read_labeled_scores(PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ARRAYTYPE_P(1),
+                                PG_GETARG_ANY_ARRAY_P(2), &n_pairs);
+    optimized_sort_value_weight_pairs(pairs, n_pairs);
+    auc = labeled_pairs_auc(pairs, n_pairs);
+    pfree(pairs);
+    
+    /* Undefined without both labels */
+    if (isnan(auc)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(auc);
+}
+
+/*
+ * weighted_roc_c - Weighted ROC curve
+ *
+ * Returns (threshold, fpr, tpr) rows by decreasing threshold.
+ *
+ * Exposed as: weighted_roc(scores[], labels[], weights[], points DEFAULT 101)
+ */
+PG_FUNCTION_INFO_V1(weighted_roc_c);
+
+Datum
+weighted_roc_c(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    RocCurve *curve;
+    
+    if (SRF_IS_FIRSTCALL()) {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        ValueWeight *pairs;
+        int n_pairs;
+        int max_points = PG_GETARG_INT32(3);
+        
+        if (max_points < 2) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("points must be at least 2")));
+        }
+        
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            elog(ERROR, "weighted_roc must return a composite type");
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        
+        pairs = read_labeled_scores(PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ARRAYTYPE_P(1),
+                                    PG_GETARG_ANY_ARRAY_P(2), &n_pairs);
+        optimized_sort_value_weight_pairs(pairs, n_pairs);
+        curve = (RocCurve *)palloc(sizeof(RocCurve));
+        build_roc_curve(pairs, n_pairs, max_points, curve);
+        pfree(pairs);
+        
+        funcctx->user_fctx = curve;
+        funcctx->max_calls = curve->n_points;
+        MemoryContextSwitchTo(oldcontext);
+    }
+    
+    funcctx = SRF_PERCALL_SETUP();
+    curve = (RocCurve *) funcctx->user_fctx;
+    
+    if (funcctx->call_cntr < funcctx->max_calls) {
+        int i = (int) funcctx->call_cntr;
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+        HeapTuple tuple;
+        
+        values[0] = Float8GetDatum(curve->thresholds[i]);
+        values[1] = Float8GetDatum(curve->fpr[i]);
+        values[2] = Float8GetDatum(curve->tpr[i]);
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Transition state of weighted_auc_agg
+ *
+ * Labeled pairs of binned scores. When the buffer fills up it is sorted and
+ * compacted to at most one positive and one negative pair per bin; bins are
+ * fixed by the score's bits, so states merge exactly whatever rows each one
+ * saw, and the state stays bounded by the number of occupied bins.
+ */
+typedef struct {
+    MemoryContext context;  /* aggregate context holding the state */
+    ValueWeight *pairs;
+    int n_pairs;
+    int capacity;
+} AucAggState;
+
+/* Bin of a score: its low mantissa bits cleared, which keeps the order */
+static inline double
+auc_agg_bin(double score)
+{
+    union { double d; uint64_t u; } conv;
+    
+    conv.d = score;
+    conv.u &= ~((UINT64CONST(1) << (52 - AUC_AGG_MANTISSA_BITS)) - 1);
+    return conv.d;
+}
+
+/* Allocate an empty state with room for capacity pairs */
+static AucAggState *
+auc_agg_create(MemoryContext agg_context, int capacity)
+{
+    AucAggState *state;
+    
+    state = (AucAggState *)MemoryContextAlloc(agg_context, sizeof(AucAggState));
+    state->context = agg_context;
+    state->capacity = Max(capacity, AUC_AGG_INITIAL_SIZE);
+    state->pairs = (ValueWeight *)MemoryContextAllocHuge(agg_context,
+                                                         (Size) state->capacity * sizeof(ValueWeight));
+    state->n_pairs = 0;
+    return state;
+}
+
+/*
+ * Sort the pairs and merge each bin into one positive and one negative pair
+ *
+ * Does not change the result. When compaction frees less than half of the
+ * buffer, its capacity doubles, so the compactions stay amortized.
+ */
+static void
+auc_agg_compact(AucAggState *state)
+{
+    ValueWeight *pairs = state->pairs;
+    int n = 0;
+    int start, end;
+    
+    optimized_sort_value_weight_pairs(pairs, state->n_pairs);
+    for (start = 0; start < state->n_pairs; start = end) {
+        double value = pairs[start].value;
+        double pos = 0.0, neg = 0.0;
+        
+        for (end = start; end < state->n_pairs && pairs[end].value == value; end++) {
+            if (pairs[end].weight > 0.0) {
+                pos += pairs[end].weight;
+            } else {
+                neg -= pairs[end].weight;
+            }
+        }
+        if (pos > 0.0) {
+            pairs[n].value = value;
+            pairs[n++].weight = pos;
+        }
+        if (neg > 0.0) {
+            pairs[n].value = value;
+            pairs[n++].weight = -neg;
+        }
+    }
+    state->n_pairs = n;
+    
+    if (n > state->capacity / 2) {
+        state->capacity *= 2;
+        state->pairs = (ValueWeight *)repalloc_huge(state->pairs,
+                                                    (Size) state->capacity * sizeof(ValueWeight));
+    }
+}
+
+/* Append a labeled pair, compacting a full buffer first */
+static inline void
+auc_agg_add(AucAggState *state, double value, double signed_weight)
+{
+    if (state->n_pairs == state->capacity) {
+        auc_agg_compact(state);
+    }
+    state->pairs[state->n_pairs].value = value;
+    state->pairs[state->n_pairs].weight = signed_weight;
+    state->n_pairs++;
+}
+
+/*
+ * weighted_auc_transfn - Add one (score, label, weight) row
+ *
+ * Rows with a NULL label or zero weight are skipped; NULL scores and weights
+ * read as 0.0, like NULL array elements.
+ */
+PG_FUNCTION_INFO_V1(weighted_auc_transfn);
+
+Datum
+weighted_auc_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    AucAggState *state;
+    double score, weight;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_auc_transfn called in non-aggregate context");
+    }
+    
+    state = PG_ARGISNULL(0) ? auc_agg_create(agg_context, AUC_AGG_INITIAL_SIZE)
+                            : (AucAggState *)PG_GETARG_POINTER(0);
+    
+    score = PG_ARGISNULL(1) ? 0.0 : PG_GETARG_FLOAT8(1);
+    weight = PG_ARGISNULL(3) ? 0.0 : PG_GETARG_FLOAT8(3);
+    weighted_check_input(score, weight);
+    if (!PG_ARGISNULL(2) && weight > 0.0) {
+        auc_agg_add(state, auc_agg_bin(score), PG_GETARG_BOOL(2) ? weight : -weight);
+    }
+    
+    PG_RETURN_POINTER(state);
+}
+
+/*
+ * weighted_auc_combinefn - Merge two partial states (parallel aggregation)
+ */
+PG_FUNCTION_INFO_V1(weighted_auc_combinefn);
+
+Datum
+weighted_auc_combinefn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    AucAggState *state1;
+    AucAggState *state2;
+    int i;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_auc_combinefn called in non-aggregate context");
+    }
+    
+    state1 = PG_ARGISNULL(0) ? NULL : (AucAggState *)PG_GETARG_POINTER(0);
+    state2 = PG_ARGISNULL(1) ? NULL : (AucAggState *)PG_GETARG_POINTER(1);
+    
+    if (state2 == NULL) {
+        if (state1 == NULL) {
+            PG_RETURN_NULL();
+        }
+        PG_RETURN_POINTER(state1);
+    }
+    
+    if (state1 == NULL) {
+        state1 = auc_agg_create(agg_context, state2->n_pairs);
+    }
+    
+    /* state2 is read-only: its pairs are appended to state1 */
+    for (i = 0; i < state2->n_pairs; i++) {
+        auc_agg_add(state1, state2->pairs[i].value, state2->pairs[i].weight);
+    }
+    
+    PG_RETURN_POINTER(state1);
+}
+
+/*
+ * weighted_auc_serialfn - Serialize a state as its compacted pairs
+ */
+PG_FUNCTION_INFO_V1(weighted_auc_serialfn);
+
+Datum
+weighted_auc_serialfn(PG_FUNCTION_ARGS)
+{
+    AucAggState *state = (AucAggState *)PG_GETARG_POINTER(0);
+    Size size;
+    bytea *result;
+    
+    auc_agg_compact(state);
+    
+    size = (Size) state->n_pairs * sizeof(ValueWeight);
+    result = (bytea *)palloc(VARHDRSZ + size);
+    SET_VARSIZE(result, VARHDRSZ + size);
+    memcpy(VARDATA(result), state->pairs, size);
+    
+    PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * weighted_auc_deserialfn - Rebuild a state from its serialized form
+ */
+PG_FUNCTION_INFO_V1(weighted_auc_deserialfn);
+
+Datum
+weighted_auc_deserialfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    bytea *serialized = PG_GETARG_BYTEA_PP(0);
+    AucAggState *state;
+    Size size;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_auc_deserialfn called in non-aggregate context");
+    }
+    
+    size = VARSIZE_ANY_EXHDR(serialized);
+    if (size % sizeof(ValueWeight) != 0) {
+        elog(ERROR, "invalid weighted AUC aggregate state size");
+    }
+    
+    state = auc_agg_create(agg_context, (int) (size / sizeof(ValueWeight)));
+    memcpy(state->pairs, VARDATA_ANY(serialized), size);
+    state->n_pairs = (int) (size / sizeof(ValueWeight));
+    
+    PG_RETURN_POINTER(state);
+}
+
+/*
+ * weighted_auc_final - Final function of weighted_auc_agg(score, label, weight)
+ */
+PG_FUNCTION_INFO_V1(weighted_auc_final);
+
+Datum
+weighted_auc_final(PG_FUNCTION_ARGS)
+{
+    AucAggState *state;
+    double auc;
+    
+    state = PG_ARGISNULL(0) ? NULL : (AucAggState *)PG_GETARG_POINTER(0);
+    if (state == NULL) {
+        PG_RETURN_NULL();
+    }
+    
+    /* Does not change the result, so shared states stay valid */
+    auc_agg_compact(state);
+    auc = labeled_pairs_auc(state->pairs, state->n_pairs);
+    
+    /* Undefined without both labels */
+    if (isnan(auc)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(auc);
+}
@@ -0,0 +1,441 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Weighted Rank Correlation
+ *
+ * Rank correlation of paired observations (x, y) with observation weights:
+ * - weighted_kendall_tau: Kendall's tau-b with pair weights w_i * w_j
+ * - weighted_spearman: weighted Pearson correlation of weighted mid-ranks
+ *
+ * Weights are relative: no implicit zero is added for sparse data, and
+ * observations with zero weight are ignored.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/array.h"
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* Observations with positive weight, in input order */
+typedef struct {
+    int n;
+    double *x;
+    double *y;
+    double *w;
+} WeightedSample;
+
+/*
+ * Read x, y and weight arrays of the same length into a sample
+ *
+ * Raises the errors of the mean/variance functions for negative weights and
+ * NaN/infinite input, and drops zero weights. NULL elements read as 0.
+ */
+static void
+read_weighted_sample(AnyArrayType *x_array, AnyArrayType *y_array,
+                     AnyArrayType *weights_array, WeightedSample *sample)
+{
+    int x_count, y_count, weights_count;
+    int n, i;
+    
+    x_count = ArrayGetNItems(AARR_NDIM(x_array), AARR_DIMS(x_array));
+    y_count = ArrayGetNItems(AARR_NDIM(y_array), AARR_DIMS(y_array));
+    weights_count = ArrayGetNItems(AARR_NDIM(weights_array), AARR_DIMS(weights_array));
+    if (x_count != y_count || x_count != weights_count) {
+        ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("x, y and weights arrays must have the same length")));
+    }
+    
+    sample->x = any_array_to_doubles(x_array, &n);
+    sample->y = any_array_to_doubles(y_array, &n);
+    sample->w = any_array_to_doubles(weights_array, &n);
+    
+    /* Validate and compact the positive weights in place */
+    sample->n = 0;
+    for (i = 0; i < n; i++) {
+        double x = sample->x[i], y = sample->y[i], w = sample->w[i];
+        
+        weighted_check_input(x, w);
+        weighted_check_input(y, w);
+        if (w > 0.0) {
+            sample->x[sample->n] = x;
+            sample->y[sample->n] = y;
+            sample->w[sample->n] = w;
+            sample->n++;
+        }
+    }
+}
+
+static void
+free_weighted_sample(WeightedSample *sample)
+{
+    pfree(sample->x);
+    pfree(sample->y);
+    pfree(sample->w);
+}
+
+/*
+ * Sort the observation indices by keys, with the pair sorts of utils.c
+ *
+ * Returns pairs of (key, index): each pair carries its observation index in
+ * the weight slot, which is exact for any array length. Equal keys come out
+ * in no particular order.
+ */
+static ValueWeight *
+sort_with_indices(const double *keys, int n)
+{
+    ValueWeight *pairs;
+    int k;
+    
+    pairs = (ValueWeight *)palloc_huge((Size) Max(n, 1) * sizeof(ValueWeight));
+    for (k = 0; k < n; k++) {
+        pairs[k].value = keys[k];
+        pairs[k].weight = (double) k;
+    }
+    optimized_sort_value_weight_pairs(pairs, n);
+    return pairs;
+}
+
+/*
+ * Order of the observations by x, ties in x ordered by y
+ *
+ * Every run of equal x in the sort on x is refilled with the y values of its
+ * observations and sorted again. Observations tied in both x and y come out
+ * in no particular order.
+ */
+static int *
+order_by_x_then_y(const WeightedSample *sample)
+{
+    ValueWeight *pairs;
+    int *order;
+    int n = sample->n;
+    int start, end, k;
+    
+    pairs = sort_with_indices(sample->x, n);
+    for (start = 0; start < n; start = end) {
+        end = start + 1;
+        while (end < n && pairs[end].value == pairs[start].value) {
+            end++;
+        }
+        if (end - start > 1) {
+            for (k = start; k < end; k++) {
+                pairs[k].value = sample->y[(int) pairs[k].weight];
+            }
+            optimized_sort_value_weight_pairs(pairs + start, end - start);
+        }
+    }
+    
+    order = (int *)palloc(Max(n, 1) * sizeof(int));
+    for (k = 0; k < n; k++) {
+        order[k] = (int) pairs[k].weight;
+    }
+    pfree(pairs);
+    return order;
+}
+
+/*
+ * Weighted mid-ranks of keys, indexed like the observations
+ *
+ * The rank of an observation is the weight of the observations with smaller
+ * keys plus half the weight of its tie group, itself included. With unit
+ * weights this is the usual mid-rank minus 1/2, a shift the correlation does
+ * not see.
+ */
+static double *
+weighted_mid_ranks(const double *keys, const double *weights, int n)
+{
+    ValueWeight *pairs;
+    double *ranks;
+    double below = 0.0;
+    int start, end, k;
+    
+    pairs = sort_with_indices(keys, n);
+    ranks = (double *)palloc(Max(n, 1) * sizeof(double));
+    for (start = 0; start < n; start = end) {
+        double tie_weight = 0.0;
+        double rank;
+        
+        for (end = start; end < n && pairs[end].value == pairs[start].value; end++) {
+            tie_weight += weights[(int) pairs[end].weight];
+        }
+        rank = below + 0.5 * tie_weight;
+        for (k = start; k < end; k++) {
+            ranks[(int) pairs[k].weight] = rank;
+        }
+        below += tie_weight;
+    }
+    
+    pfree(pairs);
+    return ranks;
+}
+
+/*
+ * Total weight w_i * w_j over the pairs i < j within a group of observations,
+ * given the group's sum of weights and sum of squared weights
+ */
+static inline double
+group_pair_weight(double sum_w, double sum_w_sq)
+{
+    return 0.5 * (sum_w * sum_w - sum_w_sq);
+}
+
+/*
+ * Bottom-up merge sort of keys (carrying weights) that returns the weighted
+ * number of inversions
+ *
+ * Every pair i < j with keys[i] > keys[j] adds w_i * w_j. When the merge
+ * takes an element from the left run, all elements already taken from the
+ * right run had smaller keys: it adds its weight times their weight, which
+ * only ever grows by addition. Equal keys are not inversions.
+ */
+static double
+merge_sort_weighted_inversions(double *keys, double *weights, int n)
+{
+    double *src_k = keys, *src_w = weights;
+    double *dst_k, *dst_w;
+    double inversions = 0.0;
+    int width;
+    
+    dst_k = (double *)palloc(Max(n, 1) * sizeof(double));
+    dst_w = (double *)palloc(Max(n, 1) * sizeof(double));
+    
+    for (width = 1; width < n; width *= 2) {
+        int lo;
+        
+        for (lo = 0; lo < n; lo += 2 * width) {
+            int mid = Min(lo + width, n);
+            int hi = Min(lo + 2 * width, n);
+            int i = lo, j = mid, k = lo;
+            double right_taken = 0.0;
+            
+            while (i < mid && j < hi) {
+                if (src_k[j] < src_k[i]) {
+                    right_taken += src_w[j];
+                    dst_k[k] = src_k[j];
+                    dst_w[k++] = src_w[j++];
+                } else {
+                    inversions += src_w[i] * right_taken;
+                    dst_k[k] = src_k[i];
+                    dst_w[k++] = src_w[i++];
+                }
+            }
+            while (i < mid) {
+                inversions += src_w[i] * right_taken;
+                dst_k[k] = src_k[i];
+                dst_w[k++] = src_w[i++];
+            }
+            while (j < hi) {
+                dst_k[k] = src_k[j];
+                dst_w[k++] = src_w[j++];
+            }
+        }
+        
+        /* The merged runs become the input of the next, wider pass */
+        {
+            double *swap_k = src_k, *swap_w = src_w;
+            
+            src_k = dst_k;
+            src_w = dst_w;
+            dst_k = swap_k;
+            dst_w = swap_w;
+        }
+    }
+    
+    /* Leave the sorted keys in the caller's buffers */
+    if (src_k != keys) {
+        memcpy(keys, src_k, n * sizeof(double));
+        memcpy(weights, src_w, n * sizeof(double));
+        pfree(src_k);
+        pfree(src_w);
+    } else {
+        pfree(dst_k);
+        pfree(dst_w);
+    }
+    return inversions;
+}
+
+/*
+ * Weighted Kendall tau-b of a sample (Knight's algorithm)
+ *
+ * With pair weights w_i * w_j, sort the observations by x (ties by y) and
+ * count the weighted discordant pairs D as the inversions of a merge sort on
+ * y. Pairs tied in x (Tx), in y (Ty) and in both (Txy) come from the runs of
+ * the two sorted orders, and with T0 the total pair weight
+ *
+ *     tau_b = (T0 - Tx - Ty + Txy - 2 D) / sqrt((T0 - Tx) (T0 - Ty))
+ *
+ * O(n log n) overall. Returns NaN when x or y is constant.
+ */
+static double
+weighted_kendall_tau_sample(const WeightedSample *sample)
+{
+    int n = sample->n;
+    int *order;
+    double *ys, *ws;
+    double sum_w = 0.0, sum_w_sq = 0.0;
+    double t0, tx = 0.0, ty = 0.0, txy = 0.0, discordant;
+    double denominator;
+    int start, end, k;
+    
+    if (n < 2) {
+        return NAN;
+    }
+    
+    order = order_by_x_then_y(sample);
+    ys = (double *)palloc(n * sizeof(double));
+    ws = (double *)palloc(n * sizeof(double));
+    for (k = 0; k < n; k++) {
+        ys[k] = sample->y[order[k]];
+        ws[k] = sample->w[order[k]];
+        sum_w += ws[k];
+        sum_w_sq += ws[k] * ws[k];
+    }
+    t0 = group_pair_weight(sum_w, sum_w_sq);
+    
+    /* Runs of equal x, and within them runs of equal y */
+    for (start = 0; start < n; start = end) {
+        double x = sample->x[order[start]];
+        double run_w = 0.0, run_w_sq = 0.0;
+        
+        for (end = start; end < n && sample->x[order[end]] == x; end++) {
+            run_w += ws[end];
+            run_w_sq += ws[end] * ws[end];
+        }
+        tx += group_pair_weight(run_w, run_w_sq);
+        
+        for (k = start; k < end; ) {
+            double joint_w = 0.0, joint_w_sq = 0.0;
+            int j;
+            
+            for (j = k; j < end && ys[j] == ys[k]; j++) {
+                joint_w += ws[j];
+                joint_w_sq += ws[j] * ws[j];
+            }
+            txy += group_pair_weight(joint_w, joint_w_sq);
+            k = j;
+        }
+    }
+    
+    discordant = merge_sort_weighted_inversions(ys, ws, n);
+    
+    /* ys is now sorted: runs of equal y */
+    for (start = 0; start < n; start = end) {
+        double run_w = 0.0, run_w_sq = 0.0;
+        
+        for (end = start; end < n && ys[end] == ys[start]; end++) {
+            run_w += ws[end];
+            run_w_sq += ws[end] * ws[end];
+        }
+        ty += group_pair_weight(run_w, run_w_sq);
+    }
+    
+    pfree(order);
+    pfree(ys);
+    pfree(ws);
+    
+    denominator = sqrt((t0 - tx) * (t0 - ty));
+    if (!(denominator > 0.0)) {
+        return NAN;
+    }
+    return Max(-1.0, Min(1.0, (t0 - tx - ty + txy - 2.0 * discordant) / denominator));
+}
+
+/*
+ * Weighted Spearman correlation of a sample
+ *
+ * The weighted Pearson correlation of the weighted mid-ranks of x and y,
+ * accumulated in one pass with West's weighted update of the means and
+ * co-moments. Returns NaN when x or y is constant.
+ */
+static double
+weighted_spearman_sample(const WeightedSample *sample)
+{
+    int n = sample->n;
+    double *rank_x, *rank_y;
+    double sum_w = 0.0, mean_x = 0.0, mean_y = 0.0;
+    double m2_x = 0.0, m2_y = 0.0, co_moment = 0.0;
+    double denominator;
+    int i;
+    
+    if (n < 2) {
+        return NAN;
+    }
+    
+    rank_x = weighted_mid_ranks(sample->x, sample->w, n);
+    rank_y = weighted_mid_ranks(sample->y, sample->w, n);
+    
+    for (i = 0; i < n; i++) {
+        double w = sample->w[i];
+        double dx = rank_x[i] - mean_x;
+        double dy = rank_y[i] - mean_y;
+        
+        sum_w += w;
+        mean_x += dx * w / sum_w;
+        mean_y += dy * w / sum_w;
+        m2_x += w * dx * (rank_x[i] - mean_x);
+        m2_y += w * dy * (rank_y[i] - mean_y);
+        co_moment += w * dx * (rank_y[i] - mean_y);
+    }
+    
+    pfree(rank_x);
+    pfree(rank_y);
+    
+    denominator = sqrt(m2_x * m2_y);
+    if (!(denominator > 0.0)) {
+        return NAN;
+    }
+    return Max(-1.0, Min(1.0, co_moment / denominator));
+}
+
+/*
+ * weighted_kendall_tau_c - Weighted Kendall rank correlation (tau-b)
+ *
+ * Exposed as: weighted_kendall_tau(x[], y[], weights[])
+ */
+PG_FUNCTION_INFO_V1(weighted_kendall_tau_c);
+
+Datum
+weighted_kendall_tau_c(PG_FUNCTION_ARGS)
+{
+    WeightedSample sample;
+    double tau;
+    
+    read_weighted_sample(PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1),
+                         PG_GETARG_ANY_ARRAY_P(2), &sample);
+    tau = weighted_kendall_tau_sample(&sample);
+    free_weighted_sample(&sample);
+    
+    /* Undefined for constant x or y */
+    if (isnan(tau)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(tau);
+}
+
+/*
+ * weighted_spearman_c - Weighted Spearman rank correlation
+ *
+ * Exposed as: weighted_spearman(x[], y[], weights[])
+ */
+PG_FUNCTION_INFO_V1(weighted_spearman_c);
+
+Datum
+weighted_spearman_c(PG_FUNCTION_ARGS)
+{
+    WeightedSample sample;
+    double rho;
+    
+    read_weighted_sample(PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1),
+                         PG_GETARG_ANY_ARRAY_P(2), &sample);
+    rho = weighted_spearman_sample(&sample);
+    free_weighted_sample(&sample);
+    
+    /* Undefined for constant x or y */
+    if (isnan(rho)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(rho);
+}
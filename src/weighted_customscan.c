@@ -0,0 +1,908 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Vectorized Aggregate Scan
+ *
+ * Optional CustomScan provider for queries of the form
+ *
+ *     SELECT weighted_mean_agg(v, w), weighted_std_agg(v, w, 1), ...
+ *     FROM tbl WHERE ...
+ *
+ * where the aggregates are weighted_mean_agg, weighted_variance_agg,
+ * weighted_std_agg and moments_sketch_agg. Instead of a scan feeding an Agg
+ * node one fmgr transition call per row, the scan itself deforms tuples into
+ * column batches and runs the batch moments and sketch kernels over them.
+ * Used for the final aggregate, or as the partial aggregate below Gather /
+ * Finalize Aggregate in parallel plans, in which case it emits the serialized
+ * transition states.
+ *
+ * Enabled with weighted_statistics.enable_custom_scan (default off).
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/htup_details.h"
+#include "access/relscan.h"
+#include "access/tableam.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/extensible.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#include "optimizer/cost.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/planmain.h"
+#include "optimizer/planner.h"
+#include "optimizer/restrictinfo.h"
+#include "optimizer/tlist.h"
+#include "parser/parsetree.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/ruleutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+#include "utils.h"
+
+/* Rows deformed per batch */
+#define CUSTOM_SCAN_BATCH_SIZE 1024
+
+/* Fraction of the Agg per-row transition cost charged by the batched scan */
+#define CUSTOM_SCAN_AGG_COST_FACTOR 0.1
+
+/* Position of the items in the CustomScan custom_private list */
+#define PRIVATE_QUALS       0
+#define PRIVATE_COLUMNS     1
+#define PRIVATE_AGGREGATES  2
+#define PRIVATE_SERIALIZE   3
+
+/* Per-aggregate descriptor: kind, value column, weight column, ddof */
+#define AGG_DESC_LENGTH 4
+
+/* GUC: plan the custom scan when possible */
+static bool enable_custom_scan = false;
+
+static create_upper_paths_hook_type prev_create_upper_paths_hook = NULL;
+
+/* Aggregate recognized by the planner hook */
+typedef struct {
+    MomentsAggKind kind;
+    AttrNumber value_attno;
+    AttrNumber weight_attno;
+    int32 ddof;
+} WeightedAggDesc;
+
+/* Executor state */
+typedef struct {
+    CustomScanState css;
+    ExprState *quals;               /* scan quals, evaluated on the heap slot */
+    TupleTableSlot *heap_slot;      /* slot of the scanned relation */
+    TableScanDesc scan_desc;
+    ParallelTableScanDesc pscan;    /* shared scan state in parallel plans */
+    bool serialize;                 /* emit serialized partial states */
+    bool done;                      /* result row already returned */
+    int n_columns;
+    AttrNumber *columns;            /* deformed columns */
+    AttrNumber max_attno;
+    double **batch;                 /* per-column batch buffers */
+    int n_aggs;
+    WeightedAggDesc *aggs;
+    int *value_column;              /* index of each aggregate's columns in batch */
+    int *weight_column;
+    MomentsAggState *states;
+    MomentsSketch *sketches;        /* state of the moments_sketch_agg aggregates */
+    MemoryContext batch_context;
+} WeightedAggScanState;
+
+static void weighted_create_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+                                        RelOptInfo *input_rel, RelOptInfo *output_rel,
+                                        void *extra);
+static Plan *plan_weighted_agg_path(PlannerInfo *root, RelOptInfo *rel,
+                                    CustomPath *best_path, List *tlist,
+                                    List *clauses, List *custom_plans);
+static Node *create_weighted_agg_scan_state(CustomScan *cscan);
+static void begin_weighted_agg_scan(CustomScanState *node, EState *estate, int eflags);
+static TupleTableSlot *exec_weighted_agg_scan(CustomScanState *node);
+static void end_weighted_agg_scan(CustomScanState *node);
+static void rescan_weighted_agg_scan(CustomScanState *node);
+static Size estimate_dsm_weighted_agg_scan(CustomScanState *node, ParallelContext *pcxt);
+static void initialize_dsm_weighted_agg_scan(CustomScanState *node, ParallelContext *pcxt,
+                                             void *coordinate);
+static void reinitialize_dsm_weighted_agg_scan(CustomScanState *node, ParallelContext *pcxt,
+                                               void *coordinate);
+static void initialize_worker_weighted_agg_scan(CustomScanState *node, shm_toc *toc,
+                                                void *coordinate);
+static void explain_weighted_agg_scan(CustomScanState *node, List *ancestors,
+                                      ExplainState *es);
+
+static CustomPathMethods weighted_agg_path_methods = {
+    .CustomName = "WeightedAggScan",
+    .PlanCustomPath = plan_weighted_agg_path,
+};
+
+static CustomScanMethods weighted_agg_scan_methods = {
+    .CustomName = "WeightedAggScan",
+    .CreateCustomScanState = create_weighted_agg_scan_state,
+};
+
+static CustomExecMethods weighted_agg_exec_methods = {
+    .CustomName = "WeightedAggScan",
+    .BeginCustomScan = begin_weighted_agg_scan,
+    .ExecCustomScan = exec_weighted_agg_scan,
+    .EndCustomScan = end_weighted_agg_scan,
+    .ReScanCustomScan = rescan_weighted_agg_scan,
+    .EstimateDSMCustomScan = estimate_dsm_weighted_agg_scan,
+    .InitializeDSMCustomScan = initialize_dsm_weighted_agg_scan,
+    .ReInitializeDSMCustomScan = reinitialize_dsm_weighted_agg_scan,
+    .InitializeWorkerCustomScan = initialize_worker_weighted_agg_scan,
+    .ExplainCustomScan = explain_weighted_agg_scan,
+};
+
+/*
+ * Register the GUC, the scan methods and the planner hook (called from _PG_init)
+ */
+void
+weighted_customscan_register(void)
+{
+    DefineCustomBoolVariable("weighted_statistics.enable_custom_scan",
+                             "Enables the vectorized scan for weighted moments aggregates.",
+                             "Replaces a sequential scan feeding weighted_mean_agg, "
+                             "weighted_variance_agg and weighted_std_agg with a scan that "
+                             "aggregates column batches directly.",
+                             &enable_custom_scan,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+    
+    RegisterCustomScanMethods(&weighted_agg_scan_methods);
+    
+    prev_create_upper_paths_hook = create_upper_paths_hook;
+    create_upper_paths_hook = weighted_create_upper_paths;
+}
+
+/* ------------------------------------------------------------------------
+ * Planning
+ * ------------------------------------------------------------------------
+ */
+
+/* Name of the C symbol behind a function, or NULL */
+static char *
+get_function_symbol(Oid funcid)
+{
+    HeapTuple tuple;
+    Form_pg_proc proc;
+    Datum prosrc;
+    bool isnull;
+    char *result = NULL;
+    
+    if (!OidIsValid(funcid)) {
+        return NULL;
+    }
+    
+    tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+    if (!HeapTupleIsValid(tuple)) {
+        return NULL;
+    }
+    
+    proc = (Form_pg_proc)GETSTRUCT(tuple);
+    if (proc->prolang == ClanguageId) {
+        prosrc = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_prosrc, &isnull);
+        if (!isnull) {
+            result = TextDatumGetCString(prosrc);
+        }
+    }
+    
+    ReleaseSysCache(tuple);
+    return result;
+}
+
+/*
+ * Identify a weighted moments aggregate from its support functions
+ *
+ * moments_sketch_agg has no final function; moments_sketch_merge, which
+ * shares its combine function, takes sketches and is not recognized.
+ */
+static bool
+lookup_moments_aggregate(Oid aggfnoid, MomentsAggKind *kind)
+{
+    HeapTuple tuple;
+    Form_pg_aggregate agg;
+    char *transfn, *finalfn;
+    bool found = false;
+    
+    tuple = SearchSysCache1(AGGFNOID, ObjectIdGetDatum(aggfnoid));
+    if (!HeapTupleIsValid(tuple)) {
+        return false;
+    }
+    
+    agg = (Form_pg_aggregate)GETSTRUCT(tuple);
+    transfn = get_function_symbol(agg->aggtransfn);
+    finalfn = get_function_symbol(agg->aggfinalfn);
+    ReleaseSysCache(tuple);
+    
+    if (transfn != NULL && finalfn == NULL && strcmp(transfn, "moments_sketch_transfn") == 0) {
+        *kind = MOMENTS_AGG_SKETCH;
+        return true;
+    }
+    
+    if (transfn == NULL || finalfn == NULL || strcmp(transfn, "weighted_moments_transfn") != 0) {
+        return false;
+    }
+    
+    if (strcmp(finalfn, "weighted_moments_mean_final") == 0) {
+        *kind = MOMENTS_AGG_MEAN;
+        found = true;
+    } else if (strcmp(finalfn, "weighted_moments_variance_final") == 0) {
+        *kind = MOMENTS_AGG_VARIANCE;
+        found = true;
+    } else if (strcmp(finalfn, "weighted_moments_std_final") == 0) {
+        *kind = MOMENTS_AGG_STD;
+        found = true;
+    }
+    
+    return found;
+}
+
+/* Column number of a float8 column of the scanned relation, or 0 */
+static AttrNumber
+get_float8_column(Expr *expr, Index relid)
+{
+    Var *var;
+    
+    if (!IsA(expr, Var)) {
+        return InvalidAttrNumber;
+    }
+    
+    var = (Var *)expr;
+    if (var->varno != relid || var->varlevelsup != 0 || var->varattno <= 0 ||
+        var->vartype != FLOAT8OID) {
+        return InvalidAttrNumber;
+    }
+    
+    return var->varattno;
+}
+
+/*
+ * Check that every aggregate of the target is a supported aggregate over
+ * plain columns of relid, and collect the distinct aggregates with their
+ * descriptors in the same order
+ */
+static bool
+collect_weighted_aggs(PathTarget *target, Index relid, List **aggrefs, List **descriptors)
+{
+    List *nodes;
+    ListCell *lc;
+    
+    *aggrefs = NIL;
+    *descriptors = NIL;
+    
+    nodes = pull_var_clause((Node *)target->exprs,
+                            PVC_INCLUDE_AGGREGATES | PVC_RECURSE_PLACEHOLDERS);
+    
+    foreach(lc, nodes) {
+        Aggref *aggref = (Aggref *)lfirst(lc);
+        MomentsAggKind kind;
+        AttrNumber value_attno, weight_attno;
+        int32 ddof = 0;
+        
+        if (!IsA(aggref, Aggref)) {
+            return false;
+        }
+        
+        if (list_member(*aggrefs, aggref)) {
+            continue;
+        }
+        
+        if (aggref->aggorder != NIL || aggref->aggdistinct != NIL ||
+            aggref->aggfilter != NULL || aggref->agglevelsup != 0 ||
+            aggref->aggstar || aggref->aggvariadic) {
+            return false;
+        }
+        
+        if (!lookup_moments_aggregate(aggref->aggfnoid, &kind)) {
+            return false;
+        }
+        
+        if (list_length(aggref->args) < 2 || list_length(aggref->args) > 3) {
+            return false;
+        }
+        
+        value_attno = get_float8_column(((TargetEntry *)linitial(aggref->args))->expr, relid);
+        weight_attno = get_float8_column(((TargetEntry *)lsecond(aggref->args))->expr, relid);
+        if (value_attno == InvalidAttrNumber || weight_attno == InvalidAttrNumber) {
+            return false;
+        }
+        
+        /* ddof must be known at plan time */
+        if (list_length(aggref->args) == 3) {
+            Expr *arg = ((TargetEntry *)lthird(aggref->args))->expr;
+            Const *ddof_const;
+            
+            if (!IsA(arg, Const)) {
+                return false;
+            }
+            ddof_const = (Const *)arg;
+            if (!ddof_const->constisnull) {
+                ddof = DatumGetInt32(ddof_const->constvalue);
+                if (ddof < 0) {
+                    /* Let the transition function raise the error */
+                    return false;
+                }
+            }
+        }
+        
+        *aggrefs = lappend(*aggrefs, aggref);
+        *descriptors = lappend(*descriptors,
+                               list_make4_int(kind, value_attno, weight_attno, ddof));
+    }
+    
+    return *aggrefs != NIL;
+}
+
+/* Cheapest sequential scan path of the relation, or NULL */
+static Path *
+find_seqscan_path(List *pathlist)
+{
+    ListCell *lc;
+    Path *best = NULL;
+    
+    foreach(lc, pathlist) {
+        Path *path = (Path *)lfirst(lc);
+        
+        if (path->pathtype == T_SeqScan && path->param_info == NULL &&
+            (best == NULL || path->total_cost < best->total_cost)) {
+            best = path;
+        }
+    }
+    
+    return best;
+}
+
+/*
+ * Build the aggregate scan path computing aggrefs, either the final values
+ * or, for a partial path, the serialized transition states
+ */
+static CustomPath *
+create_weighted_agg_path(RelOptInfo *input_rel, RelOptInfo *output_rel, PathTarget *target,
+                         Path *scan_path, List *aggrefs, List *descriptors, bool partial)
+{
+    CustomPath *cpath = makeNode(CustomPath);
+    double agg_cost;
+    
+    agg_cost = cpu_operator_cost * CUSTOM_SCAN_AGG_COST_FACTOR *
+        list_length(descriptors) * scan_path->rows;
+    
+    cpath->path.pathtype = T_CustomScan;
+    cpath->path.parent = output_rel;
+    cpath->path.pathtarget = target;
+    cpath->path.param_info = NULL;
+    cpath->path.parallel_aware = partial;
+    cpath->path.parallel_safe = partial;
+    cpath->path.parallel_workers = partial ? scan_path->parallel_workers : 0;
+    cpath->path.rows = 1;
+    cpath->path.startup_cost = scan_path->total_cost + agg_cost;
+    cpath->path.total_cost = cpath->path.startup_cost + cpu_tuple_cost;
+    cpath->path.pathkeys = NIL;
+    cpath->flags = 0;
+    cpath->custom_paths = NIL;
+    cpath->custom_private = list_make4(makeInteger(input_rel->relid), aggrefs, descriptors,
+                                       makeInteger(partial));
+    cpath->methods = &weighted_agg_path_methods;
+    
+    return cpath;
+}
+
+/*
+ * Build Finalize Aggregate <- Gather <- partial aggregate scan
+ *
+ * The core planner does not offer extensions the partial aggregation step,
+ * so the parallel plan is assembled here the way create_ordinary_grouping_paths
+ * would: the scan emits the Aggrefs marked for serialized partial
+ * aggregation, which the Finalize Aggregate matches against its own.
+ */
+static Path *
+create_parallel_weighted_agg_path(PlannerInfo *root, RelOptInfo *input_rel,
+                                  RelOptInfo *output_rel, Path *scan_path,
+                                  List *aggrefs, List *descriptors)
+{
+    PathTarget *partial_target = create_empty_pathtarget();
+    List *partial_aggrefs = NIL;
+    CustomPath *partial_path;
+    Path *gather_path;
+    AggClauseCosts agg_costs;
+    double n_partial_rows;
+    ListCell *lc;
+    
+    foreach(lc, aggrefs) {
+        Aggref *partial_aggref = copyObject((Aggref *)lfirst(lc));
+        
+        mark_partial_aggref(partial_aggref, AGGSPLIT_INITIAL_SERIAL);
+        partial_aggrefs = lappend(partial_aggrefs, partial_aggref);
+        add_column_to_pathtarget(partial_target, (Expr *)partial_aggref, 0);
+    }
+    partial_target = set_pathtarget_cost_width(root, partial_target);
+    
+    partial_path = create_weighted_agg_path(input_rel, output_rel, partial_target, scan_path,
+                                            partial_aggrefs, descriptors, true);
+    
+    n_partial_rows = partial_path->path.rows * scan_path->parallel_workers;
+    gather_path = (Path *)create_gather_path(root, output_rel, &partial_path->path,
+                                             partial_target, NULL, &n_partial_rows);
+    
+    /* Combining the few partial states is negligible next to the scan */
+    MemSet(&agg_costs, 0, sizeof(AggClauseCosts));
+    
+    return (Path *)create_agg_path(root, output_rel, gather_path, output_rel->reltarget,
+                                   AGG_PLAIN, AGGSPLIT_FINAL_DESERIAL, NIL, NIL,
+                                   &agg_costs, 1);
+}
+
+/*
+ * Planner hook: offer the aggregate scan for ungrouped aggregation of a
+ * single plain table
+ */
+static void
+weighted_create_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+                            RelOptInfo *input_rel, RelOptInfo *output_rel,
+                            void *extra)
+{
+    Query *parse = root->parse;
+    RangeTblEntry *rte;
+    List *aggrefs, *descriptors;
+    Path *scan_path;
+    ListCell *lc;
+    
+    if (prev_create_upper_paths_hook) {
+        prev_create_upper_paths_hook(root, stage, input_rel, output_rel, extra);
+    }
+    
+    if (!enable_custom_scan || stage != UPPERREL_GROUP_AGG) {
+        return;
+    }
+    
+    /* Plain SELECT of aggregates without grouping, at the top query level */
+    if (root->query_level != 1 || parse->commandType != CMD_SELECT ||
+        parse->groupClause != NIL || parse->groupingSets != NIL ||
+        parse->havingQual != NULL || parse->hasTargetSRFs ||
+        parse->rowMarks != NIL || root->hasHavingQual) {
+        return;
+    }
+    
+    /* Over a single plain table without row-level security */
+    if (input_rel->reloptkind != RELOPT_BASEREL || input_rel->rtekind != RTE_RELATION ||
+        root->qual_security_level > 0) {
+        return;
+    }
+    
+    rte = planner_rt_fetch(input_rel->relid, root);
+    if (rte->inh || rte->tablesample != NULL ||
+        (rte->relkind != RELKIND_RELATION && rte->relkind != RELKIND_MATVIEW)) {
+        return;
+    }
+    
+    /* Quals are evaluated without a parent plan node, so no subplans */
+    foreach(lc, input_rel->baserestrictinfo) {
+        if (contain_subplans((Node *)lfirst_node(RestrictInfo, lc)->clause)) {
+            return;
+        }
+    }
+    
+    if (!collect_weighted_aggs(output_rel->reltarget, input_rel->relid, &aggrefs, &descriptors)) {
+        return;
+    }
+    
+    scan_path = find_seqscan_path(input_rel->pathlist);
+    if (scan_path != NULL) {
+        add_path(output_rel, (Path *)create_weighted_agg_path(input_rel, output_rel,
+                                                              output_rel->reltarget, scan_path,
+                                                              aggrefs, descriptors, false));
+    }
+    
+    scan_path = find_seqscan_path(input_rel->partial_pathlist);
+    if (scan_path != NULL && output_rel->consider_parallel) {
+        add_path(output_rel, create_parallel_weighted_agg_path(root, input_rel, output_rel,
+                                                               scan_path, aggrefs, descriptors));
+    }
+}
+
+/* Collect the Params of the scan quals */
+static bool
+collect_qual_params(Node *node, List **params)
+{
+    if (node == NULL) {
+        return false;
+    }
+    if (IsA(node, Param)) {
+        *params = lappend(*params, copyObject(node));
+        return false;
+    }
+    return expression_tree_walker(node, collect_qual_params, (void *)params);
+}
+
+/* check_functions_in_node callback: make cached plans depend on funcid */
+static bool
+record_qual_function(Oid funcid, void *context)
+{
+    record_plan_function_dependency((PlannerInfo *)context, funcid);
+    return false;
+}
+
+/* Record the functions called by the scan quals as plan dependencies */
+static bool
+record_qual_dependencies(Node *node, PlannerInfo *root)
+{
+    if (node == NULL) {
+        return false;
+    }
+    (void) check_functions_in_node(node, record_qual_function, (void *)root);
+    return expression_tree_walker(node, record_qual_dependencies, (void *)root);
+}
+
+/*
+ * Turn the path into a CustomScan on the base relation
+ *
+ * The aggregates go into custom_scan_tlist, so the plan's targetlist refers
+ * to them by position and computes any expression over them. The scan
+ * quals are kept in custom_private and evaluated against the heap tuples by
+ * the executor. set_plan_references and finalize_plan never see them there,
+ * so their Params go into custom_exprs, which makes the plan's extParam (and
+ * the initplan values Gather sends to workers) include them, and their
+ * functions are recorded as plan dependencies here.
+ */
+static Plan *
+plan_weighted_agg_path(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+                       List *tlist, List *clauses, List *custom_plans)
+{
+    CustomScan *cscan = makeNode(CustomScan);
+    Index relid = intVal(linitial(best_path->custom_private));
+    List *aggrefs = lsecond(best_path->custom_private);
+    List *descriptors = lthird(best_path->custom_private);
+    bool partial = intVal(lfourth(best_path->custom_private));
+    RelOptInfo *base_rel = root->simple_rel_array[relid];
+    List *scan_tlist = NIL;
+    List *quals = NIL;
+    List *params = NIL;
+    List *columns = NIL;
+    List *aggregates = NIL;
+    ListCell *lc;
+    
+    foreach(lc, base_rel->baserestrictinfo) {
+        RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+        
+        quals = lappend(quals, copyObject(rinfo->clause));
+    }
+    fix_opfuncids((Node *)quals);
+    (void) collect_qual_params((Node *)quals, &params);
+    (void) record_qual_dependencies((Node *)quals, root);
+    
+    foreach(lc, aggrefs) {
+        scan_tlist = lappend(scan_tlist,
+                             makeTargetEntry((Expr *)copyObject(lfirst(lc)),
+                                             list_length(scan_tlist) + 1, NULL, false));
+    }
+    
+    /* Flatten the descriptors and collect the distinct columns to deform */
+    foreach(lc, descriptors) {
+        List *desc = (List *)lfirst(lc);
+        
+        columns = list_append_unique_int(columns, lsecond_int(desc));
+        columns = list_append_unique_int(columns, lthird_int(desc));
+        aggregates = list_concat(aggregates, list_copy(desc));
+    }
+    
+    cscan->scan.plan.targetlist = tlist;
+    cscan->scan.plan.qual = NIL;
+    cscan->scan.scanrelid = relid;
+    cscan->flags = best_path->flags;
+    cscan->custom_plans = NIL;
+    cscan->custom_exprs = params;
+    cscan->custom_private = list_make4(quals, columns, aggregates, makeInteger(partial));
+    cscan->custom_scan_tlist = scan_tlist;
+    cscan->custom_relids = NULL;
+    cscan->methods = &weighted_agg_scan_methods;
+    
+    return &cscan->scan.plan;
+}
+
+/* ------------------------------------------------------------------------
+ * Execution
+ * ------------------------------------------------------------------------
+ */
+
+static Node *
+create_weighted_agg_scan_state(CustomScan *cscan)
+{
+    WeightedAggScanState *state;
+    
+    state = (WeightedAggScanState *)newNode(sizeof(WeightedAggScanState), T_CustomScanState);
+    state->css.methods = &weighted_agg_exec_methods;
+    
+    return (Node *)state;
+}
+
+static void
+begin_weighted_agg_scan(CustomScanState *node, EState *estate, int eflags)
+{
+    WeightedAggScanState *state = (WeightedAggScanState *)node;
+    CustomScan *cscan = (CustomScan *)node->ss.ps.plan;
+    List *quals = list_nth(cscan->custom_private, PRIVATE_QUALS);
+    List *columns = list_nth(cscan->custom_private, PRIVATE_COLUMNS);
+    List *aggregates = list_nth(cscan->custom_private, PRIVATE_AGGREGATES);
+    Relation rel = node->ss.ss_currentRelation;
+    ListCell *lc;
+    int i, j;
+    
+    /*
+     * No parent: the quals read the heap slot, not the virtual scan slot
+     * holding the aggregate results
+     */
+    state->quals = ExecInitQual(quals, NULL);
+    state->heap_slot = table_slot_create(rel, NULL);
+    state->scan_desc = NULL;
+    state->pscan = NULL;
+    state->serialize = intVal(list_nth(cscan->custom_private, PRIVATE_SERIALIZE));
+    state->done = false;
+    
+    state->n_columns = list_length(columns);
+    state->columns = (AttrNumber *)palloc(state->n_columns * sizeof(AttrNumber));
+    state->batch = (double **)palloc(state->n_columns * sizeof(double *));
+    state->max_attno = 0;
+    i = 0;
+    foreach(lc, columns) {
+        state->columns[i] = lfirst_int(lc);
+        state->max_attno = Max(state->max_attno, state->columns[i]);
+        state->batch[i] = (double *)palloc(CUSTOM_SCAN_BATCH_SIZE * sizeof(double));
+        i++;
+    }
+    
+    state->n_aggs = list_length(aggregates) / AGG_DESC_LENGTH;
+    state->aggs = (WeightedAggDesc *)palloc(state->n_aggs * sizeof(WeightedAggDesc));
+    state->value_column = (int *)palloc(state->n_aggs * sizeof(int));
+    state->weight_column = (int *)palloc(state->n_aggs * sizeof(int));
+    state->states = (MomentsAggState *)palloc(state->n_aggs * sizeof(MomentsAggState));
+    state->sketches = (MomentsSketch *)palloc(state->n_aggs * sizeof(MomentsSketch));
+    for (i = 0; i < state->n_aggs; i++) {
+        WeightedAggDesc *agg = &state->aggs[i];
+        
+        agg->kind = (MomentsAggKind)list_nth_int(aggregates, i * AGG_DESC_LENGTH);
+        agg->value_attno = list_nth_int(aggregates, i * AGG_DESC_LENGTH + 1);
+        agg->weight_attno = list_nth_int(aggregates, i * AGG_DESC_LENGTH + 2);
+        agg->ddof = list_nth_int(aggregates, i * AGG_DESC_LENGTH + 3);
+        
+        for (j = 0; j < state->n_columns; j++) {
+            if (state->columns[j] == agg->value_attno) {
+                state->value_column[i] = j;
+            }
+            if (state->columns[j] == agg->weight_attno) {
+                state->weight_column[i] = j;
+            }
+        }
+    }
+    
+    state->batch_context = AllocSetContextCreate(CurrentMemoryContext,
+                                                 "WeightedAggScan batch",
+                                                 ALLOCSET_DEFAULT_SIZES);
+}
+
+/* Run the aggregates over one batch of deformed rows */
+static void
+aggregate_batch(WeightedAggScanState *state, int n_rows)
+{
+    int i;
+    
+    for (i = 0; i < state->n_aggs; i++) {
+        const double *vals = state->batch[state->value_column[i]];
+        const double *weights = state->batch[state->weight_column[i]];
+        
+        if (state->aggs[i].kind == MOMENTS_AGG_SKETCH) {
+            moments_sketch_add_batch(&state->sketches[i], vals, weights, n_rows);
+        } else {
+            moments_agg_check_batch(vals, weights, n_rows);
+            weighted_moments_add_batch(&state->states[i].moments, vals, weights, n_rows);
+        }
+        state->states[i].n_rows += n_rows;
+    }
+}
+
+/* Scan the whole relation (or this participant's share of it) */
+static void
+scan_and_aggregate(WeightedAggScanState *state)
+{
+    EState *estate = state->css.ss.ps.state;
+    ExprContext *econtext = state->css.ss.ps.ps_ExprContext;
+    TupleTableSlot *slot = state->heap_slot;
+    MemoryContext old_context;
+    int n_rows = 0;
+    int i;
+    
+    for (i = 0; i < state->n_aggs; i++) {
+        weighted_moments_init(&state->states[i].moments);
+        state->states[i].n_rows = 0;
+        state->states[i].ddof = state->aggs[i].ddof;
+        state->states[i].n_buffered = 0;
+        moments_sketch_init(&state->sketches[i]);
+    }
+    
+    if (state->scan_desc == NULL) {
+        Relation rel = state->css.ss.ss_currentRelation;
+        
+        if (state->pscan != NULL) {
+            state->scan_desc = table_beginscan_parallel(rel, state->pscan);
+        } else {
+            state->scan_desc = table_beginscan(rel, estate->es_snapshot, 0, NULL);
+        }
+    }
+    
+    old_context = MemoryContextSwitchTo(state->batch_context);
+    
+    while (table_scan_getnextslot(state->scan_desc, ForwardScanDirection, slot)) {
+        CHECK_FOR_INTERRUPTS();
+        
+        if (state->quals != NULL) {
+            econtext->ecxt_scantuple = slot;
+            if (!ExecQual(state->quals, econtext)) {
+                ResetExprContext(econtext);
+                continue;
+            }
+            ResetExprContext(econtext);
+        }
+        
+        slot_getsomeattrs(slot, state->max_attno);
+        for (i = 0; i < state->n_columns; i++) {
+            int attno = state->columns[i] - 1;
+            
+            /* NULLs are read as 0.0, like the transition function does */
+            state->batch[i][n_rows] = slot->tts_isnull[attno] ?
+                0.0 : DatumGetFloat8(slot->tts_values[attno]);
+        }
+        
+        if (++n_rows == CUSTOM_SCAN_BATCH_SIZE) {
+            aggregate_batch(state, n_rows);
+            n_rows = 0;
+            MemoryContextReset(state->batch_context);
+        }
+    }
+    
+    if (n_rows > 0) {
+        aggregate_batch(state, n_rows);
+    }
+    
+    MemoryContextSwitchTo(old_context);
+    MemoryContextReset(state->batch_context);
+}
+
+static TupleTableSlot *
+exec_weighted_agg_scan(CustomScanState *node)
+{
+    WeightedAggScanState *state = (WeightedAggScanState *)node;
+    TupleTableSlot *result_slot = node->ss.ss_ScanTupleSlot;
+    ExprContext *econtext = node->ss.ps.ps_ExprContext;
+    int i;
+    
+    if (state->done) {
+        return NULL;
+    }
+    state->done = true;
+    
+    scan_and_aggregate(state);
+    
+    ExecClearTuple(result_slot);
+    for (i = 0; i < state->n_aggs; i++) {
+        double value;
+        
+        if (state->aggs[i].kind == MOMENTS_AGG_SKETCH) {
+            /* The sketch is its own partial state; no rows give NULL */
+            result_slot->tts_values[i] = PointerGetDatum(&state->sketches[i]);
+            result_slot->tts_isnull[i] = state->states[i].n_rows == 0;
+        } else if (state->serialize) {
+            /* Partial aggregation: emit the state for Finalize Aggregate */
+            result_slot->tts_values[i] = PointerGetDatum(moments_agg_serialize(&state->states[i]));
+            result_slot->tts_isnull[i] = false;
+        } else if (moments_agg_final_value(&state->states[i], state->aggs[i].kind, &value)) {
+            result_slot->tts_values[i] = Float8GetDatum(value);
+            result_slot->tts_isnull[i] = false;
+        } else {
+            result_slot->tts_values[i] = (Datum)0;
+            result_slot->tts_isnull[i] = true;
+        }
+    }
+    ExecStoreVirtualTuple(result_slot);
+    
+    if (node->ss.ps.ps_ProjInfo == NULL) {
+        return result_slot;
+    }
+    
+    ResetExprContext(econtext);
+    econtext->ecxt_scantuple = result_slot;
+    return ExecProject(node->ss.ps.ps_ProjInfo);
+}
+
+static void
+end_weighted_agg_scan(CustomScanState *node)
+{
+    WeightedAggScanState *state = (WeightedAggScanState *)node;
+    
+    if (state->scan_desc != NULL) {
+        table_endscan(state->scan_desc);
+    }
+    ExecDropSingleTupleTableSlot(state->heap_slot);
+    MemoryContextDelete(state->batch_context);
+}
+
+static void
+rescan_weighted_agg_scan(CustomScanState *node)
+{
+    WeightedAggScanState *state = (WeightedAggScanState *)node;
+    
+    if (state->scan_desc != NULL) {
+        table_rescan(state->scan_desc, NULL);
+    }
+    state->done = false;
+}
+
+static Size
+estimate_dsm_weighted_agg_scan(CustomScanState *node, ParallelContext *pcxt)
+{
+    return table_parallelscan_estimate(node->ss.ss_currentRelation,
+                                       node->ss.ps.state->es_snapshot);
+}
+
+static void
+initialize_dsm_weighted_agg_scan(CustomScanState *node, ParallelContext *pcxt,
+                                 void *coordinate)
+{
+    WeightedAggScanState *state = (WeightedAggScanState *)node;
+    
+    state->pscan = (ParallelTableScanDesc)coordinate;
+    table_parallelscan_initialize(node->ss.ss_currentRelation, state->pscan,
+                                  node->ss.ps.state->es_snapshot);
+}
+
+static void
+reinitialize_dsm_weighted_agg_scan(CustomScanState *node, ParallelContext *pcxt,
+                                   void *coordinate)
+{
+    WeightedAggScanState *state = (WeightedAggScanState *)node;
+    
+    table_parallelscan_reinitialize(node->ss.ss_currentRelation, state->pscan);
+}
+
+static void
+initialize_worker_weighted_agg_scan(CustomScanState *node, shm_toc *toc,
+                                    void *coordinate)
+{
+    WeightedAggScanState *state = (WeightedAggScanState *)node;
+    
+    state->pscan = (ParallelTableScanDesc)coordinate;
+}
+
+/* Show the quals, which are not part of the plan's qual list */
+static void
+explain_weighted_agg_scan(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+    CustomScan *cscan = (CustomScan *)node->ss.ps.plan;
+    List *quals = list_nth(cscan->custom_private, PRIVATE_QUALS);
+    List *context;
+    char *qual_str;
+    
+    if (quals == NIL) {
+        return;
+    }
+
+#if PG_VERSION_NUM >= 130000
+    context = set_deparse_context_plan(es->deparse_cxt, node->ss.ps.plan, ancestors);
+#else
+    context = set_deparse_context_planstate(es->deparse_cxt, (Node *)node, ancestors);
+#endif
+    qual_str = deparse_expression((Node *)make_ands_explicit(quals), context,
+                                  es->verbose, false);
+    ExplainPropertyText("Filter", qual_str, es);
+}
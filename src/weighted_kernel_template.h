@@ -0,0 +1,166 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Input Kernel Template
+ *
+ * Stamps out one specialized variant of the input kernels per inclusion, in
+ * the style of PostgreSQL's lib/sort_template.h. The including file defines
+ * the parameters below; each combination gets a loop without per-element
+ * branches on the input shape, and weighted_kernels.c picks one per call.
+ *
+ * Parameters:
+ *     WK_PREFIX   - prefix of the generated functions, e.g. wk_pairs_nulls_checked
+ *     WK_PAIRS    - 1: interleaved weighted_pair data in src->vals,
+ *                   0: separate float8 data in src->vals and src->weights
+ *     WK_NULLS    - 1: honour the NULL bitmaps (NULL reads as 0), 0: none
+ *     WK_CHECKED  - 1: raise errors for negative weights and NaN/infinite
+ *                   input, 0: trusted input, non-positive weights are dropped
+ *
+ * Generated:
+ *     WK_PREFIX_gather(src, out, sum_weights)
+ *         copy the positive-weight pairs to out and return their count
+ *     WK_PREFIX_sums(src, sum_weighted, sum_weights)
+ *         sum of w * v and of w over the positive weights
+ *
+ * The parameters are undefined again at the end of the file.
+ */
+
+#define WK_MAKE_PREFIX(a) CppConcat(a,_)
+#define WK_MAKE_NAME_(a,b) CppConcat(a,b)
+#define WK_MAKE_NAME(a) WK_MAKE_NAME_(WK_MAKE_PREFIX(WK_PREFIX),a)
+
+#define WK_GATHER WK_MAKE_NAME(gather)
+#define WK_SUMS WK_MAKE_NAME(sums)
+
+/*
+ * Cursors over the input and WK_FETCH(i, v, w), which reads element i
+ *
+ * Flat data without NULLs is indexed directly. With NULLs the data only
+ * holds the non-NULL elements, so each stream keeps its own cursor.
+ */
+#if WK_PAIRS && !WK_NULLS
+#define WK_CURSORS \
+    const ValueWeight *pair_data = (const ValueWeight *) src->vals
+#define WK_FETCH(i, v, w) \
+    do { \
+        (v) = pair_data[i].value; \
+        (w) = pair_data[i].weight; \
+    } while (0)
+#elif WK_PAIRS
+#define WK_CURSORS \
+    const char *pair_cursor = src->vals
+#define WK_FETCH(i, v, w) \
+    do { \
+        if (src->vals_nulls != NULL && !(src->vals_nulls[(i) >> 3] & (1 << ((i) & 7)))) { \
+            (v) = 0.0; \
+            (w) = 0.0; \
+        } else { \
+            ValueWeight pair_; \
+            memcpy(&pair_, pair_cursor, sizeof(ValueWeight)); \
+            pair_cursor += sizeof(ValueWeight); \
+            (v) = pair_.value; \
+            (w) = pair_.weight; \
+        } \
+    } while (0)
+#elif !WK_NULLS
+#define WK_CURSORS \
+    const double *vals_data = (const double *) src->vals; \
+    const double *weights_data = (const double *) src->weights
+#define WK_FETCH(i, v, w) \
+    do { \
+        (v) = vals_data[i]; \
+        (w) = weights_data[i]; \
+    } while (0)
+#else
+#define WK_CURSORS \
+    const char *vals_cursor = src->vals; \
+    const char *weights_cursor = src->weights
+#define WK_FETCH_ONE(i, bitmap, cursor, x) \
+    do { \
+        if ((bitmap) != NULL && !((bitmap)[(i) >> 3] & (1 << ((i) & 7)))) { \
+            (x) = 0.0; \
+        } else { \
+            memcpy(&(x), (cursor), sizeof(double)); \
+            (cursor) += sizeof(double); \
+        } \
+    } while (0)
+#define WK_FETCH(i, v, w) \
+    do { \
+        WK_FETCH_ONE(i, src->vals_nulls, vals_cursor, v); \
+        WK_FETCH_ONE(i, src->weights_nulls, weights_cursor, w); \
+    } while (0)
+#endif
+
+#if WK_CHECKED
+#define WK_CHECK(v, w) weighted_check_input((v), (w))
+#else
+#define WK_CHECK(v, w) ((void) 0)
+#endif
+
+/*
+ * Copy the pairs with positive weight to out, in input order
+ *
+ * Every pair is stored and the output index only advances past kept ones, so
+ * the loop has no data-dependent branch. out needs room for src->n_elements
+ * pairs.
+ */
+static int
+WK_GATHER(const WeightedSource *src, ValueWeight *out, double *sum_weights)
+{
+    WK_CURSORS;
+    double sum = 0.0;
+    int n_kept = 0;
+    int i;
+    
+    for (i = 0; i < src->n_elements; i++) {
+        double v, w;
+        
+        WK_FETCH(i, v, w);
+        WK_CHECK(v, w);
+        out[n_kept].value = v;
+        out[n_kept].weight = w;
+        sum += w > 0.0 ? w : 0.0;
+        n_kept += w > 0.0;
+    }
+    
+    *sum_weights = sum;
+    return n_kept;
+}
+
+/* Weighted sums over the pairs with positive weight */
+static void
+WK_SUMS(const WeightedSource *src, double *sum_weighted, double *sum_weights)
+{
+    WK_CURSORS;
+    double sum_vw = 0.0;
+    double sum_w = 0.0;
+    int i;
+    
+    for (i = 0; i < src->n_elements; i++) {
+        double v, w;
+        
+        WK_FETCH(i, v, w);
+        WK_CHECK(v, w);
+#if !WK_CHECKED
+        w = w > 0.0 ? w : 0.0;
+        v = w > 0.0 ? v : 0.0;
+#endif
+        sum_vw += v * w;
+        sum_w += w;
+    }
+    
+    *sum_weighted = sum_vw;
+    *sum_weights = sum_w;
+}
+
+#undef WK_MAKE_PREFIX
+#undef WK_MAKE_NAME_
+#undef WK_MAKE_NAME
+#undef WK_GATHER
+#undef WK_SUMS
+#undef WK_CURSORS
+#undef WK_FETCH
+#undef WK_FETCH_ONE
+#undef WK_CHECK
+#undef WK_PREFIX
+#undef WK_PAIRS
+#undef WK_NULLS
+#undef WK_CHECKED
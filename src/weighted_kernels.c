@@ -0,0 +1,272 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Input Kernels
+ *
+ * Reading, validating and filtering the (value, weight) input of the array
+ * functions. weighted_kernel_template.h generates one variant per input
+ * shape (float8 arrays or weighted_pair[], with or without NULLs, checked or
+ * trusted); the dispatchers below pick the variant once per call, so the
+ * per-element loops carry no branches on the shape of the input.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/array.h"
+#include "utils/expandeddatum.h"
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define WK_PREFIX wk_arrays_trusted
+#define WK_PAIRS 0
+#define WK_NULLS 0
+#define WK_CHECKED 0
+#include "weighted_kernel_template.h"
+
+#define WK_PREFIX wk_arrays_checked
+#define WK_PAIRS 0
+#define WK_NULLS 0
+#define WK_CHECKED 1
+#include "weighted_kernel_template.h"
+
+#define WK_PREFIX wk_arrays_nulls_trusted
+#define WK_PAIRS 0
+#define WK_NULLS 1
+#define WK_CHECKED 0
+#include "weighted_kernel_template.h"
+
+#define WK_PREFIX wk_arrays_nulls_checked
+#define WK_PAIRS 0
+#define WK_NULLS 1
+#define WK_CHECKED 1
+#include "weighted_kernel_template.h"
+
+#define WK_PREFIX wk_pairs_trusted
+#define WK_PAIRS 1
+#define WK_NULLS 0
+#define WK_CHECKED 0
+#include "weighted_kernel_template.h"
+
+#define WK_PREFIX wk_pairs_checked
+#define WK_PAIRS 1
+#define WK_NULLS 0
+#define WK_CHECKED 1
+#include "weighted_kernel_template.h"
+
+#define WK_PREFIX wk_pairs_nulls_trusted
+#define WK_PAIRS 1
+#define WK_NULLS 1
+#define WK_CHECKED 0
+#include "weighted_kernel_template.h"
+
+#define WK_PREFIX wk_pairs_nulls_checked
+#define WK_PAIRS 1
+#define WK_NULLS 1
+#define WK_CHECKED 1
+#include "weighted_kernel_template.h"
+
+typedef int (*GatherKernel) (const WeightedSource *src, ValueWeight *out, double *sum_weights);
+typedef void (*SumsKernel) (const WeightedSource *src, double *sum_weighted, double *sum_weights);
+
+/* Indexed by [pairs][nulls][checked] */
+static const GatherKernel gather_kernels[2][2][2] = {
+    {{wk_arrays_trusted_gather, wk_arrays_checked_gather},
+     {wk_arrays_nulls_trusted_gather, wk_arrays_nulls_checked_gather}},
+    {{wk_pairs_trusted_gather, wk_pairs_checked_gather},
+     {wk_pairs_nulls_trusted_gather, wk_pairs_nulls_checked_gather}}
+};
+
+static const SumsKernel sums_kernels[2][2][2] = {
+    {{wk_arrays_trusted_sums, wk_arrays_checked_sums},
+     {wk_arrays_nulls_trusted_sums, wk_arrays_nulls_checked_sums}},
+    {{wk_pairs_trusted_sums, wk_pairs_checked_sums},
+     {wk_pairs_nulls_trusted_sums, wk_pairs_nulls_checked_sums}}
+};
+
+/*
+ * Point at the data of a float8[] without copying it
+ *
+ * Flat arrays (including the flat copy an expanded array still holds) are
+ * read in place. Deconstructed expanded arrays have no flat data and are
+ * copied once with any_array_to_doubles, which reads their NULLs as 0.
+ */
+static void
+source_float8_data(WeightedSource *src, AnyArrayType *array,
+                   const char **data, const bits8 **nulls)
+{
+    ArrayType *flat;
+    int n;
+    
+    if (VARATT_IS_EXPANDED_HEADER(array) && array->xpn.dvalues != NULL) {
+        double *copy = any_array_to_doubles(array, &n);
+        
+        src->to_free[src->n_to_free++] = copy;
+        *data = (const char *) copy;
+        *nulls = NULL;
+        return;
+    }
+    
+    flat = VARATT_IS_EXPANDED_HEADER(array) ? array->xpn.fvalue : &array->flt;
+    *data = ARR_DATA_PTR(flat);
+    *nulls = ARR_NULLBITMAP(flat);
+}
+
+/*
+ * Describe separate value and weight arrays of the same length
+ */
+void
+weighted_source_from_arrays(WeightedSource *src, AnyArrayType *vals_array,
+                            AnyArrayType *weights_array)
+{
+    int vals_count, weights_count;
+    
+    vals_count = ArrayGetNItems(AARR_NDIM(vals_array), AARR_DIMS(vals_array));
+    weights_count = ArrayGetNItems(AARR_NDIM(weights_array), AARR_DIMS(weights_array));
+    if (vals_count != weights_count) {
+        ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("values and weights arrays must have the same length")));
+    }
+    
+    memset(src, 0, sizeof(WeightedSource));
+    src->n_elements = vals_count;
+    src->vals_array = vals_array;
+    src->weights_array = weights_array;
+    source_float8_data(src, vals_array, &src->vals, &src->vals_nulls);
+    source_float8_data(src, weights_array, &src->weights, &src->weights_nulls);
+}
+
+/*
+ * Describe a weighted_pair[]
+ *
+ * weighted_pair is fixed-length and double aligned, so flat data is an
+ * array of ValueWeight. Deconstructed expanded arrays are copied once.
+ */
+void
+weighted_source_from_pairs(WeightedSource *src, AnyArrayType *pairs_array)
+{
+    ArrayType *flat;
+    
+    memset(src, 0, sizeof(WeightedSource));
+    src->pairs = true;
+    src->vals_array = pairs_array;
+    
+    if (VARATT_IS_EXPANDED_HEADER(pairs_array) && pairs_array->xpn.dvalues != NULL) {
+        ValueWeight *copy = extract_value_weight_pairs(pairs_array, &src->n_elements);
+        
+        src->to_free[src->n_to_free++] = copy;
+        src->vals = (const char *) copy;
+        return;
+    }
+    
+    flat = VARATT_IS_EXPANDED_HEADER(pairs_array) ? pairs_array->xpn.fvalue : &pairs_array->flt;
+    src->n_elements = ArrayGetNItems(ARR_NDIM(flat), ARR_DIMS(flat));
+    src->vals = ARR_DATA_PTR(flat);
+    src->vals_nulls = ARR_NULLBITMAP(flat);
+}
+
+/* Release the copies made for expanded arrays */
+void
+weighted_source_free(WeightedSource *src)
+{
+    int i;
+    
+    for (i = 0; i < src->n_to_free; i++) {
+        pfree(src->to_free[i]);
+    }
+    src->n_to_free = 0;
+}
+
+/*
+ * Copy the positive-weight pairs of src to out
+ *
+ * checked raises the errors of the mean/variance functions for negative
+ * weights and NaN/infinite input; otherwise such weights are just dropped.
+ * With sparse, the implicit zero is appended when the total weight is below
+ * 1.0, as compact_sparse_pairs does. out needs room for n_elements + 1 pairs.
+ * Returns the number of pairs and stores their total weight.
+ */
+int
+weighted_source_gather(const WeightedSource *src, bool checked, bool sparse,
+                       ValueWeight *out, double *total_weight)
+{
+    bool nulls = src->vals_nulls != NULL || src->weights_nulls != NULL;
+    double sum_weights;
+    int n_pairs;
+    
+    n_pairs = gather_kernels[src->pairs][nulls][checked](src, out, &sum_weights);
+    
+    /* Handle sparse data: add implicit zero if total weight < 1.0 */
+    if (sparse && sum_weights < 1.0) {
+        out[n_pairs].value = 0.0;
+        out[n_pairs].weight = 1.0 - sum_weights;
+        n_pairs++;
+        sum_weights = 1.0;
+    }
+    
+    *total_weight = sum_weights;
+    return n_pairs;
+}
+
+/*
+ * Sum of w * v and of w over the positive weights of src
+ *
+ * The implicit zero of sparse data adds nothing to the weighted sum; callers
+ * raise the weight total to 1.0 themselves.
+ */
+void
+weighted_source_sums(const WeightedSource *src, bool checked,
+                     double *sum_weighted, double *sum_weights)
+{
+    bool nulls = src->vals_nulls != NULL || src->weights_nulls != NULL;
+    
+    sums_kernels[src->pairs][nulls][checked](src, sum_weighted, sum_weights);
+}
+
+/*
+ * Reduce giant inputs in chunks (see weighted_moments_threaded)
+ *
+ * Returns false, without touching the input, when the call should stay on
+ * the single-threaded kernels. Float8 arrays and weighted_pair[] arrays
+ * without NULLs are read in place; NULLs are materialized as zeros first.
+ */
+bool
+weighted_source_moments_threaded(const WeightedSource *src, bool second_moment,
+                                 WeightedMoments *moments)
+{
+    double *vals, *weights;
+    ValueWeight *pairs;
+    int n_elements;
+    bool threaded;
+    
+    if (src->n_elements < MOMENTS_CHUNKED_MIN_ELEMENTS) {
+        return false;
+    }
+    
+    if (src->pairs) {
+        const ValueWeight *in_place = (const ValueWeight *) src->vals;
+        
+        if (src->vals_nulls == NULL) {
+            return weighted_moments_threaded(&in_place[0].value, &in_place[0].weight, 2,
+                                             src->n_elements, second_moment, moments);
+        }
+        pairs = extract_value_weight_pairs(src->vals_array, &n_elements);
+        threaded = weighted_moments_threaded(&pairs[0].value, &pairs[0].weight, 2,
+                                             n_elements, second_moment, moments);
+        pfree(pairs);
+        return threaded;
+    }
+    
+    if (src->vals_nulls == NULL && src->weights_nulls == NULL) {
+        return weighted_moments_threaded((const double *) src->vals,
+                                         (const double *) src->weights, 1,
+                                         src->n_elements, second_moment, moments);
+    }
+    
+    /* The chunk tasks read plain doubles: materialize the NULLs as zeros */
+    extract_double_arrays(src->vals_array, src->weights_array, &vals, &weights, &n_elements);
+    threaded = weighted_moments_threaded(vals, weights, 1, n_elements, second_moment, moments);
+    pfree(vals);
+    pfree(weights);
+    return threaded;
+}
@@ -9,6 +9,7 @@
 #include "utils/array.h"
 #include "utils/lsyscache.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #include <math.h>
 
 #include "utils.h"
@@ -16,6 +17,24 @@
 /* PostgreSQL extension module magic */
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+
+/* Module load: register the GUCs and planner integration */
+void
+_PG_init(void)
+{
+    weighted_customscan_register();
+    weighted_support_register();
+    weighted_parallel_register();
+    weighted_quantiles_register();
+
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("weighted_statistics");
+#else
+    EmitWarningsOnPlaceholders("weighted_statistics");
+#endif
+}
+
 /* 
  * weighted_mean_sparse_c - C implementation of weighted mean for sparse data
  * 
@@ -29,56 +48,34 @@ PG_FUNCTION_INFO_V1(weighted_mean_sparse_c);
 Datum
 weighted_mean_sparse_c(PG_FUNCTION_ARGS)
 {
-    ArrayType *vals_array, *weights_array;
-    double *vals, *weights;
-    int n_elements;
-    double sum_weighted = 0.0;
-    double sum_weights = 0.0;
-    int i;
+    WeightedSource src;
+    double sum_weighted, sum_weights;
+    WeightedMoments moments;
     
     /* Handle NULL inputs */
     if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) {
         PG_RETURN_NULL();
     }
     
-    /* Get input arrays */
-    vals_array = PG_GETARG_ARRAYTYPE_P(0);
-    weights_array = PG_GETARG_ARRAYTYPE_P(1);
-    
-    /* Extract arrays */
-    if (extract_double_arrays(vals_array, weights_array, &vals, &weights, &n_elements) < 0) {
-        PG_RETURN_NULL();
-    }
+    /* Read the arrays in place */
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
     
     /* Handle empty arrays */
-    if (n_elements == 0) {
-        pfree(vals);
-        pfree(weights);
+    if (src.n_elements == 0) {
+        weighted_source_free(&src);
         PG_RETURN_NULL();
     }
     
-    /* Calculate weighted sum and total weight */
-    for (i = 0; i < n_elements; i++) {
-        if (weights[i] < 0.0) {
-            pfree(vals);
-            pfree(weights);
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("weights must be non-negative")));
-        }
-        if (isnan(vals[i]) || isinf(vals[i]) || isnan(weights[i]) || isinf(weights[i])) {
-            pfree(vals);
-            pfree(weights);
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("input arrays must not contain NaN or infinite values")));
-        }
-        if (weights[i] > 0.0) {
-            sum_weighted += vals[i] * weights[i];
-            sum_weights += weights[i];
-        }
+    /* Giant arrays: validated and reduced in chunks, on worker threads if allowed */
+    if (weighted_source_moments_threaded(&src, false, &moments)) {
+        weighted_source_free(&src);
+        PG_RETURN_FLOAT8(weighted_moments_mean(&moments));
     }
     
+    /* Validate and calculate weighted sum and total weight */
+    weighted_source_sums(&src, true, &sum_weighted, &sum_weights);
+    weighted_source_free(&src);
+    
     /* Handle sparse data: if sum_weights < 1.0, add implicit zero */
     if (sum_weights < 1.0) {
         /* Implicit zero with weight (1.0 - sum_weights) */
@@ -86,14 +83,54 @@ weighted_mean_sparse_c(PG_FUNCTION_ARGS)
         sum_weights = 1.0;
     }
     
-    /* Clean up */
-    pfree(vals);
-    pfree(weights);
+    PG_RETURN_FLOAT8(sum_weighted / sum_weights);
+}
+
+/*
+ * weighted_mean_pairs_c - Weighted mean over a weighted_pair[] array
+ * 
+ * Same semantics as weighted_mean_sparse_c, reading the interleaved pairs
+ * directly instead of two parallel arrays.
+ * 
+ * Exposed as: weighted_mean(pairs[])
+ */
+PG_FUNCTION_INFO_V1(weighted_mean_pairs_c);
+
+Datum
+weighted_mean_pairs_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
+    double sum_weighted, sum_weights;
+    WeightedMoments moments;
+    
+    /* Handle NULL inputs */
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    
+    /* Read the pairs in place */
+    weighted_source_from_pairs(&src, PG_GETARG_ANY_ARRAY_P(0));
     
-    /* Return weighted mean */
-    if (sum_weights == 0.0) {
+    /* Handle empty arrays */
+    if (src.n_elements == 0) {
+        weighted_source_free(&src);
         PG_RETURN_NULL();
     }
     
+    /* Giant arrays: validated and reduced in chunks, on worker threads if allowed */
+    if (weighted_source_moments_threaded(&src, false, &moments)) {
+        weighted_source_free(&src);
+        PG_RETURN_FLOAT8(weighted_moments_mean(&moments));
+    }
+    
+    /* Validate and calculate weighted sum and total weight */
+    weighted_source_sums(&src, true, &sum_weighted, &sum_weights);
+    weighted_source_free(&src);
+    
+    /* Handle sparse data: if sum_weights < 1.0, add implicit zero */
+    if (sum_weights < 1.0) {
+        sum_weights = 1.0;
+    }
+    
     PG_RETURN_FLOAT8(sum_weighted / sum_weights);
-}
\ No newline at end of file
+}
@@ -0,0 +1,389 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Weighted Pair Type
+ *
+ * Implementation of the fixed-length weighted_pair type (value + weight) and
+ * the weighted_pair_agg aggregate that builds weighted_pair[] arrays.
+ *
+ * A weighted_pair is stored exactly like the ValueWeight struct, so the
+ * statistics functions can copy a whole weighted_pair[] into their sort
+ * buffer with a single memcpy instead of deconstructing two parallel arrays.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "libpq/pqformat.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/float.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* Initial capacity of the weighted_pair_agg transition buffer */
+#define PAIR_AGG_INITIAL_SIZE 64
+
+/* Transition state of weighted_pair_agg */
+typedef struct {
+    ValueWeight *pairs;
+    int n_pairs;
+    int capacity;
+} PairAggState;
+
+/* Parse one float8 field of the text representation */
+static double
+parse_pair_field(char **str, const char *orig, char terminator)
+{
+    char *end;
+    double result;
+    
+    result = weighted_float8in(*str, &end, "weighted_pair", orig);
+    if (*end != terminator) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type %s: \"%s\"",
+                        "weighted_pair", orig)));
+    }
+    
+    *str = end + 1;
+    return result;
+}
+
+/* Build a one-dimensional weighted_pair[] directly from a pair buffer */
+static ArrayType *
+construct_pair_array(const ValueWeight *pairs, int n_pairs, Oid elemtype)
+{
+    ArrayType *result;
+    Size nbytes;
+    
+    nbytes = ARR_OVERHEAD_NONULLS(1) + (Size) n_pairs * sizeof(ValueWeight);
+    if (!AllocSizeIsValid(nbytes)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("array size exceeds the maximum allowed (%d)",
+                        (int) MaxAllocSize)));
+    }
+    
+    result = (ArrayType *)palloc0(nbytes);
+    SET_VARSIZE(result, nbytes);
+    result->ndim = 1;
+    result->dataoffset = 0;
+    result->elemtype = elemtype;
+    ARR_DIMS(result)[0] = n_pairs;
+    ARR_LBOUND(result)[0] = 1;
+    memcpy(ARR_DATA_PTR(result), pairs, (Size) n_pairs * sizeof(ValueWeight));
+    
+    return result;
+}
+
+/* Make sure the transition buffer can hold n_extra more pairs */
+static void
+pair_agg_reserve(PairAggState *state, int n_extra)
+{
+    Size needed = (Size) state->n_pairs + n_extra;
+    Size new_capacity = (Size) state->capacity;
+    
+    if (needed <= new_capacity) {
+        return;
+    }
+    
+    if (needed > (Size) INT_MAX) {
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("weighted_pair_agg input exceeds the maximum number of pairs")));
+    }
+    
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    
+    /* Huge allocations, like the table-scan collector's */
+    new_capacity = Min(new_capacity, (Size) INT_MAX);
+    state->pairs = (ValueWeight *)repalloc_huge(state->pairs,
+                                                new_capacity * sizeof(ValueWeight));
+    state->capacity = (int) new_capacity;
+}
+
+/* Allocate an empty transition state in the aggregate memory context */
+static PairAggState *
+pair_agg_create(MemoryContext agg_context, int capacity)
+{
+    PairAggState *state;
+    
+    state = (PairAggState *)MemoryContextAlloc(agg_context, sizeof(PairAggState));
+    state->n_pairs = 0;
+    state->capacity = Max(capacity, PAIR_AGG_INITIAL_SIZE);
+    state->pairs = (ValueWeight *)MemoryContextAllocHuge(agg_context,
+                                                         (Size) state->capacity * sizeof(ValueWeight));
+    return state;
+}
+
+/*
+ * weighted_pair_in - Text input, e.g. '(12.5, 0.25)'
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_in);
+
+Datum
+weighted_pair_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);
+    char *cur = str;
+    ValueWeight *result;
+    
+    while (isspace((unsigned char) *cur)) {
+        cur++;
+    }
+    if (*cur != '(') {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type %s: \"%s\"",
+                        "weighted_pair", str)));
+    }
+    cur++;
+    
+    result = (ValueWeight *)palloc(sizeof(ValueWeight));
+    result->value = parse_pair_field(&cur, str, ',');
+    result->weight = parse_pair_field(&cur, str, ')');
+    
+    while (isspace((unsigned char) *cur)) {
+        cur++;
+    }
+    if (*cur != '\0') {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type %s: \"%s\"",
+                        "weighted_pair", str)));
+    }
+    
+    PG_RETURN_VALUEWEIGHT_P(result);
+}
+
+/*
+ * weighted_pair_out - Text output as '(value,weight)'
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_out);
+
+Datum
+weighted_pair_out(PG_FUNCTION_ARGS)
+{
+    ValueWeight *pair = PG_GETARG_VALUEWEIGHT_P(0);
+    char *value_str = float8out_internal(pair->value);
+    char *weight_str = float8out_internal(pair->weight);
+    
+    PG_RETURN_CSTRING(psprintf("(%s,%s)", value_str, weight_str));
+}
+
+/*
+ * weighted_pair_recv - Binary input
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_recv);
+
+Datum
+weighted_pair_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    ValueWeight *result;
+    
+    result = (ValueWeight *)palloc(sizeof(ValueWeight));
+    result->value = pq_getmsgfloat8(buf);
+    result->weight = pq_getmsgfloat8(buf);
+    
+    PG_RETURN_VALUEWEIGHT_P(result);
+}
+
+/*
+ * weighted_pair_send - Binary output
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_send);
+
+Datum
+weighted_pair_send(PG_FUNCTION_ARGS)
+{
+    ValueWeight *pair = PG_GETARG_VALUEWEIGHT_P(0);
+    StringInfoData buf;
+    
+    pq_begintypsend(&buf);
+    pq_sendfloat8(&buf, pair->value);
+    pq_sendfloat8(&buf, pair->weight);
+    
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * weighted_pair_make - Construct a pair from a value and a weight
+ *
+ * Exposed as: weighted_pair(value, weight)
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_make);
+
+Datum
+weighted_pair_make(PG_FUNCTION_ARGS)
+{
+    ValueWeight *result;
+    
+    result = (ValueWeight *)palloc(sizeof(ValueWeight));
+    result->value = PG_GETARG_FLOAT8(0);
+    result->weight = PG_GETARG_FLOAT8(1);
+    
+    PG_RETURN_VALUEWEIGHT_P(result);
+}
+
+/*
+ * weighted_pair_agg_transfn - Append one (value, weight) row
+ *
+ * NULL values are stored as 0.0 and NULL weights as 0.0, matching how the
+ * array functions treat NULL elements.
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_agg_transfn);
+
+Datum
+weighted_pair_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    PairAggState *state;
+    ValueWeight *pair;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_pair_agg_transfn called in non-aggregate context");
+    }
+    
+    if (PG_ARGISNULL(0)) {
+        state = pair_agg_create(agg_context, PAIR_AGG_INITIAL_SIZE);
+    } else {
+        state = (PairAggState *)PG_GETARG_POINTER(0);
+    }
+    
+    if (state->n_pairs >= state->capacity) {
+        MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+        pair_agg_reserve(state, 1);
+        MemoryContextSwitchTo(old_context);
+    }
+    
+    pair = &state->pairs[state->n_pairs++];
+    pair->value = PG_ARGISNULL(1) ? 0.0 : PG_GETARG_FLOAT8(1);
+    pair->weight = PG_ARGISNULL(2) ? 0.0 : PG_GETARG_FLOAT8(2);
+    
+    PG_RETURN_POINTER(state);
+}
+
+/*
+ * weighted_pair_agg_combinefn - Merge two partial states (parallel aggregation)
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_agg_combinefn);
+
+Datum
+weighted_pair_agg_combinefn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    MemoryContext old_context;
+    PairAggState *state1;
+    PairAggState *state2;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_pair_agg_combinefn called in non-aggregate context");
+    }
+    
+    state1 = PG_ARGISNULL(0) ? NULL : (PairAggState *)PG_GETARG_POINTER(0);
+    state2 = PG_ARGISNULL(1) ? NULL : (PairAggState *)PG_GETARG_POINTER(1);
+    
+    if (state2 == NULL) {
+        if (state1 == NULL) {
+            PG_RETURN_NULL();
+        }
+        PG_RETURN_POINTER(state1);
+    }
+    
+    old_context = MemoryContextSwitchTo(agg_context);
+    
+    if (state1 == NULL) {
+        state1 = pair_agg_create(agg_context, state2->n_pairs);
+    }
+    
+    pair_agg_reserve(state1, state2->n_pairs);
+    memcpy(state1->pairs + state1->n_pairs, state2->pairs,
+           state2->n_pairs * sizeof(ValueWeight));
+    state1->n_pairs += state2->n_pairs;
+    
+    MemoryContextSwitchTo(old_context);
+    
+    PG_RETURN_POINTER(state1);
+}
+
+/*
+ * weighted_pair_agg_serialfn - Serialize a state as raw pair bytes
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_agg_serialfn);
+
+Datum
+weighted_pair_agg_serialfn(PG_FUNCTION_ARGS)
+{
+    PairAggState *state = (PairAggState *)PG_GETARG_POINTER(0);
+    Size data_size = (Size) state->n_pairs * sizeof(ValueWeight);
+    bytea *result;
+    
+    result = (bytea *)palloc(VARHDRSZ + data_size);
+    SET_VARSIZE(result, VARHDRSZ + data_size);
+    memcpy(VARDATA(result), state->pairs, data_size);
+    
+    PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * weighted_pair_agg_deserialfn - Rebuild a state from raw pair bytes
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_agg_deserialfn);
+
+Datum
+weighted_pair_agg_deserialfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    bytea *serialized = PG_GETARG_BYTEA_PP(0);
+    Size data_size = VARSIZE_ANY_EXHDR(serialized);
+    PairAggState *state;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_pair_agg_deserialfn called in non-aggregate context");
+    }
+    
+    if (data_size % sizeof(ValueWeight) != 0) {
+        elog(ERROR, "invalid weighted_pair_agg state size: %zu", data_size);
+    }
+    
+    state = pair_agg_create(agg_context, (int) (data_size / sizeof(ValueWeight)));
+    memcpy(state->pairs, VARDATA_ANY(serialized), data_size);
+    state->n_pairs = (int) (data_size / sizeof(ValueWeight));
+    
+    PG_RETURN_POINTER(state);
+}
+
+/*
+ * weighted_pair_agg_finalfn - Emit the collected pairs as weighted_pair[]
+ *
+ * Like array_agg, returns NULL when no rows were aggregated.
+ */
+PG_FUNCTION_INFO_V1(weighted_pair_agg_finalfn);
+
+Datum
+weighted_pair_agg_finalfn(PG_FUNCTION_ARGS)
+{
+    PairAggState *state;
+    Oid elemtype;
+    
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    
+    state = (PairAggState *)PG_GETARG_POINTER(0);
+    
+    /* The weighted_pair OID is not fixed, so derive it from our result type */
+    elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+    if (!OidIsValid(elemtype)) {
+        elog(ERROR, "could not determine weighted_pair element type");
+    }
+    
+    PG_RETURN_ARRAYTYPE_P(construct_pair_array(state->pairs, state->n_pairs, elemtype));
+}
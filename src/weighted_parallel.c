@@ -0,0 +1,143 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Worker Threads
+ *
+ * Minimal fork/join helper for CPU-bound kernels over very large inputs. The
+ * calling backend splits its work into independent tasks over buffers it has
+ * already allocated; the tasks run on short-lived worker threads plus the
+ * backend itself and must not call any PostgreSQL function (no palloc, no
+ * ereport, no syscache): they only read their inputs and write their own
+ * slice of the outputs.
+ *
+ * Opt-in with weighted_statistics.max_worker_threads (default 1, i.e. no
+ * threads); inputs smaller than weighted_statistics.parallel_min_elements
+ * always run in the backend.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/guc.h"
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "utils.h"
+
+/* Upper bound of weighted_statistics.max_worker_threads */
+#define MAX_WORKER_THREADS 64
+
+/* GUC: threads used per kernel, including the backend (1 disables) */
+static int max_worker_threads = 1;
+
+/* GUC: smallest input (in elements) worth starting threads for */
+static int parallel_min_elements = 1000000;
+
+/* What each thread runs: tasks first, first + stride, first + 2 * stride, ... */
+typedef struct {
+    ParallelTaskFunc func;
+    void *arg;
+    int n_tasks;
+    int first;
+    int stride;
+} WorkerSlice;
+
+/*
+ * Register the GUCs (called from _PG_init)
+ */
+void
+weighted_parallel_register(void)
+{
+    DefineCustomIntVariable("weighted_statistics.max_worker_threads",
+                            "Maximum number of threads used by a single large computation.",
+                            "Counts the backend itself; 1 disables the worker threads.",
+                            &max_worker_threads,
+                            1,
+                            1, MAX_WORKER_THREADS,
+                            PGC_USERSET,
+                            0,
+                            NULL, NULL, NULL);
+    
+    DefineCustomIntVariable("weighted_statistics.parallel_min_elements",
+                            "Minimum number of input elements for using worker threads.",
+                            NULL,
+                            &parallel_min_elements,
+                            1000000,
+                            1, INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL, NULL, NULL);
+}
+
+/*
+ * Number of threads to use for an input of n_elements split into n_tasks
+ *
+ * Returns 1 when the computation should stay in the backend.
+ */
+int
+weighted_parallel_threads(int64 n_elements, int n_tasks)
+{
+    if (max_worker_threads <= 1 || n_elements < parallel_min_elements || n_tasks <= 1) {
+        return 1;
+    }
+    
+    return Min(max_worker_threads, n_tasks);
+}
+
+/* Thread body: run every stride-th task */
+static void *
+worker_main(void *arg)
+{
+    WorkerSlice *slice = (WorkerSlice *)arg;
+    int task;
+    
+    for (task = slice->first; task < slice->n_tasks; task += slice->stride) {
+        slice->func(slice->arg, task);
+    }
+    
+    return NULL;
+}
+
+/*
+ * Run func(arg, 0) ... func(arg, n_tasks - 1) on up to n_threads threads
+ *
+ * The backend runs its own share and then joins the workers, so the outputs
+ * are complete on return. Tasks are assigned statically, so callers that keep
+ * one output slot per task get the same results for any thread count. If a
+ * thread cannot be started, the backend runs its tasks too.
+ */
+void
+weighted_parallel_run(ParallelTaskFunc func, void *arg, int n_tasks, int n_threads)
+{
+    pthread_t threads[MAX_WORKER_THREADS];
+    bool started[MAX_WORKER_THREADS];
+    WorkerSlice slices[MAX_WORKER_THREADS];
+    sigset_t all_signals, old_signals;
+    int t;
+    
+    n_threads = Max(1, Min(n_threads, Min(n_tasks, MAX_WORKER_THREADS)));
+    
+    for (t = 0; t < n_threads; t++) {
+        slices[t].func = func;
+        slices[t].arg = arg;
+        slices[t].n_tasks = n_tasks;
+        slices[t].first = t;
+        slices[t].stride = n_threads;
+        started[t] = false;
+    }
+    
+    /* Signals must keep going to the backend's own thread */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    for (t = 1; t < n_threads; t++) {
+        started[t] = (pthread_create(&threads[t], NULL, worker_main, &slices[t]) == 0);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    
+    worker_main(&slices[0]);
+    for (t = 1; t < n_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            worker_main(&slices[t]);
+        }
+    }
+}
@@ -0,0 +1,518 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Exact Quantile Aggregate
+ *
+ * weighted_quantile_agg(value, weight, quantiles) gives the result of
+ * weighted_quantile(array_agg(value), array_agg(weight), quantiles) without
+ * building the arrays and without holding a large group in memory. Rows are
+ * buffered in memory until the buffer reaches work_mem; then the buffer is
+ * sorted and written to a temporary file as one run, like an external sort.
+ * The final function merges the sorted runs and the last in-memory run with
+ * a binary heap and resolves the quantile targets against the cumulative
+ * weight as the pairs stream by. Groups that never spill are finished by the
+ * same in-memory code as weighted_quantile.
+ *
+ * weighted_var_es_agg(value, weight, levels) collects rows the same way and
+ * gives the result of weighted_var_es, adding the expected shortfall sums to
+ * the same merge.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "lib/binaryheap.h"
+#include "miscadmin.h"
+#include "storage/buffile.h"
+#include "utils/array.h"
+#include "utils/memutils.h"
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* Initial capacity of the in-memory run */
+#define QUANTILE_AGG_INITIAL_SIZE 64
+
+/* Pairs read from a spilled run at a time while merging */
+#define MERGE_MIN_BATCH 16
+#define MERGE_MAX_BATCH 1024
+
+/* A sorted run in the temporary file */
+typedef struct {
+    int fileno;             /* BufFile position of its first pair */
+    off_t offset;
+    int64 n_pairs;
+} SpillRun;
+
+/*
+ * Transition state of weighted_quantile_agg
+ *
+ * Only positive weights are kept. The buffer always has one spare slot for
+ * the implicit zero of sparse data.
+ */
+typedef struct {
+    MemoryContext context;  /* aggregate context holding the state */
+    ValueWeight *pairs;     /* current in-memory run, unsorted */
+    int n_pairs;
+    int capacity;
+    int max_pairs;          /* spill threshold, from work_mem */
+    double sum_weights;     /* positive weights, summed in input order */
+    double sum_values;      /* weight * value of the same rows */
+    double *quantiles;      /* levels of the first row, NULL if that was NULL */
+    int n_quantiles;
+    BufFile *file;          /* sorted runs back to back, NULL until the first spill */
+    SpillRun *runs;
+    int n_runs;
+    int runs_capacity;
+    MemoryContextCallback cleanup;  /* closes the file if the state is reset early */
+} QuantileAggState;
+
+/* Read position in one sorted run while merging */
+typedef struct {
+    uint64_t key;           /* sortable key of the next pair */
+    ValueWeight *batch;     /* pairs read but not yet merged */
+    int n_batch;
+    int pos;
+    int fileno;             /* where the next batch starts */
+    off_t offset;
+    int64 remaining;        /* pairs of the run not yet read into a batch */
+} MergeSource;
+
+/* A quantile target cumulative weight and where its result goes */
+typedef struct {
+    double target;
+    int index;
+} MergeTarget;
+
+static int
+compare_merge_targets(const void *a, const void *b)
+{
+    const MergeTarget *ta = (const MergeTarget *)a;
+    const MergeTarget *tb = (const MergeTarget *)b;
+    
+    if (ta->target < tb->target) return -1;
+    if (ta->target > tb->target) return 1;
+    return ta->index - tb->index;
+}
+
+/*
+ * binaryheap keeps the greatest element on top, so the source with the
+ * smallest key compares greatest; ties go to the earlier run
+ */
+static int
+compare_merge_sources(Datum a, Datum b, void *arg)
+{
+    MergeSource *sources = (MergeSource *) arg;
+    int source_a = DatumGetInt32(a);
+    int source_b = DatumGetInt32(b);
+    
+    if (sources[source_a].key < sources[source_b].key) return 1;
+    if (sources[source_a].key > sources[source_b].key) return -1;
+    return source_b - source_a;
+}
+
+/* Reset callback of the aggregate context */
+static void
+quantile_agg_cleanup(void *arg)
+{
+    QuantileAggState *state = (QuantileAggState *) arg;
+    
+    if (state->file != NULL) {
+        BufFileClose(state->file);
+        state->file = NULL;
+    }
+}
+
+/* Allocate an empty transition state in the aggregate memory context */
+static QuantileAggState *
+quantile_agg_create(MemoryContext agg_context, ArrayType *quantiles_array)
+{
+    MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+    QuantileAggState *state;
+    Size max_pairs;
+    
+    state = (QuantileAggState *)palloc0(sizeof(QuantileAggState));
+    state->context = agg_context;
+    state->capacity = QUANTILE_AGG_INITIAL_SIZE;
+    state->pairs = (ValueWeight *)palloc((state->capacity + 1) * sizeof(ValueWeight));
+    
+    /* work_mem of pairs, but no huge allocation for the buffer */
+    max_pairs = (Size) work_mem * 1024 / sizeof(ValueWeight);
+    max_pairs = Min(max_pairs, MaxAllocSize / sizeof(ValueWeight) - 1);
+    state->max_pairs = (int) Max(max_pairs, QUANTILE_AGG_INITIAL_SIZE);
+    
+    if (quantiles_array != NULL) {
+        state->quantiles = extract_quantile_levels(quantiles_array, &state->n_quantiles);
+    }
+    
+    state->cleanup.func = quantile_agg_cleanup;
+    state->cleanup.arg = state;
+    
+    MemoryContextSwitchTo(old_context);
+    return state;
+}
+
+/* Sort the in-memory run and append it to the temporary file */
+static void
+quantile_agg_spill(QuantileAggState *state)
+{
+    MemoryContext old_context;
+    SpillRun *run;
+    
+    optimized_sort_value_weight_pairs(state->pairs, state->n_pairs);
+    
+    old_context = MemoryContextSwitchTo(state->context);
+    
+    if (state->file == NULL) {
+        /*
+         * Not owned by the transaction's resource owner, so the reset
+         * callback is the one place that closes it
+         */
+        state->file = BufFileCreateTemp(true);
+        MemoryContextRegisterResetCallback(state->context, &state->cleanup);
+        state->runs_capacity = 16;
+        state->runs = (SpillRun *)palloc(state->runs_capacity * sizeof(SpillRun));
+    } else if (state->n_runs >= state->runs_capacity) {
+        state->runs_capacity *= 2;
+        state->runs = (SpillRun *)repalloc(state->runs,
+                                           state->runs_capacity * sizeof(SpillRun));
+    }
+    
+    run = &state->runs[state->n_runs++];
+    BufFileTell(state->file, &run->fileno, &run->offset);
+    run->n_pairs = state->n_pairs;
+    BufFileWrite(state->file, state->pairs, (Size) state->n_pairs * sizeof(ValueWeight));
+    state->n_pairs = 0;
+    
+    MemoryContextSwitchTo(old_context);
+}
+
+/* Read the next batch of a spilled run; false once the run is exhausted */
+static bool
+merge_source_fill(BufFile *file, MergeSource *source, int batch_size)
+{
+    int n = (int) Min(source->remaining, (int64) batch_size);
+    Size nbytes = (Size) n * sizeof(ValueWeight);
+    
+    if (n == 0) {
+        return false;
+    }
+    
+    CHECK_FOR_INTERRUPTS();
+    
+    if (BufFileSeek(file, source->fileno, source->offset, SEEK_SET) != 0) {
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not seek in weighted quantile spill file")));
+    }
+    if (BufFileRead(file, source->batch, nbytes) != nbytes) {
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not read from weighted quantile spill file")));
+    }
+    BufFileTell(file, &source->fileno, &source->offset);
+    
+    source->remaining -= n;
+    source->n_batch = n;
+    source->pos = 0;
+    return true;
+}
+
+/* Same interpolation rule as the empirical CDF kernel */
+static inline double
+resolve_merge_target(double target, bool prev_valid, double prev_value, double prev_cum,
+                     double value, double cum)
+{
+    double interp_factor;
+    
+    if (!prev_valid || cum == target) {
+        return value;
+    }
+    interp_factor = (target - prev_cum) / (cum - prev_cum);
+    return prev_value + interp_factor * (value - prev_value);
+}
+
+/*
+ * Empirical CDF quantiles of a spilled group
+ *
+ * k-way merge of the sorted runs and the in-memory run; each target takes
+ * the first pair whose running cumulative weight reaches it, so only one
+ * batch per run is in memory besides the in-memory run itself. When
+ * shortfalls is not NULL it gets the expected shortfall of every level, from
+ * the running sum of w (x - mean) as in weighted_var_es.
+ */
+static void
+quantile_agg_merge_runs(QuantileAggState *state, double *results, double *shortfalls)
+{
+    double total_weight = state->sum_weights;
+    int n_sources = state->n_runs + 1;
+    int batch_size;
+    MergeSource *sources;
+    MergeTarget *targets;
+    binaryheap *heap;
+    int n_targets = 0;
+    int s, t;
+    double first_value = 0.0;
+    double value = 0.0, cum = 0.0;
+    double prev_value = 0.0, prev_cum = 0.0;
+    bool prev_valid = false, have_value = false;
+    double mean, centered = 0.0;
+    
+    /* Handle sparse data: add implicit zero if total weight < 1.0 */
+    if (total_weight < 1.0) {
+        state->pairs[state->n_pairs].value = 0.0;
+        state->pairs[state->n_pairs].weight = 1.0 - total_weight;
+        state->n_pairs++;
+        total_weight = 1.0;
+    }
+    mean = state->sum_values / total_weight;
+    optimized_sort_value_weight_pairs(state->pairs, state->n_pairs);
+    
+    /* Interior targets in ascending order; the extremes are the first and last pair */
+    targets = (MergeTarget *)palloc(state->n_quantiles * sizeof(MergeTarget));
+    for (t = 0; t < state->n_quantiles; t++) {
+        if (state->quantiles[t] > 0.0 && state->quantiles[t] < 1.0) {
+            targets[n_targets].target = state->quantiles[t] * total_weight;
+            targets[n_targets].index = t;
+            n_targets++;
+        }
+    }
+    qsort(targets, n_targets, sizeof(MergeTarget), compare_merge_targets);
+    
+    /* The read batches together take about as much memory as the in-memory run */
+    batch_size = Max(MERGE_MIN_BATCH, Min(MERGE_MAX_BATCH, state->max_pairs / state->n_runs));
+    
+    sources = (MergeSource *)palloc(n_sources * sizeof(MergeSource));
+    heap = binaryheap_allocate(n_sources, compare_merge_sources, sources);
+    for (s = 0; s < state->n_runs; s++) {
+        sources[s].batch = (ValueWeight *)palloc(batch_size * sizeof(ValueWeight));
+        sources[s].fileno = state->runs[s].fileno;
+        sources[s].offset = state->runs[s].offset;
+        sources[s].remaining = state->runs[s].n_pairs;
+        if (merge_source_fill(state->file, &sources[s], batch_size)) {
+            sources[s].key = sortable_double_key(sources[s].batch[0].value);
+            binaryheap_add_unordered(heap, Int32GetDatum(s));
+        }
+    }
+    sources[s].batch = state->pairs;
+    sources[s].n_batch = state->n_pairs;
+    sources[s].pos = 0;
+    sources[s].remaining = 0;
+    if (state->n_pairs > 0) {
+        sources[s].key = sortable_double_key(state->pairs[0].value);
+        binaryheap_add_unordered(heap, Int32GetDatum(s));
+    }
+    binaryheap_build(heap);
+    
+    t = 0;
+    while (!binaryheap_empty(heap)) {
+        MergeSource *source;
+        ValueWeight pair;
+        
+        s = DatumGetInt32(binaryheap_first(heap));
+        source = &sources[s];
+        pair = source->batch[source->pos++];
+        
+        if (source->pos < source->n_batch ||
+            merge_source_fill(state->file, source, batch_size)) {
+            source->key = sortable_double_key(source->batch[source->pos].value);
+            binaryheap_replace_first(heap, Int32GetDatum(s));
+        } else {
+            binaryheap_remove_first(heap);
+        }
+        
+        if (have_value) {
+            prev_valid = true;
+            prev_value = value;
+            prev_cum = cum;
+        } else {
+            first_value = pair.value;
+            have_value = true;
+        }
+        value = pair.value;
+        cum += pair.weight;
+        
+        while (t < n_targets && targets[t].target <= cum) {
+            results[targets[t].index] = resolve_merge_target(targets[t].target, prev_valid,
+                                                             prev_value, prev_cum, value, cum);
+            if (shortfalls != NULL) {
+                shortfalls[targets[t].index] = centered + (targets[t].target - prev_cum) *
+                                                          (value - mean);
+            }
+            t++;
+        }
+        centered += pair.weight * (value - mean);
+    }
+    
+    /* Rounding can leave targets above the summed weight: use the last pair */
+    for (; t < n_targets; t++) {
+        results[targets[t].index] = resolve_merge_target(targets[t].target, prev_valid,
+                                                         prev_value, prev_cum, value, cum);
+        if (shortfalls != NULL) {
+            shortfalls[targets[t].index] = centered;
+        }
+    }
+    
+    for (t = 0; t < state->n_quantiles; t++) {
+        if (state->quantiles[t] <= 0.0) {
+            results[t] = first_value;
+        } else if (state->quantiles[t] >= 1.0) {
+            results[t] = value;
+        }
+        if (shortfalls != NULL) {
+            double tail_weight = total_weight - Max(state->quantiles[t], 0.0) * total_weight;
+            
+            if (state->quantiles[t] <= 0.0) {
+                shortfalls[t] = mean + centered / total_weight;
+            } else if (state->quantiles[t] < 1.0 && tail_weight > 0.0) {
+                shortfalls[t] = mean + (centered - shortfalls[t]) / tail_weight;
+            } else {
+                shortfalls[t] = value;
+            }
+        }
+    }
+    
+    binaryheap_free(heap);
+    for (s = 0; s < state->n_runs; s++) {
+        pfree(sources[s].batch);
+    }
+    pfree(sources);
+    pfree(targets);
+}
+
+/*
+ * weighted_quantile_agg_transfn - Buffer one (value, weight) row
+ *
+ * Rows with NULL or non-positive weights are dropped, as weighted_quantile
+ * drops them; a NULL value reads as 0.0. The quantile levels are read from
+ * the first row of the group.
+ */
+PG_FUNCTION_INFO_V1(weighted_quantile_agg_transfn);
+
+Datum
+weighted_quantile_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    QuantileAggState *state;
+    double weight;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "weighted_quantile_agg_transfn called in non-aggregate context");
+    }
+    
+    if (PG_ARGISNULL(0)) {
+        state = quantile_agg_create(agg_context,
+                                    PG_ARGISNULL(3) ? NULL : PG_GETARG_ARRAYTYPE_P(3));
+    } else {
+        state = (QuantileAggState *)PG_GETARG_POINTER(0);
+    }
+    
+    /* NULL levels give a NULL result, so there is nothing to collect */
+    weight = PG_ARGISNULL(2) ? 0.0 : PG_GETARG_FLOAT8(2);
+    if (weight > 0.0 && state->quantiles != NULL) {
+        ValueWeight *pair;
+        
+        if (state->n_pairs >= state->capacity) {
+            if (state->capacity < state->max_pairs) {
+                state->capacity = Min(state->capacity * 2, state->max_pairs);
+                state->pairs = (ValueWeight *)repalloc(state->pairs,
+                                                       (state->capacity + 1) * sizeof(ValueWeight));
+            } else {
+                quantile_agg_spill(state);
+            }
+        }
+        
+        pair = &state->pairs[state->n_pairs++];
+        pair->value = PG_ARGISNULL(1) ? 0.0 : PG_GETARG_FLOAT8(1);
+        pair->weight = weight;
+        state->sum_weights += weight;
+        state->sum_values += weight * pair->value;
+    }
+    
+    PG_RETURN_POINTER(state);
+}
+
+/*
+ * weighted_quantile_agg_finalfn - Quantiles of the collected rows
+ *
+ * Consumes the state (FINALFUNC_MODIFY = READ_WRITE): the in-memory buffer is
+ * sorted or handed over, and the temporary file is closed.
+ */
+PG_FUNCTION_INFO_V1(weighted_quantile_agg_finalfn);
+
+Datum
+weighted_quantile_agg_finalfn(PG_FUNCTION_ARGS)
+{
+    QuantileAggState *state;
+    ArrayType *result_array;
+    double *results;
+    
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    
+    state = (QuantileAggState *)PG_GETARG_POINTER(0);
+    if (state->quantiles == NULL) {
+        PG_RETURN_NULL();
+    }
+    
+    if (state->file == NULL) {
+        /* The group fit in work_mem: the same path as weighted_quantile */
+        result_array = empirical_quantiles_from_pairs(state->pairs, state->n_pairs,
+                                                      state->quantiles, state->n_quantiles);
+        state->pairs = NULL;
+        state->n_pairs = 0;
+        PG_RETURN_ARRAYTYPE_P(result_array);
+    }
+    
+    results = (double *)palloc(state->n_quantiles * sizeof(double));
+    quantile_agg_merge_runs(state, results, NULL);
+    result_array = build_quantile_result(results, state->n_quantiles);
+    pfree(results);
+    
+    BufFileClose(state->file);
+    state->file = NULL;
+    
+    PG_RETURN_ARRAYTYPE_P(result_array);
+}
+
+/*
+ * weighted_var_es_agg_finalfn - VaR and expected shortfall of the collected rows
+ *
+ * Consumes the state like weighted_quantile_agg_finalfn.
+ */
+PG_FUNCTION_INFO_V1(weighted_var_es_agg_finalfn);
+
+Datum
+weighted_var_es_agg_finalfn(PG_FUNCTION_ARGS)
+{
+    QuantileAggState *state;
+    ArrayType *result_array;
+    double *results;
+    
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    
+    state = (QuantileAggState *)PG_GETARG_POINTER(0);
+    if (state->quantiles == NULL) {
+        PG_RETURN_NULL();
+    }
+    
+    if (state->file == NULL) {
+        /* The group fit in work_mem: the same path as weighted_var_es */
+        result_array = var_es_from_pairs(state->pairs, state->n_pairs,
+                                         state->quantiles, state->n_quantiles);
+        state->pairs = NULL;
+        state->n_pairs = 0;
+        PG_RETURN_ARRAYTYPE_P(result_array);
+    }
+    
+    results = (double *)palloc(Max(2 * state->n_quantiles, 1) * sizeof(double));
+    quantile_agg_merge_runs(state, results, results + state->n_quantiles);
+    result_array = build_var_es_result(results, state->n_quantiles);
+    pfree(results);
+    
+    BufFileClose(state->file);
+    state->file = NULL;
+    
+    PG_RETURN_ARRAYTYPE_P(result_array);
+}
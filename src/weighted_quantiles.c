@@ -5,14 +5,19 @@
  * - weighted_quantile: Simple weighted empirical CDF (existing)
  * - wquantile: Weighted Type 7 quantile (linear interpolation)
  * - whdquantile: Weighted Harrell-Davis quantile
+ * - weighted_lmoments: L-moments, integrals of the quantile function
+ * - weighted_expectile: asymmetric least-squares analogues of quantiles
+ * - weighted_var_es: Value-at-Risk and expected shortfall
  */
 
 #include "postgres.h"
 #include "fmgr.h"
+#include "nodes/primnodes.h"
 #include "utils/array.h"
 #include "utils/lsyscache.h"
 #include "utils/builtins.h"
 #include "catalog/pg_type.h"
+#include "utils/guc.h"
 #include <math.h>
 #include <string.h>
 
@@ -24,8 +29,49 @@
 #define STOP 1.0e-8
 #define TINY 1.0e-30
 
-static double beta_cdf(double x, double a, double b) {
-    const double lbeta_ab = lgamma(a) + lgamma(b) - lgamma(a + b);
+/* GUC: convergence tolerance of the continued fraction (default STOP) */
+static double beta_cdf_tolerance = STOP;
+
+/* GUC: continued fraction terms evaluated before giving up (NaN) */
+static int beta_cdf_max_iterations = 200;
+
+/*
+ * Register the GUCs (called from _PG_init)
+ *
+ * Looser settings trade Harrell-Davis accuracy for speed; see
+ * reference/benchmark_approximations.py.
+ */
+void
+weighted_quantiles_register(void)
+{
+    DefineCustomRealVariable("weighted_statistics.beta_cdf_tolerance",
+                             "Convergence tolerance of the incomplete beta function used by whdquantile.",
+                             NULL,
+                             &beta_cdf_tolerance,
+                             STOP,
+                             1.0e-15, 1.0e-2,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+    
+    DefineCustomIntVariable("weighted_statistics.beta_cdf_max_iterations",
+                            "Maximum continued fraction terms of the incomplete beta function used by whdquantile.",
+                            "Quantiles whose evaluation does not converge are NaN.",
+                            &beta_cdf_max_iterations,
+                            200,
+                            10, 1000000,
+                            PGC_USERSET,
+                            0,
+                            NULL, NULL, NULL);
+}
+
+/*
+ * Regularized incomplete beta I_x(a, b), given lbeta_ab = log(B(a, b))
+ *
+ * Does not touch global state (lgamma sets signgam), so it can run on worker
+ * threads with the normalizer computed by the caller.
+ */
+static double beta_cdf_lbeta(double x, double a, double b, double lbeta_ab) {
     const double front = exp(log(x) * a + log(1.0 - x) * b - lbeta_ab) / a;
     double f = 1.0, c = 1.0, d = 0.0;
     int i, m;
@@ -45,11 +91,11 @@ static double beta_cdf(double x, double a, double b) {
     /* The continued fraction converges nicely for x < (a+1)/(a+b+2) */
     if (x > (a + 1.0) / (a + b + 2.0)) {
         /* Use the fact that beta is symmetrical */
-        return 1.0 - beta_cdf(1.0 - x, b, a);
+        return 1.0 - beta_cdf_lbeta(1.0 - x, b, a, lbeta_ab);
     }
     
     /* Use Lentz's algorithm to evaluate the continued fraction */
-    for (i = 0; i <= 200; ++i) {
+    for (i = 0; i <= beta_cdf_max_iterations; ++i) {
         m = i / 2;
         
         if (i == 0) {
@@ -74,7 +120,7 @@ static double beta_cdf(double x, double a, double b) {
         f *= cd;
         
         /* Check for stop */
-        if (fabs(1.0 - cd) < STOP) {
+        if (fabs(1.0 - cd) < beta_cdf_tolerance) {
             return front * (f - 1.0);
         }
     }
@@ -83,126 +129,405 @@ static double beta_cdf(double x, double a, double b) {
     return NAN;
 }
 
+/* log(B(a, b)), the normalizer of the Beta distribution */
+static double log_beta(double a, double b) {
+    return lgamma(a) + lgamma(b) - lgamma(a + b);
+}
+
 /*
- * weighted_quantile_sparse_c - Simple weighted quantile using empirical CDF
- * 
- * This is the existing implementation that corresponds to Python's weighted_quantile
+ * Requested quantile levels, parsed and validated
+ *
+ * order lists the level indices by ascending level (NULL when the levels
+ * already ascend), so the empirical kernel locates them all in one forward
+ * sweep. When the levels argument is a constant or a parameter
+ * (get_fn_expr_arg_stable) the entry points keep one of these in fn_extra
+ * for the call site, with room for the Harrell-Davis Beta parameters of the
+ * last effective sample size seen; a parameter can change between calls, so
+ * its array is kept too and compared on each call. Otherwise it lives on the
+ * stack for one call, and up to SMALL_ARRAY_MAX_ELEMENTS levels use the
+ * embedded buffers.
  */
-PG_FUNCTION_INFO_V1(weighted_quantile_sparse_c);
+typedef struct {
+    int n_quantiles;
+    double *levels;             /* in the requested order */
+    int *order;                 /* ascending level indices, or NULL */
+    bool cached;                /* kept in fn_extra, never freed */
+    bool own_levels;            /* levels was allocated for this struct */
+    ArrayType *source;          /* copy of a non-Const argument, else NULL */
+    
+    /* Harrell-Davis a, b and log(B(a, b)) per level (cached entries only) */
+    double *hd_a;
+    double *hd_b;
+    double *hd_lbeta;
+    bool hd_valid;              /* computed for hd_n_eff and hd_several */
+    double hd_n_eff;
+    bool hd_several;            /* more than one pair */
+    
+    double small_levels[SMALL_ARRAY_MAX_ELEMENTS];
+    int small_order[SMALL_ARRAY_MAX_ELEMENTS];
+} QuantileLevels;
 
-Datum
-weighted_quantile_sparse_c(PG_FUNCTION_ARGS)
+/* Signature shared by the quantile kernels below */
+typedef void (*QuantileKernel) (ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                                QuantileLevels *levels, double *results);
+
+static void empirical_quantile_kernel(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                                      QuantileLevels *levels, double *results);
+static void hd_quantile_kernel(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                               QuantileLevels *levels, double *results);
+static void expectile_kernel(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                             QuantileLevels *levels, double *results);
+
+/*
+ * Above this many pairs, empirical CDF quantiles use radix select instead of
+ * sorting everything, as long as only a few quantiles are requested (each
+ * one keeps a bucket of elements for refinement)
+ */
+#define RADIX_SELECT_MIN_PAIRS 65536
+#define RADIX_SELECT_MAX_QUANTILES 64
+
+/*
+ * Read and validate the requested quantile levels
+ *
+ * The levels are stored in buffer when they fit in buffer_size entries and
+ * in a palloc'd copy otherwise. Arrays without NULLs are read in place.
+ * levels_name names the levels in the out-of-range error.
+ */
+static double *
+read_quantile_levels(ArrayType *quantiles_array, const char *levels_name, double *buffer,
+                     int buffer_size, int *n_quantiles)
 {
-    ArrayType *vals_array, *weights_array, *quantiles_array;
-    double *vals, *weights, *quantiles;
-    int n_elements, n_quantiles;
-    double total_weight = 0.0;
-    ValueWeight *vw_pairs;
-    int n_pairs = 0;
-    ArrayType *result_array;
-    Datum *result_datums;
-    Datum *q_datums;
-    bool *q_nulls;
-    int q_count;
-    int i, q_idx;
-    double *cumulative_weights;
-    double cumsum;
+    double *quantiles;
+    int n;
+    int i;
     
-    /* Handle NULL inputs */
-    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
-        /* Return array of zeros */
-        quantiles_array = PG_GETARG_ARRAYTYPE_P(2);
-        
-        deconstruct_array(quantiles_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                          &q_datums, &q_nulls, &q_count);
+    n = ArrayGetNItems(ARR_NDIM(quantiles_array), ARR_DIMS(quantiles_array));
+    quantiles = n <= buffer_size ? buffer : (double *)palloc(Max(n, 1) * sizeof(double));
+    
+    if (!ARR_HASNULL(quantiles_array)) {
+        memcpy(quantiles, ARR_DATA_PTR(quantiles_array), n * sizeof(double));
+    } else {
+        bits8 *bitmap = ARR_NULLBITMAP(quantiles_array);
+        const char *data = ARR_DATA_PTR(quantiles_array);
         
-        result_datums = (Datum *)palloc(q_count * sizeof(Datum));
-        for (i = 0; i < q_count; i++) {
-            result_datums[i] = Float8GetDatum(0.0);
+        for (i = 0; i < n; i++) {
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                memcpy(&quantiles[i], data, sizeof(double));
+                data += sizeof(double);
+            } else {
+                quantiles[i] = 0.0;
+            }
         }
-        
-        result_array = construct_array(result_datums, q_count, FLOAT8OID,
-                                       8, FLOAT8PASSBYVAL, 'd');
-        
-        pfree(result_datums);
-        PG_RETURN_ARRAYTYPE_P(result_array);
     }
     
-    /* Get input arrays */
-    vals_array = PG_GETARG_ARRAYTYPE_P(0);
-    weights_array = PG_GETARG_ARRAYTYPE_P(1);
-    quantiles_array = PG_GETARG_ARRAYTYPE_P(2);
-    
-    /* Extract quantiles array */
-    deconstruct_array(quantiles_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                      &q_datums, &q_nulls, &n_quantiles);
-    
-    quantiles = (double *)palloc(n_quantiles * sizeof(double));
-    for (i = 0; i < n_quantiles; i++) {
-        quantiles[i] = q_nulls[i] ? 0.0 : DatumGetFloat8(q_datums[i]);
-        /* Validate quantile values */
+    /* Validate quantile values */
+    for (i = 0; i < n; i++) {
         if (quantiles[i] < 0.0 || quantiles[i] > 1.0 || isnan(quantiles[i]) || isinf(quantiles[i])) {
-            pfree(quantiles);
             ereport(ERROR,
                     (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("quantile values must be between 0 and 1")));
+                     errmsg("%s must be between 0 and 1", levels_name)));
         }
     }
     
-    /* Extract value and weight arrays */
-    if (extract_double_arrays(vals_array, weights_array, &vals, &weights, &n_elements) < 0) {
-        /* Return zeros on error */
-        result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
-        for (i = 0; i < n_quantiles; i++) {
-            result_datums[i] = Float8GetDatum(0.0);
+    *n_quantiles = n;
+    return quantiles;
+}
+
+/* Order level indices by level, ties by index */
+static int
+compare_level_index(const void *a, const void *b, void *arg)
+{
+    const double *levels = (const double *) arg;
+    int i = *(const int *) a;
+    int j = *(const int *) b;
+    
+    if (levels[i] < levels[j]) return -1;
+    if (levels[i] > levels[j]) return 1;
+    return (i > j) - (i < j);
+}
+
+/* Point levels at n validated quantile levels and work out their order */
+static void
+set_quantile_levels(QuantileLevels *levels, double *quantiles, int n, bool own_levels)
+{
+    int i;
+    
+    levels->n_quantiles = n;
+    levels->levels = quantiles;
+    levels->own_levels = own_levels;
+    levels->order = NULL;
+    
+    for (i = 1; i < n; i++) {
+        if (quantiles[i] < quantiles[i - 1]) {
+            break;
+        }
+    }
+    if (i < n) {
+        levels->order = n <= SMALL_ARRAY_MAX_ELEMENTS ? levels->small_order
+                                                      : (int *)palloc(n * sizeof(int));
+        for (i = 0; i < n; i++) {
+            levels->order[i] = i;
+        }
+        qsort_arg(levels->order, n, sizeof(int), compare_level_index, quantiles);
+    }
+}
+
+/* Parse a levels argument into levels (which must be zeroed) */
+static void
+init_quantile_levels(QuantileLevels *levels, ArrayType *quantiles_array,
+                     const char *levels_name)
+{
+    double *quantiles;
+    int n;
+    
+    quantiles = read_quantile_levels(quantiles_array, levels_name, levels->small_levels,
+                                     SMALL_ARRAY_MAX_ELEMENTS, &n);
+    set_quantile_levels(levels, quantiles, n, quantiles != levels->small_levels);
+}
+
+/* Free what set_quantile_levels allocated, unless the call site keeps it */
+static void
+release_quantile_levels(QuantileLevels *levels)
+{
+    if (levels->cached) {
+        return;
+    }
+    if (levels->order != NULL && levels->order != levels->small_order) {
+        pfree(levels->order);
+    }
+    if (levels->own_levels) {
+        pfree(levels->levels);
+    }
+}
+
+/* Whether argument argno of the call expression is a Const node */
+static bool
+fn_expr_arg_is_const(FmgrInfo *flinfo, int argno)
+{
+    Node *expr = flinfo->fn_expr;
+    List *args;
+    
+    if (expr == NULL || !IsA(expr, FuncExpr)) {
+        return false;
+    }
+    args = ((FuncExpr *) expr)->args;
+    return argno < list_length(args) && IsA(list_nth(args, argno), Const);
+}
+
+/*
+ * Quantile levels of a call, from argument argno
+ *
+ * A constant or parameter argument is parsed into fn_mcxt and kept in
+ * fn_extra; the Harrell-Davis kernel also gets room to keep its parameters
+ * there. A parameter (e.g. a PL/pgSQL variable) keeps the same call site
+ * while its value changes, so its array is copied alongside and the levels
+ * are parsed again whenever the argument differs. Anything else is parsed
+ * into local for this call only. The expectile kernel's levels are reported
+ * as expectile levels in errors.
+ */
+static QuantileLevels *
+get_quantile_levels(FunctionCallInfo fcinfo, int argno, QuantileKernel kernel,
+                    QuantileLevels *local)
+{
+    FmgrInfo *flinfo = fcinfo->flinfo;
+    ArrayType *quantiles_array;
+    QuantileLevels *levels;
+    MemoryContext oldcontext;
+    const char *levels_name = kernel == expectile_kernel ? "expectile levels"
+                                                         : "quantile values";
+    
+    levels = flinfo != NULL ? (QuantileLevels *) flinfo->fn_extra : NULL;
+    if (levels != NULL && levels->source == NULL) {
+        return levels;
+    }
+    
+    quantiles_array = PG_GETARG_ARRAYTYPE_P(argno);
+    if (levels != NULL) {
+        if (VARSIZE(levels->source) == VARSIZE(quantiles_array) &&
+            memcmp(levels->source, quantiles_array, VARSIZE(quantiles_array)) == 0) {
+            return levels;
         }
         
-        result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                       8, FLOAT8PASSBYVAL, 'd');
+        /* The parameter changed: drop the old levels and parse the new ones */
+        flinfo->fn_extra = NULL;
+        if (levels->order != NULL && levels->order != levels->small_order) {
+            pfree(levels->order);
+        }
+        if (levels->own_levels) {
+            pfree(levels->levels);
+        }
+        if (levels->hd_a != NULL) {
+            pfree(levels->hd_a);
+        }
+        pfree(levels->source);
+        pfree(levels);
+    } else if (flinfo == NULL || !get_fn_expr_arg_stable(flinfo, argno)) {
+        memset(local, 0, offsetof(QuantileLevels, small_levels));
+        init_quantile_levels(local, quantiles_array, levels_name);
+        return local;
+    }
+    
+    oldcontext = MemoryContextSwitchTo(flinfo->fn_mcxt);
+    levels = (QuantileLevels *)palloc0(sizeof(QuantileLevels));
+    init_quantile_levels(levels, quantiles_array, levels_name);
+    levels->cached = true;
+    if (!fn_expr_arg_is_const(flinfo, argno)) {
+        levels->source = (ArrayType *)palloc(VARSIZE(quantiles_array));
+        memcpy(levels->source, quantiles_array, VARSIZE(quantiles_array));
+    }
+    if (kernel == hd_quantile_kernel) {
+        int n = Max(levels->n_quantiles, 1);
         
-        pfree(quantiles);
-        pfree(result_datums);
-        PG_RETURN_ARRAYTYPE_P(result_array);
+        levels->hd_a = (double *)palloc(3 * n * sizeof(double));
+        levels->hd_b = levels->hd_a + n;
+        levels->hd_lbeta = levels->hd_a + 2 * n;
+    }
+    MemoryContextSwitchTo(oldcontext);
+    
+    flinfo->fn_extra = levels;
+    return levels;
+}
+
+/* Extract and validate the requested quantile levels into a palloc'd buffer */
+double *
+extract_quantile_levels(ArrayType *quantiles_array, int *n_quantiles)
+{
+    return read_quantile_levels(quantiles_array, "quantile values", NULL, 0, n_quantiles);
+}
+
+/*
+ * Build a float8[] result from computed quantiles (NULL gives all zeros)
+ *
+ * The array is laid out directly, without a Datum buffer for construct_array.
+ */
+ArrayType *
+build_quantile_result(const double *results, int n_quantiles)
+{
+    ArrayType *result_array;
+    Size nbytes;
+    
+    if (n_quantiles == 0) {
+        return construct_empty_array(FLOAT8OID);
+    }
+    
+    nbytes = ARR_OVERHEAD_NONULLS(1) + n_quantiles * sizeof(double);
+    result_array = (ArrayType *)palloc0(nbytes);
+    SET_VARSIZE(result_array, nbytes);
+    result_array->ndim = 1;
+    result_array->dataoffset = 0;
+    result_array->elemtype = FLOAT8OID;
+    ARR_DIMS(result_array)[0] = n_quantiles;
+    ARR_LBOUND(result_array)[0] = 1;
+    if (results != NULL) {
+        memcpy(ARR_DATA_PTR(result_array), results, n_quantiles * sizeof(double));
     }
     
+    return result_array;
+}
+
+/*
+ * Build sparse value-weight pairs from an array function's input
+ *
+ * Keeps only positive weights and appends the implicit zero when the total
+ * weight is below 1.0, reading the arrays in place. Small inputs go to
+ * small_pairs (SMALL_ARRAY_MAX_PAIRS entries), larger ones to a palloc'd
+ * buffer.
+ */
+static ValueWeight *
+build_sparse_pairs(WeightedSource *src, ValueWeight *small_pairs,
+                   int *n_pairs, double *total_weight)
+{
+    ValueWeight *vw_pairs = small_pairs;
+    
     /* Pre-allocate for worst case: all elements + 1 for sparse data */
-    vw_pairs = (ValueWeight *)palloc((n_elements + 1) * sizeof(ValueWeight));
-    
-    /* Create value-weight pairs for non-zero weights */
-    for (i = 0; i < n_elements; i++) {
-        if (weights[i] > 0.0) {
-            vw_pairs[n_pairs].value = vals[i];
-            vw_pairs[n_pairs].weight = weights[i];
-            total_weight += weights[i];
-            n_pairs++;
-        }
+    if (src->n_elements > SMALL_ARRAY_MAX_ELEMENTS) {
+        vw_pairs = (ValueWeight *)palloc_huge((Size) (src->n_elements + 1) * sizeof(ValueWeight));
     }
+    *n_pairs = weighted_source_gather(src, false, true, vw_pairs, total_weight);
+    weighted_source_free(src);
+    return vw_pairs;
+}
+
+/*
+ * Sort the pairs, run a quantile kernel and build the result array
+ *
+ * vw_pairs must already be compacted by compact_sparse_pairs; it is sorted
+ * in place and left to the caller to free.
+ */
+static ArrayType *
+compute_weighted_quantiles(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                           QuantileLevels *levels, QuantileKernel kernel)
+{
+    ArrayType *result_array;
+    double small_results[SMALL_ARRAY_MAX_ELEMENTS];
+    double *results = small_results;
+    int n_quantiles = levels->n_quantiles;
     
-    /* Handle sparse data: add implicit zero if total weight < 1.0 */
-    if (total_weight < 1.0) {
-        vw_pairs[n_pairs].value = 0.0;
-        vw_pairs[n_pairs].weight = 1.0 - total_weight;
-        n_pairs++;
-        total_weight = 1.0;
+    if (n_quantiles > SMALL_ARRAY_MAX_ELEMENTS) {
+        results = (double *)palloc(n_quantiles * sizeof(double));
     }
     
-    /* Sort by value using optimized algorithm */
-    optimized_sort_value_weight_pairs(vw_pairs, n_pairs);
+    if (kernel == empirical_quantile_kernel && n_pairs > RADIX_SELECT_MIN_PAIRS &&
+        n_quantiles <= RADIX_SELECT_MAX_QUANTILES) {
+        /* Only the elements around each target are needed */
+        radix_select_weighted_quantiles(vw_pairs, n_pairs, total_weight,
+                                        levels->levels, n_quantiles, results);
+    } else {
+        /* Sort by value using optimized algorithm */
+        optimized_sort_value_weight_pairs(vw_pairs, n_pairs);
+        kernel(vw_pairs, n_pairs, total_weight, levels, results);
+    }
     
-    /* Single-pass quantile calculation */
-    result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
+    result_array = build_quantile_result(results, n_quantiles);
+    
+    if (results != small_results) {
+        pfree(results);
+    }
+    return result_array;
+}
+
+/* Pairs per block of the chunked cumulative sums */
+#define CUMSUM_BLOCK_SIZE 4096
+
+/*
+ * empirical_quantile_kernel - Simple weighted quantile using empirical CDF
+ *
+ * Expects pairs sorted by value. Only the cumulative weight at the start of
+ * each block of CUMSUM_BLOCK_SIZE pairs is stored; a target is located by
+ * binary search over the blocks and a scan of one block, which continues the
+ * same running sum, so no buffer of n cumulative weights is needed. Targets
+ * are visited in ascending order and a target in the same block as the
+ * previous one resumes the scan where that one stopped.
+ */
+static void
+empirical_quantile_kernel(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                          QuantileLevels *levels, double *results)
+{
+    double small_cumsum[2];
+    double *block_cumsum = small_cumsum;
+    double cumsum;
+    int n_blocks = (n_pairs + CUMSUM_BLOCK_SIZE - 1) / CUMSUM_BLOCK_SIZE;
+    int block = -1, pos = 0;
+    double prev_cumsum = 0.0, curr_cumsum = 0.0;
+    int i, k;
     
-    /* Pre-compute cumulative weights */
-    cumulative_weights = (double *)palloc(n_pairs * sizeof(double));
+    /* block_cumsum[k]: cumulative weight before block k; the last entry is the total */
+    if (n_blocks > 1) {
+        block_cumsum = (double *)palloc((n_blocks + 1) * sizeof(double));
+    }
     cumsum = 0.0;
     for (i = 0; i < n_pairs; i++) {
+        if (i % CUMSUM_BLOCK_SIZE == 0) {
+            block_cumsum[i / CUMSUM_BLOCK_SIZE] = cumsum;
+        }
         cumsum += vw_pairs[i].weight;
-        cumulative_weights[i] = cumsum;
     }
+    block_cumsum[n_blocks] = cumsum;
     
     /* Calculate all quantiles in single pass */
-    for (q_idx = 0; q_idx < n_quantiles; q_idx++) {
-        double q = quantiles[q_idx];
+    for (k = 0; k < levels->n_quantiles; k++) {
+        int q_idx = levels->order != NULL ? levels->order[k] : k;
+        double q = levels->levels[q_idx];
         double target_weight = q * total_weight;
         double result_value;
         
@@ -214,27 +539,39 @@ weighted_quantile_sparse_c(PG_FUNCTION_ARGS)
         } else if (target_weight <= vw_pairs[0].weight) {
             result_value = vw_pairs[0].value;
         } else {
-            /* Binary search for efficiency with many quantiles */
-            int left = 0, right = n_pairs - 1;
-            int pos = n_pairs - 1;
+            /* First block whose cumulative weight at its end reaches the target */
+            int left = 0, right = n_blocks - 1;
+            int target_block = n_blocks - 1;
+            int end;
             
-            /* Find position where cumulative_weight >= target_weight */
             while (left <= right) {
                 int mid = (left + right) / 2;
-                if (cumulative_weights[mid] >= target_weight) {
-                    pos = mid;
+                if (block_cumsum[mid + 1] >= target_weight) {
+                    target_block = mid;
                     right = mid - 1;
                 } else {
                     left = mid + 1;
                 }
             }
             
-            if (pos == 0 || cumulative_weights[pos] == target_weight) {
+            /* Position where cumulative_weight >= target_weight (or the last pair) */
+            if (target_block != block) {
+                block = target_block;
+                pos = block * CUMSUM_BLOCK_SIZE;
+                prev_cumsum = block_cumsum[block];
+                curr_cumsum = prev_cumsum + vw_pairs[pos].weight;
+            }
+            end = Min(block * CUMSUM_BLOCK_SIZE + CUMSUM_BLOCK_SIZE, n_pairs);
+            while (curr_cumsum < target_weight && pos < end - 1) {
+                pos++;
+                prev_cumsum = curr_cumsum;
+                curr_cumsum += vw_pairs[pos].weight;
+            }
+            
+            if (pos == 0 || curr_cumsum == target_weight) {
                 result_value = vw_pairs[pos].value;
             } else {
                 /* Linear interpolation */
-                double prev_cumsum = cumulative_weights[pos - 1];
-                double curr_cumsum = cumulative_weights[pos];
                 double lower_val = vw_pairs[pos - 1].value;
                 double upper_val = vw_pairs[pos].value;
                 double interp_factor = (target_weight - prev_cumsum) / (curr_cumsum - prev_cumsum);
@@ -242,124 +579,33 @@ weighted_quantile_sparse_c(PG_FUNCTION_ARGS)
             }
         }
         
-        result_datums[q_idx] = Float8GetDatum(result_value);
+        results[q_idx] = result_value;
     }
     
-    pfree(cumulative_weights);
-    
-    /* Create result array */
-    result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                   8, FLOAT8PASSBYVAL, 'd');
-    
-    /* Clean up */
-    pfree(vals);
-    pfree(weights);
-    pfree(quantiles);
-    pfree(vw_pairs);
-    pfree(result_datums);
-    
-    PG_RETURN_ARRAYTYPE_P(result_array);
+    if (block_cumsum != small_cumsum) {
+        pfree(block_cumsum);
+    }
 }
 
 /*
- * wquantile_sparse_c - Weighted Type 7 quantile (linear interpolation)
- * 
- * Generalizes Hyndman-Fan Type 7 to weighted samples
+ * Normalize sorted pairs and build block cumulative probabilities
+ *
+ * Shared set-up of the Type 7 and Harrell-Davis kernels: weights are divided
+ * by total_weight in place and Kish's effective sample size is returned.
+ * block_probs receives the cumulative probability before each block of
+ * block_size pairs plus the total (n_blocks + 1 entries); the kernels
+ * continue the running sum from there instead of keeping n_pairs + 1 of them.
+ * A single block uses small_probs (two entries) instead of a palloc'd buffer.
  */
-PG_FUNCTION_INFO_V1(wquantile_sparse_c);
-
-Datum
-wquantile_sparse_c(PG_FUNCTION_ARGS)
+static double
+normalize_pairs(ValueWeight *vw_pairs, int n_pairs, double total_weight, int block_size,
+                double *small_probs, double **block_probs)
 {
-    ArrayType *vals_array, *weights_array, *quantiles_array;
-    double *vals, *weights, *quantiles;
-    int n_elements, n_quantiles;
-    double total_weight = 0.0;
-    ValueWeight *vw_pairs;
-    int n_pairs = 0;
-    ArrayType *result_array;
-    Datum *result_datums;
-    Datum *q_datums;
-    bool *q_nulls;
-    int i, q_idx;
-    double sum_weights_sq, n_eff;
-    double *cum_probs;
-    
-    /* Handle NULL inputs */
-    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
-        quantiles_array = PG_GETARG_ARRAYTYPE_P(2);
-        deconstruct_array(quantiles_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                          &q_datums, &q_nulls, &n_quantiles);
-        
-        result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
-        for (i = 0; i < n_quantiles; i++) {
-            result_datums[i] = Float8GetDatum(0.0);
-        }
-        
-        result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                       8, FLOAT8PASSBYVAL, 'd');
-        pfree(result_datums);
-        PG_RETURN_ARRAYTYPE_P(result_array);
-    }
-    
-    /* Get input arrays */
-    vals_array = PG_GETARG_ARRAYTYPE_P(0);
-    weights_array = PG_GETARG_ARRAYTYPE_P(1);
-    quantiles_array = PG_GETARG_ARRAYTYPE_P(2);
-    
-    /* Extract quantiles array */
-    deconstruct_array(quantiles_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                      &q_datums, &q_nulls, &n_quantiles);
-    
-    quantiles = (double *)palloc(n_quantiles * sizeof(double));
-    for (i = 0; i < n_quantiles; i++) {
-        quantiles[i] = q_nulls[i] ? 0.0 : DatumGetFloat8(q_datums[i]);
-        /* Validate quantile values */
-        if (quantiles[i] < 0.0 || quantiles[i] > 1.0 || isnan(quantiles[i]) || isinf(quantiles[i])) {
-            pfree(quantiles);
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("quantile values must be between 0 and 1")));
-        }
-    }
-    
-    /* Extract value and weight arrays */
-    if (extract_double_arrays(vals_array, weights_array, &vals, &weights, &n_elements) < 0) {
-        result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
-        for (i = 0; i < n_quantiles; i++) {
-            result_datums[i] = Float8GetDatum(0.0);
-        }
-        
-        result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                       8, FLOAT8PASSBYVAL, 'd');
-        pfree(quantiles);
-        pfree(result_datums);
-        PG_RETURN_ARRAYTYPE_P(result_array);
-    }
-    
-    /* Pre-allocate for worst case: all elements + 1 for sparse data */
-    vw_pairs = (ValueWeight *)palloc((n_elements + 1) * sizeof(ValueWeight));
-    
-    /* Create value-weight pairs for non-zero weights */
-    for (i = 0; i < n_elements; i++) {
-        if (weights[i] > 0.0) {
-            vw_pairs[n_pairs].value = vals[i];
-            vw_pairs[n_pairs].weight = weights[i];
-            total_weight += weights[i];
-            n_pairs++;
-        }
-    }
-    
-    /* Handle sparse data: add implicit zero if total weight < 1.0 */
-    if (total_weight < 1.0) {
-        vw_pairs[n_pairs].value = 0.0;
-        vw_pairs[n_pairs].weight = 1.0 - total_weight;
-        n_pairs++;
-        total_weight = 1.0;
-    }
-    
-    /* Sort by value */
-    optimized_sort_value_weight_pairs(vw_pairs, n_pairs);
+    double sum_weights_sq;
+    double cum;
+    double *probs;
+    int n_blocks = (n_pairs + block_size - 1) / block_size;
+    int i;
     
     /* Normalize weights */
     for (i = 0; i < n_pairs; i++) {
@@ -371,22 +617,46 @@ wquantile_sparse_c(PG_FUNCTION_ARGS)
     for (i = 0; i < n_pairs; i++) {
         sum_weights_sq += vw_pairs[i].weight * vw_pairs[i].weight;
     }
-    n_eff = 1.0 / sum_weights_sq;
     
-    /* Pre-compute cumulative probabilities */
-    cum_probs = (double *)palloc((n_pairs + 1) * sizeof(double));
-    cum_probs[0] = 0.0;
+    /* Cumulative probabilities at the block starts */
+    probs = n_blocks <= 1 ? small_probs : (double *)palloc((n_blocks + 1) * sizeof(double));
+    cum = 0.0;
     for (i = 0; i < n_pairs; i++) {
-        cum_probs[i + 1] = cum_probs[i] + vw_pairs[i].weight;
+        if (i % block_size == 0) {
+            probs[i / block_size] = cum;
+        }
+        cum += vw_pairs[i].weight;
     }
+    probs[n_blocks] = cum;
+    
+    *block_probs = probs;
+    return 1.0 / sum_weights_sq;
+}
+
+/*
+ * type7_quantile_kernel - Weighted Type 7 quantile (linear interpolation)
+ *
+ * Expects pairs sorted by value.
+ */
+static void
+type7_quantile_kernel(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                      QuantileLevels *levels, double *results)
+{
+    double n_eff;
+    double small_probs[2];
+    double *block_probs;
+    int i, q_idx;
     
-    result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
+    /* One block: the sweeps below run the cumulative probability themselves */
+    n_eff = normalize_pairs(vw_pairs, n_pairs, total_weight, Max(n_pairs, 1),
+                            small_probs, &block_probs);
     
     /* Calculate each quantile using Type 7 method */
-    for (q_idx = 0; q_idx < n_quantiles; q_idx++) {
-        double p = quantiles[q_idx];
+    for (q_idx = 0; q_idx < levels->n_quantiles; q_idx++) {
+        double p = levels->levels[q_idx];
         double result_value = 0.0;
         double h, u_val, w;
+        double cum_prev;
         
         if (p <= 0.0) {
             result_value = vw_pairs[0].value;
@@ -397,41 +667,349 @@ wquantile_sparse_c(PG_FUNCTION_ARGS)
             h = p * (n_eff - 1) + 1;
             
             /* Calculate weights for each value using Type 7 CDF */
+            cum_prev = block_probs[0];
             for (i = 0; i < n_pairs; i++) {
-                /* Type 7 CDF: u = max((h-1)/n, min(h/n, cum_probs[i+1])) */
-                u_val = fmax((h - 1) / n_eff, fmin(h / n_eff, cum_probs[i + 1]));
+                double cum_next = cum_prev + vw_pairs[i].weight;
+                
+                /* Type 7 CDF: u = max((h-1)/n, min(h/n, cumulative probability through i)) */
+                u_val = fmax((h - 1) / n_eff, fmin(h / n_eff, cum_next));
                 
                 /* Weight is the CDF evaluated at this point: w = u*n - h + 1 */
                 w = u_val * n_eff - h + 1;
                 
                 /* Only previous point contributes negatively */
                 if (i > 0) {
-                    double u_prev = fmax((h - 1) / n_eff, fmin(h / n_eff, cum_probs[i]));
+                    double u_prev = fmax((h - 1) / n_eff, fmin(h / n_eff, cum_prev));
                     double w_prev = u_prev * n_eff - h + 1;
                     w -= w_prev;
                 }
                 
                 result_value += w * vw_pairs[i].value;
+                cum_prev = cum_next;
             }
         }
         
-        result_datums[q_idx] = Float8GetDatum(result_value);
+        results[q_idx] = result_value;
     }
     
-    pfree(cum_probs);
+    if (block_probs != small_probs) {
+        pfree(block_probs);
+    }
+}
+
+/* Pairs per task of the Harrell-Davis kernel */
+#define HD_CHUNK_SIZE 16384
+
+/*
+ * Shared state of the Harrell-Davis kernel tasks
+ *
+ * Task c sums the contributions of pairs [c * HD_CHUNK_SIZE, ...) to every
+ * quantile into its own row of partials, which are added up in chunk order
+ * afterwards, so the result does not depend on the number of threads.
+ */
+typedef struct {
+    const ValueWeight *vw_pairs;
+    const double *block_probs;  /* cumulative probability before each chunk */
+    int n_pairs;
+    int n_quantiles;
+    const double *a;            /* Beta parameters per quantile */
+    const double *b;
+    const double *lbeta;        /* log(B(a, b)), NaN for degenerate quantiles */
+    double *partials;           /* n_chunks x n_quantiles */
+} HDChunkWork;
+
+/* Task body: no PostgreSQL calls, see weighted_parallel.c */
+static void
+hd_chunk_task(void *arg, int chunk)
+{
+    HDChunkWork *work = (HDChunkWork *)arg;
+    int start = chunk * HD_CHUNK_SIZE;
+    int end = Min(start + HD_CHUNK_SIZE, work->n_pairs);
+    double *partial = work->partials + (size_t)chunk * work->n_quantiles;
+    int i, q_idx;
+    
+    for (q_idx = 0; q_idx < work->n_quantiles; q_idx++) {
+        double a = work->a[q_idx];
+        double b = work->b[q_idx];
+        double lbeta = work->lbeta[q_idx];
+        double q_low, q_high;
+        double cum;
+        double sum = 0.0;
+        
+        if (isnan(lbeta)) {
+            continue;
+        }
+        
+        /* Each boundary's CDF is shared by the two pairs around it */
+        cum = work->block_probs[chunk];
+        q_low = beta_cdf_lbeta(cum, a, b, lbeta);
+        for (i = start; i < end; i++) {
+            cum += work->vw_pairs[i].weight;
+            q_high = beta_cdf_lbeta(cum, a, b, lbeta);
+            sum += (q_high - q_low) * work->vw_pairs[i].value;
+            q_low = q_high;
+        }
+        partial[q_idx] = sum;
+    }
+}
+
+/*
+ * Beta parameters of the Harrell-Davis weights for each level
+ *
+ * Degenerate levels get a NaN normalizer, which makes their quantile NaN.
+ */
+static void
+hd_beta_parameters(const QuantileLevels *levels, double n_eff, int n_pairs,
+                   double *a, double *b, double *lbeta)
+{
+    int q_idx;
+    
+    for (q_idx = 0; q_idx < levels->n_quantiles; q_idx++) {
+        double p = levels->levels[q_idx];
+        
+        /* Beta distribution parameters */
+        a[q_idx] = (n_eff + 1) * p;
+        b[q_idx] = (n_eff + 1) * (1 - p);
+        
+        /* Degenerate cases return NaN, flagged by a NaN normalizer */
+        if (p <= 0.0 || p >= 1.0 || n_eff <= 1.0 || n_pairs <= 1 ||
+            a[q_idx] <= 0.0 || b[q_idx] <= 0.0) {
+            lbeta[q_idx] = NAN;
+        } else {
+            lbeta[q_idx] = log_beta(a[q_idx], b[q_idx]);
+        }
+    }
+}
+
+/*
+ * hd_quantile_kernel - Weighted Harrell-Davis quantile
+ *
+ * Expects pairs sorted by value. Each quantile is an O(n) sweep of Beta CDF
+ * evaluations, run as chunks of pairs that are split across worker threads
+ * for large inputs when weighted_statistics.max_worker_threads allows it.
+ * The Beta normalizers are computed here, in the backend, before any thread
+ * starts; a call site with constant levels keeps them for as long as the
+ * effective sample size stays the same (e.g. equal weights of one size).
+ */
+static void
+hd_quantile_kernel(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                   QuantileLevels *levels, double *results)
+{
+    HDChunkWork work;
+    double n_eff;
+    double small_probs[2];
+    double *block_probs;
+    double small_params[4 * SMALL_ARRAY_MAX_ELEMENTS];
+    double *a, *b, *lbeta;
+    int n_quantiles = levels->n_quantiles;
+    int n_chunks = (n_pairs + HD_CHUNK_SIZE - 1) / HD_CHUNK_SIZE;
+    bool small = n_chunks == 1 && n_quantiles <= SMALL_ARRAY_MAX_ELEMENTS;
+    int c, q_idx;
+    
+    n_eff = normalize_pairs(vw_pairs, n_pairs, total_weight, HD_CHUNK_SIZE,
+                            small_probs, &block_probs);
+    
+    if (levels->hd_a != NULL) {
+        /* Cached call site: recompute only for a new effective sample size */
+        if (!levels->hd_valid || levels->hd_n_eff != n_eff ||
+            levels->hd_several != (n_pairs > 1)) {
+            hd_beta_parameters(levels, n_eff, n_pairs,
+                               levels->hd_a, levels->hd_b, levels->hd_lbeta);
+            levels->hd_valid = true;
+            levels->hd_n_eff = n_eff;
+            levels->hd_several = n_pairs > 1;
+        }
+        a = levels->hd_a;
+        b = levels->hd_b;
+        lbeta = levels->hd_lbeta;
+    } else {
+        /* Few quantiles over one chunk: parameters on the stack */
+        if (small) {
+            a = small_params;
+            b = small_params + n_quantiles;
+            lbeta = small_params + 2 * n_quantiles;
+        } else {
+            a = (double *)palloc(n_quantiles * sizeof(double));
+            b = (double *)palloc(n_quantiles * sizeof(double));
+            lbeta = (double *)palloc(n_quantiles * sizeof(double));
+        }
+        hd_beta_parameters(levels, n_eff, n_pairs, a, b, lbeta);
+    }
     
-    /* Create result array */
-    result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                   8, FLOAT8PASSBYVAL, 'd');
+    work.vw_pairs = vw_pairs;
+    work.block_probs = block_probs;
+    work.n_pairs = n_pairs;
+    work.n_quantiles = n_quantiles;
+    work.a = a;
+    work.b = b;
+    work.lbeta = lbeta;
+    if (small) {
+        work.partials = small_params + 3 * n_quantiles;
+        memset(work.partials, 0, n_quantiles * sizeof(double));
+    } else {
+        work.partials = (double *)palloc0((size_t)n_chunks * n_quantiles * sizeof(double));
+    }
     
-    /* Clean up */
-    pfree(vals);
-    pfree(weights);
-    pfree(quantiles);
+    weighted_parallel_run(hd_chunk_task, &work, n_chunks,
+                          weighted_parallel_threads(n_pairs, n_chunks));
+    
+    for (q_idx = 0; q_idx < n_quantiles; q_idx++) {
+        double result_value = 0.0;
+        
+        if (isnan(lbeta[q_idx])) {
+            results[q_idx] = NAN;  /* Return NaN to match Python behavior */
+            continue;
+        }
+        for (c = 0; c < n_chunks; c++) {
+            result_value += work.partials[(size_t)c * n_quantiles + q_idx];
+        }
+        results[q_idx] = result_value;
+    }
+    
+    if (!small) {
+        pfree(work.partials);
+    }
+    if (!small && levels->hd_a == NULL) {
+        pfree(a);
+        pfree(b);
+        pfree(lbeta);
+    }
+    if (block_probs != small_probs) {
+        pfree(block_probs);
+    }
+}
+
+/*
+ * Empirical CDF quantiles of an unsorted, uncompacted pair buffer
+ *
+ * Entry point for callers that collect pairs themselves (e.g. the table scan
+ * functions). The buffer needs room for n_elements + 1 pairs and is freed.
+ */
+ArrayType *
+empirical_quantiles_from_pairs(ValueWeight *vw_pairs, int n_elements,
+                               const double *quantiles, int n_quantiles)
+{
+    ArrayType *result_array;
+    QuantileLevels levels;
+    int n_pairs;
+    double total_weight;
+    
+    memset(&levels, 0, offsetof(QuantileLevels, small_levels));
+    set_quantile_levels(&levels, (double *) quantiles, n_quantiles, false);
+    
+    n_pairs = compact_sparse_pairs(vw_pairs, n_elements, &total_weight);
+    result_array = compute_weighted_quantiles(vw_pairs, n_pairs, total_weight,
+                                              &levels, empirical_quantile_kernel);
     pfree(vw_pairs);
-    pfree(result_datums);
+    release_quantile_levels(&levels);
+    return result_array;
+}
+
+/*
+ * Quantiles of an array function's input
+ *
+ * Inputs of up to SMALL_ARRAY_MAX_ELEMENTS elements and levels stay in stack
+ * buffers, so the only allocation is the result array. Frees the source.
+ */
+static ArrayType *
+quantiles_from_source(WeightedSource *src, QuantileLevels *levels, QuantileKernel kernel)
+{
+    ArrayType *result_array;
+    ValueWeight small_pairs[SMALL_ARRAY_MAX_PAIRS];
+    ValueWeight *vw_pairs;
+    int n_pairs;
+    double total_weight;
+    
+    /* One pass over the input, dropping zero weights */
+    vw_pairs = build_sparse_pairs(src, small_pairs, &n_pairs, &total_weight);
+    
+    result_array = compute_weighted_quantiles(vw_pairs, n_pairs, total_weight, levels, kernel);
+    
+    if (vw_pairs != small_pairs) {
+        pfree(vw_pairs);
+    }
+    release_quantile_levels(levels);
+    return result_array;
+}
+
+/* Shared body of the value/weight array entry points */
+static Datum
+quantiles_from_arrays(FunctionCallInfo fcinfo, QuantileKernel kernel)
+{
+    WeightedSource src;
+    QuantileLevels local;
+    QuantileLevels *levels;
+    
+    if (PG_ARGISNULL(2)) {
+        PG_RETURN_NULL();
+    }
+    levels = get_quantile_levels(fcinfo, 2, kernel, &local);
+    
+    /* Handle NULL inputs: return array of zeros */
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) {
+        int n_quantiles = levels->n_quantiles;
+        
+        release_quantile_levels(levels);
+        PG_RETURN_ARRAYTYPE_P(build_quantile_result(NULL, n_quantiles));
+    }
     
-    PG_RETURN_ARRAYTYPE_P(result_array);
+    /* Read the value and weight arrays in place */
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
+    
+    PG_RETURN_ARRAYTYPE_P(quantiles_from_source(&src, levels, kernel));
+}
+
+/* Shared body of the weighted_pair[] entry points */
+static Datum
+quantiles_from_pairs(FunctionCallInfo fcinfo, QuantileKernel kernel)
+{
+    WeightedSource src;
+    QuantileLevels local;
+    QuantileLevels *levels;
+    
+    if (PG_ARGISNULL(1)) {
+        PG_RETURN_NULL();
+    }
+    levels = get_quantile_levels(fcinfo, 1, kernel, &local);
+    
+    /* Handle NULL inputs: return array of zeros */
+    if (PG_ARGISNULL(0)) {
+        int n_quantiles = levels->n_quantiles;
+        
+        release_quantile_levels(levels);
+        PG_RETURN_ARRAYTYPE_P(build_quantile_result(NULL, n_quantiles));
+    }
+    
+    /* Read the interleaved pairs in place */
+    weighted_source_from_pairs(&src, PG_GETARG_ANY_ARRAY_P(0));
+    
+    PG_RETURN_ARRAYTYPE_P(quantiles_from_source(&src, levels, kernel));
+}
+
+/*
+ * weighted_quantile_sparse_c - Simple weighted quantile using empirical CDF
+ * 
+ * This is the existing implementation that corresponds to Python's weighted_quantile
+ */
+PG_FUNCTION_INFO_V1(weighted_quantile_sparse_c);
+
+Datum
+weighted_quantile_sparse_c(PG_FUNCTION_ARGS)
+{
+    return quantiles_from_arrays(fcinfo, empirical_quantile_kernel);
+}
+
+/*
+ * wquantile_sparse_c - Weighted Type 7 quantile (linear interpolation)
+ * 
+ * Generalizes Hyndman-Fan Type 7 to weighted samples
+ */
+PG_FUNCTION_INFO_V1(wquantile_sparse_c);
+
+Datum
+wquantile_sparse_c(PG_FUNCTION_ARGS)
+{
+    return quantiles_from_arrays(fcinfo, type7_quantile_kernel);
 }
 
 /*
@@ -444,154 +1022,478 @@ PG_FUNCTION_INFO_V1(whdquantile_sparse_c);
 Datum
 whdquantile_sparse_c(PG_FUNCTION_ARGS)
 {
-    ArrayType *vals_array, *weights_array, *quantiles_array;
-    double *vals, *weights, *quantiles;
-    int n_elements, n_quantiles;
-    double total_weight = 0.0;
-    ValueWeight *vw_pairs;
-    int n_pairs = 0;
-    ArrayType *result_array;
-    Datum *result_datums;
-    Datum *q_datums;
-    bool *q_nulls;
-    int i, q_idx;
-    double sum_weights_sq, n_eff;
-    double *cum_probs;
-    
-    /* Handle NULL inputs */
-    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
-        quantiles_array = PG_GETARG_ARRAYTYPE_P(2);
-        deconstruct_array(quantiles_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                          &q_datums, &q_nulls, &n_quantiles);
+    return quantiles_from_arrays(fcinfo, hd_quantile_kernel);
+}
+
+/*
+ * weighted_quantile_pairs_c, wquantile_pairs_c, whdquantile_pairs_c
+ *
+ * weighted_pair[] overloads of the three quantile methods.
+ *
+ * Exposed as: weighted_quantile(pairs[], quantiles[]), wquantile(pairs[], quantiles[]),
+ *             whdquantile(pairs[], quantiles[])
+ */
+PG_FUNCTION_INFO_V1(weighted_quantile_pairs_c);
+
+Datum
+weighted_quantile_pairs_c(PG_FUNCTION_ARGS)
+{
+    return quantiles_from_pairs(fcinfo, empirical_quantile_kernel);
+}
+
+PG_FUNCTION_INFO_V1(wquantile_pairs_c);
+
+Datum
+wquantile_pairs_c(PG_FUNCTION_ARGS)
+{
+    return quantiles_from_pairs(fcinfo, type7_quantile_kernel);
+}
+
+PG_FUNCTION_INFO_V1(whdquantile_pairs_c);
+
+Datum
+whdquantile_pairs_c(PG_FUNCTION_ARGS)
+{
+    return quantiles_from_pairs(fcinfo, hd_quantile_kernel);
+}
+
+/* Highest order of weighted_lmoments */
+#define LMOMENTS_MAX_ORDER 20
+
+/*
+ * L-moments lambda_1..lambda_nmom of the weighted empirical distribution
+ *
+ * lambda_{r+1} is the integral of Q(u) P*_r(u) over [0, 1], with Q the
+ * quantile function and P*_r the shifted Legendre polynomial. Summing by
+ * parts over the steps of Q gives the sum over i of
+ * (x_{i+1} - x_i) * -G_r(c_i), with c_i the cumulative probability after
+ * pair i and G_r(u) = (P*_{r+1}(u) - P*_{r-1}(u)) / (2(2r + 1)) the
+ * antiderivative of P*_r, which is 0 at both ends. No large terms cancel,
+ * unlike in the combination of probability-weighted moments, and one sweep
+ * over the gaps yields every order. Expects pairs sorted by value.
+ */
+static void
+weighted_lmoments_sorted(const ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                         int nmom, double *lambdas)
+{
+    double legendre[LMOMENTS_MAX_ORDER + 1];
+    double sum_weighted = 0.0, cum = 0.0;
+    int i, r;
+    
+    for (i = 0; i < n_pairs; i++) {
+        sum_weighted += vw_pairs[i].weight * vw_pairs[i].value;
+    }
+    lambdas[0] = sum_weighted / total_weight;
+    for (r = 1; r < nmom; r++) {
+        lambdas[r] = 0.0;
+    }
+    
+    for (i = 0; i + 1 < n_pairs; i++) {
+        double gap = vw_pairs[i + 1].value - vw_pairs[i].value;
+        double t;
         
-        result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
-        for (i = 0; i < n_quantiles; i++) {
-            result_datums[i] = Float8GetDatum(0.0);
+        cum += vw_pairs[i].weight;
+        if (gap == 0.0) {
+            continue;
         }
         
-        result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                       8, FLOAT8PASSBYVAL, 'd');
-        pfree(result_datums);
-        PG_RETURN_ARRAYTYPE_P(result_array);
-    }
-    
-    /* Get input arrays */
-    vals_array = PG_GETARG_ARRAYTYPE_P(0);
-    weights_array = PG_GETARG_ARRAYTYPE_P(1);
-    quantiles_array = PG_GETARG_ARRAYTYPE_P(2);
-    
-    /* Extract quantiles array */
-    deconstruct_array(quantiles_array, FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-                      &q_datums, &q_nulls, &n_quantiles);
-    
-    quantiles = (double *)palloc(n_quantiles * sizeof(double));
-    for (i = 0; i < n_quantiles; i++) {
-        quantiles[i] = q_nulls[i] ? 0.0 : DatumGetFloat8(q_datums[i]);
-        /* Validate quantile values */
-        if (quantiles[i] < 0.0 || quantiles[i] > 1.0 || isnan(quantiles[i]) || isinf(quantiles[i])) {
-            pfree(quantiles);
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("quantile values must be between 0 and 1")));
+        /* Legendre polynomials at t = 2 c_i - 1, i.e. P*_r(c_i) */
+        t = 2.0 * (cum / total_weight) - 1.0;
+        legendre[0] = 1.0;
+        legendre[1] = t;
+        for (r = 1; r < nmom; r++) {
+            legendre[r + 1] = ((2 * r + 1) * t * legendre[r] - r * legendre[r - 1]) / (r + 1);
+        }
+        for (r = 1; r < nmom; r++) {
+            lambdas[r] -= gap * (legendre[r + 1] - legendre[r - 1]) / (2.0 * (2 * r + 1));
         }
     }
+}
+
+/*
+ * Weighted L-moments of an array function's input, as
+ * {lambda_1, lambda_2, tau_3, ..., tau_nmom} with tau_r = lambda_r / lambda_2;
+ * the ratios are NULL when lambda_2 is 0. Frees the source.
+ */
+static ArrayType *
+lmoments_from_source(WeightedSource *src, int nmom)
+{
+    ValueWeight small_pairs[SMALL_ARRAY_MAX_PAIRS];
+    ValueWeight *vw_pairs;
+    double lambdas[LMOMENTS_MAX_ORDER];
+    Datum elems[LMOMENTS_MAX_ORDER];
+    bool nulls[LMOMENTS_MAX_ORDER];
+    int dims[1], lbs[1];
+    int n_pairs;
+    double total_weight;
+    int r;
     
-    /* Extract value and weight arrays */
-    if (extract_double_arrays(vals_array, weights_array, &vals, &weights, &n_elements) < 0) {
-        result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
-        for (i = 0; i < n_quantiles; i++) {
-            result_datums[i] = Float8GetDatum(0.0);
-        }
-        
-        result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                       8, FLOAT8PASSBYVAL, 'd');
-        pfree(quantiles);
-        pfree(result_datums);
-        PG_RETURN_ARRAYTYPE_P(result_array);
+    if (nmom < 1 || nmom > LMOMENTS_MAX_ORDER) {
+        weighted_source_free(src);
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("nmom must be between 1 and %d", LMOMENTS_MAX_ORDER)));
     }
     
-    /* Pre-allocate for worst case: all elements + 1 for sparse data */
-    vw_pairs = (ValueWeight *)palloc((n_elements + 1) * sizeof(ValueWeight));
-    
-    /* Create value-weight pairs for non-zero weights */
-    for (i = 0; i < n_elements; i++) {
-        if (weights[i] > 0.0) {
-            vw_pairs[n_pairs].value = vals[i];
-            vw_pairs[n_pairs].weight = weights[i];
-            total_weight += weights[i];
-            n_pairs++;
-        }
+    /* Same input handling and sort as the quantile functions */
+    vw_pairs = build_sparse_pairs(src, small_pairs, &n_pairs, &total_weight);
+    optimized_sort_value_weight_pairs(vw_pairs, n_pairs);
+    weighted_lmoments_sorted(vw_pairs, n_pairs, total_weight, nmom, lambdas);
+    if (vw_pairs != small_pairs) {
+        pfree(vw_pairs);
     }
     
-    /* Handle sparse data: add implicit zero if total weight < 1.0 */
-    if (total_weight < 1.0) {
-        vw_pairs[n_pairs].value = 0.0;
-        vw_pairs[n_pairs].weight = 1.0 - total_weight;
-        n_pairs++;
-        total_weight = 1.0;
+    for (r = 0; r < nmom; r++) {
+        nulls[r] = r >= 2 && lambdas[1] == 0.0;
+        elems[r] = Float8GetDatum(r < 2 || nulls[r] ? lambdas[r] : lambdas[r] / lambdas[1]);
     }
+    dims[0] = nmom;
+    lbs[0] = 1;
+    return construct_md_array(elems, nulls, 1, dims, lbs, FLOAT8OID,
+                              sizeof(float8), FLOAT8PASSBYVAL, 'd');
+}
+
+/*
+ * weighted_lmoments_c - Weighted L-moments
+ *
+ * Exposed as: weighted_lmoments(vals[], weights[], nmom DEFAULT 4)
+ */
+PG_FUNCTION_INFO_V1(weighted_lmoments_c);
+
+Datum
+weighted_lmoments_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
     
-    /* Sort by value */
-    optimized_sort_value_weight_pairs(vw_pairs, n_pairs);
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
+    PG_RETURN_ARRAYTYPE_P(lmoments_from_source(&src, PG_GETARG_INT32(2)));
+}
+
+/*
+ * weighted_lmoments_pairs_c - Weighted L-moments over a weighted_pair[] array
+ *
+ * Exposed as: weighted_lmoments(pairs[], nmom DEFAULT 4)
+ */
+PG_FUNCTION_INFO_V1(weighted_lmoments_pairs_c);
+
+Datum
+weighted_lmoments_pairs_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
     
-    /* Normalize weights */
-    for (i = 0; i < n_pairs; i++) {
-        vw_pairs[i].weight /= total_weight;
+    weighted_source_from_pairs(&src, PG_GETARG_ANY_ARRAY_P(0));
+    PG_RETURN_ARRAYTYPE_P(lmoments_from_source(&src, PG_GETARG_INT32(1)));
+}
+
+/*
+ * Weighted expectiles of sorted pairs
+ *
+ * The tau-expectile e solves (1 - tau) sum_{x < e} w (e - x) =
+ * tau sum_{x > e} w (x - e). The difference of the two sides, g(e), is
+ * increasing and linear between consecutive values, so after prefix sums
+ * W_j and S_j of w and w x over the first j pairs a binary search finds the
+ * first pair j with g(x_j) >= 0, and on [x_{j-1}, x_j]
+ * e = ((1 - tau) S_j + tau (S - S_j)) / ((1 - tau) W_j + tau (W - W_j)).
+ * Values are centered on the weighted mean first so that the sums do not
+ * cancel. Ascending levels narrow the search, since e grows with tau.
+ * Expects positive weights.
+ */
+static void
+expectile_kernel(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+                 QuantileLevels *levels, double *results)
+{
+    double small_prefix[2 * (SMALL_ARRAY_MAX_PAIRS + 1)];
+    double *cum_weight = small_prefix;
+    double *cum_value;
+    double mean, sum_value = 0.0;
+    int first = 1;
+    int i, k;
+    
+    if (n_pairs > SMALL_ARRAY_MAX_PAIRS) {
+        cum_weight = (double *)palloc_huge((Size) 2 * (n_pairs + 1) * sizeof(double));
     }
+    cum_value = cum_weight + n_pairs + 1;
     
-    /* Calculate effective sample size using Kish's formula */
-    sum_weights_sq = 0.0;
     for (i = 0; i < n_pairs; i++) {
-        sum_weights_sq += vw_pairs[i].weight * vw_pairs[i].weight;
+        sum_value += vw_pairs[i].weight * vw_pairs[i].value;
     }
-    n_eff = 1.0 / sum_weights_sq;
+    mean = sum_value / total_weight;
     
-    /* Pre-compute cumulative probabilities */
-    cum_probs = (double *)palloc((n_pairs + 1) * sizeof(double));
-    cum_probs[0] = 0.0;
+    cum_weight[0] = 0.0;
+    cum_value[0] = 0.0;
     for (i = 0; i < n_pairs; i++) {
-        cum_probs[i + 1] = cum_probs[i] + vw_pairs[i].weight;
+        cum_weight[i + 1] = cum_weight[i] + vw_pairs[i].weight;
+        cum_value[i + 1] = cum_value[i] + vw_pairs[i].weight * (vw_pairs[i].value - mean);
+    }
+    
+    for (k = 0; k < levels->n_quantiles; k++) {
+        int q_idx = levels->order != NULL ? levels->order[k] : k;
+        double tau = levels->levels[q_idx];
+        double weight_total = cum_weight[n_pairs];
+        double value_total = cum_value[n_pairs];
+        double result_value;
+        
+        if (tau <= 0.0 || n_pairs == 1) {
+            result_value = vw_pairs[0].value;
+        } else if (tau >= 1.0) {
+            result_value = vw_pairs[n_pairs - 1].value;
+        } else {
+            int left = first, right = n_pairs - 1;
+            int j = n_pairs - 1;
+            
+            /* First pair whose value has g >= 0 (g(x_{n-1}) always is) */
+            while (left <= right) {
+                int mid = left + (right - left) / 2;
+                double x = vw_pairs[mid].value - mean;
+                double below = cum_weight[mid] * x - cum_value[mid];
+                double above = (value_total - cum_value[mid]) - (weight_total - cum_weight[mid]) * x;
+                
+                if ((1.0 - tau) * below - tau * above >= 0.0) {
+                    j = mid;
+                    right = mid - 1;
+                } else {
+                    left = mid + 1;
+                }
+            }
+            first = j;
+            
+            result_value = mean + ((1.0 - tau) * cum_value[j] + tau * (value_total - cum_value[j])) /
+                                  ((1.0 - tau) * cum_weight[j] + tau * (weight_total - cum_weight[j]));
+            
+            /* Rounding may put the solve a hair outside its segment */
+            result_value = Max(result_value, vw_pairs[j - 1].value);
+            result_value = Min(result_value, vw_pairs[j].value);
+        }
+        
+        results[q_idx] = result_value;
     }
     
-    result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
+    if (cum_weight != small_prefix) {
+        pfree(cum_weight);
+    }
+}
+
+/*
+ * weighted_expectile_c, weighted_expectile_pairs_c - Weighted expectiles
+ *
+ * Exposed as: weighted_expectile(vals[], weights[], taus[]),
+ *             weighted_expectile(pairs[], taus[])
+ */
+PG_FUNCTION_INFO_V1(weighted_expectile_c);
+
+Datum
+weighted_expectile_c(PG_FUNCTION_ARGS)
+{
+    return quantiles_from_arrays(fcinfo, expectile_kernel);
+}
+
+PG_FUNCTION_INFO_V1(weighted_expectile_pairs_c);
+
+Datum
+weighted_expectile_pairs_c(PG_FUNCTION_ARGS)
+{
+    return quantiles_from_pairs(fcinfo, expectile_kernel);
+}
+
+/*
+ * Value-at-Risk and expected shortfall of sorted pairs, as losses
+ *
+ * results gets the VaR of every level, the empirical CDF quantile exactly as
+ * weighted_quantile computes it, followed by the expected shortfall: the mean
+ * of the upper (1 - level) fraction of the weight, in which the pair the
+ * boundary falls in counts with the part of its weight above the boundary.
+ * One sweep of the cumulative weight and the cumulative w (x - mean) serves
+ * all levels: each records the sum below its boundary, subtracted from the
+ * total at the end. Centering keeps the sums from cancelling.
+ */
+static void
+var_es_sorted(const ValueWeight *vw_pairs, int n_pairs, double total_weight,
+              const QuantileLevels *levels, double *results)
+{
+    int n_levels = levels->n_quantiles;
+    double *shortfalls = results + n_levels;
+    double last_value = vw_pairs[n_pairs - 1].value;
+    double mean, sum_value = 0.0;
+    double cum = 0.0, prev_cum = 0.0, centered = 0.0;
+    int i, k = 0;
     
-    /* Calculate each quantile using Harrell-Davis method */
-    for (q_idx = 0; q_idx < n_quantiles; q_idx++) {
-        double p = quantiles[q_idx];
-        double result_value = 0.0;
+    for (i = 0; i < n_pairs; i++) {
+        sum_value += vw_pairs[i].weight * vw_pairs[i].value;
+    }
+    mean = sum_value / total_weight;
+    
+    for (i = 0; i < n_pairs; i++) {
+        double value = vw_pairs[i].value;
         
-        /* Beta distribution parameters */
-        double a = (n_eff + 1) * p;
-        double b = (n_eff + 1) * (1 - p);
+        prev_cum = cum;
+        cum += vw_pairs[i].weight;
         
-        /* Check for degenerate cases that should return NaN */
-        if (p <= 0.0 || p >= 1.0 || n_eff <= 1.0 || n_pairs <= 1 || a <= 0.0 || b <= 0.0) {
-            result_value = NAN;  /* Return NaN to match Python behavior */
-        } else {
-            /* Calculate weights using Beta CDF */
-            for (i = 0; i < n_pairs; i++) {
-                double q_low = beta_cdf(cum_probs[i], a, b);
-                double q_high = beta_cdf(cum_probs[i + 1], a, b);
-                double w = q_high - q_low;
-                result_value += w * vw_pairs[i].value;
+        /* Levels whose target falls in this pair; the last pair takes the rest */
+        while (k < n_levels) {
+            int q_idx = levels->order != NULL ? levels->order[k] : k;
+            double level = levels->levels[q_idx];
+            double target = level * total_weight;
+            
+            if (level < 1.0 && cum < target && i < n_pairs - 1) {
+                break;
+            }
+            if (level >= 1.0) {
+                results[q_idx] = last_value;
+            } else if (i == 0 || cum == target) {
+                results[q_idx] = value;
+            } else {
+                double prev_value = vw_pairs[i - 1].value;
+                
+                results[q_idx] = prev_value + (target - prev_cum) / (cum - prev_cum) * (value - prev_value);
             }
+            /* Centered sum of the weight below the boundary */
+            shortfalls[q_idx] = centered + (target - prev_cum) * (value - mean);
+            k++;
         }
+        centered += vw_pairs[i].weight * (value - mean);
+    }
+    
+    for (k = 0; k < n_levels; k++) {
+        double tail_weight = total_weight - levels->levels[k] * total_weight;
         
-        result_datums[q_idx] = Float8GetDatum(result_value);
+        if (tail_weight > 0.0) {
+            shortfalls[k] = mean + (centered - shortfalls[k]) / tail_weight;
+        } else {
+            shortfalls[k] = last_value;
+        }
     }
+}
+
+/*
+ * Build the float8[2][n_levels] result of weighted_var_es from the VaR of
+ * every level followed by the expected shortfalls
+ */
+ArrayType *
+build_var_es_result(const double *results, int n_levels)
+{
+    ArrayType *result_array;
+    Size nbytes;
     
-    pfree(cum_probs);
+    if (n_levels == 0) {
+        return construct_empty_array(FLOAT8OID);
+    }
+    
+    nbytes = ARR_OVERHEAD_NONULLS(2) + 2 * n_levels * sizeof(double);
+    result_array = (ArrayType *)palloc0(nbytes);
+    SET_VARSIZE(result_array, nbytes);
+    result_array->ndim = 2;
+    result_array->dataoffset = 0;
+    result_array->elemtype = FLOAT8OID;
+    ARR_DIMS(result_array)[0] = 2;
+    ARR_DIMS(result_array)[1] = n_levels;
+    ARR_LBOUND(result_array)[0] = 1;
+    ARR_LBOUND(result_array)[1] = 1;
+    memcpy(ARR_DATA_PTR(result_array), results, 2 * n_levels * sizeof(double));
+    
+    return result_array;
+}
+
+/* Sort compacted pairs and build the weighted_var_es result */
+static ArrayType *
+compute_var_es(ValueWeight *vw_pairs, int n_pairs, double total_weight,
+               const QuantileLevels *levels)
+{
+    ArrayType *result_array;
+    double small_results[2 * SMALL_ARRAY_MAX_ELEMENTS];
+    double *results = small_results;
+    int n_levels = levels->n_quantiles;
+    
+    if (n_levels > SMALL_ARRAY_MAX_ELEMENTS) {
+        results = (double *)palloc(2 * n_levels * sizeof(double));
+    }
+    
+    optimized_sort_value_weight_pairs(vw_pairs, n_pairs);
+    var_es_sorted(vw_pairs, n_pairs, total_weight, levels, results);
+    result_array = build_var_es_result(results, n_levels);
+    
+    if (results != small_results) {
+        pfree(results);
+    }
+    return result_array;
+}
+
+/*
+ * weighted_var_es of an unsorted, uncompacted pair buffer
+ *
+ * Counterpart of empirical_quantiles_from_pairs for weighted_var_es_agg. The
+ * buffer needs room for n_elements + 1 pairs and is freed.
+ */
+ArrayType *
+var_es_from_pairs(ValueWeight *vw_pairs, int n_elements,
+                  const double *levels, int n_levels)
+{
+    ArrayType *result_array;
+    QuantileLevels quantile_levels;
+    int n_pairs;
+    double total_weight;
     
-    /* Create result array */
-    result_array = construct_array(result_datums, n_quantiles, FLOAT8OID,
-                                   8, FLOAT8PASSBYVAL, 'd');
+    memset(&quantile_levels, 0, offsetof(QuantileLevels, small_levels));
+    set_quantile_levels(&quantile_levels, (double *) levels, n_levels, false);
     
-    /* Clean up */
-    pfree(vals);
-    pfree(weights);
-    pfree(quantiles);
+    n_pairs = compact_sparse_pairs(vw_pairs, n_elements, &total_weight);
+    result_array = compute_var_es(vw_pairs, n_pairs, total_weight, &quantile_levels);
     pfree(vw_pairs);
-    pfree(result_datums);
+    release_quantile_levels(&quantile_levels);
+    return result_array;
+}
+
+/* weighted_var_es of an array function's input; frees the source */
+static ArrayType *
+var_es_from_source(WeightedSource *src, QuantileLevels *levels)
+{
+    ArrayType *result_array;
+    ValueWeight small_pairs[SMALL_ARRAY_MAX_PAIRS];
+    ValueWeight *vw_pairs;
+    int n_pairs;
+    double total_weight;
     
-    PG_RETURN_ARRAYTYPE_P(result_array);
-}
\ No newline at end of file
+    vw_pairs = build_sparse_pairs(src, small_pairs, &n_pairs, &total_weight);
+    result_array = compute_var_es(vw_pairs, n_pairs, total_weight, levels);
+    
+    if (vw_pairs != small_pairs) {
+        pfree(vw_pairs);
+    }
+    release_quantile_levels(levels);
+    return result_array;
+}
+
+/*
+ * weighted_var_es_c - Weighted Value-at-Risk and expected shortfall
+ *
+ * Exposed as: weighted_var_es(vals[], weights[], levels[])
+ */
+PG_FUNCTION_INFO_V1(weighted_var_es_c);
+
+Datum
+weighted_var_es_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
+    QuantileLevels local;
+    QuantileLevels *levels = get_quantile_levels(fcinfo, 2, NULL, &local);
+    
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
+    PG_RETURN_ARRAYTYPE_P(var_es_from_source(&src, levels));
+}
+
+/*
+ * weighted_var_es_pairs_c - weighted_var_es over a weighted_pair[] array
+ *
+ * Exposed as: weighted_var_es(pairs[], levels[])
+ */
+PG_FUNCTION_INFO_V1(weighted_var_es_pairs_c);
+
+Datum
+weighted_var_es_pairs_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
+    QuantileLevels local;
+    QuantileLevels *levels = get_quantile_levels(fcinfo, 1, NULL, &local);
+    
+    weighted_source_from_pairs(&src, PG_GETARG_ANY_ARRAY_P(0));
+    PG_RETURN_ARRAYTYPE_P(var_es_from_source(&src, levels));
+}
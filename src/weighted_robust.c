@@ -0,0 +1,607 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Robust Estimators
+ *
+ * Robust estimators built on pairwise differences:
+ * - weighted_hodges_lehmann: weighted median of the shifts y_j - x_i
+ * - weighted_qn: Rousseeuw-Croux Qn, an order statistic of |x_i - x_j|
+ * - weighted_sn: Rousseeuw-Croux Sn, a median over i of medians over j
+ *   of |x_i - x_j|
+ *
+ * A sorted matrix, ascending along its rows and its columns, is given by its
+ * sorted row and column values: element (r, c) is col_values[c] +
+ * row_values[r] and weighs row_weights[r] times the weight of column c. Its
+ * weighted order statistics are found without materializing it (Monahan's
+ * selection, after Johnson and Mizoguchi): a random remaining candidate is
+ * the pivot, a staircase walk counts the weight at or below it in
+ * O(rows + columns), and every row keeps the range of columns still holding
+ * candidates. Each pivot discards a constant fraction of the candidates on
+ * average, so a selection takes O((rows + columns) log(rows * columns))
+ * expected time and linear memory.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/array.h"
+#include "utils/float.h"
+#include <math.h>
+
+#include "utils.h"
+
+/* Consistency constants for the standard deviation of normal data */
+#define QN_CONSISTENCY 2.21914
+#define SN_CONSISTENCY 1.1926
+
+/*
+ * Relative slack of the weight comparisons: sums of the same weights in
+ * different orders differ by rounding, which must not decide whether exactly
+ * half (or k pairs out of n) of the weight is reached, e.g. for weights 1/n
+ */
+#define WEIGHT_RELATIVE_SLACK 1e-12
+
+/* weight reaches target, up to the slack */
+static inline bool
+weight_reaches(double weight, double target)
+{
+    return weight >= target * (1.0 - WEIGHT_RELATIVE_SLACK);
+}
+
+/* weight exceeds target by more than the slack */
+static inline bool
+weight_exceeds(double weight, double target)
+{
+    return weight > target * (1.0 + WEIGHT_RELATIVE_SLACK);
+}
+
+/* Sorted matrix of sums, see the file header */
+typedef struct {
+    int n_rows;
+    int n_cols;
+    const double *row_values;       /* ascending */
+    const double *row_weights;
+    const double *col_values;       /* ascending */
+    const double *col_cum_weights;  /* n_cols + 1 prefix sums of the column weights */
+    const int *first_col;           /* first column of each row, or NULL for 0 */
+} SortedMatrix;
+
+/*
+ * Pivot choice of the selection (splitmix64). The seed is fixed, so a call
+ * always takes the same steps; the result does not depend on it.
+ */
+static inline uint64
+next_pivot_random(uint64 *state)
+{
+    uint64 z = (*state += UINT64CONST(0x9E3779B97F4A7C15));
+    
+    z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+/*
+ * Weight of the elements below pivot, or at or below it when inclusive
+ *
+ * Stores in counts[r] the number of columns of row r that qualify, counting
+ * from column 0. Row values ascend, so the counts do not increase and one
+ * walk down the columns serves all rows. The walk only visits the columns
+ * [lo[r], hi[r]) of each row, which must hold every element of the row
+ * equal to pivot and leave those below it to the left, those above it to
+ * the right.
+ */
+static double
+sorted_matrix_rank(const SortedMatrix *m, const int *lo, const int *hi,
+                   double pivot, bool inclusive, int *counts)
+{
+    double weight = 0.0;
+    int c = m->n_cols;
+    int r;
+    
+    for (r = 0; r < m->n_rows; r++) {
+        double row_value = m->row_values[r];
+        int first = m->first_col ? m->first_col[r] : 0;
+        
+        c = Min(c, hi[r]);
+        if (inclusive) {
+            while (c > lo[r] && m->col_values[c - 1] + row_value > pivot) {
+                c--;
+            }
+        } else {
+            while (c > lo[r] && m->col_values[c - 1] + row_value >= pivot) {
+                c--;
+            }
+        }
+        counts[r] = c;
+        if (c > first) {
+            weight += m->row_weights[r] * (m->col_cum_weights[c] - m->col_cum_weights[first]);
+        }
+    }
+    
+    return weight;
+}
+
+/* Make every valid element a candidate; returns their number */
+static int64
+sorted_matrix_reset(const SortedMatrix *m, int *lo, int *hi)
+{
+    int64 n_candidates = 0;
+    int r;
+    
+    for (r = 0; r < m->n_rows; r++) {
+        lo[r] = m->first_col ? m->first_col[r] : 0;
+        hi[r] = m->n_cols;
+        n_candidates += hi[r] - lo[r];
+    }
+    return n_candidates;
+}
+
+/* Weight of the whole matrix, summed as sorted_matrix_rank sums it */
+static double
+sorted_matrix_total(const SortedMatrix *m, int *lo, int *hi, int *counts)
+{
+    sorted_matrix_reset(m, lo, hi);
+    return sorted_matrix_rank(m, lo, hi, get_float8_infinity(), true, counts);
+}
+
+/*
+ * Smallest element whose weight at or below it reaches target
+ *
+ * target must not exceed the weight of the whole matrix, as computed by
+ * sorted_matrix_total, so that the largest element qualifies. lo, hi and
+ * counts are workspaces of n_rows entries.
+ */
+static double
+sorted_matrix_select(const SortedMatrix *m, double target, int *lo, int *hi, int *counts)
+{
+    uint64 random_state = 0;
+    double best = NAN;
+    int64 n_candidates = sorted_matrix_reset(m, lo, hi);
+    int r;
+    
+    while (n_candidates > 0) {
+        int64 k = (int64) (next_pivot_random(&random_state) % (uint64) n_candidates);
+        double pivot;
+        
+        /* The k-th remaining candidate, in row order */
+        for (r = 0; k >= hi[r] - lo[r]; r++) {
+            k -= hi[r] - lo[r];
+        }
+        pivot = m->col_values[lo[r] + k] + m->row_values[r];
+        
+        if (weight_reaches(sorted_matrix_rank(m, lo, hi, pivot, true, counts), target)) {
+            /* The answer is at most pivot: keep the candidates below it */
+            best = pivot;
+            sorted_matrix_rank(m, lo, hi, pivot, false, counts);
+            for (r = 0; r < m->n_rows; r++) {
+                hi[r] = counts[r];
+            }
+        } else {
+            /* The answer is above pivot: drop the candidates at or below it */
+            for (r = 0; r < m->n_rows; r++) {
+                lo[r] = counts[r];
+            }
+        }
+        
+        n_candidates = 0;
+        for (r = 0; r < m->n_rows; r++) {
+            n_candidates += hi[r] - lo[r];
+        }
+    }
+    
+    return best;
+}
+
+/*
+ * Weighted median of a sorted matrix: the midpoint of its lower and upper
+ * weighted medians, so equal weights give the usual median
+ */
+static double
+sorted_matrix_median(const SortedMatrix *m)
+{
+    int *lo = (int *)palloc_huge((Size) m->n_rows * sizeof(int));
+    int *hi = (int *)palloc_huge((Size) m->n_rows * sizeof(int));
+    int *counts = (int *)palloc_huge((Size) m->n_rows * sizeof(int));
+    double half, lower, upper;
+    int r;
+    
+    half = 0.5 * sorted_matrix_total(m, lo, hi, counts);
+    lower = sorted_matrix_select(m, half, lo, hi, counts);
+    
+    /*
+     * The upper median is the lower one unless exactly half of the weight is
+     * at or below it; then it is the next larger element, the smallest of
+     * the first elements above the lower median in each row
+     */
+    sorted_matrix_reset(m, lo, hi);
+    upper = lower;
+    if (!weight_exceeds(sorted_matrix_rank(m, lo, hi, lower, true, counts), half)) {
+        upper = get_float8_infinity();
+        for (r = 0; r < m->n_rows; r++) {
+            int c = Max(counts[r], lo[r]);
+            
+            if (c < m->n_cols) {
+                upper = Min(upper, m->col_values[c] + m->row_values[r]);
+            }
+        }
+    }
+    
+    pfree(lo);
+    pfree(hi);
+    pfree(counts);
+    return 0.5 * (lower + upper);
+}
+
+/*
+ * Read a sample's values and weights, sorted by value
+ *
+ * Raises the errors of the mean/variance functions and drops zero weights;
+ * NULL elements read as 0. Values are negated first when negate is set.
+ * Returns a palloc'd buffer and stores the number of observations.
+ */
+static ValueWeight *
+read_sorted_sample(AnyArrayType *vals_array, AnyArrayType *weights_array,
+                   bool negate, int *n_pairs)
+{
+    WeightedSource src;
+    ValueWeight *pairs;
+    double total_weight;
+    int i;
+    
+    weighted_source_from_arrays(&src, vals_array, weights_array);
+    pairs = (ValueWeight *)palloc_huge((Size) Max(src.n_elements, 1) * sizeof(ValueWeight));
+    *n_pairs = weighted_source_gather(&src, true, false, pairs, &total_weight);
+    weighted_source_free(&src);
+    
+    if (negate) {
+        for (i = 0; i < *n_pairs; i++) {
+            pairs[i].value = -pairs[i].value;
+        }
+    }
+    
+    optimized_sort_value_weight_pairs(pairs, *n_pairs);
+    return pairs;
+}
+
+/*
+ * weighted_hodges_lehmann_c - Weighted Hodges-Lehmann shift estimate
+ *
+ * Weighted median of y_j - x_i over all pairs, each weighing wx_i * wy_j.
+ * With x negated and sorted, the differences y_j + (-x_i) form a sorted
+ * matrix with one sample along the rows and the other along the columns, so
+ * neither the n * m differences nor their weights are ever stored.
+ *
+ * Exposed as: weighted_hodges_lehmann(x[], wx[], y[], wy[])
+ */
+PG_FUNCTION_INFO_V1(weighted_hodges_lehmann_c);
+
+Datum
+weighted_hodges_lehmann_c(PG_FUNCTION_ARGS)
+{
+    ValueWeight *x_pairs, *y_pairs, *rows, *cols;
+    int n_x, n_y, n_rows, n_cols, i;
+    double *row_values, *row_weights, *col_values, *col_cum_weights;
+    SortedMatrix matrix;
+    double result;
+    
+    x_pairs = read_sorted_sample(PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1), true, &n_x);
+    y_pairs = read_sorted_sample(PG_GETARG_ANY_ARRAY_P(2), PG_GETARG_ANY_ARRAY_P(3), false, &n_y);
+    
+    /* Undefined unless both samples have positive weight */
+    if (n_x == 0 || n_y == 0) {
+        pfree(x_pairs);
+        pfree(y_pairs);
+        PG_RETURN_NULL();
+    }
+    
+    /* The selection walks every row at each step: rows are the smaller sample */
+    if (n_x <= n_y) {
+        rows = x_pairs;
+        n_rows = n_x;
+        cols = y_pairs;
+        n_cols = n_y;
+    } else {
+        rows = y_pairs;
+        n_rows = n_y;
+        cols = x_pairs;
+        n_cols = n_x;
+    }
+    
+    row_values = (double *)palloc_huge((Size) n_rows * sizeof(double));
+    row_weights = (double *)palloc_huge((Size) n_rows * sizeof(double));
+    for (i = 0; i < n_rows; i++) {
+        row_values[i] = rows[i].value;
+        row_weights[i] = rows[i].weight;
+    }
+    col_values = (double *)palloc_huge((Size) n_cols * sizeof(double));
+    col_cum_weights = (double *)palloc_huge((Size) (n_cols + 1) * sizeof(double));
+    col_cum_weights[0] = 0.0;
+    for (i = 0; i < n_cols; i++) {
+        col_values[i] = cols[i].value;
+        col_cum_weights[i + 1] = col_cum_weights[i] + cols[i].weight;
+    }
+    pfree(x_pairs);
+    pfree(y_pairs);
+    
+    matrix.n_rows = n_rows;
+    matrix.n_cols = n_cols;
+    matrix.row_values = row_values;
+    matrix.row_weights = row_weights;
+    matrix.col_values = col_values;
+    matrix.col_cum_weights = col_cum_weights;
+    matrix.first_col = NULL;
+    result = sorted_matrix_median(&matrix);
+    
+    pfree(row_values);
+    pfree(row_weights);
+    pfree(col_values);
+    pfree(col_cum_weights);
+    
+    PG_RETURN_FLOAT8(result);
+}
+
+/*
+ * Weighted Qn of sorted pairs: the order statistic of the distances
+ * x_j - x_i (i < j), each weighing w_i * w_j, at the level of Croux and
+ * Rousseeuw, k of the n(n-1)/2 pairs with k = h(h-1)/2 and h = n/2 + 1
+ *
+ * The distances form the upper triangle of a sorted matrix: row r holds
+ * observation i = n - 1 - r negated, and its valid columns are j > i.
+ * Returns NaN for fewer than two observations.
+ */
+static double
+weighted_qn_sorted(const ValueWeight *pairs, int n)
+{
+    double *row_values, *row_weights, *col_values, *col_cum_weights;
+    int *first_col, *lo, *hi, *counts;
+    SortedMatrix matrix;
+    double n_pairs, k, total, result;
+    int h, i;
+    
+    if (n < 2) {
+        return NAN;
+    }
+    
+    row_values = (double *)palloc_huge((Size) n * sizeof(double));
+    row_weights = (double *)palloc_huge((Size) n * sizeof(double));
+    first_col = (int *)palloc_huge((Size) n * sizeof(int));
+    col_values = (double *)palloc_huge((Size) n * sizeof(double));
+    col_cum_weights = (double *)palloc_huge((Size) (n + 1) * sizeof(double));
+    col_cum_weights[0] = 0.0;
+    for (i = 0; i < n; i++) {
+        row_values[i] = -pairs[n - 1 - i].value;
+        row_weights[i] = pairs[n - 1 - i].weight;
+        first_col[i] = n - i;
+        col_values[i] = pairs[i].value;
+        col_cum_weights[i + 1] = col_cum_weights[i] + pairs[i].weight;
+    }
+    
+    matrix.n_rows = n;
+    matrix.n_cols = n;
+    matrix.row_values = row_values;
+    matrix.row_weights = row_weights;
+    matrix.col_values = col_values;
+    matrix.col_cum_weights = col_cum_weights;
+    matrix.first_col = first_col;
+    
+    lo = (int *)palloc_huge((Size) n * sizeof(int));
+    hi = (int *)palloc_huge((Size) n * sizeof(int));
+    counts = (int *)palloc_huge((Size) n * sizeof(int));
+    
+    h = n / 2 + 1;
+    n_pairs = (double) n * (n - 1) / 2.0;
+    k = (double) h * (h - 1) / 2.0;
+    total = sorted_matrix_total(&matrix, lo, hi, counts);
+    result = sorted_matrix_select(&matrix, total * (k / n_pairs), lo, hi, counts);
+    
+    pfree(row_values);
+    pfree(row_weights);
+    pfree(first_col);
+    pfree(col_values);
+    pfree(col_cum_weights);
+    pfree(lo);
+    pfree(hi);
+    pfree(counts);
+    return QN_CONSISTENCY * result;
+}
+
+/*
+ * Weighted Sn of sorted pairs: the weighted low median over i of m_i, the
+ * weighted high median over j (i included) of |x_i - x_j|
+ *
+ * The observations within d of x_i form a run of the sorted pairs, so m_i is
+ * the smallest cost max(x_i - x_a, x_b - x_i) of a run [a, b] holding i and
+ * more than half of the weight. For a given start a, the best end is the
+ * later of i and b(a), the end of the shortest run from a holding more than
+ * half; two pointers find b(a) for all a at once. The cost first decreases
+ * then increases with a, so a bisection finds m_i, in O(n log n) overall.
+ */
+static double
+weighted_sn_sorted(const ValueWeight *pairs, int n)
+{
+    double *cum_weights;
+    int *run_end;
+    ValueWeight *medians;
+    double half, total, cum, result = 0.0;
+    int n_starts, a, b, i;
+    
+    cum_weights = (double *)palloc_huge((Size) (n + 1) * sizeof(double));
+    cum_weights[0] = 0.0;
+    for (i = 0; i < n; i++) {
+        cum_weights[i + 1] = cum_weights[i] + pairs[i].weight;
+    }
+    half = 0.5 * cum_weights[n];
+    
+    /* b(a) for the starts that have one: a prefix, as b(a) does not decrease */
+    run_end = (int *)palloc_huge((Size) n * sizeof(int));
+    for (a = 0, b = 0; a < n; a++) {
+        b = Max(b, a);
+        while (b < n && !weight_exceeds(cum_weights[b + 1] - cum_weights[a], half)) {
+            b++;
+        }
+        if (b == n) {
+            break;
+        }
+        run_end[a] = b;
+    }
+    n_starts = a;
+    
+    medians = (ValueWeight *)palloc_huge((Size) n * sizeof(ValueWeight));
+    for (i = 0; i < n; i++) {
+        double x = pairs[i].value;
+        int lo = 0, hi = Min(i, n_starts - 1) + 1;
+        double m = get_float8_infinity();
+        
+        /* First start whose left reach no longer exceeds its right reach */
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            
+            if (x - pairs[mid].value <= pairs[Max(i, run_end[mid])].value - x) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        if (lo <= Min(i, n_starts - 1)) {
+            m = pairs[Max(i, run_end[lo])].value - x;
+        }
+        if (lo > 0) {
+            m = Min(m, x - pairs[lo - 1].value);
+        }
+        
+        medians[i].value = m;
+        medians[i].weight = pairs[i].weight;
+    }
+    
+    /* Weighted low median of the m_i */
+    optimized_sort_value_weight_pairs(medians, n);
+    total = 0.0;
+    for (i = 0; i < n; i++) {
+        total += medians[i].weight;
+    }
+    cum = 0.0;
+    for (i = 0; i < n; i++) {
+        cum += medians[i].weight;
+        if (weight_reaches(cum, 0.5 * total)) {
+            result = medians[i].value;
+            break;
+        }
+    }
+    
+    pfree(cum_weights);
+    pfree(run_end);
+    pfree(medians);
+    return SN_CONSISTENCY * result;
+}
+
+/*
+ * Sorted pairs of a scale estimator's input, with the implicit zero of
+ * sparse data
+ *
+ * Raises the errors of the mean/variance functions and drops zero weights.
+ * Returns a palloc'd buffer and stores the number of pairs.
+ */
+static ValueWeight *
+gather_sorted_pairs(WeightedSource *src, int *n_pairs)
+{
+    ValueWeight *pairs;
+    double total_weight;
+    
+    pairs = (ValueWeight *)palloc_huge((Size) (src->n_elements + 1) * sizeof(ValueWeight));
+    *n_pairs = weighted_source_gather(src, true, true, pairs, &total_weight);
+    weighted_source_free(src);
+    
+    optimized_sort_value_weight_pairs(pairs, *n_pairs);
+    return pairs;
+}
+
+/* Run a scale estimator on the pairs of src; NaN when it is undefined */
+static double
+scale_from_source(WeightedSource *src, double (*estimator) (const ValueWeight *, int))
+{
+    ValueWeight *pairs;
+    int n_pairs;
+    double result;
+    
+    pairs = gather_sorted_pairs(src, &n_pairs);
+    result = estimator(pairs, n_pairs);
+    pfree(pairs);
+    return result;
+}
+
+/*
+ * weighted_qn_c - Weighted Qn scale estimator
+ *
+ * Exposed as: weighted_qn(vals[], weights[])
+ */
+PG_FUNCTION_INFO_V1(weighted_qn_c);
+
+Datum
+weighted_qn_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
+    double result;
+    
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
+    result = scale_from_source(&src, weighted_qn_sorted);
+    
+    /* Undefined for a single observation */
+    if (isnan(result)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(result);
+}
+
+/*
+ * weighted_qn_pairs_c - Weighted Qn over a weighted_pair[] array
+ *
+ * Exposed as: weighted_qn(pairs[])
+ */
+PG_FUNCTION_INFO_V1(weighted_qn_pairs_c);
+
+Datum
+weighted_qn_pairs_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
+    double result;
+    
+    weighted_source_from_pairs(&src, PG_GETARG_ANY_ARRAY_P(0));
+    result = scale_from_source(&src, weighted_qn_sorted);
+    
+    /* Undefined for a single observation */
+    if (isnan(result)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(result);
+}
+
+/*
+ * weighted_sn_c - Weighted Sn scale estimator
+ *
+ * Exposed as: weighted_sn(vals[], weights[])
+ */
+PG_FUNCTION_INFO_V1(weighted_sn_c);
+
+Datum
+weighted_sn_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
+    
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
+    PG_RETURN_FLOAT8(scale_from_source(&src, weighted_sn_sorted));
+}
+
+/*
+ * weighted_sn_pairs_c - Weighted Sn over a weighted_pair[] array
+ *
+ * Exposed as: weighted_sn(pairs[])
+ */
+PG_FUNCTION_INFO_V1(weighted_sn_pairs_c);
+
+Datum
+weighted_sn_pairs_c(PG_FUNCTION_ARGS)
+{
+    WeightedSource src;
+    
+    weighted_source_from_pairs(&src, PG_GETARG_ANY_ARRAY_P(0));
+    PG_RETURN_FLOAT8(scale_from_source(&src, weighted_sn_sorted));
+}
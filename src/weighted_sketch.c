@@ -0,0 +1,827 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Moments Sketch
+ *
+ * Fixed-size (192 byte) mergeable quantile summary after Gan et al.,
+ * "Moment-Based Quantile Sketches for Efficient High Cardinality Aggregation
+ * Queries" (VLDB 2018): the minimum, the maximum, the weighted power sums
+ * sum(w * x^i) and the weighted log-power sums sum(w * log(x)^i) over the
+ * positive values, for i = 0..10. Sketches merge by adding the sums, so
+ * per-minute or per-host rollups can be stored and combined cheaply.
+ * Quantiles are estimated from the maximum-entropy density on [min, max]
+ * that matches the moments.
+ *
+ * Follows the conventions of weighted_quantile: rows with non-positive
+ * weights are ignored, and when the total weight is below 1 the missing mass
+ * is an implicit zero. The implicit zero is only applied when estimating, so
+ * merged partial sketches give the same result as one sketch of all rows.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "libpq/pqformat.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/float.h"
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* Number of float8 fields, in storage and text order */
+#define SKETCH_N_FIELDS (2 + 2 * (SKETCH_K + 1))
+
+/* Midpoint grid on [-1, 1] used to integrate the maximum-entropy density */
+#define SKETCH_GRID_SIZE 1024
+
+/* Newton iterations of the maximum-entropy solver */
+#define SKETCH_MAX_ITERATIONS 100
+#define SKETCH_GRADIENT_TOLERANCE 1e-9
+
+/* Chebyshev moments must lie in [-1, 1]; beyond this, rounding has taken over */
+#define SKETCH_MOMENT_SLACK 1e-6
+
+/*
+ * Largest sum of the magnitudes of the terms that cancel into a Chebyshev
+ * moment; at 1e9 the rounding error of the sums stays around 1e-6
+ */
+#define SKETCH_MAX_CANCELLATION 1e9
+
+#define DatumGetMomentsSketchP(X)      ((MomentsSketch *) DatumGetPointer(X))
+#define PG_GETARG_MOMENTS_SKETCH_P(n)  DatumGetMomentsSketchP(PG_GETARG_DATUM(n))
+#define PG_RETURN_MOMENTS_SKETCH_P(x)  return PointerGetDatum(x)
+
+/* A domain the density is fitted on, mapped linearly onto [-1, 1] */
+typedef struct {
+    bool log_scale;             /* fitted to log(x) instead of x */
+    double center;
+    double half_width;
+    int n_moments;              /* usable Chebyshev moments 1..n_moments */
+    double cheb[SKETCH_K + 1];  /* E[T_j(u)], cheb[0] = 1 */
+} SketchDomain;
+
+/* Reset a sketch to no rows */
+void
+moments_sketch_init(MomentsSketch *sketch)
+{
+    memset(sketch, 0, sizeof(MomentsSketch));
+    sketch->min = get_float8_infinity();
+    sketch->max = -get_float8_infinity();
+}
+
+/* Add one row; non-positive weights are ignored */
+static void
+sketch_add(MomentsSketch *sketch, double value, double weight)
+{
+    double term;
+    int i;
+    
+    if (isnan(value) || isinf(value) || isnan(weight) || isinf(weight)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("input values must not contain NaN or infinite values")));
+    }
+    if (weight <= 0.0) {
+        return;
+    }
+    
+    sketch->min = Min(sketch->min, value);
+    sketch->max = Max(sketch->max, value);
+    
+    term = weight;
+    for (i = 0; i <= SKETCH_K; i++) {
+        sketch->power_sums[i] += term;
+        term *= value;
+    }
+    
+    if (value > 0.0) {
+        double log_value = log(value);
+        
+        term = weight;
+        for (i = 0; i <= SKETCH_K; i++) {
+            sketch->log_sums[i] += term;
+            term *= log_value;
+        }
+    }
+}
+
+/*
+ * Add a batch of rows, as the transition function would one at a time
+ *
+ * Used by the custom scan, which deforms column batches itself.
+ */
+void
+moments_sketch_add_batch(MomentsSketch *sketch, const double *vals, const double *weights,
+                         int n_elements)
+{
+    int i;
+    
+    for (i = 0; i < n_elements; i++) {
+        sketch_add(sketch, vals[i], weights[i]);
+    }
+}
+
+/* Merge src into dst: the sums simply add up */
+static void
+sketch_merge(MomentsSketch *dst, const MomentsSketch *src)
+{
+    int i;
+    
+    dst->min = Min(dst->min, src->min);
+    dst->max = Max(dst->max, src->max);
+    for (i = 0; i <= SKETCH_K; i++) {
+        dst->power_sums[i] += src->power_sums[i];
+    }
+    for (i = 0; i <= SKETCH_K; i++) {
+        dst->log_sums[i] += src->log_sums[i];
+    }
+}
+
+/*
+ * Chebyshev moments of the data mapped from [lo, hi] onto [-1, 1]
+ *
+ * sums[i] = sum(w * y^i). Sets domain->cheb and the number of leading
+ * moments that survived the change of basis: higher moments of data far from
+ * zero relative to its spread are lost to cancellation and are dropped.
+ */
+static void
+sketch_domain_moments(SketchDomain *domain, const double *sums, double lo, double hi)
+{
+    double raw[SKETCH_K + 1];
+    double scaled[SKETCH_K + 1];
+    double magnitude[SKETCH_K + 1];
+    double coef[SKETCH_K + 1][SKETCH_K + 1];
+    double shift;
+    int i, j;
+    
+    domain->center = (hi + lo) / 2.0;
+    domain->half_width = (hi - lo) / 2.0;
+    
+    /* Moments of y / half_width, then of u = (y - center) / half_width */
+    for (i = 0; i <= SKETCH_K; i++) {
+        raw[i] = sums[i] / sums[0] / pow(domain->half_width, i);
+    }
+    shift = -domain->center / domain->half_width;
+    for (j = 0; j <= SKETCH_K; j++) {
+        double binomial = 1.0;
+        
+        scaled[j] = 0.0;
+        magnitude[j] = 0.0;
+        for (i = 0; i <= j; i++) {
+            scaled[j] += binomial * raw[i] * pow(shift, j - i);
+            magnitude[j] += fabs(binomial * raw[i] * pow(shift, j - i));
+            binomial = binomial * (j - i) / (i + 1);
+        }
+    }
+    
+    /* Power coefficients of T_j, from T_{j+1} = 2u T_j - T_{j-1} */
+    memset(coef, 0, sizeof(coef));
+    coef[0][0] = 1.0;
+    coef[1][1] = 1.0;
+    for (j = 1; j < SKETCH_K; j++) {
+        for (i = 0; i <= j + 1; i++) {
+            coef[j + 1][i] = (i > 0 ? 2.0 * coef[j][i - 1] : 0.0) - coef[j - 1][i];
+        }
+    }
+    
+    domain->n_moments = 0;
+    domain->cheb[0] = 1.0;
+    for (j = 1; j <= SKETCH_K; j++) {
+        double moment = 0.0;
+        double cancellation = 0.0;
+        
+        for (i = 0; i <= j; i++) {
+            moment += coef[j][i] * scaled[i];
+            cancellation += fabs(coef[j][i]) * magnitude[i];
+        }
+        if (isnan(moment) || fabs(moment) > 1.0 + SKETCH_MOMENT_SLACK ||
+            cancellation > SKETCH_MAX_CANCELLATION) {
+            break;
+        }
+        domain->cheb[j] = Max(-1.0, Min(1.0, moment));
+        domain->n_moments = j;
+    }
+}
+
+/*
+ * Dual objective of the maximum-entropy problem
+ *
+ * The density is exp(sum_j lambda_j T_j(u)) on [-1, 1]; minimizing
+ * integral(density) - sum_j lambda_j mu_j matches its moments to mu.
+ * Also leaves the density on the grid. Returns infinity on overflow.
+ */
+static double
+maxent_dual(const double *lambda, int m, const double *basis, const double *mu,
+            double *density)
+{
+    double h = 2.0 / SKETCH_GRID_SIZE;
+    double integral = 0.0;
+    double result;
+    int g, j;
+    
+    for (g = 0; g < SKETCH_GRID_SIZE; g++) {
+        double exponent = 0.0;
+        
+        for (j = 0; j <= m; j++) {
+            exponent += lambda[j] * basis[j * SKETCH_GRID_SIZE + g];
+        }
+        density[g] = exp(exponent);
+        integral += density[g] * h;
+    }
+    
+    result = integral;
+    for (j = 0; j <= m; j++) {
+        result -= lambda[j] * mu[j];
+    }
+    
+    return isfinite(result) ? result : get_float8_infinity();
+}
+
+/* Solve the small SPD system a x = b in place by Cholesky; false if singular */
+static bool
+cholesky_solve(double *a, double *b, int n)
+{
+    int i, j, k;
+    
+    for (j = 0; j < n; j++) {
+        double d = a[j * n + j];
+        
+        for (k = 0; k < j; k++) {
+            d -= a[j * n + k] * a[j * n + k];
+        }
+        if (!(d > 1e-14)) {
+            return false;
+        }
+        a[j * n + j] = sqrt(d);
+        for (i = j + 1; i < n; i++) {
+            double s = a[i * n + j];
+            
+            for (k = 0; k < j; k++) {
+                s -= a[i * n + k] * a[j * n + k];
+            }
+            a[i * n + j] = s / a[j * n + j];
+        }
+    }
+    
+    /* Forward then back substitution with the lower factor */
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < i; k++) {
+            b[i] -= a[i * n + k] * b[k];
+        }
+        b[i] /= a[i * n + i];
+    }
+    for (i = n - 1; i >= 0; i--) {
+        for (k = i + 1; k < n; k++) {
+            b[i] -= a[k * n + i] * b[k];
+        }
+        b[i] /= a[i * n + i];
+    }
+    
+    return true;
+}
+
+/*
+ * Fit the maximum-entropy density to the first m Chebyshev moments
+ *
+ * Damped Newton on the dual, whose gradient is the moment mismatch and whose
+ * Hessian is the moment matrix of the current density. Returns false when
+ * the moments are not attainable on the grid (singular Hessian, no descent).
+ */
+static bool
+maxent_solve(const double *mu, int m, const double *basis, double *density)
+{
+    double h = 2.0 / SKETCH_GRID_SIZE;
+    double lambda[SKETCH_K + 1];
+    double trial[SKETCH_K + 1];
+    double gradient[SKETCH_K + 1];
+    double step[SKETCH_K + 1];
+    double hessian[(SKETCH_K + 1) * (SKETCH_K + 1)];
+    double objective;
+    int n = m + 1;
+    int iteration, g, i, j;
+    
+    /* Start from the uniform density */
+    memset(lambda, 0, sizeof(lambda));
+    lambda[0] = log(0.5);
+    objective = maxent_dual(lambda, m, basis, mu, density);
+    
+    for (iteration = 0; iteration < SKETCH_MAX_ITERATIONS; iteration++) {
+        double max_gradient = 0.0;
+        double slope = 0.0;
+        double t = 1.0;
+        bool accepted = false;
+        
+        for (i = 0; i < n; i++) {
+            gradient[i] = -mu[i];
+            for (j = 0; j <= i; j++) {
+                hessian[i * n + j] = 0.0;
+            }
+        }
+        for (g = 0; g < SKETCH_GRID_SIZE; g++) {
+            double fh = density[g] * h;
+            
+            for (i = 0; i < n; i++) {
+                double ti = basis[i * SKETCH_GRID_SIZE + g] * fh;
+                
+                gradient[i] += ti;
+                for (j = 0; j <= i; j++) {
+                    hessian[i * n + j] += ti * basis[j * SKETCH_GRID_SIZE + g];
+                }
+            }
+        }
+        for (i = 0; i < n; i++) {
+            max_gradient = Max(max_gradient, fabs(gradient[i]));
+            for (j = 0; j < i; j++) {
+                hessian[j * n + i] = hessian[i * n + j];
+            }
+        }
+        
+        if (max_gradient < SKETCH_GRADIENT_TOLERANCE) {
+            return true;
+        }
+        
+        for (i = 0; i < n; i++) {
+            step[i] = -gradient[i];
+        }
+        if (!cholesky_solve(hessian, step, n)) {
+            return false;
+        }
+        for (i = 0; i < n; i++) {
+            slope += gradient[i] * step[i];
+        }
+        
+        /* Backtracking line search (Armijo) */
+        while (t > 1e-10) {
+            double trial_objective;
+            
+            for (i = 0; i < n; i++) {
+                trial[i] = lambda[i] + t * step[i];
+            }
+            trial_objective = maxent_dual(trial, m, basis, mu, density);
+            if (trial_objective <= objective + 1e-4 * t * slope) {
+                memcpy(lambda, trial, n * sizeof(double));
+                objective = trial_objective;
+                accepted = true;
+                break;
+            }
+            t *= 0.5;
+        }
+        if (!accepted) {
+            return false;
+        }
+    }
+    
+    return false;
+}
+
+/* Map a grid point of a domain back to the data scale */
+static double
+sketch_domain_value(const SketchDomain *domain, double u)
+{
+    double y = domain->center + u * domain->half_width;
+    
+    return domain->log_scale ? exp(y) : y;
+}
+
+/*
+ * Fit a domain, dropping moments until the solver converges
+ *
+ * With no moments left the fit is the uniform density, which always works.
+ */
+static void
+sketch_fit_domain(SketchDomain *domain, const double *basis, double *density)
+{
+    while (domain->n_moments > 0 &&
+           !maxent_solve(domain->cheb, domain->n_moments, basis, density)) {
+        domain->n_moments--;
+    }
+    if (domain->n_moments == 0) {
+        maxent_solve(domain->cheb, 0, basis, density);
+    }
+}
+
+/*
+ * Mismatch of a fitted density against the first two moments of another
+ * domain, which it was not fitted to
+ */
+static double
+sketch_cross_error(const SketchDomain *fitted, const double *density,
+                   const SketchDomain *other)
+{
+    double h = 2.0 / SKETCH_GRID_SIZE;
+    double mass = 0.0, t1 = 0.0, t2 = 0.0;
+    int g;
+    
+    if (other->n_moments < 2) {
+        return 0.0;
+    }
+    
+    for (g = 0; g < SKETCH_GRID_SIZE; g++) {
+        double u = -1.0 + (g + 0.5) * h;
+        double x = sketch_domain_value(fitted, u);
+        double y = other->log_scale ? log(x) : x;
+        double v = (y - other->center) / other->half_width;
+        double fh = density[g] * h;
+        
+        mass += fh;
+        t1 += v * fh;
+        t2 += (2.0 * v * v - 1.0) * fh;
+    }
+    
+    return fabs(t1 / mass - other->cheb[1]) + fabs(t2 / mass - other->cheb[2]);
+}
+
+/* Normalized cumulative integral of a fitted density at the grid cell edges */
+static double *
+sketch_density_cdf(const double *density)
+{
+    double *cdf = (double *)palloc((SKETCH_GRID_SIZE + 1) * sizeof(double));
+    int g;
+    
+    cdf[0] = 0.0;
+    for (g = 0; g < SKETCH_GRID_SIZE; g++) {
+        cdf[g + 1] = cdf[g] + density[g];
+    }
+    for (g = 1; g <= SKETCH_GRID_SIZE; g++) {
+        cdf[g] /= cdf[SKETCH_GRID_SIZE];
+    }
+    
+    return cdf;
+}
+
+/* Fitted CDF at a value of the data scale */
+static double
+sketch_cdf_at(const SketchDomain *domain, const double *cdf, double x)
+{
+    double y, position;
+    int cell;
+    
+    if (domain->log_scale) {
+        if (x <= 0.0) {
+            return 0.0;
+        }
+        x = log(x);
+    }
+    y = (x - domain->center) / domain->half_width;
+    if (y <= -1.0) {
+        return 0.0;
+    }
+    if (y >= 1.0) {
+        return 1.0;
+    }
+    
+    position = (y + 1.0) * SKETCH_GRID_SIZE / 2.0;
+    cell = Min((int) position, SKETCH_GRID_SIZE - 1);
+    return cdf[cell] + (position - cell) * (cdf[cell + 1] - cdf[cell]);
+}
+
+/* Invert the fitted CDF at level p */
+static double
+sketch_quantile_at(const SketchDomain *domain, const double *cdf, double p)
+{
+    double h = 2.0 / SKETCH_GRID_SIZE;
+    double u;
+    int lo = 0, hi = SKETCH_GRID_SIZE;
+    
+    /* Last cell whose start is below the target */
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        
+        if (cdf[mid] < p) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    u = -1.0 + h * lo;
+    if (cdf[lo + 1] > cdf[lo]) {
+        u += h * (p - cdf[lo]) / (cdf[lo + 1] - cdf[lo]);
+    }
+    return sketch_domain_value(domain, Max(-1.0, Min(1.0, u)));
+}
+
+/*
+ * Estimate quantiles from a sketch
+ *
+ * Fits the maximum-entropy density to the power moments and, when all the
+ * rows are positive, also to the log moments; each fit is checked against
+ * the first moments of the other kind and the better one is used. The
+ * implicit zero of sparse data is a known point mass, so it is not smoothed
+ * into the density but mixed back in when inverting the CDF.
+ */
+static void
+sketch_estimate_quantiles(const MomentsSketch *sketch, const double *quantiles,
+                          int n_quantiles, double *results)
+{
+    double explicit_weight = sketch->power_sums[0];
+    double zero_mass = Max(0.0, 1.0 - explicit_weight);
+    double total_weight = explicit_weight + zero_mass;
+    double below_zero = 0.0;
+    SketchDomain domains[2];
+    double *basis, *densities[2], *cdf;
+    int n_domains = 1;
+    int best = 0;
+    int d, g, j, q;
+    
+    /* No explicit rows, or all at one value: two point masses at most */
+    if (explicit_weight <= 0.0 || sketch->min == sketch->max) {
+        double value = (explicit_weight > 0.0) ? sketch->min : 0.0;
+        double first = Min(value, 0.0), second = Max(value, 0.0);
+        double first_mass = (value < 0.0) ? explicit_weight : zero_mass;
+        
+        if (zero_mass <= 0.0) {
+            first = second = value;
+        }
+        for (q = 0; q < n_quantiles; q++) {
+            results[q] = (quantiles[q] * total_weight <= first_mass) ? first : second;
+        }
+        return;
+    }
+    
+    domains[0].log_scale = false;
+    sketch_domain_moments(&domains[0], sketch->power_sums, sketch->min, sketch->max);
+    if (sketch->min > 0.0 && sketch->log_sums[0] == sketch->power_sums[0]) {
+        domains[1].log_scale = true;
+        sketch_domain_moments(&domains[1], sketch->log_sums,
+                              log(sketch->min), log(sketch->max));
+        n_domains = 2;
+    }
+    
+    /* T_j on the grid */
+    basis = (double *)palloc((SKETCH_K + 1) * SKETCH_GRID_SIZE * sizeof(double));
+    for (g = 0; g < SKETCH_GRID_SIZE; g++) {
+        double u = -1.0 + (g + 0.5) * 2.0 / SKETCH_GRID_SIZE;
+        
+        basis[g] = 1.0;
+        basis[SKETCH_GRID_SIZE + g] = u;
+        for (j = 2; j <= SKETCH_K; j++) {
+            basis[j * SKETCH_GRID_SIZE + g] = 2.0 * u * basis[(j - 1) * SKETCH_GRID_SIZE + g] -
+                                              basis[(j - 2) * SKETCH_GRID_SIZE + g];
+        }
+    }
+    
+    for (d = 0; d < n_domains; d++) {
+        densities[d] = (double *)palloc(SKETCH_GRID_SIZE * sizeof(double));
+        sketch_fit_domain(&domains[d], basis, densities[d]);
+    }
+    if (n_domains == 2 &&
+        sketch_cross_error(&domains[1], densities[1], &domains[0]) <
+        sketch_cross_error(&domains[0], densities[0], &domains[1])) {
+        best = 1;
+    }
+    
+    cdf = sketch_density_cdf(densities[best]);
+    if (zero_mass > 0.0) {
+        below_zero = explicit_weight * sketch_cdf_at(&domains[best], cdf, 0.0);
+    }
+    
+    for (q = 0; q < n_quantiles; q++) {
+        double p = quantiles[q] * total_weight;
+        
+        if (quantiles[q] <= 0.0) {
+            /* The extremes are known exactly */
+            results[q] = (zero_mass > 0.0) ? Min(sketch->min, 0.0) : sketch->min;
+        } else if (quantiles[q] >= 1.0) {
+            results[q] = (zero_mass > 0.0) ? Max(sketch->max, 0.0) : sketch->max;
+        } else if (p <= below_zero) {
+            results[q] = sketch_quantile_at(&domains[best], cdf, p / explicit_weight);
+        } else if (p <= below_zero + zero_mass) {
+            results[q] = 0.0;
+        } else {
+            results[q] = sketch_quantile_at(&domains[best], cdf,
+                                            (p - zero_mass) / explicit_weight);
+        }
+    }
+    
+    pfree(cdf);
+    for (d = 0; d < n_domains; d++) {
+        pfree(densities[d]);
+    }
+    pfree(basis);
+}
+
+/*
+ * moments_sketch_in - Text input: '(min,max,p0,...,p10,l0,...,l10)'
+ */
+PG_FUNCTION_INFO_V1(moments_sketch_in);
+
+Datum
+moments_sketch_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);
+    char *cur = str;
+    double *fields;
+    MomentsSketch *result;
+    int i;
+    
+    result = (MomentsSketch *)palloc(sizeof(MomentsSketch));
+    fields = (double *)result;
+    
+    while (isspace((unsigned char) *cur)) {
+        cur++;
+    }
+    if (*cur != '(') {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type %s: \"%s\"",
+                        "moments_sketch", str)));
+    }
+    cur++;
+    
+    for (i = 0; i < SKETCH_N_FIELDS; i++) {
+        char *end;
+        
+        fields[i] = weighted_float8in(cur, &end, "moments_sketch", str);
+        if (*end != (i == SKETCH_N_FIELDS - 1 ? ')' : ',')) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                     errmsg("invalid input syntax for type %s: \"%s\"",
+                            "moments_sketch", str)));
+        }
+        cur = end + 1;
+    }
+    
+    while (isspace((unsigned char) *cur)) {
+        cur++;
+    }
+    if (*cur != '\0') {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type %s: \"%s\"",
+                        "moments_sketch", str)));
+    }
+    
+    PG_RETURN_MOMENTS_SKETCH_P(result);
+}
+
+/*
+ * moments_sketch_out - Text output as '(min,max,p0,...,p10,l0,...,l10)'
+ */
+PG_FUNCTION_INFO_V1(moments_sketch_out);
+
+Datum
+moments_sketch_out(PG_FUNCTION_ARGS)
+{
+    MomentsSketch *sketch = PG_GETARG_MOMENTS_SKETCH_P(0);
+    const double *fields = (const double *)sketch;
+    StringInfoData buf;
+    int i;
+    
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '(');
+    for (i = 0; i < SKETCH_N_FIELDS; i++) {
+        if (i > 0) {
+            appendStringInfoChar(&buf, ',');
+        }
+        appendStringInfoString(&buf, float8out_internal(fields[i]));
+    }
+    appendStringInfoChar(&buf, ')');
+    
+    PG_RETURN_CSTRING(buf.data);
+}
+
+/*
+ * moments_sketch_recv - Binary input
+ */
+PG_FUNCTION_INFO_V1(moments_sketch_recv);
+
+Datum
+moments_sketch_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    MomentsSketch *result;
+    double *fields;
+    int i;
+    
+    result = (MomentsSketch *)palloc(sizeof(MomentsSketch));
+    fields = (double *)result;
+    for (i = 0; i < SKETCH_N_FIELDS; i++) {
+        fields[i] = pq_getmsgfloat8(buf);
+    }
+    
+    PG_RETURN_MOMENTS_SKETCH_P(result);
+}
+
+/*
+ * moments_sketch_send - Binary output
+ */
+PG_FUNCTION_INFO_V1(moments_sketch_send);
+
+Datum
+moments_sketch_send(PG_FUNCTION_ARGS)
+{
+    MomentsSketch *sketch = PG_GETARG_MOMENTS_SKETCH_P(0);
+    const double *fields = (const double *)sketch;
+    StringInfoData buf;
+    int i;
+    
+    pq_begintypsend(&buf);
+    for (i = 0; i < SKETCH_N_FIELDS; i++) {
+        pq_sendfloat8(&buf, fields[i]);
+    }
+    
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * moments_sketch_transfn - Add one (value, weight) row
+ *
+ * NULL values and weights are read as 0.0, like NULL array elements. The
+ * state is updated in place.
+ */
+PG_FUNCTION_INFO_V1(moments_sketch_transfn);
+
+Datum
+moments_sketch_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    MomentsSketch *state;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "moments_sketch_transfn called in non-aggregate context");
+    }
+    
+    if (PG_ARGISNULL(0)) {
+        state = (MomentsSketch *)MemoryContextAlloc(agg_context, sizeof(MomentsSketch));
+        moments_sketch_init(state);
+    } else {
+        state = PG_GETARG_MOMENTS_SKETCH_P(0);
+    }
+    
+    sketch_add(state,
+               PG_ARGISNULL(1) ? 0.0 : PG_GETARG_FLOAT8(1),
+               PG_ARGISNULL(2) ? 0.0 : PG_GETARG_FLOAT8(2));
+    
+    PG_RETURN_MOMENTS_SKETCH_P(state);
+}
+
+/*
+ * moments_sketch_combinefn - Merge two sketches
+ *
+ * Combine function of moments_sketch_agg, and transition function of
+ * moments_sketch_merge over stored sketches. Only the first argument is
+ * modified.
+ */
+PG_FUNCTION_INFO_V1(moments_sketch_combinefn);
+
+Datum
+moments_sketch_combinefn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+    MomentsSketch *state;
+    
+    if (!AggCheckCallContext(fcinfo, &agg_context)) {
+        elog(ERROR, "moments_sketch_combinefn called in non-aggregate context");
+    }
+    
+    if (PG_ARGISNULL(1)) {
+        if (PG_ARGISNULL(0)) {
+            PG_RETURN_NULL();
+        }
+        PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+    }
+    
+    if (PG_ARGISNULL(0)) {
+        state = (MomentsSketch *)MemoryContextAlloc(agg_context, sizeof(MomentsSketch));
+        *state = *PG_GETARG_MOMENTS_SKETCH_P(1);
+        PG_RETURN_MOMENTS_SKETCH_P(state);
+    }
+    
+    state = PG_GETARG_MOMENTS_SKETCH_P(0);
+    sketch_merge(state, PG_GETARG_MOMENTS_SKETCH_P(1));
+    
+    PG_RETURN_MOMENTS_SKETCH_P(state);
+}
+
+/*
+ * moments_sketch_quantile_c - Estimated quantiles of a sketch
+ *
+ * Exposed as: moments_sketch_quantile(sketch, quantiles[])
+ */
+PG_FUNCTION_INFO_V1(moments_sketch_quantile_c);
+
+Datum
+moments_sketch_quantile_c(PG_FUNCTION_ARGS)
+{
+    MomentsSketch *sketch = PG_GETARG_MOMENTS_SKETCH_P(0);
+    double *quantiles;
+    double *results;
+    Datum *result_datums;
+    int n_quantiles;
+    int i;
+    
+    quantiles = extract_quantile_levels(PG_GETARG_ARRAYTYPE_P(1), &n_quantiles);
+    results = (double *)palloc(n_quantiles * sizeof(double));
+    
+    sketch_estimate_quantiles(sketch, quantiles, n_quantiles, results);
+    
+    result_datums = (Datum *)palloc(n_quantiles * sizeof(Datum));
+    for (i = 0; i < n_quantiles; i++) {
+        result_datums[i] = Float8GetDatum(results[i]);
+    }
+    
+    PG_RETURN_ARRAYTYPE_P(construct_array(result_datums, n_quantiles, FLOAT8OID,
+                                          8, FLOAT8PASSBYVAL, 'd'));
+}
@@ -0,0 +1,188 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Planner Support
+ *
+ * Support function for the array versions of weighted_mean, weighted_variance
+ * and weighted_std. A call such as
+ *
+ *     weighted_mean(array_agg(v), array_agg(w))
+ *
+ * is rewritten during expression simplification into the equivalent row
+ * aggregate weighted_mean_agg(v, w), which streams the rows instead of
+ * building two arrays per group and can run in parallel. Disabled with
+ * weighted_statistics.enable_array_agg_rewrite.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_namespace.h"
+#include "catalog/pg_type.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#include "parser/parse_func.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+
+#include "utils.h"
+
+/* GUC: rewrite array_agg-based calls into the row aggregates */
+static bool enable_array_agg_rewrite = true;
+
+/*
+ * Register the GUC (called from _PG_init)
+ */
+void
+weighted_support_register(void)
+{
+    DefineCustomBoolVariable("weighted_statistics.enable_array_agg_rewrite",
+                             "Rewrites array_agg-based calls into the weighted row aggregates.",
+                             "Plans weighted_mean(array_agg(v), array_agg(w)) and the "
+                             "variance/std equivalents as weighted_mean_agg(v, w) etc.",
+                             &enable_array_agg_rewrite,
+                             true,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+}
+
+/*
+ * Argument of a plain array_agg(float8) call of this query level, or NULL
+ *
+ * DISTINCT and ORDER BY are rejected: the former changes the result and the
+ * latter has no equivalent in the row aggregates.
+ */
+static Expr *
+get_array_agg_arg(Node *node)
+{
+    Aggref *aggref;
+    
+    if (!IsA(node, Aggref)) {
+        return NULL;
+    }
+    
+    aggref = (Aggref *)node;
+    if (aggref->aggorder != NIL || aggref->aggdistinct != NIL || aggref->aggstar ||
+        aggref->aggvariadic || aggref->aggkind != AGGKIND_NORMAL || aggref->agglevelsup != 0 ||
+        aggref->aggsplit != AGGSPLIT_SIMPLE || list_length(aggref->args) != 1) {
+        return NULL;
+    }
+    
+    if (get_func_namespace(aggref->aggfnoid) != PG_CATALOG_NAMESPACE ||
+        strcmp(get_func_name(aggref->aggfnoid), "array_agg") != 0 ||
+        aggref->aggtype != FLOAT8ARRAYOID) {
+        return NULL;
+    }
+    
+    return ((TargetEntry *)linitial(aggref->args))->expr;
+}
+
+/* Build the row aggregate call replacing the array function call */
+static Node *
+make_row_aggregate(FuncExpr *expr, Aggref *vals_agg, Expr *value, Expr *weight, Node *ddof)
+{
+    char *agg_name;
+    List *agg_qualified_name;
+    Oid argtypes[3] = {FLOAT8OID, FLOAT8OID, INT4OID};
+    int nargs = (ddof != NULL) ? 3 : 2;
+    Oid aggfnoid;
+    Aggref *aggref;
+    List *args;
+    
+    /* weighted_mean -> weighted_mean_agg, in the extension's schema */
+    agg_name = psprintf("%s_agg", get_func_name(expr->funcid));
+    agg_qualified_name = list_make2(makeString(get_namespace_name(get_func_namespace(expr->funcid))),
+                                    makeString(agg_name));
+    aggfnoid = LookupFuncName(agg_qualified_name, nargs, argtypes, true);
+    if (!OidIsValid(aggfnoid)) {
+        return NULL;
+    }
+    
+    args = list_make2(makeTargetEntry((Expr *)copyObject(value), 1, NULL, false),
+                      makeTargetEntry((Expr *)copyObject(weight), 2, NULL, false));
+    if (ddof != NULL) {
+        args = lappend(args, makeTargetEntry((Expr *)copyObject(ddof), 3, NULL, false));
+    }
+    
+    aggref = makeNode(Aggref);
+    aggref->aggfnoid = aggfnoid;
+    aggref->aggtype = FLOAT8OID;
+    aggref->aggcollid = InvalidOid;
+    aggref->inputcollid = InvalidOid;
+    aggref->aggtranstype = InvalidOid;
+    aggref->aggargtypes = (nargs == 3) ?
+        list_make3_oid(FLOAT8OID, FLOAT8OID, INT4OID) : list_make2_oid(FLOAT8OID, FLOAT8OID);
+    aggref->aggdirectargs = NIL;
+    aggref->args = args;
+    aggref->aggorder = NIL;
+    aggref->aggdistinct = NIL;
+    aggref->aggfilter = (Expr *)copyObject(vals_agg->aggfilter);
+    aggref->aggstar = false;
+    aggref->aggvariadic = false;
+    aggref->aggkind = AGGKIND_NORMAL;
+    aggref->agglevelsup = 0;
+    aggref->aggsplit = AGGSPLIT_SIMPLE;
+#if PG_VERSION_NUM >= 140000
+    aggref->aggno = -1;
+    aggref->aggtransno = -1;
+#endif
+    aggref->location = expr->location;
+    
+    return (Node *)aggref;
+}
+
+/*
+ * weighted_array_agg_support - Planner support function
+ *
+ * Handles SupportRequestSimplify for weighted_mean(values[], weights[]) and
+ * weighted_variance/weighted_std(values[], weights[], ddof). The call is
+ * replaced when both arrays come from array_agg over the same rows (same
+ * FILTER, aggregated at this query level) and ddof is a constant.
+ */
+PG_FUNCTION_INFO_V1(weighted_array_agg_support);
+
+Datum
+weighted_array_agg_support(PG_FUNCTION_ARGS)
+{
+    Node *rawreq = (Node *)PG_GETARG_POINTER(0);
+    SupportRequestSimplify *req;
+    FuncExpr *expr;
+    Aggref *vals_agg, *weights_agg;
+    Expr *value, *weight;
+    Node *ddof = NULL;
+    
+    if (!IsA(rawreq, SupportRequestSimplify) || !enable_array_agg_rewrite) {
+        PG_RETURN_POINTER(NULL);
+    }
+    
+    req = (SupportRequestSimplify *)rawreq;
+    expr = req->fcall;
+    
+    if (list_length(expr->args) < 2 || list_length(expr->args) > 3) {
+        PG_RETURN_POINTER(NULL);
+    }
+    
+    value = get_array_agg_arg(linitial(expr->args));
+    weight = get_array_agg_arg(lsecond(expr->args));
+    if (value == NULL || weight == NULL) {
+        PG_RETURN_POINTER(NULL);
+    }
+    
+    /* Both arrays must be built from the same rows */
+    vals_agg = (Aggref *)linitial(expr->args);
+    weights_agg = (Aggref *)lsecond(expr->args);
+    if (!equal(vals_agg->aggfilter, weights_agg->aggfilter)) {
+        PG_RETURN_POINTER(NULL);
+    }
+    
+    /* ddof moves into the aggregate arguments, so it must not depend on the group */
+    if (list_length(expr->args) == 3) {
+        ddof = lthird(expr->args);
+        if (!IsA(ddof, Const)) {
+            PG_RETURN_POINTER(NULL);
+        }
+    }
+    
+    PG_RETURN_POINTER(make_row_aggregate(expr, vals_agg, value, weight, ddof));
+}
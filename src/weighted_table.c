@@ -0,0 +1,501 @@
+/*
+ * Weighted Statistics PostgreSQL Extension - Table Scan Functions
+ *
+ * Weighted statistics computed directly over a table's heap:
+ * - weighted_quantile_table: Empirical CDF quantiles of two columns
+ * - weighted_mean_table: Weighted mean of two columns
+ * - weighted_variance_table: Weighted variance of two columns
+ *
+ * The table is scanned in C with the table AM, deforming only up to the two
+ * requested columns, under the query's MVCC snapshot. Rows are converted in
+ * chunks and fed straight into the sort buffer or the moment reductions,
+ * which avoids the per-row executor and array_agg overhead of the
+ * equivalent SQL. Quantiles of tables larger than work_mem are selected with
+ * several passes of radix histograms instead of a sort buffer.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_type.h"
+#include "executor/tuptable.h"
+#include "miscadmin.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include <limits.h>
+#include <math.h>
+
+#include "utils.h"
+
+/* Number of rows converted before handing a chunk to the consumer */
+#define TABLE_SCAN_CHUNK_SIZE 1024
+
+/* Pair buffer filled by the quantile scan, up to work_mem */
+typedef struct {
+    ValueWeight *pairs;
+    int n_pairs;
+    int capacity;
+    int max_pairs;
+    MultipassSelect *select;    /* first pass of the multi-pass select, once past max_pairs */
+} PairCollector;
+
+/* Table and columns replayed by the later passes of the multi-pass select */
+typedef struct {
+    Oid relid;
+    Name value_col;
+    Name weight_col;
+} TableScanArgs;
+
+/* Moments accumulated by the mean/variance scans */
+typedef struct {
+    WeightedMoments moments;
+    int64 n_rows;
+} MomentsCollector;
+
+/* Whether a column type can be read as double precision */
+static bool
+is_supported_column_type(Oid typid)
+{
+    switch (typid) {
+        case FLOAT8OID:
+        case FLOAT4OID:
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case NUMERICOID:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Convert a non-NULL column datum to double precision */
+static double
+column_datum_to_double(Datum datum, Oid typid)
+{
+    switch (typid) {
+        case FLOAT8OID:
+            return DatumGetFloat8(datum);
+        case FLOAT4OID:
+            return (double) DatumGetFloat4(datum);
+        case INT2OID:
+            return (double) DatumGetInt16(datum);
+        case INT4OID:
+            return (double) DatumGetInt32(datum);
+        case INT8OID:
+            return (double) DatumGetInt64(datum);
+        case NUMERICOID:
+            return DatumGetFloat8(DirectFunctionCall1(numeric_float8_no_overflow, datum));
+        default:
+            elog(ERROR, "unsupported column type %u", typid);
+            return 0.0;         /* keep compiler quiet */
+    }
+}
+
+/* Resolve a column by name and check that it is numeric */
+static AttrNumber
+lookup_weighted_column(Relation rel, Name colname)
+{
+    AttrNumber attnum;
+    Oid typid;
+    
+    attnum = get_attnum(RelationGetRelid(rel), NameStr(*colname));
+    if (attnum == InvalidAttrNumber) {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg("column \"%s\" of relation \"%s\" does not exist",
+                        NameStr(*colname), RelationGetRelationName(rel))));
+    }
+    if (attnum < 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("system column \"%s\" is not supported", NameStr(*colname))));
+    }
+    
+    typid = TupleDescAttr(RelationGetDescr(rel), attnum - 1)->atttypid;
+    if (!is_supported_column_type(typid)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("column \"%s\" must be of a numeric type, not %s",
+                        NameStr(*colname), format_type_be(typid))));
+    }
+    
+    return attnum;
+}
+
+/* Check SELECT privilege on the two columns and refuse row-level security */
+static void
+check_table_access(Relation rel, AttrNumber value_attnum, AttrNumber weight_attnum)
+{
+    Oid relid = RelationGetRelid(rel);
+    AclResult aclresult;
+    
+    aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+    if (aclresult != ACLCHECK_OK) {
+        /* Column privileges are enough, as for a plain SELECT */
+        aclresult = pg_attribute_aclcheck(relid, value_attnum, GetUserId(), ACL_SELECT);
+        if (aclresult == ACLCHECK_OK) {
+            aclresult = pg_attribute_aclcheck(relid, weight_attnum, GetUserId(), ACL_SELECT);
+        }
+        if (aclresult != ACLCHECK_OK) {
+            aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind),
+                           RelationGetRelationName(rel));
+        }
+    }
+    
+    /* A raw scan would bypass the policies, so don't silently ignore them */
+    if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("table functions do not support row-level security on \"%s\"",
+                        RelationGetRelationName(rel))));
+    }
+}
+
+/* Scan one relation with storage and feed its rows to the consumer in chunks */
+static void
+scan_relation_chunks(Relation rel, Name value_col, Name weight_col,
+                     WeightedChunkFn consumer, void *arg)
+{
+    AttrNumber value_attnum = lookup_weighted_column(rel, value_col);
+    AttrNumber weight_attnum = lookup_weighted_column(rel, weight_col);
+    AttrNumber max_attnum = Max(value_attnum, weight_attnum);
+    TupleDesc tupdesc = RelationGetDescr(rel);
+    Oid value_type = TupleDescAttr(tupdesc, value_attnum - 1)->atttypid;
+    Oid weight_type = TupleDescAttr(tupdesc, weight_attnum - 1)->atttypid;
+    TableScanDesc scan;
+    TupleTableSlot *slot;
+    MemoryContext chunk_context;
+    MemoryContext old_context;
+    double *vals, *weights;
+    int n_rows = 0;
+    
+    vals = (double *)palloc(TABLE_SCAN_CHUNK_SIZE * sizeof(double));
+    weights = (double *)palloc(TABLE_SCAN_CHUNK_SIZE * sizeof(double));
+    
+    /* Numeric conversion allocates; keep that garbage per chunk */
+    chunk_context = AllocSetContextCreate(CurrentMemoryContext,
+                                          "weighted table scan chunk",
+                                          ALLOCSET_SMALL_SIZES);
+    
+    /*
+     * No synchronized scan, which would start at another block on each call:
+     * the passes of the multi-pass select must see the rows in one order
+     */
+    scan = table_beginscan_strat(rel, GetActiveSnapshot(), 0, NULL, true, false);
+    slot = table_slot_create(rel, NULL);
+    
+    old_context = MemoryContextSwitchTo(chunk_context);
+    
+    while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
+        /* Deform only up to the last column we need */
+        slot_getsomeattrs(slot, max_attnum);
+        
+        vals[n_rows] = slot->tts_isnull[value_attnum - 1] ? 0.0 :
+            column_datum_to_double(slot->tts_values[value_attnum - 1], value_type);
+        weights[n_rows] = slot->tts_isnull[weight_attnum - 1] ? 0.0 :
+            column_datum_to_double(slot->tts_values[weight_attnum - 1], weight_type);
+        
+        if (++n_rows == TABLE_SCAN_CHUNK_SIZE) {
+            MemoryContextSwitchTo(old_context);
+            consumer(vals, weights, n_rows, arg);
+            n_rows = 0;
+            MemoryContextReset(chunk_context);
+            CHECK_FOR_INTERRUPTS();
+            MemoryContextSwitchTo(chunk_context);
+        }
+    }
+    
+    MemoryContextSwitchTo(old_context);
+    
+    if (n_rows > 0) {
+        consumer(vals, weights, n_rows, arg);
+    }
+    
+    ExecDropSingleTupleTableSlot(slot);
+    table_endscan(scan);
+    
+    MemoryContextDelete(chunk_context);
+    pfree(vals);
+    pfree(weights);
+}
+
+/*
+ * Scan a table (and its inheritance children or partitions) chunk by chunk
+ */
+static void
+scan_weighted_table(Oid relid, Name value_col, Name weight_col,
+                    WeightedChunkFn consumer, void *arg)
+{
+    Relation rel;
+    List *relids;
+    ListCell *lc;
+    char relkind;
+    
+    rel = table_open(relid, AccessShareLock);
+    relkind = rel->rd_rel->relkind;
+    
+    if (relkind != RELKIND_RELATION && relkind != RELKIND_MATVIEW &&
+        relkind != RELKIND_PARTITIONED_TABLE) {
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a table or materialized view",
+                        RelationGetRelationName(rel))));
+    }
+    
+    /* Privileges are checked on the named table only, as for a SELECT */
+    check_table_access(rel, lookup_weighted_column(rel, value_col),
+                       lookup_weighted_column(rel, weight_col));
+    
+    relids = find_all_inheritors(relid, AccessShareLock, NULL);
+    
+    foreach(lc, relids) {
+        Oid child_relid = lfirst_oid(lc);
+        Relation child = (child_relid == relid) ? rel : table_open(child_relid, NoLock);
+        
+        if (RELKIND_HAS_STORAGE(child->rd_rel->relkind)) {
+            scan_relation_chunks(child, value_col, weight_col, consumer, arg);
+        }
+        
+        if (child != rel) {
+            table_close(child, NoLock);
+        }
+    }
+    
+    table_close(rel, AccessShareLock);
+}
+
+/* Replay the collected pairs into a multi-pass select and drop the buffer */
+static void
+collector_start_multipass(PairCollector *collector)
+{
+    double vals[TABLE_SCAN_CHUNK_SIZE];
+    double weights[TABLE_SCAN_CHUNK_SIZE];
+    int start, i;
+    
+    collector->select = multipass_select_begin();
+    for (start = 0; start < collector->n_pairs; start += TABLE_SCAN_CHUNK_SIZE) {
+        int n_rows = Min(TABLE_SCAN_CHUNK_SIZE, collector->n_pairs - start);
+        
+        for (i = 0; i < n_rows; i++) {
+            vals[i] = collector->pairs[start + i].value;
+            weights[i] = collector->pairs[start + i].weight;
+        }
+        multipass_select_consume(vals, weights, n_rows, collector->select);
+    }
+    
+    pfree(collector->pairs);
+    collector->pairs = NULL;
+    collector->n_pairs = 0;
+}
+
+/*
+ * Chunk consumer: append positive-weight pairs to the sort buffer, or feed
+ * the first pass of the multi-pass select once the buffer is full
+ */
+static void
+collect_pairs_chunk(const double *vals, const double *weights, int n_rows, void *arg)
+{
+    PairCollector *collector = (PairCollector *) arg;
+    int i;
+    
+    /* Keep one spare slot for the implicit zero of sparse data */
+    if (collector->select == NULL && collector->n_pairs + n_rows + 1 > collector->capacity) {
+        Size needed = (Size) collector->n_pairs + n_rows + 1;
+        Size new_capacity = (Size) collector->capacity * 2;
+        
+        if (needed > (Size) collector->max_pairs + 1) {
+            collector_start_multipass(collector);
+        } else {
+            while (new_capacity < needed) {
+                new_capacity *= 2;
+            }
+            /* Huge allocations go past 1GB when work_mem allows it */
+            new_capacity = Min(new_capacity, (Size) collector->max_pairs + 1);
+            collector->pairs = (ValueWeight *)repalloc_huge(collector->pairs,
+                                                            new_capacity * sizeof(ValueWeight));
+            collector->capacity = (int) new_capacity;
+        }
+    }
+    
+    if (collector->select != NULL) {
+        multipass_select_consume(vals, weights, n_rows, collector->select);
+        return;
+    }
+    
+    for (i = 0; i < n_rows; i++) {
+        if (weights[i] > 0.0) {
+            collector->pairs[collector->n_pairs].value = vals[i];
+            collector->pairs[collector->n_pairs].weight = weights[i];
+            collector->n_pairs++;
+        }
+    }
+}
+
+/* WeightedScanFn of the multi-pass select: scan the table again */
+static void
+rescan_weighted_table(void *scan_arg, WeightedChunkFn consumer, void *consumer_arg)
+{
+    TableScanArgs *args = (TableScanArgs *) scan_arg;
+    
+    scan_weighted_table(args->relid, args->value_col, args->weight_col,
+                        consumer, consumer_arg);
+}
+
+/* Chunk consumer: validate rows and accumulate weighted moments */
+static void
+collect_moments_chunk(const double *vals, const double *weights, int n_rows, void *arg)
+{
+    MomentsCollector *collector = (MomentsCollector *) arg;
+    int i;
+    
+    for (i = 0; i < n_rows; i++) {
+        weighted_check_input(vals[i], weights[i]);
+    }
+    
+    weighted_moments_add_batch(&collector->moments, vals, weights, n_rows);
+    collector->n_rows += n_rows;
+}
+
+/* Scan the table into a MomentsCollector */
+static void
+scan_weighted_moments(FunctionCallInfo fcinfo, MomentsCollector *collector)
+{
+    weighted_moments_init(&collector->moments);
+    collector->n_rows = 0;
+    
+    scan_weighted_table(PG_GETARG_OID(0), PG_GETARG_NAME(1), PG_GETARG_NAME(2),
+                        collect_moments_chunk, collector);
+}
+
+/*
+ * weighted_quantile_table_c - Empirical CDF quantiles straight from a table
+ *
+ * Same result as weighted_quantile(array_agg(value_col), array_agg(weight_col), quantiles)
+ * over the whole table.
+ *
+ * Exposed as: weighted_quantile_table(rel, value_col, weight_col, quantiles[])
+ */
+PG_FUNCTION_INFO_V1(weighted_quantile_table_c);
+
+Datum
+weighted_quantile_table_c(PG_FUNCTION_ARGS)
+{
+    PairCollector collector;
+    double *quantiles;
+    int n_quantiles;
+    ArrayType *result_array;
+    
+    /* Extract quantiles array */
+    quantiles = extract_quantile_levels(PG_GETARG_ARRAYTYPE_P(3), &n_quantiles);
+    
+    collector.capacity = TABLE_SCAN_CHUNK_SIZE;
+    collector.n_pairs = 0;
+    collector.pairs = (ValueWeight *)palloc(collector.capacity * sizeof(ValueWeight));
+    collector.max_pairs = (int) Min((Size) work_mem * 1024 / sizeof(ValueWeight),
+                                    (Size) INT_MAX - 1);
+    collector.max_pairs = Max(collector.max_pairs, TABLE_SCAN_CHUNK_SIZE);
+    collector.select = NULL;
+    
+    scan_weighted_table(PG_GETARG_OID(0), PG_GETARG_NAME(1), PG_GETARG_NAME(2),
+                        collect_pairs_chunk, &collector);
+    
+    if (collector.select != NULL) {
+        /* More rows than fit in work_mem: narrow the quantiles with more passes */
+        TableScanArgs args;
+        double *results;
+        
+        args.relid = PG_GETARG_OID(0);
+        args.value_col = PG_GETARG_NAME(1);
+        args.weight_col = PG_GETARG_NAME(2);
+        
+        results = (double *)palloc(n_quantiles * sizeof(double));
+        multipass_select_finish(collector.select, rescan_weighted_table, &args,
+                                quantiles, n_quantiles, results);
+        result_array = build_quantile_result(results, n_quantiles);
+        pfree(results);
+    } else {
+        result_array = empirical_quantiles_from_pairs(collector.pairs, collector.n_pairs,
+                                                      quantiles, n_quantiles);
+    }
+    pfree(quantiles);
+    
+    PG_RETURN_ARRAYTYPE_P(result_array);
+}
+
+/*
+ * weighted_mean_table_c - Weighted mean straight from a table
+ *
+ * Exposed as: weighted_mean_table(rel, value_col, weight_col)
+ */
+PG_FUNCTION_INFO_V1(weighted_mean_table_c);
+
+Datum
+weighted_mean_table_c(PG_FUNCTION_ARGS)
+{
+    MomentsCollector collector;
+    
+    scan_weighted_moments(fcinfo, &collector);
+    
+    /* Handle empty tables like empty arrays */
+    if (collector.n_rows == 0) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(weighted_moments_mean(&collector.moments));
+}
+
+/*
+ * weighted_variance_table_c - Weighted variance straight from a table
+ *
+ * Exposed as: weighted_variance_table(rel, value_col, weight_col, ddof DEFAULT 0)
+ */
+PG_FUNCTION_INFO_V1(weighted_variance_table_c);
+
+Datum
+weighted_variance_table_c(PG_FUNCTION_ARGS)
+{
+    MomentsCollector collector;
+    int ddof = 0;
+    double variance;
+    
+    /* Handle NULL inputs */
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
+        PG_RETURN_NULL();
+    }
+    
+    /* Get optional ddof parameter (default 0) */
+    if (!PG_ARGISNULL(3)) {
+        ddof = PG_GETARG_INT32(3);
+        if (ddof < 0) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("ddof must be non-negative")));
+        }
+    }
+    
+    scan_weighted_moments(fcinfo, &collector);
+    
+    /* Handle empty tables like empty arrays */
+    if (collector.n_rows == 0) {
+        PG_RETURN_FLOAT8(0.0);
+    }
+    
+    variance = weighted_moments_variance(&collector.moments, ddof);
+    
+    /* Handle NaN result */
+    if (isnan(variance)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(variance);
+}
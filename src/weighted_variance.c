@@ -13,6 +13,50 @@
 
 #include "utils.h"
 
+/*
+ * Shared body of the variance and std entry points
+ * 
+ * Validates the input and returns the variance, or NaN when it is undefined.
+ * Giant inputs are validated and reduced in chunks, on worker threads when
+ * weighted_statistics.max_worker_threads allows it. Frees the source.
+ */
+static double
+variance_from_source(WeightedSource *src, int ddof)
+{
+    WeightedMoments moments;
+    ValueWeight small_pairs[SMALL_ARRAY_MAX_ELEMENTS];
+    ValueWeight *pairs = small_pairs;
+    int n_pairs;
+    double total_weight;
+    double variance;
+    
+    if (weighted_source_moments_threaded(src, true, &moments)) {
+        weighted_source_free(src);
+        return weighted_moments_variance(&moments, ddof);
+    }
+    
+    /* Validate and keep the positive weights, the only ones the variance reads */
+    if (src->n_elements > SMALL_ARRAY_MAX_ELEMENTS) {
+        pairs = (ValueWeight *)palloc_huge((Size) (src->n_elements + 1) * sizeof(ValueWeight));
+    }
+    n_pairs = weighted_source_gather(src, true, false, pairs, &total_weight);
+    
+    if (n_pairs == 0 && src->n_elements > 0) {
+        /* Only zero weights: the variance of the lone implicit zero */
+        variance = ddof > 0 ? NAN : 0.0;
+    } else {
+        /* Interleaved pairs: values and weights are two doubles apart */
+        variance = calculate_weighted_variance_strided(&pairs[0].value, &pairs[0].weight,
+                                                       2, n_pairs, ddof);
+    }
+    
+    if (pairs != small_pairs) {
+        pfree(pairs);
+    }
+    weighted_source_free(src);
+    return variance;
+}
+
 /*
  * weighted_variance_sparse_c - Weighted variance for sparse data
  * 
@@ -27,9 +71,7 @@ PG_FUNCTION_INFO_V1(weighted_variance_sparse_c);
 Datum
 weighted_variance_sparse_c(PG_FUNCTION_ARGS)
 {
-    ArrayType *vals_array, *weights_array;
-    double *vals, *weights;
-    int n_elements;
+    WeightedSource src;
     int ddof = 0;
     double variance;
     
@@ -38,10 +80,6 @@ weighted_variance_sparse_c(PG_FUNCTION_ARGS)
         PG_RETURN_NULL();
     }
     
-    /* Get input arrays */
-    vals_array = PG_GETARG_ARRAYTYPE_P(0);
-    weights_array = PG_GETARG_ARRAYTYPE_P(1);
-    
     /* Get optional ddof parameter (default 0) */
     if (!PG_ARGISNULL(2)) {
         ddof = PG_GETARG_INT32(2);
@@ -52,35 +90,9 @@ weighted_variance_sparse_c(PG_FUNCTION_ARGS)
         }
     }
     
-    /* Extract arrays */
-    if (extract_double_arrays(vals_array, weights_array, &vals, &weights, &n_elements) < 0) {
-        PG_RETURN_NULL();
-    }
-    
-    /* Check for negative weights and invalid values */
-    for (int i = 0; i < n_elements; i++) {
-        if (weights[i] < 0.0) {
-            pfree(vals);
-            pfree(weights);
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("weights must be non-negative")));
-        }
-        if (isnan(vals[i]) || isinf(vals[i]) || isnan(weights[i]) || isinf(weights[i])) {
-            pfree(vals);
-            pfree(weights);
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("input arrays must not contain NaN or infinite values")));
-        }
-    }
-    
-    /* Calculate variance using shared function */
-    variance = calculate_weighted_variance(vals, weights, n_elements, ddof);
-    
-    /* Clean up */
-    pfree(vals);
-    pfree(weights);
+    /* Read the arrays in place */
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
+    variance = variance_from_source(&src, ddof);
     
     /* Handle NaN result */
     if (isnan(variance)) {
@@ -102,9 +114,7 @@ PG_FUNCTION_INFO_V1(weighted_std_sparse_c);
 Datum
 weighted_std_sparse_c(PG_FUNCTION_ARGS)
 {
-    ArrayType *vals_array, *weights_array;
-    double *vals, *weights;
-    int n_elements;
+    WeightedSource src;
     int ddof = 0;
     double variance;
     
@@ -113,10 +123,6 @@ weighted_std_sparse_c(PG_FUNCTION_ARGS)
         PG_RETURN_NULL();
     }
     
-    /* Get input arrays */
-    vals_array = PG_GETARG_ARRAYTYPE_P(0);
-    weights_array = PG_GETARG_ARRAYTYPE_P(1);
-    
     /* Get optional ddof parameter (default 0) */
     if (!PG_ARGISNULL(2)) {
         ddof = PG_GETARG_INT32(2);
@@ -127,35 +133,89 @@ weighted_std_sparse_c(PG_FUNCTION_ARGS)
         }
     }
     
-    /* Extract arrays */
-    if (extract_double_arrays(vals_array, weights_array, &vals, &weights, &n_elements) < 0) {
+    /* Read the arrays in place */
+    weighted_source_from_arrays(&src, PG_GETARG_ANY_ARRAY_P(0), PG_GETARG_ANY_ARRAY_P(1));
+    variance = variance_from_source(&src, ddof);
+    
+    /* Handle NaN result */
+    if (isnan(variance)) {
         PG_RETURN_NULL();
     }
     
-    /* Check for negative weights and invalid values */
-    for (int i = 0; i < n_elements; i++) {
-        if (weights[i] < 0.0) {
-            pfree(vals);
-            pfree(weights);
-            ereport(ERROR,
-                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("weights must be non-negative")));
-        }
-        if (isnan(vals[i]) || isinf(vals[i]) || isnan(weights[i]) || isinf(weights[i])) {
-            pfree(vals);
-            pfree(weights);
+    /* Return standard deviation (square root of variance) */
+    PG_RETURN_FLOAT8(sqrt(variance));
+}
+
+/*
+ * Read the ddof argument of the weighted_pair[] variance and std entry points
+ * and return the variance, or NaN when it is undefined
+ */
+static double
+variance_from_pairs(FunctionCallInfo fcinfo)
+{
+    WeightedSource src;
+    int ddof = 0;
+    
+    /* Get optional ddof parameter (default 0) */
+    if (!PG_ARGISNULL(1)) {
+        ddof = PG_GETARG_INT32(1);
+        if (ddof < 0) {
             ereport(ERROR,
                     (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                     errmsg("input arrays must not contain NaN or infinite values")));
+                     errmsg("ddof must be non-negative")));
         }
     }
     
-    /* Calculate variance using shared function */
-    variance = calculate_weighted_variance(vals, weights, n_elements, ddof);
+    /* Read the pairs in place */
+    weighted_source_from_pairs(&src, PG_GETARG_ANY_ARRAY_P(0));
+    return variance_from_source(&src, ddof);
+}
+
+/*
+ * weighted_variance_pairs_c - Weighted variance over a weighted_pair[] array
+ * 
+ * Exposed as: weighted_variance(pairs[], ddof DEFAULT 0)
+ */
+PG_FUNCTION_INFO_V1(weighted_variance_pairs_c);
+
+Datum
+weighted_variance_pairs_c(PG_FUNCTION_ARGS)
+{
+    double variance;
+    
+    /* Handle NULL inputs */
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    
+    variance = variance_from_pairs(fcinfo);
+    
+    /* Handle NaN result */
+    if (isnan(variance)) {
+        PG_RETURN_NULL();
+    }
+    
+    PG_RETURN_FLOAT8(variance);
+}
+
+/*
+ * weighted_std_pairs_c - Weighted standard deviation over a weighted_pair[] array
+ * 
+ * Exposed as: weighted_std(pairs[], ddof DEFAULT 0)
+ */
+PG_FUNCTION_INFO_V1(weighted_std_pairs_c);
+
+Datum
+weighted_std_pairs_c(PG_FUNCTION_ARGS)
+{
+    double variance;
+    
+    /* Handle NULL inputs */
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
     
-    /* Clean up */
-    pfree(vals);
-    pfree(weights);
+    variance = variance_from_pairs(fcinfo);
     
     /* Handle NaN result */
     if (isnan(variance)) {
@@ -164,4 +224,4 @@ weighted_std_sparse_c(PG_FUNCTION_ARGS)
     
     /* Return standard deviation (square root of variance) */
     PG_RETURN_FLOAT8(sqrt(variance));
-}
\ No newline at end of file
+}